@@ -15,11 +15,10 @@ CONFIG += debug
 # and the regex library is in /usr/lib/libboost_regex
 # 
 
-LIBS += -L/usr/lib -L/usr/lib64  -lboost_regex -lboost_filesystem -lboost_system
+LIBS += -L/usr/lib -L/usr/lib64  -lboost_regex -lboost_filesystem -lboost_system -lboost_thread
 
 QT += core
 QT += gui
-QT += xml
 
 # Input
 HEADERS += src/aboutDialog_w.h
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+/*!
+**  \brief Output buffer writing to a file descriptor out of one buffer
+**         allocated up front
+**
+**  Nothing is allocated while writing.  Writes larger than the buffer go
+**  straight to the file.  A failed write is kept in getError() and the
+**  stream goes bad, as streams don't let an exception through.
+*/
+class FileWriteBuffer : public std::streambuf
+{
+    int fd;
+    std::vector< char > buffer;
+    int error;
+
+    bool writeAll( char const * data, size_t size )
+    {
+        while ( size > 0 && error == 0 )
+        {
+            ssize_t written = ::write( fd, data, size );
+            if ( written < 0 )
+            {
+                if ( errno != EINTR )
+                    error = errno;
+                continue;
+            }
+            data += written;
+            size -= written;
+        }
+        return error == 0;
+    }
+
+    bool flushBuffer()
+    {
+        bool ok = writeAll( pbase(), pptr() - pbase() );
+        setp( &buffer[0], &buffer[0] + buffer.size() );
+        return ok;
+    }
+
+protected:
+    int_type overflow( int_type c )
+    {
+        if ( !flushBuffer() )
+            return traits_type::eof();
+        if ( !traits_type::eq_int_type( c, traits_type::eof() ) )
+        {
+            *pptr() = traits_type::to_char_type( c );
+            pbump( 1 );
+        }
+        return traits_type::not_eof( c );
+    }
+
+    std::streamsize xsputn( char const * s, std::streamsize n )
+    {
+        if ( n > epptr() - pptr() )
+        {
+            if ( !flushBuffer() )
+                return 0;
+            if ( n >= (std::streamsize)buffer.size() )
+                return writeAll( s, n ) ? n : 0;
+        }
+        memcpy( pptr(), s, n );
+        pbump( n );
+        return n;
+    }
+
+    int sync()
+    {
+        return flushBuffer() ? 0 : -1;
+    }
+
+public:
+    explicit FileWriteBuffer( int _fd, size_t size = 1024 * 1024 )
+     : fd( _fd ), buffer( size ), error( 0 )
+    {
+        setp( &buffer[0], &buffer[0] + buffer.size() );
+    }
+
+    /*!
+    **  \brief errno of the first write that failed, 0 if none did
+    */
+    int getError() const { return error; }
+};
+
+/*!
+**  \brief A file written under a temporary name next to the one it
+**         replaces and renamed over it by commit().
+**
+**  Until commit() the old file stays as it was, so a crash or an error
+**  while writing never leaves half a file behind.  Where the kernel has
+**  O_TMPFILE the new file has no name at all until then, so nothing is left
+**  over either.  The new file takes the permissions and owner of the one it
+**  replaces, or mode when there wasn't one.
+*/
+class AtomicFile
+{
+    std::string filename;       // symbolic links followed
+    std::string tempname;       // empty while the file has no name
+    int fd;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    bool replacing;
+    FileWriteBuffer * buffer;
+    std::ostream * out;
+
+    AtomicFile( AtomicFile const & );
+    AtomicFile & operator=( AtomicFile const & );
+
+    std::string directory() const
+    {
+        std::string::size_type slash = filename.rfind( '/' );
+        if ( slash == std::string::npos )
+            return ".";
+        if ( slash == 0 )
+            return "/";
+        return filename.substr( 0, slash );
+    }
+
+    void fail( std::string const & what, int err = errno ) const
+    {
+        throw what + " " + filename + ": " + strerror( err );
+    }
+
+    void open()
+    {
+#ifdef O_TMPFILE
+        if ( access( "/proc/self/fd", X_OK ) == 0 )
+        {
+            fd = ::open( directory().c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, mode );
+            if ( fd >= 0 )
+                return;
+            if ( errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL && errno != ENOENT )
+                fail( "Unable to create a file next to" );
+        }
+#endif
+        std::vector< char > name( filename.begin(), filename.end() );
+        char const suffix[] = ".XXXXXX";
+        name.insert( name.end(), suffix, suffix + sizeof( suffix ) );
+        fd = mkstemp( &name[0] );
+        if ( fd < 0 )
+            fail( "Unable to create a file next to" );
+        tempname = &name[0];
+    }
+
+    /*!
+    **  \brief Give a file opened with O_TMPFILE the name tempname
+    */
+    void link()
+    {
+        std::string proc = "/proc/self/fd/" + boost::lexical_cast< std::string >( fd );
+        tempname = filename + ".tmp" + boost::lexical_cast< std::string >( getpid() );
+        if ( linkat( AT_FDCWD, proc.c_str(), AT_FDCWD, tempname.c_str(), AT_SYMLINK_FOLLOW ) < 0 )
+        {
+            // Left over by a crashed process that had our pid.
+            if ( errno != EEXIST || unlink( tempname.c_str() ) < 0
+                    || linkat( AT_FDCWD, proc.c_str(), AT_FDCWD, tempname.c_str(), AT_SYMLINK_FOLLOW ) < 0 )
+            {
+                int err = errno;
+                tempname.clear();
+                fail( "Unable to name the new", err );
+            }
+        }
+    }
+
+public:
+    /*!
+    **  \brief Start writing a file to replace _filename
+    **
+    **  \param newMode permissions if _filename doesn't exist yet
+    */
+    explicit AtomicFile( std::string const & _filename, mode_t newMode = 0644 )
+     : filename( _filename ), fd( -1 ), mode( newMode ), uid( -1 ), gid( -1 ), replacing( false ), buffer( 0 ), out( 0 )
+    {
+        char resolved[ PATH_MAX ];
+        if ( realpath( filename.c_str(), resolved ) )
+            filename = resolved;
+
+        struct stat old;
+        if ( stat( filename.c_str(), &old ) == 0 )
+        {
+            replacing = true;
+            mode = old.st_mode & 07777;
+            uid = old.st_uid;
+            gid = old.st_gid;
+        }
+
+        open();
+        buffer = new FileWriteBuffer( fd );
+        out = new std::ostream( buffer );
+    }
+
+    ~AtomicFile()
+    {
+        delete out;
+        delete buffer;
+        if ( fd >= 0 )
+            close( fd );
+        if ( !tempname.empty() )
+            unlink( tempname.c_str() );
+    }
+
+    std::ostream & stream() { return *out; }
+
+    /*!
+    **  \brief Put everything written so far on disk and in place of the old
+    **         file
+    */
+    void commit()
+    {
+        out->flush();
+        if ( buffer->getError() != 0 )
+            fail( "Unable to write", buffer->getError() );
+        if ( !*out )
+            fail( "Unable to write", EIO );
+
+        if ( replacing && geteuid() == 0 )
+        {
+            if ( fchown( fd, uid, gid ) < 0 )
+                fail( "Unable to set the owner of" );
+        }
+        if ( fchmod( fd, mode ) < 0 )
+            fail( "Unable to set the permissions of" );
+        if ( fsync( fd ) < 0 )
+            fail( "Unable to sync" );
+        if ( tempname.empty() )
+            link();
+        if ( close( fd ) < 0 )
+        {
+            fd = -1;
+            fail( "Unable to write" );
+        }
+        fd = -1;
+
+        if ( rename( tempname.c_str(), filename.c_str() ) < 0 )
+            fail( "Unable to replace" );
+        tempname.clear();
+
+        // Make the rename itself survive a crash.
+        int dir = ::open( directory().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+        if ( dir >= 0 )
+        {
+            fsync( dir );
+            close( dir );
+        }
+    }
+};
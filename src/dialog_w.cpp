@@ -24,7 +24,12 @@ void GuardPuppyDialog_w::on_protocolTreeWidget_itemClicked( QTreeWidgetItem * it
 
 void GuardPuppyDialog_w::on_protocolTreeWidget_itemChanged( QTreeWidgetItem * item, int column )
 {
-    std::string protocol = item->text( column ).toStdString();
+    // The last column holds the log check box of each protocol.
+    if ( item->parent() && column > 0 && column == protocolTreeWidget->columnCount() - 1 )
+    {
+        std::string protocol = item->data( 0, Qt::UserRole ).toString().toStdString();
+        firewall.setProtocolLogging( protocol, item->checkState( column ) == Qt::Checked );
+    }
 }
 
 
@@ -71,6 +76,8 @@ void GuardPuppyDialog_w::on_zoneNameLineEdit_textChanged( QString const & text )
     std::string s = text.toStdString();
     std::replace( s.begin(), s.end(), ' ', '_');
 
+    if ( s != currentZoneName() )
+        zoneCostChanged();
     firewall.zoneRename( currentZoneName(), s );
 
     if ( zoneListWidget->currentItem() )
@@ -94,7 +101,8 @@ void GuardPuppyDialog_w::on_zoneAddressListBox_currentItemChanged( QListWidgetIt
     {
         zoneAddressLineEdit->setText( current->text() );
 
-        if ( firewall.getZone( currentZoneName() ).editable() )
+        ::Zone const & zone = firewall.getZone( currentZoneName() );
+        if ( zone.editable() && !zone.isDefined() )
             zoneAddressLineEdit->setEnabled( true );
         else
             zoneAddressLineEdit->setEnabled( false );
@@ -103,22 +111,35 @@ void GuardPuppyDialog_w::on_zoneAddressListBox_currentItemChanged( QListWidgetIt
 
 void GuardPuppyDialog_w::on_zoneAddressLineEdit_textChanged( QString const & text )
 {
+    if ( text.toStdString() == currentMachineName() )
+        return;
     firewall.setNewMachineName( currentZoneName(), currentMachineName(), text.toStdString() );
 
     if ( zoneAddressListBox->currentItem() )
         zoneAddressListBox->currentItem()->setText( text );
+    zoneCostChanged();
 }
 
 void GuardPuppyDialog_w::on_newZonePushButton_clicked()
 {
     firewall.addZone( "new_zone" );
+    zoneCostChanged();
     zoneListWidget->addItem( "new_zone" );
     zoneListWidget->setCurrentRow( zoneListWidget->count() - 1 );
 }
 
 void GuardPuppyDialog_w::on_deleteZonePushButton_clicked()
 {
-    firewall.deleteZone( currentZoneName() );
+    try
+    {
+        firewall.deleteZone( currentZoneName() );
+    }
+    catch ( std::string const & s )
+    {
+        QMessageBox::warning(this, "Delete Zone", s.c_str());
+        return;
+    }
+    zoneCostChanged();
     QListWidgetItem * item = zoneListWidget->takeItem( zoneListWidget->currentRow() );
     if ( item )
     {
@@ -135,6 +156,7 @@ void GuardPuppyDialog_w::on_newZoneAddressPushButton_clicked()
 
     setZoneAddressGUI( firewall.getZone( currentZoneName()) );
     zoneAddressListBox->setCurrentRow( zoneAddressListBox->count() - 1 );
+    zoneCostChanged();
 }
 
 void GuardPuppyDialog_w::on_deleteZoneAddressPushButton_clicked()
@@ -146,6 +168,7 @@ void GuardPuppyDialog_w::on_deleteZoneAddressPushButton_clicked()
     {
         delete item;
     }
+    zoneCostChanged();
 }
 
 
@@ -153,6 +176,7 @@ void GuardPuppyDialog_w::rebuildGui()
 {
     if ( guiReady )
     {
+        zoneCostChanged();
         checkBox_3->setCheckState( Qt::PartiallyChecked );
 
         zoneListWidget->clear();
@@ -188,9 +212,16 @@ void GuardPuppyDialog_w::rebuildGui()
 
         logRateUnitComboBox->setCurrentIndex(firewall.getLogRateUnit());
         logBurstSpinBox->setValue(firewall.getLogRateBurst());
+        logPerSourceCheckBox->setChecked(firewall.isLogPerSource());
+        logSampleCheckBox->setChecked(firewall.isLogSample());
+        logSampleSpinBox->setValue(firewall.getLogSampleRate());
         logWarnRateLimitCheckBox->setChecked(firewall.isLogWarnLimit());
         logWarnRateLimitSpinBox->setValue(firewall.getLogWarnLimitRate());
         logWarnRateUnitComboBox->setCurrentIndex(firewall.getLogWarnLimitRateUnit());
+        logNflogCheckBox->setChecked(firewall.isLogNFLOG());
+        nflogGroupSpinBox->setValue(firewall.getNFLOGGroup());
+        nflogThresholdSpinBox->setValue(firewall.getNFLOGThreshold());
+        nflogSnaplenSpinBox->setValue(firewall.getNFLOGSnapLen());
 
         // Put the widgets in the right state for the Advanced page.
         uint start, end;
@@ -210,6 +241,9 @@ void GuardPuppyDialog_w::rebuildGui()
 
         allowTcpTimeStampsCheckBox->setChecked(firewall.isAllowTCPTimestamps());
 
+        enableFlowtableCheckBox->setChecked(firewall.isFlowtableEnabled());
+        flowtableInterfaceNameLineEdit->setText(firewall.getFlowtableInterfaceName().c_str());
+
         createUdpTableWidget();
         createProtocolPages();
         setProtocolPagesEnabled(!firewall.isDisabled());
@@ -240,10 +274,19 @@ void GuardPuppyDialog_w::setLoggingPageEnabled(bool enabled)
     logRateSpinBox->setEnabled(enabled && limiting);
     logRateUnitComboBox->setEnabled(enabled && limiting);
     logBurstSpinBox->setEnabled(enabled && limiting);
+    logPerSourceCheckBox->setEnabled(enabled && limiting);
+    logSampleCheckBox->setEnabled(enabled && limiting);
+    logSampleSpinBox->setEnabled(enabled && limiting && firewall.isLogSample());
         // Limit warning.
     logWarnRateLimitCheckBox->setEnabled(enabled && limiting);
     logWarnRateLimitSpinBox->setEnabled(enabled && limiting && firewall.isLogWarnLimit());
     logWarnRateUnitComboBox->setEnabled(enabled && limiting && firewall.isLogWarnLimit());
+        // NFLOG.
+    logNflogCheckBox->setEnabled(enabled && logging);
+    bool nflog = logging && firewall.isLogNFLOG();
+    nflogGroupSpinBox->setEnabled(enabled && nflog);
+    nflogThresholdSpinBox->setEnabled(enabled && nflog);
+    nflogSnaplenSpinBox->setEnabled(enabled && nflog);
 }
 
 
@@ -269,6 +312,7 @@ void ProtocolCheckBox::stateChanged( int state )
 void GuardPuppyDialog_w::protocolStateChanged( std::string const & zoneTo, std::string const & protocol, Zone::ProtocolState state )
 {
     firewall.setProtocolState( currentProtocolZoneName(), zoneTo, protocol, state );
+    zoneCostChanged();
 }
 
 void GuardPuppyDialog_w::createProtocolPages()
@@ -282,6 +326,7 @@ void GuardPuppyDialog_w::createProtocolPages()
     {
         columns += col.c_str();
     }
+    columns += QObject::tr("Log");
 
     protocolTreeWidget->setHeaderLabels( columns );
 
@@ -301,10 +346,11 @@ void GuardPuppyDialog_w::AddProtocolToTable_::operator()(ProtocolEntry const & p
     }
     if(!parent)
     {//add new top level parent of the same class.
-        parent = new QTreeWidgetItem( QStringList( pe.Classification.c_str() ) );
+        parent = new QTreeWidgetItem( QStringList( pe.Classification.get().c_str() ) );
         g.protocolTreeWidget->addTopLevelItem( parent );
     }
     QTreeWidgetItem * item = new QTreeWidgetItem(parent, QStringList( pe.longname.c_str() ) );
+    item->setData( 0, Qt::UserRole, QString( pe.name.c_str() ) );
 
     g.protocolTreeWidget->header()->setResizeMode( QHeaderView::ResizeToContents );
 
@@ -327,6 +373,9 @@ void GuardPuppyDialog_w::AddProtocolToTable_::operator()(ProtocolEntry const & p
         connect( itemCheckBox, SIGNAL( stateChanged(int) ), itemCheckBox, SLOT( stateChanged(int)) );
         connect( itemCheckBox, SIGNAL( protocolStateChanged(std::string const&, std::string const &, Zone::ProtocolState) ), &g, SLOT( protocolStateChanged(std::string const &, std::string const &, Zone::ProtocolState)) );
     }
+
+    // Whether dropped packets of this protocol are logged.
+    item->setCheckState( connectedZones.size()+1, g.firewall.isProtocolLogging( pe.name ) ? Qt::Checked : Qt::Unchecked );
 }
 
 
@@ -334,17 +383,20 @@ void GuardPuppyDialog_w::setZoneGUI( ::Zone const & zone )
 {
     zoneNameLineEdit->setText( zone.getName().c_str());
     zoneCommentLineEdit->setText( zone.getComment().c_str());
+    zoneDefinitionLineEdit->setText( zone.getDefinition().c_str());
 
     if ( zone.editable() )
     {
         zoneNameLineEdit->setReadOnly(false);
         zoneCommentLineEdit->setReadOnly(false);
+        zoneDefinitionLineEdit->setReadOnly(false);
         //deleteZonePushButton->setEnabled(true);
     }
     else
     {
         zoneNameLineEdit->setReadOnly(true);
         zoneCommentLineEdit->setReadOnly(true);
+        zoneDefinitionLineEdit->setReadOnly(true);
         //deleteZonePushButton->setEnabled(false);
     }
 }
@@ -374,8 +426,8 @@ void GuardPuppyDialog_w::setZoneAddressGUI( ::Zone const & zone)
     {
         zoneAddressListBox->setCurrentRow(0); //,true);
         zoneAddressListBox->setEnabled(f&&true);
-        deleteZoneAddressPushButton->setEnabled(f&&true);
-        zoneAddressLineEdit->setEnabled(f&&true);
+        deleteZoneAddressPushButton->setEnabled(f&&!zone.isDefined());
+        zoneAddressLineEdit->setEnabled(f&&!zone.isDefined());
     }
     else
     {
@@ -384,9 +436,11 @@ void GuardPuppyDialog_w::setZoneAddressGUI( ::Zone const & zone)
         deleteZoneAddressPushButton->setEnabled(f&&false);
         zoneAddressLineEdit->setEnabled(f&&false);
     }
+    // A zone defined by other zones has the addresses they come to.
+    bool given = zone.editable() && !zone.isDefined();
     zoneAddressListBox->setEnabled( f&&zone.editable());
-    newZoneAddressPushButton->setEnabled(f&&zone.editable());
-    zoneFileImportPushButton->setEnabled(f&&zone.editable());
+    newZoneAddressPushButton->setEnabled(f&&given);
+    zoneFileImportPushButton->setEnabled(f&&given);
 
 }
 
@@ -395,7 +449,7 @@ void GuardPuppyDialog_w::setZonePageEnabled(::Zone const & thisZone, bool enable
     if(!thisZone.getMemberMachineList().empty())
     {
         zoneAddressListBox->setEnabled(enabled);
-        zoneAddressLineEdit->setEnabled(enabled);
+        zoneAddressLineEdit->setEnabled(enabled&&!thisZone.isDefined());
     }
     else
     {
@@ -403,9 +457,10 @@ void GuardPuppyDialog_w::setZonePageEnabled(::Zone const & thisZone, bool enable
         zoneAddressLineEdit->setEnabled(false);
     }
 
-    newZoneAddressPushButton->setEnabled((enabled?thisZone.editable():false));
-    zoneFileImportPushButton->setEnabled((enabled?thisZone.editable():false));
+    newZoneAddressPushButton->setEnabled((enabled?thisZone.editable()&&!thisZone.isDefined():false));
+    zoneFileImportPushButton->setEnabled((enabled?thisZone.editable()&&!thisZone.isDefined():false));
     zoneCommentLineEdit->setEnabled(enabled);
+    zoneDefinitionLineEdit->setEnabled(enabled);
     zoneNameLineEdit->setEnabled(enabled);
     newZonePushButton->setEnabled(enabled);
     deleteZonePushButton->setEnabled(enabled);
@@ -415,8 +470,28 @@ void GuardPuppyDialog_w::setZonePageEnabled(::Zone const & thisZone, bool enable
 
 void GuardPuppyDialog_w::on_zoneConnectionTableWidget_itemChanged( QTableWidgetItem * item )
 {
+    if ( item->column() == 3 )
+        return;                 // the cost is only shown
+    if ( item->column() == 1 )
+    {
+        QTableWidgetItem * zoneItem = zoneConnectionTableWidget->item( item->row(), 0 );
+        if ( zoneItem )
+            firewall.setFastPath( currentZoneName(), zoneItem->text().toStdString(), item->checkState() == Qt::Checked );
+        return;
+    }
+    if ( item->column() == 2 )
+    {
+        QTableWidgetItem * zoneItem = zoneConnectionTableWidget->item( item->row(), 0 );
+        if ( zoneItem )
+            firewall.setZoneLogging( currentZoneName(), zoneItem->text().toStdString(), item->checkState() == Qt::Checked );
+        return;
+    }
     std::string fromZone = item->text().toStdString();
-    firewall.updateZoneConnection( currentZoneName(), fromZone, item->checkState() == Qt::Checked);
+    bool connected = item->checkState() == Qt::Checked;
+    if ( firewall.areZonesConnected( currentZoneName(), fromZone ) == connected )
+        return;
+    firewall.updateZoneConnection( currentZoneName(), fromZone, connected );
+    zoneCostChanged();
 }
 
 void GuardPuppyDialog_w::on_zoneCommentLineEdit_editingFinished()
@@ -424,6 +499,23 @@ void GuardPuppyDialog_w::on_zoneCommentLineEdit_editingFinished()
     firewall.getZone(currentZoneName()).setComment(zoneCommentLineEdit->text().toStdString());
 }
 
+void GuardPuppyDialog_w::on_zoneDefinitionLineEdit_editingFinished()
+{
+    if ( currentZoneName() == "" )
+        return;
+    try
+    {
+        firewall.setZoneDefinition( currentZoneName(), zoneDefinitionLineEdit->text().toStdString() );
+    }
+    catch ( std::string const & s )
+    {
+        QMessageBox::warning(this, "Zone Definition", s.c_str());
+    }
+    setZoneGUI( firewall.getZone( currentZoneName() ) );
+    setZoneAddressGUI( firewall.getZone( currentZoneName() ) );
+    zoneCostChanged();
+}
+
 void GuardPuppyDialog_w::setZoneConnectionGUI(::Zone const & zone)
 {
     zoneConnectionTableWidget->setRowCount( 0 );
@@ -450,7 +542,164 @@ void GuardPuppyDialog_w::setZoneConnectionGUI(::Zone const & zone)
             item->setFlags( item->flags() & ~Qt::ItemIsEnabled );  // cannot change default zones
 
         zoneConnectionTableWidget->setItem( zoneConnectionTableWidget->rowCount()-1, 0, item );
+
+        // Fast path only applies to forwarded traffic, so never to/from the Local zone.
+        QTableWidgetItem * fastPathItem = new QTableWidgetItem( QObject::tr("Fast path") );
+        fastPathItem->setCheckState( firewall.isFastPath( zoneFrom, zoneTo ) ? Qt::Checked : Qt::Unchecked );
+        if ( zoneTo == zoneFrom || zone.isLocal() || firewall.getZone( zoneTo ).isLocal() || !firewall.isFlowtableEnabled() )
+            fastPathItem->setFlags( fastPathItem->flags() & ~Qt::ItemIsEnabled );
+        zoneConnectionTableWidget->setItem( zoneConnectionTableWidget->rowCount()-1, 1, fastPathItem );
+
+        QTableWidgetItem * logItem = new QTableWidgetItem( QObject::tr("Log") );
+        logItem->setCheckState( firewall.isZoneLogging( zoneFrom, zoneTo ) ? Qt::Checked : Qt::Unchecked );
+        if ( zoneTo == zoneFrom )
+            logItem->setFlags( logItem->flags() & ~Qt::ItemIsEnabled );
+        zoneConnectionTableWidget->setItem( zoneConnectionTableWidget->rowCount()-1, 2, logItem );
+
+        QTableWidgetItem * costItem = new QTableWidgetItem();
+        costItem->setFlags( Qt::ItemIsEnabled );
+        zoneConnectionTableWidget->setItem( zoneConnectionTableWidget->rowCount()-1, 3, costItem );
     }
+    if ( zoneCost )
+        setZoneCostGUI();
+    else
+        zoneCostTimer.start();
+}
+
+/*!
+**  \brief Forget the estimated costs, and estimate them again once the
+**         edits stop coming in for a moment.
+**
+**  Estimating them walks all the rules, so it isn't done on every
+**  keystroke.
+*/
+void GuardPuppyDialog_w::zoneCostChanged()
+{
+    zoneCost.reset();
+    zoneCostTimer.start();
+}
+
+/*!
+**  \brief Fill in how many rules a new connection from the current zone
+**         is checked against, and the size of the whole rule set.
+*/
+void GuardPuppyDialog_w::setZoneCostGUI()
+{
+    if ( currentZoneName() == "" || zoneConnectionTableWidget->columnCount() < 4 )
+        return;
+
+    if ( !zoneCost )
+        zoneCost.reset( new RuleCostEstimator( firewall ) );
+    RuleCostEstimator const & estimator = *zoneCost;
+    setZoneOverlapGUI( estimator.getZoneIndex() );
+    std::string zoneFrom = currentZoneName();
+    for ( int row = 0; row < zoneConnectionTableWidget->rowCount(); row++ )
+    {
+        QTableWidgetItem * zoneItem = zoneConnectionTableWidget->item( row, 0 );
+        QTableWidgetItem * costItem = zoneConnectionTableWidget->item( row, 3 );
+        if ( !zoneItem || !costItem )
+            continue;
+        std::string zoneTo = zoneItem->text().toStdString();
+        if ( zoneTo == zoneFrom )
+        {
+            costItem->setText( "" );
+            continue;
+        }
+        RuleCostEstimator::Cost const & cost = estimator.getCost( zoneFrom, zoneTo );
+        if ( !cost.reachable )
+        {
+            costItem->setText( "-" );
+            costItem->setToolTip( QObject::tr( "One of the zones has no address the firewall can match." ) );
+            continue;
+        }
+        costItem->setText( QObject::tr( "%1, at most %2" ).arg( cost.typical, 0, 'f', 0 ).arg( cost.worst ) );
+        costItem->setToolTip( QObject::tr( "Rules a new connection is typically and at most checked against on its way from '%1' to '%2'. "
+                    "The '%1' to '%2' chain holds %3 rules." ).arg( zoneFrom.c_str() ).arg( zoneTo.c_str() ).arg( cost.chainRules ) );
+    }
+    zoneCostLabel->setText( QObject::tr( "The zone chains of this firewall hold %1 rules in %2 chains." )
+            .arg( (qulonglong)estimator.getRuleCount() ).arg( (qulonglong)estimator.getChainCount() ) );
+}
+
+/*!
+**  \brief Tell which networks of the current zone overlap those of other
+**         zones or add nothing, and which zone the address asked about on
+**         the zone page belongs to.
+*/
+void GuardPuppyDialog_w::setZoneOverlapGUI( ZoneAddressIndex const & index )
+{
+    std::string address = zoneOwnerLineEdit->text().trimmed().toStdString();
+    if ( address.empty() )
+        zoneOwnerLabel->setText( "" );
+    else
+    {
+        int owner = index.lookup( address );
+        zoneOwnerLabel->setText( owner < 0 ? QObject::tr( "is not an IPv4 address" )
+                : QObject::tr( "is in zone '%1'" ).arg( index.zoneName( owner ).c_str() ) );
+    }
+
+    int current = -1;
+    for ( uint16_t z = 0; z < index.zoneCount(); z++ )
+    {
+        if ( index.zoneName( z ) == currentZoneName() )
+            current = z;
+    }
+
+    MemberOverlaps const & overlaps = index.getOverlaps();
+    size_t redundant = 0;
+    size_t shadowed = 0;
+    size_t overlapping = 0;
+    QStringList details;
+    for ( size_t e = 0; e < overlaps.size(); e++ )
+    {
+        MemberOverlaps::Entry const & entry = overlaps[e];
+        MemberOverlaps::Entry const * over = entry.over < 0 ? 0 : &overlaps[ entry.over ];
+        if ( entry.zone == current && entry.state == MemberOverlaps::REDUNDANT )
+        {
+            redundant++;
+            if ( over && over->zone == current )
+                details << QObject::tr( "%1 is already in %2" ).arg( entry.str().c_str() ).arg( over->str().c_str() );
+            else
+                details << QObject::tr( "%1 is covered by more specific addresses of the zone" ).arg( entry.str().c_str() );
+        }
+        else if ( entry.zone == current && entry.state == MemberOverlaps::SHADOWED )
+        {
+            shadowed++;
+            details << QObject::tr( "%1 is taken by more specific addresses of other zones" ).arg( entry.str().c_str() );
+        }
+        else if ( entry.state != MemberOverlaps::REDUNDANT && over && over->zone != entry.zone
+                && ( entry.zone == current || over->zone == current ) )
+        {
+            overlapping++;
+            details << QObject::tr( "%1 of zone '%2' takes its addresses from %3 of zone '%4'" )
+                .arg( entry.str().c_str() ).arg( index.zoneName( entry.zone ).c_str() )
+                .arg( over->str().c_str() ).arg( index.zoneName( over->zone ).c_str() );
+        }
+    }
+
+    if ( redundant + shadowed + overlapping == 0 )
+    {
+        zoneOverlapLabel->setText( "" );
+        zoneOverlapLabel->setToolTip( "" );
+        return;
+    }
+    zoneOverlapLabel->setText( QObject::tr( "%1 networks of this zone add nothing to it and %2 are taken by other zones; "
+                "the script leaves them out where they can't match.  %3 networks overlap between this zone and others." )
+            .arg( (qulonglong)redundant ).arg( (qulonglong)shadowed ).arg( (qulonglong)overlapping ) );
+    int const shown = 20;
+    if ( details.size() > shown )
+    {
+        int more = details.size() - shown;
+        details = details.mid( 0, shown );
+        details << QObject::tr( "and %1 more" ).arg( more );
+    }
+    zoneOverlapLabel->setToolTip( details.join( "\n" ) );
+}
+
+void GuardPuppyDialog_w::on_zoneOwnerLineEdit_textChanged( QString const & /* text */ )
+{
+    if ( !zoneCost )
+        zoneCost.reset( new RuleCostEstimator( firewall ) );
+    setZoneOverlapGUI( zoneCost->getZoneIndex() );
 }
 
 void GuardPuppyDialog_w::on_advImportPushButton_clicked()
@@ -511,7 +760,9 @@ void GuardPuppyDialog_w::on_zoneFileImportPushButton_clicked()
     if(filename != "")
     {
         firewall.getZone( currentZoneName()).ZoneImport(filename);
+        firewall.updateZoneDefinitions();
         setZoneAddressGUI( firewall.getZone( currentZoneName()) );
+        zoneCostChanged();
     }
 }
 
@@ -606,7 +857,7 @@ void GuardPuppyDialog_w::createUdpTableWidget()
     model->setHorizontalHeaderLabels(s);
     userDefinedProtocolTreeView->setHeaderHidden(false);
     AddUDPToTable_ audptt(model);
-    firewall.ApplyToDB(audptt);
+    firewall.ApplyToRows(audptt);
 }
 
 void GuardPuppyDialog_w::setAdvancedPageEnabled(bool enabled)
@@ -624,6 +875,8 @@ void GuardPuppyDialog_w::setAdvancedPageEnabled(bool enabled)
     dhcpdInterfaceNameLineEdit->setEnabled( enabled && firewall.isDHCPdEnabled() );
 
     allowTcpTimeStampsCheckBox->setEnabled(enabled);
+    enableFlowtableCheckBox->setEnabled( enabled );
+    flowtableInterfaceNameLineEdit->setEnabled( enabled && firewall.isFlowtableEnabled() );
     advRestoreFactoryDefaultsPushButton->setEnabled(enabled);
     deleteUserDefinedProtocolPushButton->setEnabled(enabled);
     NewPortRangePushButton->setEnabled(enabled);
@@ -650,6 +903,15 @@ void GuardPuppyDialog_w::on_logUserRateLimitCheckBox_stateChanged( int state )
 {
     firewall.setLogRateLimit( state );
 }
+void GuardPuppyDialog_w::on_logPerSourceCheckBox_stateChanged( int state )
+{
+    firewall.setLogPerSource( state );
+}
+void GuardPuppyDialog_w::on_logSampleCheckBox_stateChanged( int state )
+{
+    firewall.setLogSample( state );
+    logSampleSpinBox->setEnabled( state );
+}
 void GuardPuppyDialog_w::on_logWarnRateLimitCheckBox_stateChanged( int state )
 {
     firewall.setLogWarnLimitRate( state );
@@ -666,6 +928,11 @@ void GuardPuppyDialog_w::on_logTcpOptionsCheckBox_stateChanged( int state )
 {
     firewall.setLogTCPOptions( state );
 }
+void GuardPuppyDialog_w::on_logNflogCheckBox_stateChanged( int state )
+{
+    firewall.setLogNFLOG( state );
+    setLoggingPageEnabled( !firewall.isDisabled() );
+}
 
 void GuardPuppyDialog_w::on_showAdvancedProtocolHelpCheckBox_stateChanged( int state )
 {
@@ -727,6 +994,15 @@ void GuardPuppyDialog_w::on_enableDhcpdCheckBox_stateChanged( int state )
 {
     firewall.setDHCPdEnabled( state );
 }
+void GuardPuppyDialog_w::on_enableFlowtableCheckBox_stateChanged( int state )
+{
+    firewall.setFlowtableEnabled( state );
+    flowtableInterfaceNameLineEdit->setEnabled( state );
+}
+void GuardPuppyDialog_w::on_flowtableInterfaceNameLineEdit_textChanged( QString const & text )
+{
+    firewall.setFlowtableInterfaceName( text.toStdString() );
+}
 void GuardPuppyDialog_w::on_logRateSpinBox_valueChanged( int value )
 {
     firewall.setLogRate( value );
@@ -735,10 +1011,26 @@ void GuardPuppyDialog_w::on_logBurstSpinBox_valueChanged( int value )
 {
     firewall.setLogRateBurst( value );
 }
+void GuardPuppyDialog_w::on_logSampleSpinBox_valueChanged( int value )
+{
+    firewall.setLogSampleRate( value );
+}
 void GuardPuppyDialog_w::on_logWarnRateLimitSpinBox_valueChanged( int value )
 {
     firewall.setLogWarnLimitRate( value );
 }
+void GuardPuppyDialog_w::on_nflogGroupSpinBox_valueChanged( int value )
+{
+    firewall.setNFLOGGroup( value );
+}
+void GuardPuppyDialog_w::on_nflogThresholdSpinBox_valueChanged( int value )
+{
+    firewall.setNFLOGThreshold( value );
+}
+void GuardPuppyDialog_w::on_nflogSnaplenSpinBox_valueChanged( int value )
+{
+    firewall.setNFLOGSnapLen( value );
+}
 void GuardPuppyDialog_w::on_localPortRangeLowSpinBox_valueChanged( int value )
 {
     firewall.setLocalDynamicPortRangeStart( value );
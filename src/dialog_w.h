@@ -6,11 +6,15 @@
 #include <QFileDialog>
 #include <QCheckBox>
 #include <QErrorMessage>
+#include <QTimer>
 #include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "ui_guardPuppy.h"
 #include "firewall.h"
 #include "zone.h"
+#include "zoneaddressindex.h"
+#include "rulecost.h"
 #include "userDefinedProtocolTreeHelpers.h"
 
 class ProtocolCheckBox : public QCheckBox
@@ -35,6 +39,8 @@ class GuardPuppyDialog_w : public QDialog, Ui::GuardPuppyDialog
     Q_OBJECT;
     bool guiReady;
     GuardPuppyFireWall & firewall;
+    QTimer zoneCostTimer;                               // runs while edits to the zones are coming in
+    boost::scoped_ptr< RuleCostEstimator > zoneCost;    // 0 when the zones changed since it was built
 
 //private functors
     class AddProtocolToTable_
@@ -52,7 +58,7 @@ class GuardPuppyDialog_w : public QDialog, Ui::GuardPuppyDialog
     public:
         AddUDPToTable_( QStandardItemModel * t_):t(t_)
         {}
-        void operator()(ProtocolEntry const & pe)
+        void operator()(ProtocolEntry const & pe, ProtocolTable::Protocol const & rows)
         {
             if(pe.Classification == "User Defined")
             {
@@ -61,13 +67,12 @@ class GuardPuppyDialog_w : public QDialog, Ui::GuardPuppyDialog
                 std::string s = pe.getName();
                 parent->setText(s.c_str());//set the name for the parent
                 parent->setData(s.c_str(), Qt::EditRole); //"previous" name
-                //next get the list of types and range strings
-                std::vector<uchar> types = pe.getTypes();
-                std::vector<std::string> rngs = pe.getRangeStrings();
-                std::vector<bool> bid = pe.getBidirectionals();
+                //next the types, ranges and directions of its rows
+                ProtocolColumn<uchar> const & types = rows.types;
+                ProtocolColumn<uchar> const & bid = rows.bidirectionals;
                 //QShortcut* del = new QShortcut(QkeySequence(Qt::Key_Delete), parent);
 
-                for(uint i(0); i < rngs.size(); i++)
+                for(uint i(0); i < rows.size(); i++)
                 {
                     QList<QStandardItem *> child;
                     QStandardItem * temp;
@@ -77,7 +82,7 @@ class GuardPuppyDialog_w : public QDialog, Ui::GuardPuppyDialog
                     temp->setData(types[i], Qt::EditRole);//type
                     temp->setData(((types[i]==IPPROTO_TCP)? "TCP" : "UDP"), Qt::DisplayRole);
                     child.push_back(temp);
-                    temp = new QStandardItem(rngs[i].c_str());
+                    temp = new QStandardItem(rows.rangeString(i).c_str());
                     child.push_back(temp);
                     temp = new QStandardItem("");
                     if(types[i]==IPPROTO_TCP)
@@ -120,6 +125,9 @@ public:
     {
         //! \todo Read program options, i.e window geometery
         setupUi( this );
+        zoneCostTimer.setSingleShot( true );
+        zoneCostTimer.setInterval( 300 );
+        connect( &zoneCostTimer, SIGNAL( timeout() ), this, SLOT( setZoneCostGUI() ) );
         QStandardItemModel * model = new QStandardItemModel(0,4, userDefinedProtocolTreeView);
         userDefinedProtocolTreeView->setModel(model);
         UDPTreeDelegate* tempDelegate = new UDPTreeDelegate(&firewall, this);
@@ -143,6 +151,8 @@ public:
     void setZoneAddressGUI( ::Zone const & zone);
     void setZonePageEnabled( ::Zone const & thisZone, bool enabled);
     void setZoneConnectionGUI( ::Zone const & zone);
+    void zoneCostChanged();
+    void setZoneOverlapGUI( ZoneAddressIndex const & index );
     void setUserDefinedProtocolGUI( std::string const &, int const j) ;
     void createProtocolPages();
     void setProtocolPagesEnabled(bool enabled);
@@ -152,6 +162,7 @@ public:
 
 
 private slots:
+    void setZoneCostGUI();
     void on_aboutPushButton_clicked();
     void on_okayPushButton_clicked();
     void on_cancelPushButton_clicked();
@@ -172,6 +183,8 @@ private slots:
     void protocolStateChanged( std::string const & zoneTo, std::string const & protocol, Zone::ProtocolState state );
     void on_zoneConnectionTableWidget_itemChanged( QTableWidgetItem * item );
     void on_zoneCommentLineEdit_editingFinished();
+    void on_zoneDefinitionLineEdit_editingFinished();
+    void on_zoneOwnerLineEdit_textChanged( QString const & text );
 
     void on_advImportPushButton_clicked();
     void on_advExportPushButton_clicked();
@@ -192,23 +205,32 @@ private slots:
     void on_logRejectPacketsCheckBox_stateChanged( int state );
     void on_logAbortedTcpCheckBox_stateChanged( int state );
     void on_logUserRateLimitCheckBox_stateChanged( int state );
+    void on_logPerSourceCheckBox_stateChanged( int state );
+    void on_logSampleCheckBox_stateChanged( int state );
     void on_logWarnRateLimitCheckBox_stateChanged( int state );
     void on_logIpOptionsCheckBox_stateChanged( int state );
     void on_logTcpSequenceCheckBox_stateChanged( int state );
     void on_logTcpOptionsCheckBox_stateChanged( int state );
+    void on_logNflogCheckBox_stateChanged( int state );
     void on_showAdvancedProtocolHelpCheckBox_stateChanged( int state );
     void on_disableFirewallCheckBox_stateChanged( int state );
     void on_blockEverythingCheckBox_stateChanged( int state );
     void on_allowTcpTimeStampsCheckBox_stateChanged( int state );
     void on_enableDhcpCheckBox_stateChanged( int state );
     void on_enableDhcpdCheckBox_stateChanged( int state );
+    void on_enableFlowtableCheckBox_stateChanged( int state );
+    void on_flowtableInterfaceNameLineEdit_textChanged( QString const & text );
 
     //void on_userDefinedProtocolBidirectionalCheckBox_stateChanged( int state );//
 
     //  The spinboxes
     void on_logRateSpinBox_valueChanged( int value );
     void on_logBurstSpinBox_valueChanged( int value );
+    void on_logSampleSpinBox_valueChanged( int value );
     void on_logWarnRateLimitSpinBox_valueChanged( int value );
+    void on_nflogGroupSpinBox_valueChanged( int value );
+    void on_nflogThresholdSpinBox_valueChanged( int value );
+    void on_nflogSnaplenSpinBox_valueChanged( int value );
     void on_localPortRangeLowSpinBox_valueChanged( int value );
     void on_localPortRangeHighSpinBox_valueChanged( int value );
     void on_logLevelComboBox_currentIndexChanged(int value);
@@ -11,20 +11,32 @@
 **  to communicate with.
 */
 
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <sstream>
+#include <set>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/spirit/home/phoenix/core.hpp>
 #include <boost/spirit/home/phoenix/operator.hpp>
 #include <boost/spirit/home/phoenix/bind.hpp>
+#include <boost/thread.hpp>
 
+#include "atomicfile.h"
+#include "mappedfile.h"
+#include "memberoverlaps.h"
+#include "perfecthash.h"
+#include "policysnapshot.h"
 #include "protocoldb.h"
+#include "scriptlines.h"
 #include "zone.h"
+#include "zoneexpression.h"
 
 #define SYSTEM_RC_FIREWALL2 "/etc/rc.firewall"
 //#define SYSTEM_RC_FIREWALL2 "/etc/rc2.firewall"   //  This is temporary during development so that guardpuppy doesn't actually overwrite rc.firewall
@@ -60,6 +72,33 @@ class GuardPuppyFireWall
 
     std::vector< Zone > zones;
 
+    /*!
+    **  \brief What save() wrote for one pair of zones, kept until something
+    **         it was written from changes.
+    **
+    **  The zone pair setters drop the entries of their pair both ways, as the
+    **  unlogged drops of each chain depend on both, renaming or deleting a
+    **  zone those of all its pairs, and the settings every pair is
+    **  written with, like the protocols and their logging, drop them all.  The
+    **  addresses of the zones aren't used here, the parts of the script built
+    **  from them are only as long as the address lists and always rewritten.
+    */
+    struct ZonePairScript
+    {
+        std::string config;         // the [FromZone] section of the header
+        std::string rules;          // the rules added to the filter chains
+        std::string drops;          // the unlogged drops ending the from_to chain
+
+        void swap( ZonePairScript & other )
+        {
+            config.swap( other.config );
+            rules.swap( other.rules );
+            drops.swap( other.drops );
+        }
+    };
+    typedef std::map< std::pair< unsigned int, unsigned int >, ZonePairScript > ZonePairScriptMap;
+    ZonePairScriptMap zonePairScripts;      // by the ids of the from and to zone
+
     uint localPortRangeStart;
     uint localPortRangeEnd;
     bool disabled;
@@ -84,6 +123,22 @@ class GuardPuppyFireWall
     bool dhcpdenabled;
     std::string dhcpdinterfacename;
     bool allowtcptimestamps;
+    bool flowtableenabled;
+    std::string flowtableinterfacename;
+    bool lognflog;                  // Log through NFLOG to a userspace logger instead of LOG
+    uint nfloggroup;
+    uint nflogthreshold;            // Packets the kernel queues before sending a batch
+    uint nflogsnaplen;              // Bytes of each packet copied, 0 = whole packet
+    bool logpersource;              // Give every source address its own log rate limit
+    bool logsample;                 // Still log one in logsamplerate packets above the rate limit
+    uint logsamplerate;
+    std::set< std::string > nologprotocols;  // Protocols whose dropped packets are not logged
+
+    /*!
+    **  \brief The protocol database, for looking protocols up without
+    **         being able to change them
+    */
+    ProtocolDB const & db() const { return *pdb; }
 
 //  time to get serious
 //    std::vector< UserDefinedProtocol > userdefinedprotocols;
@@ -101,10 +156,10 @@ public:
         std::stringstream temp;
         try
         {
-            temp << pdb->lookup( protocol ).description << std::endl;
+            temp << db().lookup( protocol ).description << std::endl;
             if(isShowAdvancedProtocolHelp())
             {
-                pdb->lookup( protocol ).print(temp);
+                db().lookup( protocol ).print(temp);
             }
             text = temp.str();
         }
@@ -114,9 +169,9 @@ public:
     }
 
     //! \todo My guess is none of the checkboxes on the GUI are connected to these calls yet
-    void setLogDrop(bool on) { logdrop = on; }
+    void setLogDrop(bool on) { logdrop = on; zonePairScripts.clear(); }
     bool isLogDrop() { return logdrop; }
-    void setLogReject(bool on) { logreject = on; }
+    void setLogReject(bool on) { logreject = on; zonePairScripts.clear(); }
     bool isLogReject() { return logreject; }
     void setLogIPOptions(bool on) { logipoptions = on; }
     bool isLogIPOptions() { return logipoptions; }
@@ -150,6 +205,53 @@ public:
     bool isDHCPdEnabled() { return dhcpdenabled; }
     void setAllowTCPTimestamps(bool on) { allowtcptimestamps = on; }
     bool isAllowTCPTimestamps() { return allowtcptimestamps; }
+    void setFlowtableEnabled(bool on) { flowtableenabled = on; }
+    bool isFlowtableEnabled() { return flowtableenabled; }
+    void setLogNFLOG(bool on) { lognflog = on; }
+    bool isLogNFLOG() { return lognflog; }
+    void setNFLOGGroup(uint group) { nfloggroup = group; }
+    uint getNFLOGGroup() { return nfloggroup; }
+    void setNFLOGThreshold(uint packets) { nflogthreshold = packets; }
+    uint getNFLOGThreshold() { return nflogthreshold; }
+    void setNFLOGSnapLen(uint bytes) { nflogsnaplen = bytes; }
+    uint getNFLOGSnapLen() { return nflogsnaplen; }
+    void setLogPerSource(bool on) { logpersource = on; }
+    bool isLogPerSource() { return logpersource; }
+    void setLogSample(bool on) { logsample = on; }
+    bool isLogSample() { return logsample; }
+    void setLogSampleRate(uint oneIn) { logsamplerate = oneIn; }
+    uint getLogSampleRate() { return logsamplerate; }
+
+    /*!
+    **  \brief Turn logging of dropped packets of a protocol on or off
+    */
+    void setProtocolLogging( std::string const & protocolName, bool on )
+    {
+        std::string name = protocolName;
+        try
+        {
+            name = db().lookup( protocolName ).name;
+        }
+        catch ( ... )
+        { }
+        if ( on )
+            nologprotocols.erase( name );
+        else
+            nologprotocols.insert( name );
+        zonePairScripts.clear();
+    }
+
+    bool isProtocolLogging( std::string const & protocolName ) const
+    {
+        std::string name = protocolName;
+        try
+        {
+            name = db().lookup( protocolName ).name;
+        }
+        catch ( ... )
+        { }
+        return nologprotocols.find( name ) == nologprotocols.end();
+    }
 
     /*!
     **  \brief add an ipAddress to a zone
@@ -157,8 +259,10 @@ public:
     void addNewMachine( std::string const & zoneName, std::string const & ipAddress )
     {
         Zone & zone = getZone( zoneName );
+        checkMembersEditable( zone );
 
         zone.addMemberMachine( IPRange( ipAddress ) );
+        updateZoneDefinitions();
     }
 
     /*!
@@ -167,8 +271,10 @@ public:
     void deleteMachine( std::string const & zoneName, std::string const & ipAddress )
     {
         Zone & zone = getZone( zoneName );
+        checkMembersEditable( zone );
 
         zone.deleteMemberMachine( IPRange( ipAddress ) );
+        updateZoneDefinitions();
     }
 
     /*!
@@ -177,8 +283,71 @@ public:
     void setNewMachineName( std::string const & zoneName, std::string const & oldMachineName, std::string const & newMachineName )
     {
         Zone & zone = getZone( zoneName );
+        if ( oldMachineName == newMachineName )
+            return;
+        checkMembersEditable( zone );
 
         zone.renameMachine( oldMachineName, newMachineName );
+        updateZoneDefinitions();
+    }
+
+    /*!
+    **  \brief Work the members of zoneName out from the ZoneExpression
+    **         text from now on, or keep the members it has and stop if text
+    **         is blank
+    **
+    **  The zones in text have to be user zones.  Throws a std::string
+    **  telling what is wrong with text, leaving the zone as it was.
+    */
+    void setZoneDefinition( std::string const & zoneName, std::string const & text )
+    {
+        Zone & zone = getZone( zoneName );
+        if ( !zone.editable() )
+        {
+            throw std::string( "Zone " ) + zoneName + " can't be defined by other zones";
+        }
+        ZoneExpression expression( text );
+        BOOST_FOREACH( std::string const & name, expression.getZones() )
+        {
+            std::vector< Zone >::const_iterator operand = std::find_if( zones.begin(), zones.end(), boost::phoenix::bind( &Zone::getName, boost::phoenix::arg_names::arg1) == name );
+            if ( operand == zones.end() )
+            {
+                throw std::string( "No zone " ) + name + " to define zone " + zoneName + " by";
+            }
+            if ( !operand->editable() )
+            {
+                throw std::string( "Zone " ) + name + " can't be in the definition of a zone";
+            }
+        }
+
+        std::string oldDefinition = zone.getDefinition();
+        std::vector< std::pair< unsigned int, unsigned int > > oldInputs = zone.getDefinitionInputs();
+        zone.setDefinition( expression.str() );
+        try
+        {
+            updateZoneDefinitions();
+        }
+        catch ( std::string const & )
+        {
+            Zone & z = getZone( zoneName );
+            z.setDefinition( oldDefinition );
+            z.setDefinitionInputs( oldInputs );
+            throw;
+        }
+    }
+
+    /*!
+    **  \brief Work out again the members of each defined zone whose zones
+    **         have changed since they last were, zones they're defined by
+    **         first
+    */
+    void updateZoneDefinitions()
+    {
+        std::map< std::string, int > done;     // 1 while a zone is being worked out, 2 once it has been
+        BOOST_FOREACH( Zone & zone, zones )
+        {
+            updateZoneDefinition( zone, done );
+        }
     }
 
     /*!
@@ -188,7 +357,8 @@ public:
     {
         Zone & zone = getZone( zoneFrom );
 
-        return zone.setProtocolState( zoneTo, protocolName, state );
+        zone.setProtocolState( zoneTo, protocolName, state );
+        zonePairChanged( zoneFrom, zoneTo );
     }
 
     /*!
@@ -235,9 +405,19 @@ public:
     */
     void deleteZone( std::string const & zoneName )
     {
+        BOOST_FOREACH( Zone const & z, zones )
+        {
+            std::vector< std::string > operands = ZoneExpression( z.getDefinition() ).getZones();
+            if ( std::find( operands.begin(), operands.end(), zoneName ) != operands.end() )
+            {
+                throw std::string( "Zone " ) + zoneName + " can't be deleted, zone " + z.getName() + " is defined by it";
+            }
+        }
+        zoneChanged( getZone( zoneName ) );
         BOOST_FOREACH(Zone & z, zones)
         {
             z.disconnect(zoneName);
+            z.forgetZone(zoneName);
         }
 
         std::vector< Zone >::iterator zit = std::find_if( zones.begin(), zones.end(), boost::phoenix::bind( &Zone::getName, boost::phoenix::arg_names::arg1) == zoneName );
@@ -304,6 +484,7 @@ public:
         {
             getZone( zoneFrom ).disconnect( zoneTo );
         }
+        zonePairChanged( zoneFrom, zoneTo );
     }
 
     /*!
@@ -330,6 +511,235 @@ public:
         }
     }
 
+    /*!
+    **  \brief  Mark zoneFrom->zoneTo as a fast path pair, established forwarded
+    **          flows between them are offloaded to the nftables flowtable.
+    */
+    void setFastPath( std::string const & zoneFrom, std::string const & zoneTo, bool on )
+    {
+        getZone( zoneFrom ).setFastPath( zoneTo, on );
+        zonePairChanged( zoneFrom, zoneTo );
+    }
+
+    /*!
+    **  \brief boolean whether zoneFrom->zoneTo is a fast path pair
+    */
+    bool isFastPath( std::string const & zoneFrom, std::string const & zoneTo ) const
+    {
+        try
+        {
+            return getZone( zoneFrom ).isFastPath( zoneTo );
+        }
+        catch (...)
+        {
+            return false;
+        }
+    }
+
+    /*!
+    **  \brief  Turn logging of traffic dropped between zoneFrom->zoneTo on or off
+    */
+    void setZoneLogging( std::string const & zoneFrom, std::string const & zoneTo, bool on )
+    {
+        getZone( zoneFrom ).setLogging( zoneTo, on );
+        zonePairChanged( zoneFrom, zoneTo );
+    }
+
+    /*!
+    **  \brief boolean whether traffic dropped between zoneFrom->zoneTo is logged
+    */
+    bool isZoneLogging( std::string const & zoneFrom, std::string const & zoneTo ) const
+    {
+        try
+        {
+            return getZone( zoneFrom ).isLogging( zoneTo );
+        }
+        catch (...)
+        {
+            return true;
+        }
+    }
+
+    /*!
+    **  \brief Walk the rules of the zone to zone filter chains in the order
+    **         the script adds them.
+    **
+    **  sink.rule() gets every protocol rule with the arguments of
+    **  expandIPTablesFilterRule(), sink.chainEnd() the DROP rule closing each
+    **  chain, and whatever goes to sink.comment() only annotates the script.
+    **  Anything modelling the firewall, like PacketClassifier, uses this walk
+    **  so it sees exactly the rules the script gets.  writeIPTablesFirewall()
+    **  goes the same way, taking each pair's rules from zonePairScripts.
+    */
+    template< class Sink >
+    void walkFilterRules( Sink & sink ) const
+    {
+        // This PortRangeInfo object holds the info about the super tight
+        // port ranges our machine now uses.
+        PortRangeInfo localPRI( localPortRangeStart, localPortRangeEnd );
+
+        sink.comment()<<"# Add rules to the filter chains\n";
+        // 'From' zone loop
+        BOOST_FOREACH( Zone const & fromZone, zones )
+        {
+            // 'To' zone loop
+            BOOST_FOREACH( Zone const & toZone, zones )
+            {
+                if ( fromZone != toZone )
+                {
+                    walkZonePairRules( sink, fromZone, toZone, localPRI );
+                }
+            }
+        }
+
+        // Place DENY and log rules at the end of our filter chains
+        sink.comment()<<"\n" "# Place DROP and log rules at the end of our filter chains.\n";
+        // 'From' zone loop
+        BOOST_FOREACH( Zone const & fromZone, zones )
+        {
+            // 'To' zone loop
+            BOOST_FOREACH( Zone const & toZone, zones )
+            {
+                if ( fromZone != toZone )
+                {
+                    walkUnloggedDrops( sink, fromZone, toZone, localPRI );
+                    // Finally, the DENY and LOG packet rule to finish things off.
+                    sink.chainEnd( fromZone.getName(), toZone.getName(), fromZone.isLogging( toZone.getName() ) );
+                }
+            }
+        }
+    }
+
+    /*!
+    **  \brief The part of walkFilterRules() for the protocols of one pair of
+    **         zones
+    **
+    **  The rules only depend on the protocols of the pair, its logging, the
+    **  names of the two zones and the settings zonePairScripts is cleared for.
+    */
+    template< class Sink >
+    void walkZonePairRules( Sink & sink, Zone const & fromZone, Zone const & toZone, PortRangeInfo & localPRI ) const
+    {
+        // Detect and accept permitted protocols.
+        std::vector< std::string > permitZoneProtocols = fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::PERMIT );
+        sink.comment()<<"\n# Traffic from '"<< fromZone.getName() << "' to '"<< toZone.getName() << "'\n";
+        BOOST_FOREACH( std::string const & zoneProtocol, permitZoneProtocols )
+        {
+            sink.comment() << "# Allow '" << zoneProtocol <<"'\n";
+            std::vector< ProtocolNetUse > const & networkuses = getNetworkUse( zoneProtocol );
+
+            BOOST_FOREACH( ProtocolNetUse const & networkuse, networkuses )
+            {
+                // If this netuse has been marked with the RELATED pragma
+                // then we don't need to output it becuase netfilter will
+                // be connection tracking it. The general state handling
+                // rule will handle this connection automatically.
+
+                if ( !networkuse.description.empty() )
+                {
+                    sink.comment() << "# "<< networkuse.description << "\n";
+                }
+                if ( !networkuse.isRelated() )
+                {
+                    if ( networkuse.source == ENTITY_CLIENT)
+                    {
+                        sink.rule( fromZone.getName(), fromZone.isLocal() ? &localPRI : 0,
+                                toZone.getName(), toZone.isLocal() ? &localPRI : 0, networkuse, Zone::PERMIT);
+                    }
+                    if ( networkuse.dest == ENTITY_CLIENT)
+                    {
+                        sink.rule( toZone.getName(), toZone.isLocal() ? &localPRI : 0,
+                                fromZone.getName(), fromZone.isLocal() ? &localPRI : 0, networkuse, Zone::PERMIT);
+                    }
+                }
+                else
+                {
+                    sink.comment()<<"#  - Handled by netfilter state tracking\n";
+                }
+            }
+        }
+
+        // Detect and reject protocols that have been marked for such treatment. :-)
+
+        std::vector< std::string > rejectZoneProtocols = fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::REJECT );
+        sink.comment()<<"\n# Rejected traffic from '"<<fromZone.getName()<<"' to '"<<toZone.getName()<<"'\n";
+        BOOST_FOREACH( std::string const & zoneProtocol, rejectZoneProtocols )
+        {
+            sink.comment() << "# Reject '" << zoneProtocol << "'\n";
+            bool log = logreject && fromZone.isLogging( toZone.getName() ) && isProtocolLogging( zoneProtocol );
+
+            std::vector< ProtocolNetUse > const & networkuses = getNetworkUse( zoneProtocol );
+
+            BOOST_FOREACH( ProtocolNetUse const & networkuse, networkuses )
+            {
+                if ( !networkuse.description.empty() )
+                {
+                    sink.comment()<<"# "<<networkuse.description <<"\n";
+                }
+                if(networkuse.source==ENTITY_CLIENT)
+                {
+                    sink.rule(fromZone.getName(),fromZone.isLocal() ? &localPRI : 0, toZone.getName(), toZone.isLocal() ? &localPRI : 0,networkuse,Zone::REJECT,log);
+                }
+                if(networkuse.dest==ENTITY_CLIENT)
+                {
+                    sink.rule(toZone.getName(),toZone.isLocal() ? &localPRI : 0, fromZone.getName(), fromZone.isLocal() ? &localPRI : 0,networkuse,Zone::REJECT,log);
+                }
+            }
+        }
+    }
+
+    /*!
+    **  \brief The rules dropping, without logging, what fromZone->toZone
+    **         would log and drop of the protocols that aren't logged
+    **
+    **  They go after the rules of every pair, right before the logdrop rule
+    **  ending the chain, as the rules of the pair toZone->fromZone add to
+    **  this chain too.  A protocol the chain permits or rejects either way
+    **  is left to those rules.
+    */
+    template< class Sink >
+    void walkUnloggedDrops( Sink & sink, Zone const & fromZone, Zone const & toZone, PortRangeInfo & localPRI ) const
+    {
+        if ( !logdrop || !fromZone.isLogging( toZone.getName() ) || nologprotocols.empty() )
+            return;
+
+        // The chain gets the netuses with fromZone as the client of the
+        // protocols of this pair, and those with toZone as the client of
+        // the protocols of the reverse pair.
+        std::vector< std::string > fromClients = fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::PERMIT );
+        std::vector< std::string > rejected = fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::REJECT );
+        fromClients.insert( fromClients.end(), rejected.begin(), rejected.end() );
+        std::vector< std::string > toClients = toZone.getConnectedZoneProtocols( fromZone.getName(), Zone::PERMIT );
+        rejected = toZone.getConnectedZoneProtocols( fromZone.getName(), Zone::REJECT );
+        toClients.insert( toClients.end(), rejected.begin(), rejected.end() );
+
+        sink.comment()<<"\n# Unlogged traffic from '"<<fromZone.getName()<<"' to '"<<toZone.getName()<<"'\n";
+        BOOST_FOREACH( std::string const & zoneProtocol, nologprotocols )
+        {
+            bool fromClient = std::find( fromClients.begin(), fromClients.end(), zoneProtocol ) == fromClients.end();
+            bool toClient = std::find( toClients.begin(), toClients.end(), zoneProtocol ) == toClients.end();
+            if ( !fromClient && !toClient )
+                continue;
+
+            bool commented = false;
+            std::vector< ProtocolNetUse > const & networkuses = getNetworkUse( zoneProtocol );
+            BOOST_FOREACH( ProtocolNetUse const & networkuse, networkuses )
+            {
+                if ( networkuse.isRelated() )
+                    continue;
+                if ( ( fromClient && networkuse.source == ENTITY_CLIENT ) || ( toClient && networkuse.dest == ENTITY_CLIENT ) )
+                {
+                    if ( !commented )
+                    {
+                        sink.comment() << "# Drop '" << zoneProtocol << "'\n";
+                        commented = true;
+                    }
+                    sink.rule(fromZone.getName(),fromZone.isLocal() ? &localPRI : 0, toZone.getName(), toZone.isLocal() ? &localPRI : 0,networkuse,Zone::DENY,false);
+                }
+            }
+        }
+    }
+
     /*!
     **  \brief  Rename a zone name
     **
@@ -338,6 +748,19 @@ public:
     {
         Zone & zone = getZone( oldZoneName );
         zone.setName( newZoneName );
+        zoneChanged( zone );
+        BOOST_FOREACH( Zone & z, zones )
+        {
+            z.renameZoneReferences( oldZoneName, newZoneName );
+            if ( z.isDefined() )
+            {
+                ZoneExpression expression( z.getDefinition() );
+                expression.renameZone( oldZoneName, newZoneName );
+                std::vector< std::pair< unsigned int, unsigned int > > inputs = z.getDefinitionInputs();
+                z.setDefinition( expression.str() );
+                z.setDefinitionInputs( inputs );
+            }
+        }
     }
 
     /*!
@@ -346,6 +769,7 @@ public:
     void newUserDefinedProtocol(std::string name, uchar udpType, uint udpStartPort, uint udpEndPort, bool bi)
     {//we still have udps, we just will not access them the same way. This function will likely go away
         pdb->UserDefinedProtocol(name, udpType, udpStartPort, udpEndPort, bi);
+        zonePairScripts.clear();
         //userdefinedprotocols.push_back(p);
     }
 
@@ -356,6 +780,7 @@ public:
     void deleteUserDefinedProtocol( std::string i )
     {
         pdb->deleteProtocolEntry(i);
+        zonePairScripts.clear();
     }
 
     /*!
@@ -388,7 +813,7 @@ public:
                 std::cerr << "Unable to locate "<< filename << " in "<< defdir << std::endl;
             }
         }
-            pdb = new ProtocolDB( confdir+filename );
+            pdb = new ProtocolDB( confdir+filename, ProtocolDB::overlayFiles( confdir + "protocols.d" ) );
         try
         {
             factoryDefaults();
@@ -418,10 +843,12 @@ public:
     void setLocalDynamicPortRangeStart(uint start)
     {
         localPortRangeStart = start;
+        zonePairScripts.clear();
     }
     void setLocalDynamicPortRangeEnd( uint end )
     {
         localPortRangeEnd = end;
+        zonePairScripts.clear();
     }
 
     void getLocalDynamicPortRange(uint &start,uint &end)
@@ -450,6 +877,16 @@ public:
         return dhcpdinterfacename;
     }
 
+    void setFlowtableInterfaceName(const std::string &ifacename)
+    {
+        flowtableinterfacename = ifacename;
+    }
+
+    std::string getFlowtableInterfaceName()
+    {
+        return flowtableinterfacename;
+    }
+
     bool isSuperUserMode() const
     {
         return superUserMode;
@@ -467,6 +904,7 @@ public:
         std::cout << "Saving firewall " << filename << std::endl;
 
         save( filename );
+        keepSnapshot( filename );
         apply();
     }
 
@@ -487,8 +925,6 @@ public:
         tmp += tmpFile.string();
 #endif
         save( tmp );
-        std::string cmd = "chmod 0700 " + tmp;
-        system( cmd.c_str() );
         runFirewall( tmp );
         boost::filesystem::remove( tmp );
     }
@@ -527,7 +963,21 @@ public:
 
             try
             {
-                readFirewall( filename );
+                bool fromSnapshot = false;
+                try
+                {
+                    fromSnapshot = readSnapshot( filename );
+                }
+                catch ( std::string const & msg )
+                {
+                    std::cerr << "Ignoring the snapshot of " << filename << ": " << msg << std::endl;
+                    factoryDefaults();
+                }
+                if ( !fromSnapshot )
+                {
+                    readFirewall( filename );
+                    keepSnapshot( filename );
+                }
             }
             catch(...)
             {
@@ -544,39 +994,29 @@ public:
         }
     }
 
-    std::vector< ProtocolNetUse > getNetworkUse( std::string const & protocolName ) const
+    std::vector< ProtocolNetUse > const & getNetworkUse( std::string const & protocolName ) const
     {
-        std::vector< ProtocolNetUse > protos = pdb->getNetworkUses( protocolName );
-        return protos;
+        return pdb->getNetworkUses( protocolName );
     }
 
     /*!
     **  \brief Save firewall to filename
+    **
+    **  The script only takes the place of the old one once it is completely
+    **  on disk.  A new script is only readable and runnable by its owner.
     */
     void save( std::string const & filename )
     {
-        std::ofstream stream( filename.c_str() );
-        //! \todo Update permissions to be secure chmod 0700 ?
-
-        int c,oldc;
-
-        stream<<"#!/bin/bash\n"
-            "# [GuardPuppy]\n"
-            "# DO NOT EDIT!\n"
-            "# This firewall script was generated by \"guard-puppy\" \n"
-            "# https://github.com/SamAxe/guard-puppy.  This script requires iptables\n"
-            "#\n"
-            "# [Description]\n";
-        c = 0;
-        oldc = 0;
-        while((c = description.find('\n',c))>=0) {
-            stream<<"#  "<<description.substr(oldc,c-oldc)<<"\n";
-            oldc = c + 1;
-            c++;
-        }
-        c = (int)description.length();
-        stream<<"#  "<<description.substr(oldc,c-oldc)<<"\n";
+        AtomicFile file( filename, 0700 );
+        writeScript( file.stream() );
+        file.commit();
+    }
 
+    /*!
+    **  \brief Write the [Config] section of the firewall script to stream
+    */
+    void writeSettings( std::ostream & stream ) const
+    {
         stream<<
             "# [Config]\n"
             "# LOCALPORTRANGESTART="<<localPortRangeStart<<"\n"
@@ -600,7 +1040,51 @@ public:
             "# DHCPCINTERFACENAME="<<(dhcpcinterfacename)<<"\n"
             "# DHCPD="<<(dhcpdenabled?1:0)<<"\n"
             "# DHCPDINTERFACENAME="<<(dhcpdinterfacename)<<"\n"
-            "# ALLOWTCPTIMESTAMPS="<<(allowtcptimestamps?1:0)<<"\n";
+            "# ALLOWTCPTIMESTAMPS="<<(allowtcptimestamps?1:0)<<"\n"
+            "# FLOWTABLE="<<(flowtableenabled?1:0)<<"\n"
+            "# FLOWTABLEINTERFACENAME="<<(flowtableinterfacename)<<"\n"
+            "# LOGNFLOG="<<(lognflog?1:0)<<"\n"
+            "# NFLOGGROUP="<<nfloggroup<<"\n"
+            "# NFLOGTHRESHOLD="<<nflogthreshold<<"\n"
+            "# NFLOGSNAPLEN="<<nflogsnaplen<<"\n"
+            "# LOGPERSOURCE="<<(logpersource?1:0)<<"\n"
+            "# LOGSAMPLE="<<(logsample?1:0)<<"\n"
+            "# LOGSAMPLERATE="<<logsamplerate<<"\n";
+        BOOST_FOREACH( std::string const & p, nologprotocols )
+        {
+            stream<<"# NOLOGPROTOCOL="<<p<<"\n";
+        }
+    }
+
+    /*!
+    **  \brief Write the part of the firewall script readFirewall() reads
+    **         back, up to and including "# [End]", to stream
+    */
+    void writeConfig( std::ostream & stream )
+    {
+        updateZoneDefinitions();
+        renderZonePairScripts();
+
+        int c,oldc;
+
+        stream<<"#!/bin/bash\n"
+            "# [GuardPuppy]\n"
+            "# DO NOT EDIT!\n"
+            "# This firewall script was generated by \"guard-puppy\" \n"
+            "# https://github.com/SamAxe/guard-puppy.  This script requires iptables\n"
+            "#\n"
+            "# [Description]\n";
+        c = 0;
+        oldc = 0;
+        while((c = description.find('\n',c))>=0) {
+            stream<<"#  "<<description.substr(oldc,c-oldc)<<"\n";
+            oldc = c + 1;
+            c++;
+        }
+        c = (int)description.length();
+        stream<<"#  "<<description.substr(oldc,c-oldc)<<"\n";
+
+        writeSettings( stream );
 
         // Output the info about the Zones we have. No need to output the default zones.
         BOOST_FOREACH( Zone & zit, zones )
@@ -610,6 +1094,10 @@ public:
                 stream<<"# [Zone]\n";
                 stream<<"# NAME="<<(zit.getName().c_str())<<"\n";
                 stream<<"# COMMENT="<<(zit.getComment())<<"\n";
+                if ( zit.isDefined() )
+                {
+                    stream<<"# DEFINITION="<<zit.getDefinition()<<"\n";
+                }
                 BOOST_FOREACH( IPRange const & addy, zit.getMemberMachineList() )
                 {
                     stream<<"# ADDRESS="<<addy.getAddress()<<"\n";
@@ -620,7 +1108,7 @@ public:
         // Output the User Defined Protocols
         {//kill the functor we don't care about it after it does it's work.
             OutputUDP OutputUDPm(stream);
-            pdb->ApplyToDB(OutputUDPm);
+            pdb->ApplyToRows(OutputUDPm);
         }
         // Go over each Zone and output which protocols are allowed to whom.
         BOOST_FOREACH( Zone const & toZone, zones )
@@ -632,38 +1120,23 @@ public:
             {
                 if ( toZone != fromZone )
                 {
-                    stream << "# [FromZone] " << fromZone .getName() <<"\n";
+                    stream << getZonePairScript( fromZone, toZone ).config;
+                }
+            }
+        }
 
-                    if ( areZonesConnected( fromZone.getName(), toZone.getName()) )
-                    {
-                        stream<<"# CONNECTED=1\n";
-                        // Now we iterate over and output each enabled protocol.
-                        //                    protodictit = toZone.newPermitProtocolZoneIterator(fromZone );
-                        std::vector< std::string > zones1 = getConnectedZoneProtocols( fromZone.getName(), toZone .getName(), Zone::PERMIT );
-                        BOOST_FOREACH( std::string const & p, zones1 )
-                        {
-                            stream << "# PROTOCOL=" << p << std::endl;
-                        }
+        stream<<"# [End]\n";
+    }
 
-                        // Output each Rejected protocol.
-                        std::vector< std::string > zones2 = getConnectedZoneProtocols( fromZone.getName(), toZone .getName(), Zone::REJECT );
-                        BOOST_FOREACH( std::string const & p, zones2 )
-                        {
-                            stream << "# REJECT=" << p << std::endl;
-                        }
-                    }
-                    else
-                    {
-                        // This server/client zone combo is not currently connected.
-                        stream<<"# CONNECTED=0\n";
-                    }
-                }
-            }
-        }
+    /*!
+    **  \brief Write the firewall script to stream
+    */
+    void writeScript( std::ostream & stream )
+    {
+        writeConfig( stream );
 
         // The real script starts here.
-        stream<<"# [End]\n"
-            "\n"
+        stream<<"\n"
             "# Real code starts here\n"
             "# If you change the line below then also change the # DISABLED line above.\n";
         if(disabled)
@@ -705,15 +1178,346 @@ public:
             "true\n";
     }
 private:
-    
+    /*!
+    **  \brief Forget what was written for zoneFrom->zoneTo
+    */
+    void zonePairChanged( std::string const & zoneFrom, std::string const & zoneTo )
+    {
+        std::vector< Zone >::const_iterator to = std::find_if( zones.begin(), zones.end(), boost::phoenix::bind( &Zone::getName, boost::phoenix::arg_names::arg1) == zoneTo );
+        if ( to != zones.end() )
+        {
+            zonePairScripts.erase( std::make_pair( getZone( zoneFrom ).getId(), to->getId() ) );
+            zonePairScripts.erase( std::make_pair( to->getId(), getZone( zoneFrom ).getId() ) );
+        }
+    }
+
+    /*!
+    **  \brief Forget what was written for every pair zone is in
+    */
+    void zoneChanged( Zone const & zone )
+    {
+        BOOST_FOREACH( Zone const & other, zones )
+        {
+            zonePairScripts.erase( std::make_pair( zone.getId(), other.getId() ) );
+            zonePairScripts.erase( std::make_pair( other.getId(), zone.getId() ) );
+        }
+    }
+
+    /*!
+    **  \brief Throw if zone's members are worked out from a definition,
+    **         rather than given
+    */
+    static void checkMembersEditable( Zone const & zone )
+    {
+        if ( zone.isDefined() )
+        {
+            throw std::string( "Zone " ) + zone.getName() + " is defined as " + zone.getDefinition() + ", its addresses can't be changed";
+        }
+    }
+
+    /*!
+    **  \brief The zones of expression, each with its getMembersVersion()
+    */
+    std::vector< std::pair< unsigned int, unsigned int > > definitionInputs( ZoneExpression const & expression ) const
+    {
+        std::vector< std::pair< unsigned int, unsigned int > > inputs;
+        BOOST_FOREACH( std::string const & name, expression.getZones() )
+        {
+            Zone const & operand = getZone( name );
+            inputs.push_back( std::make_pair( operand.getId(), operand.getMembersVersion() ) );
+        }
+        return inputs;
+    }
+
+    /*!
+    **  \brief updateZoneDefinitions() for zone and the zones it is defined
+    **         by
+    */
+    void updateZoneDefinition( Zone & zone, std::map< std::string, int > & done )
+    {
+        if ( !zone.isDefined() || done[ zone.getName() ] == 2 )
+        {
+            return;
+        }
+        if ( done[ zone.getName() ] == 1 )
+        {
+            throw std::string( "Zone " ) + zone.getName() + " is defined by itself";
+        }
+        done[ zone.getName() ] = 1;
+
+        ZoneExpression expression( zone.getDefinition() );
+        BOOST_FOREACH( std::string const & name, expression.getZones() )
+        {
+            updateZoneDefinition( getZone( name ), done );
+        }
+        std::vector< std::pair< unsigned int, unsigned int > > inputs = definitionInputs( expression );
+        if ( inputs != zone.getDefinitionInputs() )
+        {
+            std::map< std::string, IntervalSet< uint32_t > > addresses;
+            std::map< std::string, std::set< std::string > > names;
+            BOOST_FOREACH( std::string const & name, expression.getZones() )
+            {
+                IntervalSet< uint32_t > & set = addresses[ name ];
+                std::set< std::string > & other = names[ name ];
+                BOOST_FOREACH( IPRange const & member, getZone( name ).getMemberMachineList() )
+                {
+                    uint32_t first, last;
+                    if ( member.getBounds( first, last ) )
+                        set.add( first, last );
+                    else
+                        other.insert( member.getAddress() );
+                }
+                set.build();
+            }
+
+            std::vector< IPRange > members;
+            IntervalSet< uint32_t > result = expression.evaluate( addresses );
+            BOOST_FOREACH( IntervalSet< uint32_t >::Interval const & i, result )
+            {
+                members.push_back( IPRange::fromBounds( i.first, i.last ) );
+            }
+            BOOST_FOREACH( std::string const & name, expression.evaluate( names ) )
+            {
+                members.push_back( IPRange( name ) );
+            }
+            zone.setMemberMachines( members );
+            zone.setDefinitionInputs( inputs );
+        }
+        done[ zone.getName() ] = 2;
+    }
+
+    /*!
+    **  \brief Take the members of each defined zone as just read to be
+    **         those of its definition, without working them out
+    */
+    void markZoneDefinitionsCurrent()
+    {
+        BOOST_FOREACH( Zone & zone, zones )
+        {
+            if ( zone.isDefined() )
+            {
+                zone.setDefinitionInputs( definitionInputs( ZoneExpression( zone.getDefinition() ) ) );
+            }
+        }
+    }
+
+    /*!
+    **  \brief What save() writes for fromZone->toZone, written again only if
+    **         something it comes from changed since the last save
+    */
+    ZonePairScript const & getZonePairScript( Zone const & fromZone, Zone const & toZone )
+    {
+        std::pair< unsigned int, unsigned int > key( fromZone.getId(), toZone.getId() );
+        ZonePairScriptMap::const_iterator cached = zonePairScripts.find( key );
+        if ( cached != zonePairScripts.end() )
+        {
+            return cached->second;
+        }
+
+        ZonePairScript script;
+        renderZonePair( fromZone, toZone, script );
+        return zonePairScripts[ key ] = script;
+    }
+
+    /*!
+    **  \brief Write the parts of the script for fromZone->toZone into script
+    **
+    **  Only reads the firewall, and the protocols through db(), so any number
+    **  of pairs can be written at once as long as the protocol table() is
+    **  built first and nothing changes the firewall meanwhile.
+    */
+    void renderZonePair( Zone const & fromZone, Zone const & toZone, ZonePairScript & script ) const
+    {
+        std::ostringstream config;
+        writeZonePairConfig( config, fromZone, toZone );
+
+        std::ostringstream rules;
+        PortRangeInfo localPRI( localPortRangeStart, localPortRangeEnd );
+        FilterRuleScriptWriter writer( *this, rules );
+        walkZonePairRules( writer, fromZone, toZone, localPRI );
+
+        std::ostringstream drops;
+        FilterRuleScriptWriter dropWriter( *this, drops );
+        walkUnloggedDrops( dropWriter, fromZone, toZone, localPRI );
+
+        script.config = config.str();
+        script.rules = rules.str();
+        script.drops = drops.str();
+    }
+
+    /*!
+    **  \brief Render the zone pairs that changed since the last save on one
+    **         thread per cpu.
+    **
+    **  The pairs go into zonePairScripts, from which save() writes them in
+    **  zone order, so the script doesn't depend on which thread wrote what.
+    */
+    void renderZonePairScripts()
+    {
+        std::vector< std::pair< Zone const *, Zone const * > > pairs;
+        BOOST_FOREACH( Zone const & fromZone, zones )
+        {
+            BOOST_FOREACH( Zone const & toZone, zones )
+            {
+                if ( fromZone != toZone && zonePairScripts.find( std::make_pair( fromZone.getId(), toZone.getId() ) ) == zonePairScripts.end() )
+                {
+                    pairs.push_back( std::make_pair( &fromZone, &toZone ) );
+                }
+            }
+        }
+
+        std::vector< ZonePairScript > scripts( pairs.size() );
+        ZonePairRenderer renderer( *this, pairs, scripts );
+        pdb->table();       // looked up by every thread
+
+        size_t threads = std::min< size_t >( boost::thread::hardware_concurrency(), pairs.size() / ZonePairRenderer::CHUNK );
+        if ( threads <= 1 )
+        {
+            renderer.run();
+        }
+        else
+        {
+            boost::thread_group group;
+            for ( size_t i = 0; i < threads; i++ )
+            {
+                group.create_thread( boost::bind( &ZonePairRenderer::run, &renderer ) );
+            }
+            group.join_all();
+        }
+        if ( !renderer.getError().empty() )
+        {
+            throw renderer.getError();
+        }
+
+        for ( size_t i = 0; i < pairs.size(); i++ )
+        {
+            zonePairScripts[ std::make_pair( pairs[i].first->getId(), pairs[i].second->getId() ) ].swap( scripts[i] );
+        }
+    }
+
+    /*!
+    **  \brief Shares the zone pairs out between the threads of
+    **         renderZonePairScripts()
+    **
+    **  Each thread takes the next CHUNK pairs nobody has taken yet, so the
+    **  threads that got small pairs carry on with the rest while one works
+    **  through a big one.
+    */
+    class ZonePairRenderer
+    {
+        GuardPuppyFireWall const & firewall;
+        std::vector< std::pair< Zone const *, Zone const * > > const & pairs;
+        std::vector< ZonePairScript > & scripts;
+        boost::mutex mutex;
+        size_t next;
+        std::string error;
+
+        bool take( size_t & first, size_t & last )
+        {
+            boost::mutex::scoped_lock lock( mutex );
+            if ( next >= pairs.size() || !error.empty() )
+            {
+                return false;
+            }
+            first = next;
+            last = std::min( pairs.size(), next + CHUNK );
+            next = last;
+            return true;
+        }
+
+    public:
+        enum { CHUNK = 16 };
+
+        ZonePairRenderer( GuardPuppyFireWall const & _firewall, std::vector< std::pair< Zone const *, Zone const * > > const & _pairs,
+                std::vector< ZonePairScript > & _scripts )
+         : firewall( _firewall ), pairs( _pairs ), scripts( _scripts ), next( 0 )
+        {
+        }
+
+        void run()
+        {
+            size_t first, last;
+            try
+            {
+                while ( take( first, last ) )
+                {
+                    for ( size_t i = first; i < last; i++ )
+                    {
+                        firewall.renderZonePair( *pairs[i].first, *pairs[i].second, scripts[i] );
+                    }
+                }
+            }
+            catch ( std::string const & e )
+            {
+                fail( e );
+            }
+            catch ( std::exception const & e )
+            {
+                fail( e.what() );
+            }
+        }
+
+        void fail( std::string const & e )
+        {
+            boost::mutex::scoped_lock lock( mutex );
+            if ( error.empty() )
+            {
+                error = e;
+            }
+        }
+
+        std::string const & getError() const { return error; }
+    };
+
+    /*!
+    **  \brief The [FromZone] section of the header for fromZone->toZone
+    */
+    void writeZonePairConfig( std::ostream & stream, Zone const & fromZone, Zone const & toZone ) const
+    {
+        stream << "# [FromZone] " << fromZone .getName() <<"\n";
+
+        if ( fromZone.isConnectedTo( toZone.getName() ) )
+        {
+            stream<<"# CONNECTED=1\n";
+            // Now we iterate over and output each enabled protocol.
+            //                    protodictit = toZone.newPermitProtocolZoneIterator(fromZone );
+            std::vector< std::string > zones1 = fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::PERMIT );
+            BOOST_FOREACH( std::string const & p, zones1 )
+            {
+                stream << "# PROTOCOL=" << p << "\n";
+            }
+
+            // Output each Rejected protocol.
+            std::vector< std::string > zones2 = fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::REJECT );
+            BOOST_FOREACH( std::string const & p, zones2 )
+            {
+                stream << "# REJECT=" << p << "\n";
+            }
+
+            if ( fromZone.isFastPath( toZone.getName() ) )
+            {
+                stream << "# FASTPATH=1\n";
+            }
+        }
+        else
+        {
+            // This server/client zone combo is not currently connected.
+            stream<<"# CONNECTED=0\n";
+        }
+        if ( !fromZone.isLogging( toZone.getName() ) )
+        {
+            stream << "# LOG=0\n";
+        }
+    }
+
     //helper functor for save
     class OutputUDP
     {
-        std::ofstream & o;
+        std::ostream & o;
         public:
-        OutputUDP(std::ofstream & _o):o(_o)
+        OutputUDP(std::ostream & _o):o(_o)
         {}
-        void operator()(ProtocolEntry const & i)
+        void operator()(ProtocolEntry const & i, ProtocolTable::Protocol const & rows)
         {
             if(i.Classification == "User Defined")
             {
@@ -721,15 +1525,37 @@ private:
                 o<<"# ID="<<("0"/*currentudp.getID()*/)<<"\n";
                 o<<"# NAME="<<(i.getName())<<"\n";
 
-                std::vector<uchar> types = i.getTypes();
-                std::vector<uint> start = i.getStartPorts();
-                std::vector<uint> end = i.getEndPorts();
-                std::vector<bool> bi = i.getBidirectionals();
-                for(uint j(0); j < types.size(); j++)
+                for(uint j(0); j < rows.size(); j++)
+                {
+                    o<<"# TYPE="<<(rows.types[j]==IPPROTO_TCP ? "TCP" : "UDP")<<"\n";
+                    o<<"# PORT="<< rows.destStarts[j]<<":"<< rows.destEnds[j]<<"\n";
+                    o<<"# BIDIRECTIONAL="<<(rows.bidirectionals[j] ? 1 : 0)<<"\n";
+                }
+            }
+        }
+    };
+
+    //helper functor for writeSnapshot, like OutputUDP
+    class SnapshotUDP
+    {
+        PolicySnapshotWriter & snapshot;
+        public:
+        SnapshotUDP(PolicySnapshotWriter & _snapshot):snapshot(_snapshot)
+        {}
+        void operator()(ProtocolEntry const & i, ProtocolTable::Protocol const & rows)
+        {
+            if(i.Classification == "User Defined")
+            {
+                std::vector<uint32_t> & protocols = snapshot.section( PolicySnapshot::PROTOCOLS );
+                protocols[0]++;
+                protocols.push_back( snapshot.intern( i.getName() ) );
+                protocols.push_back( rows.size() );
+                for(uint j(0); j < rows.size(); j++)
                 {
-                    o<<"# TYPE="<<(types[j]==IPPROTO_TCP ? "TCP" : "UDP")<<"\n";
-                    o<<"# PORT="<< start[j]<<":"<< end[j]<<"\n";
-                    o<<"# BIDIRECTIONAL="<<(bi[j] ? 1 : 0)<<"\n";
+                    protocols.push_back( rows.types[j]==IPPROTO_TCP ? IPPROTO_TCP : IPPROTO_UDP );
+                    protocols.push_back( rows.destStarts[j] );
+                    protocols.push_back( rows.destEnds[j] );
+                    protocols.push_back( rows.bidirectionals[j] ? 1 : 0 );
                 }
             }
         }
@@ -762,20 +1588,32 @@ private:
             "iptables -X\n"
             "ip6tables -F\n"
             "ip6tables -X\n"
+            "iptables -t raw -F\n"
+            "iptables -t raw -X\n"
+            "nft delete table inet guardpuppy &> /dev/null\n"
             "\n"
             "# Load any special kernel modules.\n"
             "[ $GUARDDOG_VERBOSE -eq 1 ] && echo \""<<("Loading kernel modules.")<<"\"\n";
 
 
+        // Only the helpers of protocols that are actually permitted somewhere.
+        std::set< std::string > helpers = getPermittedHelpers();
         std::vector< std::string > modules;
+        BOOST_FOREACH( std::string const & h, helpers )
+        {
+            modules.push_back( "nf_conntrack_" + h );
+        }
         BOOST_FOREACH( std::string const & m, modules )
         {
             // Output the modprobe code to load the extra modules.
-            stream << "modprobe " << m << std::endl;
+            stream << "modprobe " << m << "\n";
         }
 
         stream<<"\n"
             "[ $GUARDDOG_VERBOSE -eq 1 ] && echo \""<<("Setting kernel parameters.")<<"\"\n"
+            "# Helpers are attached explicitly in the raw table, don't let conntrack\n"
+            "# try every loaded helper against every new connection.\n"
+            "echo 0 > /proc/sys/net/netfilter/nf_conntrack_helper 2> /dev/null\n"
             "# Turn on kernel IP spoof protection\n"
             "echo 1 > /proc/sys/net/ipv4/icmp_echo_ignore_broadcasts 2> /dev/null\n"
             "# Set the TCP timestamps config\n"
@@ -836,29 +1674,16 @@ private:
         stream<<"iptables -N logdrop2\n";
         if(logdrop)
         {
-            stream<<"iptables -A logdrop2 -j LOG --log-prefix \"DROPPED \" --log-level "<<loglevel<<" ";
-            if(logipoptions)
-            {
-                stream<<"--log-ip-options ";
-            }
-            if(logtcpoptions)
-            {
-                stream<<"--log-tcp-options ";
-            }
-            if(logtcpsequence)
-            {
-                stream<<"--log-tcp-sequence ";
-            }
-            stream<<"\n";
+            stream<<"iptables -A logdrop2 "<<logTarget("DROPPED")<<"\n";
         }
         stream<<"iptables -A logdrop2 -j DROP\n";
         stream<<"iptables -N logdrop\n";
         if(logdrop && logratelimit)
         {
-            stream<<"iptables -A logdrop -m limit --limit "<<lograte<<"/"<<rateunits[lograteunit]<<" --limit-burst "<<lograteburst<<" -j logdrop2\n";
+            writeLogLimitRules( stream, "logdrop", rateunits );
             if(logwarnlimit)
             {
-                stream<<"iptables -A logdrop -m limit --limit "<<logwarnrate<<"/"<<rateunits[logwarnrateunit]<<" --limit-burst 1 -j LOG --log-prefix \"LIMITED \" --log-level "<<loglevel<<"\n";
+                stream<<"iptables -A logdrop -m limit --limit "<<logwarnrate<<"/"<<rateunits[logwarnrateunit]<<" --limit-burst 1 "<<logTarget("LIMITED", false)<<"\n";
             }
             stream<<"iptables -A logdrop -j DROP\n";
         }
@@ -871,20 +1696,7 @@ private:
         stream<<"iptables -N logreject2\n";
         if(logreject)
         {
-            stream<<"iptables -A logreject2 -j LOG --log-prefix \"REJECTED \" --log-level "<<loglevel<<" ";
-            if(logipoptions)
-            {
-                stream<<"--log-ip-options ";
-            }
-            if(logtcpoptions)
-            {
-                stream<<"--log-tcp-options ";
-            }
-            if(logtcpsequence)
-            {
-                stream<<"--log-tcp-sequence ";
-            }
-            stream<<"\n";
+            stream<<"iptables -A logreject2 "<<logTarget("REJECTED")<<"\n";
         }
         stream<<"iptables -A logreject2 -p tcp -j REJECT --reject-with tcp-reset\n"
             "iptables -A logreject2 -p udp -j REJECT --reject-with icmp-port-unreachable\n"
@@ -892,10 +1704,10 @@ private:
         stream<<"iptables -N logreject\n";
         if(logreject && logratelimit)
         {
-            stream<<"iptables -A logreject -m limit --limit "<<lograte<<"/"<<rateunits[lograteunit]<<" --limit-burst "<<lograteburst<<" -j logreject2\n";
+            writeLogLimitRules( stream, "logreject", rateunits );
             if(logwarnlimit)
             {
-                stream<<"iptables -A logreject -m limit --limit "<<logwarnrate<<"/"<<rateunits[logwarnrateunit]<<" --limit-burst 1 -j LOG --log-prefix \"LIMITED \" --log-level "<<loglevel<<"\n";
+                stream<<"iptables -A logreject -m limit --limit "<<logwarnrate<<"/"<<rateunits[logwarnrateunit]<<" --limit-burst 1 "<<logTarget("LIMITED", false)<<"\n";
             }
             stream<<"iptables -A logreject -p tcp -j REJECT --reject-with tcp-reset\n"
                 "iptables -A logreject -p udp -j REJECT --reject-with icmp-port-unreachable\n"
@@ -910,20 +1722,7 @@ private:
         if(logabortedtcp)
         {
             stream<<"iptables -N logaborted2\n"
-                "iptables -A logaborted2 -j LOG --log-prefix \"ABORTED \" --log-level "<<loglevel<<" ";
-            if(logipoptions)
-            {
-                stream<<"--log-ip-options ";
-            }
-            if(logtcpoptions)
-            {
-                stream<<"--log-tcp-options ";
-            }
-            if(logtcpsequence)
-            {
-                stream<<"--log-tcp-sequence ";
-            }
-            stream<<"\n";
+                "iptables -A logaborted2 "<<logTarget("ABORTED")<<"\n";
             // Put this rule here so that we don't return from this chain
             // and interfer with any Rate Limit warnings.
             stream<<"iptables -A logaborted2 -m state --state ESTABLISHED,RELATED -j ACCEPT\n";
@@ -931,10 +1730,10 @@ private:
             stream<<"iptables -N logaborted\n";
             if(logratelimit)
             {
-                stream<<"iptables -A logaborted -m limit --limit "<<lograte<<"/"<<rateunits[lograteunit]<<" --limit-burst "<<lograteburst<<" -j logaborted2\n";
+                writeLogLimitRules( stream, "logaborted", rateunits );
                 if(logwarnlimit)
                 {
-                    stream<<"iptables -A logaborted -m limit --limit "<<logwarnrate<<"/"<<rateunits[logwarnrateunit]<<" --limit-burst 1 -j LOG --log-prefix \"LIMITED \" --log-level "<<loglevel<<"\n";
+                    stream<<"iptables -A logaborted -m limit --limit "<<logwarnrate<<"/"<<rateunits[logwarnrateunit]<<" --limit-burst 1 "<<logTarget("LIMITED", false)<<"\n";
                 }
             }
             else
@@ -1120,7 +1919,9 @@ private:
         localPRI.dynamicStart = localPortRangeStart;
         localPRI.dynamicEnd = localPortRangeEnd;
 
-        // Now we add the rules to the filter chains.
+        // Now we add the rules to the filter chains, the same way as
+        // walkFilterRules() but with the rules of the zone pairs that didn't
+        // change since the last save taken as they were.
         stream<<"# Add rules to the filter chains\n";
         // 'From' zone loop
         BOOST_FOREACH( Zone const & fromZone, zones )
@@ -1130,76 +1931,13 @@ private:
             {
                 if ( fromZone != toZone )
                 {
-                    // Detect and accept permitted protocols.
-                    std::vector< std::string > permitZoneProtocols = getConnectedZoneProtocols( fromZone.getName(), toZone.getName(), Zone::PERMIT );
-                    stream<<"\n# Traffic from '"<< fromZone.getName() << "' to '"<< toZone.getName() << "'\n";
-                    BOOST_FOREACH( std::string const & zoneProtocol, permitZoneProtocols )
-                    {
-                        stream << "# Allow '" << zoneProtocol <<"'\n";
-                        std::vector< ProtocolNetUse > networkuses = getNetworkUse( zoneProtocol );
-
-                        BOOST_FOREACH( ProtocolNetUse & networkuse, networkuses )
-                        {
-                            // If this netuse has been marked with the RELATED pragma
-                            // then we don't need to output it becuase netfilter will
-                            // be connection tracking it. The general state handling
-                            // rule will handle this connection automatically.
-
-                            if ( !networkuse.description.empty() )
-                            {
-                                stream << "# "<< networkuse.description << "\n";
-                            }
-                            if ( networkuse.pragma[ "guarddog" ] != "RELATED" )
-                            {
-                                if ( networkuse.source == ENTITY_CLIENT)
-                                {
-                                    expandIPTablesFilterRule( stream, fromZone.getName(), fromZone.isLocal() ? &localPRI : 0,
-                                            toZone.getName(), toZone.isLocal() ? &localPRI : 0, networkuse);
-                                }
-                                if ( networkuse.dest == ENTITY_CLIENT)
-                                {
-                                    expandIPTablesFilterRule( stream, toZone.getName(), toZone.isLocal() ? &localPRI : 0,
-                                            fromZone.getName(), fromZone.isLocal() ? &localPRI : 0, networkuse);
-                                }
-                            }
-                            else
-                            {
-                                stream<<"#  - Handled by netfilter state tracking\n";
-                            }
-                        }
-                    }
-
-                    // Detect and reject protocols that have been marked for such treatment. :-)
-
-                    std::vector< std::string > rejectZoneProtocols = getConnectedZoneProtocols( fromZone.getName(), toZone.getName(), Zone::REJECT );
-                    stream<<"\n# Rejected traffic from '"<<fromZone.getName()<<"' to '"<<toZone.getName()<<"'\n";
-                    BOOST_FOREACH( std::string const & zoneProtocol, rejectZoneProtocols )
-                    {
-                        stream << "# Reject '" << zoneProtocol << "'\n";
-
-                        std::vector< ProtocolNetUse > networkuses = getNetworkUse( zoneProtocol );
-
-                        BOOST_FOREACH( ProtocolNetUse & networkuse, networkuses )
-                        {
-                            if ( networkuse.description.length() != 0 )
-                            {
-                                stream<<"# "<<networkuse.description <<"\n";
-                            }
-                            if(networkuse.source==ENTITY_CLIENT)
-                            {
-                                expandIPTablesFilterRule(stream,fromZone.getName(),fromZone.isLocal() ? &localPRI : 0, toZone.getName(), toZone.isLocal() ? &localPRI : 0,networkuse,false,logreject);
-                            }
-                            if(networkuse.dest==ENTITY_CLIENT)
-                            {
-                                expandIPTablesFilterRule(stream,toZone.getName(),toZone.isLocal() ? &localPRI : 0, fromZone.getName(), fromZone.isLocal() ? &localPRI : 0,networkuse,false,logreject);
-                            }
-                        }
-                    }
+                    stream << getZonePairScript( fromZone, toZone ).rules;
                 }
             }
         }
 
         // Place DENY and log rules at the end of our filter chains
+        FilterRuleScriptWriter writer( *this, stream );
         stream<<"\n" "# Place DROP and log rules at the end of our filter chains.\n";
         // 'From' zone loop
         BOOST_FOREACH( Zone const & fromZone, zones )
@@ -1209,9 +1947,8 @@ private:
             {
                 if ( fromZone != toZone )
                 {
-                    // Finally, the DENY and LOG packet rule to finish things off.
-                    stream<<"# Failing all the rules above, we log and DROP the packet.\n"
-                        "iptables -A " << fromZone.getName() << "_to_" << toZone.getName() << " -j logdrop\n";
+                    stream << getZonePairScript( fromZone, toZone ).drops;
+                    writer.chainEnd( fromZone.getName(), toZone.getName(), fromZone.isLogging( toZone.getName() ) );
                 }
             }
         }
@@ -1228,7 +1965,21 @@ private:
             "  iptables -A INPUT -p udp --sport 53:53 --dport 0:65535 -j ACCEPT\n"
             "fi\n";
 
-        // Create the split chains.
+        // Create the split chains.  The zones are told apart by the longest
+        // prefix that matches, so an address range goes in as the prefixes
+        // covering it.  Prefixes that can't decide anything are left out.
+        std::vector< std::vector< IPRange > > prefixes( zones.size() );
+        for ( size_t z = 0; z < zones.size(); z++ )
+        {
+            if ( zones[z].isLocal() || zones[z].isInternet() )
+                continue;
+            BOOST_FOREACH( IPRange const & addy, zones[z].getMemberMachineList() )
+            {
+                std::vector< IPRange > p = addy.getPrefixes();
+                prefixes[z].insert( prefixes[z].end(), p.begin(), p.end() );
+            }
+        }
+        MemberOverlaps overlaps( prefixes );
 
         BOOST_FOREACH( Zone const & zit, zones )
         {
@@ -1249,13 +2000,15 @@ private:
             // Branch for traffic going to every other chain
             for(int mask=32; mask>=0; mask--)
             {
-                BOOST_FOREACH( Zone const & zit2, zones )
+                for ( size_t z = 0; z < zones.size(); z++ )
                 {
+                    Zone const & zit2 = zones[z];
                     if ( zit != zit2 && !zit2.isLocal() && !zit2.isInternet())
                     {
-                        BOOST_FOREACH( IPRange const & addy, zit2.getMemberMachineList() )
+                        for ( size_t i = 0; i < prefixes[z].size(); i++ )
                         {
-                            if ( addy.getMask()==(uint)mask)
+                            IPRange const & addy = prefixes[z][i];
+                            if ( addy.getMask()==(uint)mask && overlaps.getState( z, i ) != MemberOverlaps::REDUNDANT )
                             {
                                 stream<<"iptables -A " << zit.getName() <<" -d "<<addy.getAddress()<<" -j " << zit.getName() << "_to_" << zit2.getName() <<"\n";
                             }
@@ -1285,13 +2038,15 @@ private:
         stream<<"if [ $MIN_MODE -eq 0 ] ; then\n";
         for(int mask=32; mask>=0; mask--)
         {
-            BOOST_FOREACH( Zone const & zit2, zones )
+            for ( size_t z = 0; z < zones.size(); z++ )
             {
+                Zone const & zit2 = zones[z];
                 if ( !zit2.isLocal() && !zit2.isInternet())
                 {
-                    BOOST_FOREACH( IPRange const & addy, zit2.getMemberMachineList() )
+                    for ( size_t i = 0; i < prefixes[z].size(); i++ )
                     {
-                        if(addy.getMask() == (uint)mask)
+                        IPRange const & addy = prefixes[z][i];
+                        if(addy.getMask() == (uint)mask && overlaps.getState( z, i ) == MemberOverlaps::LIVE)
                         {
                             stream<<"iptables -A srcfilt -s " << addy.getAddress()<<" -j "<<zit2.getName()<<"\n";
                         }
@@ -1307,6 +2062,8 @@ private:
             "iptables -A srcfilt -j Internet\n"
             "\n";
 
+        writeIPTablesHelperRules( stream, localPRI, prefixes, overlaps );
+
         // Remove the temp DNS accept rules.
         stream<<"if [ $MIN_MODE -eq 0 ] ; then\n"
             "  # Remove the temp DNS accept rules\n"
@@ -1325,18 +2082,552 @@ private:
             "\n"
             "# All traffic on the forward chains goes to the srcfilt chain.\n"
             "iptables -A FORWARD -j srcfilt &> /dev/null\n"
-            "\n"
-            "logger -p auth.info -t guarddog Finished configuring firewall\n"
-            "[ $GUARDDOG_VERBOSE -eq 1 ] && echo \""<<("Finished.")<<"\"\n";
+            "\n";
 
-    }
+        if ( flowtableenabled )
+        {
+            writeNFTablesFlowtable( stream );
+        }
+
+        stream<<"logger -p auth.info -t guarddog Finished configuring firewall\n"
+            "[ $GUARDDOG_VERBOSE -eq 1 ] && echo \""<<("Finished.")<<"\"\n";
+
+    }
+
+    /*!
+    **  \brief Conntrack helpers needed by the protocols permitted between any
+    **         two connected zones
+    */
+    std::set< std::string > getPermittedHelpers() const
+    {
+        std::set< std::string > helpers;
+        BOOST_FOREACH( Zone const & fromZone, zones )
+        {
+            BOOST_FOREACH( Zone const & toZone, zones )
+            {
+                if ( fromZone != toZone )
+                {
+                    BOOST_FOREACH( std::string const & protocol, fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::PERMIT ) )
+                    {
+                        std::string helper = getProtocolHelper( protocol );
+                        if ( !helper.empty() )
+                            helpers.insert( helper );
+                    }
+                }
+            }
+        }
+        return helpers;
+    }
+
+    std::string getProtocolHelper( std::string const & protocolName ) const
+    {
+        try
+        {
+            return db().lookup( protocolName ).getHelper();
+        }
+        catch ( std::string const & )
+        {
+            return "";
+        }
+    }
+
+    /*!
+    **  \brief Add the raw table rule attaching a conntrack helper to the
+    **         connections of one netuse to rules, the rules of the pair of
+    **         the client zone and the server zone
+    */
+    void expandIPTablesHelperRule( std::vector< std::string > & rules, std::string const & helper,
+            Zone const & clientZone, Zone const & serverZone, ProtocolNetUse const & netuse, PortRangeInfo & localPRI ) const
+    {
+        char const * proto;
+        switch ( netuse.type )
+        {
+            case IPPROTO_TCP: proto = "tcp"; break;
+            case IPPROTO_UDP: proto = "udp"; break;
+            default: return;
+        }
+
+        ProtocolNetUseDetail const & source = netuse.sourcedetail;
+        ProtocolNetUseDetail const & dest = netuse.destdetail;
+        PortRangeInfo * clientPRI = clientZone.isLocal() ? &localPRI : 0;
+        PortRangeInfo * serverPRI = serverZone.isLocal() ? &localPRI : 0;
+
+        std::stringstream rule;
+        rule << " -p " << proto
+            << " --sport " << source.getStart( clientPRI ) << ":" << source.getEnd( clientPRI )
+            << " --dport " << dest.getStart( serverPRI ) << ":" << dest.getEnd( serverPRI )
+            << " -j CT --helper " << helper << "\n";
+        if ( std::find( rules.begin(), rules.end(), rule.str() ) == rules.end() )
+        {
+            rules.push_back( rule.str() );
+        }
+    }
+
+    /*!
+    **  \brief Write a raw table chain of the given rules, leaving out the
+    **         RETURNs at its end
+    */
+    static void writeRawChain( std::ostream & stream, std::string const & chain, std::vector< std::string > rules )
+    {
+        while ( !rules.empty() && boost::ends_with( rules.back(), " -j RETURN" ) )
+        {
+            rules.pop_back();
+        }
+        stream<<"iptables -t raw -N "<<chain<<"\n";
+        BOOST_FOREACH( std::string const & rule, rules )
+        {
+            stream<<"iptables -t raw -A "<<chain<<rule<<"\n";
+        }
+    }
+
+    /*!
+    **  \brief Write the raw table rules attaching conntrack helpers.
+    **
+    **  With automatic helper assignment turned off a helper only sees the
+    **  connections it is attached to here: the control connections of the
+    **  protocols that need it, between the zones where they are permitted.
+    **  The RELATED connections it opens are then accepted by the general
+    **  state rules.
+    **
+    **  The zones are told apart the way the filter table does it, with a
+    **  srcfilt chain and split chains of the same names and the same
+    **  prefixes, leading to a chain for each pair of zones with helpers.  An
+    **  address of a zone the packet has no helpers towards RETURNs instead,
+    **  so it doesn't fall through to a wider prefix of another zone.
+    **
+    **  \param prefixes, overlaps The prefixes of the zones and how they
+    **         overlap, as the filter chains are written from them
+    */
+    void writeIPTablesHelperRules( std::ostream & stream, PortRangeInfo & localPRI,
+            std::vector< std::vector< IPRange > > const & prefixes, MemberOverlaps const & overlaps ) const
+    {
+        size_t const n = zones.size();
+        std::vector< std::vector< std::string > > pairRules( n * n );     // by from * n + to
+        for ( size_t from = 0; from < n; from++ )
+        {
+            for ( size_t to = 0; to < n; to++ )
+            {
+                if ( from == to )
+                    continue;
+                BOOST_FOREACH( std::string const & zoneProtocol, zones[from].getConnectedZoneProtocols( zones[to].getName(), Zone::PERMIT ) )
+                {
+                    std::string helper = getProtocolHelper( zoneProtocol );
+                    if ( helper.empty() )
+                        continue;
+
+                    std::vector< ProtocolNetUse > const & networkuses = getNetworkUse( zoneProtocol );
+                    BOOST_FOREACH( ProtocolNetUse const & networkuse, networkuses )
+                    {
+                        // RELATED netuses are what the helper is there to find.
+                        if ( networkuse.isRelated() )
+                            continue;
+                        if ( networkuse.source == ENTITY_CLIENT )
+                        {
+                            expandIPTablesHelperRule( pairRules[ from * n + to ], helper, zones[from], zones[to], networkuse, localPRI );
+                        }
+                        if ( networkuse.dest == ENTITY_CLIENT )
+                        {
+                            expandIPTablesHelperRule( pairRules[ to * n + from ], helper, zones[to], zones[from], networkuse, localPRI );
+                        }
+                    }
+                }
+            }
+        }
+
+        stream<<"# Attach conntrack helpers to permitted protocols\n"
+            "if [ $MIN_MODE -eq 0 ] ; then\n";
+
+        // The chains of the pairs, and which split chains lead to any.
+        std::vector< bool > split( n, false );
+        for ( size_t from = 0; from < n; from++ )
+        {
+            for ( size_t to = 0; to < n; to++ )
+            {
+                std::vector< std::string > const & rules = pairRules[ from * n + to ];
+                if ( rules.empty() )
+                    continue;
+                split[from] = true;
+                std::string chain = zones[from].getName() + "_to_" + zones[to].getName();
+                stream<<"iptables -t raw -N "<<chain<<"\n";
+                BOOST_FOREACH( std::string const & rule, rules )
+                {
+                    stream<<"iptables -t raw -A "<<chain<<rule;
+                }
+            }
+        }
+
+        size_t internet = n;
+        for ( size_t from = 0; from < n; from++ )
+        {
+            if ( zones[from].isInternet() )
+                internet = from;
+            if ( !split[from] )
+                continue;
+
+            std::string const & chain = zones[from].getName();
+            std::vector< std::string > rules;
+            for ( size_t to = 0; to < n; to++ )
+            {
+                if ( to != from && zones[to].isLocal() )
+                {
+                    rules.push_back( " -m addrtype --dst-type LOCAL -j " +
+                        ( pairRules[ from * n + to ].empty() ? "RETURN" : chain + "_to_" + zones[to].getName() ) );
+                }
+            }
+            for ( int mask = 32; mask >= 0; mask-- )
+            {
+                for ( size_t to = 0; to < n; to++ )
+                {
+                    if ( to == from || zones[to].isLocal() || zones[to].isInternet() )
+                        continue;
+                    for ( size_t i = 0; i < prefixes[to].size(); i++ )
+                    {
+                        IPRange const & addy = prefixes[to][i];
+                        if ( addy.getMask() == (uint)mask && overlaps.getState( to, i ) != MemberOverlaps::REDUNDANT )
+                        {
+                            rules.push_back( " -d " + addy.getAddress() + " -j " +
+                                ( pairRules[ from * n + to ].empty() ? "RETURN" : chain + "_to_" + zones[to].getName() ) );
+                        }
+                    }
+                }
+            }
+            if ( internet < n && from != internet && !pairRules[ from * n + internet ].empty() )
+            {
+                rules.push_back( " -j " + chain + "_to_" + zones[internet].getName() );
+            }
+            writeRawChain( stream, chain, rules );
+        }
+
+        bool srcfilt = false;
+        for ( size_t from = 0; from < n; from++ )
+        {
+            if ( split[from] && !zones[from].isLocal() )
+                srcfilt = true;
+        }
+        if ( srcfilt )
+        {
+            std::vector< std::string > rules;
+            for ( int mask = 32; mask >= 0; mask-- )
+            {
+                for ( size_t z = 0; z < n; z++ )
+                {
+                    if ( zones[z].isLocal() || zones[z].isInternet() )
+                        continue;
+                    for ( size_t i = 0; i < prefixes[z].size(); i++ )
+                    {
+                        IPRange const & addy = prefixes[z][i];
+                        if ( addy.getMask() == (uint)mask && overlaps.getState( z, i ) == MemberOverlaps::LIVE )
+                        {
+                            rules.push_back( " -s " + addy.getAddress() + " -j " + ( split[z] ? zones[z].getName() : "RETURN" ) );
+                        }
+                    }
+                }
+            }
+            if ( internet < n && split[internet] )
+            {
+                rules.push_back( " -j " + zones[internet].getName() );
+            }
+            writeRawChain( stream, "srcfilt", rules );
+            stream<<"iptables -t raw -A PREROUTING -j srcfilt\n";
+        }
+        for ( size_t z = 0; z < n; z++ )
+        {
+            if ( split[z] && zones[z].isLocal() )
+            {
+                stream<<"iptables -t raw -A OUTPUT -j "<<zones[z].getName()<<"\n";
+            }
+        }
+
+        stream<<"    true # make sure this if [] has at least something in it.\n"
+            "fi\n"
+            "\n";
+    }
+
+    /*!
+    **  \brief Name of the nftables set holding the addresses of a zone
+    */
+    static std::string nftZoneSetName( Zone const & zone )
+    {
+        return "zone_" + zone.getName();
+    }
+
+    /*!
+    **  \brief  Write the nftables flowtable used to offload established
+    **          forwarded flows between fast path zone pairs.
+    **
+    **  Only the offload lives in nftables, the policy itself stays in the
+    **  iptables chains above.  The forward hook runs just ahead of the iptables
+    **  filter table and accepts everything, so the first packets of a flow still
+    **  go through FORWARD -> srcfilt -> split chain -> A_to_B.  Once conntrack
+    **  sees the flow as ESTABLISHED it is added to the flowtable and later
+    **  packets bypass the rule path entirely.
+    **
+    **  The Local zone never forwards, so pairs with it are skipped.  The Internet
+    **  zone has no addresses of its own, it is matched as "not in any zone".
+    **  Domain names can't be put into an nftables interval set and are skipped.
+    */
+    void writeNFTablesFlowtable( std::ostream & stream )
+    {
+        std::vector< std::string > interfaces;
+        boost::split(interfaces, flowtableinterfacename, boost::is_any_of(", "), boost::token_compress_on);
+        interfaces.erase( std::remove( interfaces.begin(), interfaces.end(), std::string() ), interfaces.end() );
+
+        std::vector< std::pair< Zone const *, Zone const * > > fastPathPairs;
+        BOOST_FOREACH( Zone const & fromZone, zones )
+        {
+            BOOST_FOREACH( Zone const & toZone, zones )
+            {
+                if ( fromZone != toZone && !fromZone.isLocal() && !toZone.isLocal() &&
+                     fromZone.isFastPath( toZone.getName() ) && areZonesConnected( fromZone.getName(), toZone.getName() ) )
+                {
+                    fastPathPairs.push_back( std::make_pair( &fromZone, &toZone ) );
+                }
+            }
+        }
+
+        stream<<"# Offload established forwarded traffic between fast path zones.\n";
+        if ( interfaces.empty() || fastPathPairs.empty() )
+        {
+            stream<<"# No fast path zone pairs or flowtable interfaces configured.\n\n";
+            return;
+        }
+
+        stream<<"if command -v nft &> /dev/null ; then\n"
+            "[ $GUARDDOG_VERBOSE -eq 1 ] && echo \""<<("Setting up flowtable.")<<"\"\n"
+            "nft -f - <<'GUARDPUPPY_NFT'\n"
+            "table inet guardpuppy {\n";
+
+        // One interval set per user zone, plus the union of all of them so
+        // that the Internet zone can be matched by exclusion.
+        std::vector< std::string > allElements;
+        BOOST_FOREACH( Zone const & zone, zones )
+        {
+            if ( zone.isLocal() || zone.isInternet() )
+                continue;
+
+            std::vector< std::string > elements;
+            BOOST_FOREACH( IPRange addy, zone.getMemberMachineList() )
+            {
+                if ( addy.getType() == ip || addy.getType() == iprange )
+                {
+                    std::string address = addy.getAddress();
+                    elements.push_back( address.substr( 0, address.find( '/' ) ) + "/" + boost::lexical_cast<std::string>( addy.getMask() ) );
+                }
+                else if ( addy.getType() == ipinterval )
+                {
+                    elements.push_back( addy.getAddress() );
+                }
+            }
+            allElements.insert( allElements.end(), elements.begin(), elements.end() );
+
+            stream<<"  set "<<nftZoneSetName( zone )<<" {\n"
+                "    type ipv4_addr; flags interval; auto-merge;\n";
+            if ( !elements.empty() )
+            {
+                stream<<"    elements = { "<<boost::algorithm::join( elements, ", " )<<" }\n";
+            }
+            stream<<"  }\n";
+        }
+        stream<<"  set zones {\n"
+            "    type ipv4_addr; flags interval; auto-merge;\n";
+        if ( !allElements.empty() )
+        {
+            stream<<"    elements = { "<<boost::algorithm::join( allElements, ", " )<<" }\n";
+        }
+        stream<<"  }\n";
+
+        stream<<"  flowtable fastpath {\n"
+            "    hook ingress priority 0; devices = { "<<boost::algorithm::join( interfaces, ", " )<<" };\n"
+            "  }\n"
+            "  chain forward {\n"
+            "    type filter hook forward priority -1; policy accept;\n";
+        for ( size_t i = 0; i < fastPathPairs.size(); i++ )
+        {
+            Zone const & fromZone = *fastPathPairs[i].first;
+            Zone const & toZone   = *fastPathPairs[i].second;
+            stream<<"    # Fast path from '"<<fromZone.getName()<<"' to '"<<toZone.getName()<<"'\n"
+                "    ct state established";
+            if ( fromZone.isInternet() )
+                stream<<" ct original ip saddr != @zones";
+            else
+                stream<<" ct original ip saddr @"<<nftZoneSetName( fromZone );
+            if ( toZone.isInternet() )
+                stream<<" ct original ip daddr != @zones";
+            else
+                stream<<" ct original ip daddr @"<<nftZoneSetName( toZone );
+            stream<<" meta l4proto { tcp, udp } flow add @fastpath\n";
+        }
+        stream<<"  }\n"
+            "}\n"
+            "GUARDPUPPY_NFT\n"
+            "fi\n"
+            "\n";
+    }
+
+    /*!
+    **  \brief The iptables target that logs a packet with the given prefix.
+    **
+    **  Either a kernel LOG line, or an NFLOG message that the kernel batches
+    **  up and hands to a userspace logger.
+    */
+    std::string logTarget( std::string const & prefix, bool details = true ) const
+    {
+        std::stringstream target;
+        if ( lognflog )
+        {
+            target << "-j NFLOG --nflog-group " << nfloggroup << " --nflog-prefix \"" << prefix << " \"";
+            if ( nflogthreshold > 1 )
+            {
+                target << " --nflog-threshold " << nflogthreshold;
+            }
+            if ( nflogsnaplen > 0 )
+            {
+                target << " --nflog-size " << nflogsnaplen;
+            }
+            return target.str();
+        }
+        target << "-j LOG --log-prefix \"" << prefix << " \" --log-level " << loglevel;
+        if ( details )
+        {
+            target << " ";
+            if(logipoptions)
+            {
+                target << "--log-ip-options ";
+            }
+            if(logtcpoptions)
+            {
+                target << "--log-tcp-options ";
+            }
+            if(logtcpsequence)
+            {
+                target << "--log-tcp-sequence ";
+            }
+        }
+        return target.str();
+    }
+
+    /*!
+    **  \brief Rules that pass the packets within the log budget of a log chain
+    **         on to the chain that logs them, e.g. logdrop -> logdrop2.
+    **
+    **  The budget is either one bucket for everything or, with logpersource,
+    **  one bucket per source address so a single scanner can't use it all up.
+    **  With logsample one in logsamplerate of the packets over the budget are
+    **  still logged, held to a bucket of a logsamplerate'th of the budget,
+    **  again per source address with logpersource, so that the volume stays
+    **  bounded during a flood and a flooding source can't take all of it.
+    **
+    **  \param rateunits The names of the LogRateUnits
+    */
+    void writeLogLimitRules( std::ostream & stream, std::string const & chain, char const * const * rateunits ) const
+    {
+        if ( logpersource )
+        {
+            stream<<"iptables -A "<<chain<<" -m hashlimit --hashlimit-upto "<<lograte<<"/"<<rateunits[lograteunit]<<" --hashlimit-burst "<<lograteburst<<
+                " --hashlimit-mode srcip --hashlimit-name "<<chain<<" -j "<<chain<<"2\n";
+        }
+        else
+        {
+            stream<<"iptables -A "<<chain<<" -m limit --limit "<<lograte<<"/"<<rateunits[lograteunit]<<" --limit-burst "<<lograteburst<<" -j "<<chain<<"2\n";
+        }
+        if ( logsample && logsamplerate > 1 )
+        {
+            // lograte / logsamplerate, in the first unit from lograteunit
+            // on where it is at least one
+            static uint const perNext[] = { 60, 60, 24 };
+            uint unit = lograteunit;
+            uint64_t rate = lograte;
+            while ( rate < logsamplerate && unit < DAY )
+            {
+                rate *= perNext[unit++];
+            }
+            rate = std::max< uint64_t >( rate / logsamplerate, 1 );
+            uint burst = std::max< uint >( lograteburst / logsamplerate, 1 );
+
+            stream<<"iptables -A "<<chain<<" -m statistic --mode random --probability "<<( 1.0 / logsamplerate );
+            if ( logpersource )
+            {
+                stream<<" -m hashlimit --hashlimit-upto "<<rate<<"/"<<rateunits[unit]<<" --hashlimit-burst "<<burst<<
+                    " --hashlimit-mode srcip --hashlimit-name "<<chain<<"_s";
+            }
+            else
+            {
+                stream<<" -m limit --limit "<<rate<<"/"<<rateunits[unit]<<" --limit-burst "<<burst;
+            }
+            stream<<" -j "<<chain<<"2\n";
+        }
+    }
+
+    /*!
+    **  \brief The iptables target for a packet of the given type in the given state.
+    **
+    **  log is only honoured for DENY and REJECT.
+    */
+    static std::string filterTarget( uchar type, Zone::ProtocolState state, bool log )
+    {
+        switch ( state )
+        {
+            case Zone::PERMIT:
+                return "ACCEPT";
+            case Zone::DENY:
+                return log ? "logdrop" : "DROP";
+            case Zone::REJECT:
+            default:
+                if ( log )
+                    return "logreject";
+                switch ( type )
+                {
+                    case IPPROTO_TCP: return "REJECT --reject-with tcp-reset";
+                    case IPPROTO_UDP: return "REJECT --reject-with icmp-port-unreachable";
+                    default:          return "DROP";   // We can't REJECT icmp really. But
+                                                       // we can't just ACCEPT it either.
+                }
+        }
+    }
+
+    /*!
+    **  \brief walkFilterRules() sink writing the rules into the script
+    */
+    class FilterRuleScriptWriter
+    {
+        GuardPuppyFireWall const & firewall;
+        std::ostream & stream;
+    public:
+        FilterRuleScriptWriter( GuardPuppyFireWall const & _firewall, std::ostream & _stream )
+         : firewall( _firewall ), stream( _stream )
+        {
+        }
+
+        std::ostream & comment()
+        {
+            return stream;
+        }
+
+        void rule( std::string const & fromzone, PortRangeInfo * fromzonePRI, std::string const & tozone, PortRangeInfo * tozonePRI,
+                ProtocolNetUse const & netuse, Zone::ProtocolState state = Zone::PERMIT, bool log = false )
+        {
+            firewall.expandIPTablesFilterRule( stream, fromzone, fromzonePRI, tozone, tozonePRI, netuse, state, log );
+        }
+
+        void chainEnd( std::string const & fromzone, std::string const & tozone, bool logged )
+        {
+            if ( logged )
+            {
+                stream<<"# Failing all the rules above, we log and DROP the packet.\n"
+                    "iptables -A " << fromzone << "_to_" << tozone << " -j logdrop\n";
+            }
+            else
+            {
+                stream<<"# Failing all the rules above, we DROP the packet without logging it.\n"
+                    "iptables -A " << fromzone << "_to_" << tozone << " -j DROP\n";
+            }
+        }
+    };
 
     ///////////////////////////////////////////////////////////////////////////
     //
-    // permit==true && log==true is not supported.
-    //
     void expandIPTablesFilterRule( std::ostream & stream, std::string const & fromzone, PortRangeInfo * fromzonePRI, std::string const & tozone, PortRangeInfo *tozonePRI,
-            ProtocolNetUse const & netuse, bool permit = true, bool log = false)
+            ProtocolNetUse const & netuse, Zone::ProtocolState state = Zone::PERMIT, bool log = false) const
     {
         const char *icmpname;
         ProtocolNetUseDetail const & source = netuse.sourcedetail;
@@ -1347,47 +2638,15 @@ private:
                 stream<<"iptables -A "<<fromzone<<"_to_"<<tozone<<" -p tcp"
                     " --sport "<<(source.getStart(fromzonePRI))<<":"<<(source.getEnd(fromzonePRI))<<
                     " --dport "<<(dest.getStart(tozonePRI))<<":"<<(dest.getEnd(tozonePRI))<<
-                    " -m state --state NEW";
-                if(permit)
-                {
-                    // Permitted
-                    stream<<" -j ACCEPT\n";
-                }
-                else
-                {
-                    // Not permitted.
-                    if(log)
-                    {
-                        stream<<" -j logreject\n";
-                    }
-                    else
-                    {
-                        stream<<" -j REJECT --reject-with tcp-reset\n";
-                    }
-                }
+                    " -m state --state NEW"
+                    " -j "<<filterTarget(netuse.type, state, log)<<"\n";
                 break;
 
             case IPPROTO_UDP:
                 stream<<"iptables -A "<<fromzone<<"_to_"<<tozone<<" -p udp"
                     " --sport "<<(source.getStart(fromzonePRI))<<":"<<(source.getEnd(fromzonePRI))<<
-                    " --dport "<<(dest.getStart(tozonePRI))<<":"<<(dest.getEnd(tozonePRI));
-                if(permit)
-                {
-                    // Permitted.
-                    stream<<" -j ACCEPT\n";
-                }
-                else
-                {
-                    // Not permitted.
-                    if(log)
-                    {
-                        stream<<" -j logreject\n";
-                    }
-                    else
-                    {
-                        stream<<" -j REJECT --reject-with icmp-port-unreachable\n";
-                    }
-                }
+                    " --dport "<<(dest.getStart(tozonePRI))<<":"<<(dest.getEnd(tozonePRI))<<
+                    " -j "<<filterTarget(netuse.type, state, log)<<"\n";
                 break;
 
             case IPPROTO_ICMP:
@@ -1478,36 +2737,281 @@ private:
                         icmpname = 0;
                         break;
                 }
-
-                stream<<"iptables -A "<<fromzone<<"_to_"<<tozone<<" -p icmp --icmp-type ";
-                if(icmpname!=0)
-                    stream<<(icmpname);
-                else
+
+                stream<<"iptables -A "<<fromzone<<"_to_"<<tozone<<" -p icmp --icmp-type ";
+                if(icmpname!=0)
+                    stream<<(icmpname);
+                else
+                {
+                    stream<<(source.getType());
+                    if(source.getCode()!=-1)
+                        stream<<"/"<<(source.getCode());
+                }
+
+                stream<<" -j "<<filterTarget(netuse.type, state, log)<<"\n";
+                break;
+
+            default:                            // Every other protocol.
+                stream<<"iptables -A "<<fromzone<<"_to_"<<tozone<<
+                    " -p "<<(uint)netuse.getType()<<
+                    " -j "<<filterTarget(netuse.type, state, log)<<"\n";
+                    // Unlike the ipchains code, we don't need to check for
+                    // bidirectionness. We can just rely on connection tracking
+                    // to handle that.
+                break;
+        }
+    }
+
+    /*!
+    **  \brief The protocol called name, 0 if there isn't one, remembering
+    **         the answer in known
+    */
+    ProtocolEntry const * lookupProtocol( std::map<std::string, ProtocolEntry const *> & known, std::string const & name )
+    {
+        std::map<std::string, ProtocolEntry const *>::iterator i = known.find( name );
+        if ( i != known.end() )
+        {
+            return i->second;
+        }
+        ProtocolEntry const * entry = 0;
+        try
+        {
+            entry = &db().lookup( name );
+        }
+        catch ( ... )
+        {
+            //std::cout << "Shouldn't see this anymore..." << std::endl;
+        }
+        known[ name ] = entry;
+        return entry;
+    }
+
+    /*!
+    **  \brief The user defined protocol called name, added if there isn't
+    **         one yet
+    */
+    ProtocolEntry & userDefinedProtocol( std::string const & name )
+    {
+        try { return pdb->lookup(name); }
+        catch(...)
+        {
+            ProtocolEntry t(name);
+            pdb->addProtocolEntry(t);
+            ProtocolEntry & ent = pdb->lookup(name);
+            ent.Classification = "User Defined";
+            ent.longname = name; //for udp the name and long name are the same
+            pdb->protocolChanged();
+            return ent;
+        }
+    }
+
+    void addUserDefinedNetwork( ProtocolEntry & ent, uchar type, uint startPort, uint endPort, bool bidirectional )
+    {
+        ProtocolNetUse t;
+        t.addDest(ProtocolNetUseDetail(PORTRANGE_RANGE, startPort, endPort));
+        t.setType(type);
+        t.setBidirectional(bidirectional);
+        ent.addNetwork(t);
+        pdb->protocolChanged();
+    }
+
+    /*!
+    **  \brief The keys of the [Config] section, in the order of the switch
+    **         in readConfigValue()
+    */
+    static PerfectHash const & configKeys()
+    {
+        static char const * const names[] = {
+            "LOCALPORTRANGESTART",
+            "LOCALPORTRANGEEND",
+            "DISABLED",
+            "LOGREJECT",
+            "LOGDROP",
+            "LOGABORTEDTCP",
+            "LOGIPOPTIONS",
+            "LOGTCPOPTIONS",
+            "LOGTCPSEQUENCE",
+            "LOGLEVEL",
+            "LOGRATELIMIT",
+            "LOGRATE",
+            "LOGRATEUNIT",
+            "LOGRATEBURST",
+            "LOGWARNLIMIT",
+            "LOGWARNRATE",
+            "LOGWARNRATEUNIT",
+            "DHCPC",
+            "DHCPCINTERFACENAME",
+            "DHCPD",
+            "DHCPDINTERFACENAME",
+            "ALLOWTCPTIMESTAMPS",
+            "FLOWTABLE",
+            "FLOWTABLEINTERFACENAME",
+            "LOGNFLOG",
+            "NFLOGGROUP",
+            "NFLOGTHRESHOLD",
+            "NFLOGSNAPLEN",
+            "NOLOGPROTOCOL",
+            "LOGPERSOURCE",
+            "LOGSAMPLE",
+            "LOGSAMPLERATE",
+        };
+        static PerfectHash const keys( names, sizeof(names) / sizeof(names[0]) );
+        return keys;
+    }
+
+    /*!
+    **  \brief Set what the [Config] line with key number i of configKeys()
+    **         sets to rightpart
+    */
+    void readConfigValue( int i, std::string const & rightpart )
+    {
+        switch(i)
+        {
+            case 0:     // # LOCALPORTRANGESTART=
+                localPortRangeStart = boost::lexical_cast<uint>( rightpart ); //.toUInt(&ok);
+                if(localPortRangeStart<1024)
+                {
+                    throw std::string ("Value in LOCALPORTRANGESTART section was less then 1024.");
+                }
+                break;
+            case 1:     // # LOCALPORTRANGEEND=
+                localPortRangeEnd = boost::lexical_cast<uint>( rightpart ); //rightpart.toUInt(&ok);
+                if(localPortRangeEnd>65535) {
+                    throw std::string("Value in LOCALPORTRANGEEND is greater than 65535.");
+                }
+                break;
+            case 2:     // # DISABLED=
+                disabled = rightpart=="1";
+                break;
+            case 3:     // # LOGREJECT=
+                logreject = rightpart=="1";
+                break;
+            case 4:     // # LOGDROP=
+                logdrop = rightpart=="1";
+                break;
+            case 5:     // # LOGABORTEDTCP=
+                logabortedtcp = rightpart=="1";
+                break;
+            case 6:     // # LOGIPOPTIONS=
+                logipoptions = rightpart=="1";
+                break;
+            case 7:     // # LOGTCPOPTIONS=
+                logtcpoptions = rightpart=="1";
+                break;
+            case 8:     // # LOGTCPSEQUENCE=
+                logtcpsequence = rightpart=="1";
+                break;
+            case 9:     // # LOGLEVEL=",
+                loglevel = boost::lexical_cast<uint>( rightpart );
+                if(loglevel>7)
+                {
+                    throw std::string("Error, the value in the LOGLEVEL section is too big.");
+                }
+                break;
+            case 10:     // # LOGRATELIMIT=
+                logratelimit = rightpart=="1";
+                break;
+            case 11:    // # LOGRATE=
+                lograte = boost::lexical_cast<uint>( rightpart );
+                if(lograte>65535)
                 {
-                    stream<<(source.getType());
-                    if(source.getCode()!=-1)
-                        stream<<"/"<<(source.getCode());
+                    throw std::string("Error, the value in the LOGRATE section is too big (>65535).");
+                }
+                break;
+            case 12:    // # LOGRATEUNIT=
+                lograteunit = (LogRateUnit)boost::lexical_cast<uint>( rightpart );
+                if(lograteunit>3)
+                {
+                    throw std::string("Error the value in the LOGRATEUNIT section is out of range.");
+                }
+                break;
+            case 13:    // # LOGRATEBURST=
+                lograteburst = boost::lexical_cast<uint>( rightpart );
+                if(lograteburst > 65535) {
+                    throw std::string("Error, the value in the LOGRATEBURST section is too big.");
+                }
+                break;
+            case 14:    // # LOGWARNLIMIT=
+                logwarnlimit = rightpart=="1";
+                break;
+            case 15:    // # LOGWARNRATE=
+                logwarnrate = boost::lexical_cast<uint>( rightpart );
+                if(logwarnrate > 65535)
+                {
+                    throw std::string("Error, the value in the LOGWARNRATE section is too big (>65535).");
+                }
+                break;
+            case 16:    // # LOGWARNRATEUNIT=
+                logwarnrateunit = (LogRateUnit)boost::lexical_cast<uint>( rightpart );
+                if(logwarnrateunit>3)
+                {
+                    throw std::string("Error the value in the LOGWARNRATEUNIT section is out of range.");
+                }
+                break;
+            case 17:    // # DHCPC=
+                dhcpcenabled = rightpart=="1";
+                break;
+            case 18:    // # DHCPCINTERFACENAME=
+                dhcpcinterfacename = rightpart;
+                break;
+            case 19:    // # DHCPD=
+                dhcpdenabled = rightpart=="1";
+                break;
+            case 20:    // # DHCPDINTERFACENAME=
+                dhcpdinterfacename = rightpart;
+                break;
+            case 21:    // # ALLOWTCPTIMESTAMPS=
+                allowtcptimestamps = rightpart=="1";
+                break;
+            case 22:    // # FLOWTABLE=
+                flowtableenabled = rightpart=="1";
+                break;
+            case 23:    // # FLOWTABLEINTERFACENAME=
+                flowtableinterfacename = rightpart;
+                break;
+            case 24:    // # LOGNFLOG=
+                lognflog = rightpart=="1";
+                break;
+            case 25:    // # NFLOGGROUP=
+                nfloggroup = boost::lexical_cast<uint>( rightpart );
+                if(nfloggroup > 65535)
+                {
+                    throw std::string("Error, the value in the NFLOGGROUP section is too big (>65535).");
+                }
+                break;
+            case 26:    // # NFLOGTHRESHOLD=
+                nflogthreshold = boost::lexical_cast<uint>( rightpart );
+                if(nflogthreshold < 1 || nflogthreshold > 65535)
+                {
+                    throw std::string("Error the value in the NFLOGTHRESHOLD section is out of range.");
+                }
+                break;
+            case 27:    // # NFLOGSNAPLEN=
+                nflogsnaplen = boost::lexical_cast<uint>( rightpart );
+                if(nflogsnaplen > 65535)
+                {
+                    throw std::string("Error, the value in the NFLOGSNAPLEN section is too big (>65535).");
+                }
+                break;
+            case 28:    // # NOLOGPROTOCOL=
+                nologprotocols.insert( rightpart );
+                break;
+            case 29:    // # LOGPERSOURCE=
+                logpersource = rightpart=="1";
+                break;
+            case 30:    // # LOGSAMPLE=
+                logsample = rightpart=="1";
+                break;
+            case 31:    // # LOGSAMPLERATE=
+                logsamplerate = boost::lexical_cast<uint>( rightpart );
+                if(logsamplerate < 1 || logsamplerate > 1000000)
+                {
+                    throw std::string("Error the value in the LOGSAMPLERATE section is out of range.");
                 }
-
-                if(permit)                      // Permitted.
-                    stream<<" -j ACCEPT\n";
-                else                            // Not permitted.
-                    if(log)
-                        stream<<" -j logreject\n";
-                    else
-                        stream<<" -j DROP\n";   // We can't REJECT icmp really. But
-                                                // we can't just ACCEPT it either.
                 break;
 
-            default:                            // Every other protocol.
-                if(permit)
-                    stream<<"iptables -A "<<fromzone<<"_to_"<<tozone<<
-                        " -p "<<netuse.getType()<<
-                        " -j ACCEPT\n";
-                    // Unlike the ipchains code, we don't need to check for
-                    // bidirectionness. We can just rely on connection tracking
-                    // to handle that.
-                    //TODO shouldn't we handle dropped, or logged?
+            default:
+                // Should we complain?
                 break;
         }
     }
@@ -1522,9 +3026,12 @@ public:
 
     void readFirewall( std::string const & filename )
     {
-        std::ifstream stream( filename.c_str() );
-        std::string s;
+        MappedFile file( filename );
+        ScriptLines lines( file.begin(), file.end() );
+        ScriptLine s;
         int state;
+
+        zonePairScripts.clear();
 #define READSTATE_FIRSTLINE 0
 #define READSTATE_SECONDLINE 1
 #define READSTATE_COPPERPLATE   2
@@ -1539,42 +3046,18 @@ public:
         uint udpstartport;
         uint udpendport;
         bool udpbidirectional;
-        std::string parameterlist[] = {
-            "# LOCALPORTRANGESTART=",
-            "# LOCALPORTRANGEEND=",
-            "# DISABLED=",
-            "# LOGREJECT=",
-            "# LOGDROP=",
-            "# LOGABORTEDTCP=",
-            "# LOGIPOPTIONS=",
-            "# LOGTCPOPTIONS=",
-            "# LOGTCPSEQUENCE=",
-            "# LOGLEVEL=",
-            "# LOGRATELIMIT=",
-            "# LOGRATE=",
-            "# LOGRATEUNIT=",
-            "# LOGRATEBURST=",
-            "# LOGWARNLIMIT=",
-            "# LOGWARNRATE=",
-            "# LOGWARNRATEUNIT=",
-            "# DHCPC=",
-            "# DHCPCINTERFACENAME=",
-            "# DHCPD=",
-            "# DHCPDINTERFACENAME=",
-            "# ALLOWTCPTIMESTAMPS=",
-        };
-        uint i;
-        std::string rightpart;
+        std::deque< std::vector<IPRange> > memberLists;   // of each [Zone] read
+        std::map<std::string, ProtocolEntry const *> protocolsByName;   // 0 for unknown names
         bool addcr;
 
         state = READSTATE_FIRSTLINE;
 
-        std::getline( stream, s );
+        s = lines.next();
         if ( s.empty() ) throw std::string( "Error reading first line" );
 
         state = READSTATE_SECONDLINE;
 
-        std::getline( stream, s );
+        s = lines.next();
         if(s.empty()) throw std::string( "Error reading second line" );
 
         if ( s=="## [GuardDog]" )
@@ -1590,7 +3073,7 @@ public:
         state = READSTATE_COPPERPLATE;
         while ( true )
         {
-            std::getline( stream, s );
+            s = lines.next();
             if ( s.empty()) throw std::string("Error reading file. (Before [Config] section.)");
             if ( s == "# [Config]" )
             {   // Config is starting, goodie, lets break this.
@@ -1611,8 +3094,8 @@ public:
         {
             while ( true )
             {
-                std::getline( stream, s );
-                if ( s.empty() ) std::string("Error reading file. ([Config] section.)");
+                s = lines.next();
+                if ( s.empty() ) throw std::string("Error reading file. ([Config] section.)");
                 if ( s == "# [Config]" )
                 {
                     state = READSTATE_CONFIG;
@@ -1623,133 +3106,29 @@ public:
                     description.append("\n");
                 }
                 addcr = true;
-                description += (s.substr(3));
+                description.append( s.begin + std::min( s.size(), (size_t)3 ), s.end );
             }
         }
 
         state = READSTATE_CONFIG;
+        nologprotocols.clear();
         while ( true )
         {
-            std::getline( stream, s );
-            if ( s.empty()) std::string("Error reading firewall. (In the Zone config).");
-            if ( s.substr(0,3) == ("# [") )
+            s = lines.next();
+            if ( s.empty()) throw std::string("Error reading firewall. (In the Zone config).");
+            if ( s.startsWith("# [") )
             {
                 break;  // We've got to the end of this part of the show.
             }
-            // Try to identify the line we are looking at.
-            for(i=0; i < 22 /*parameterlist.size()*/; i++)
+            // Try to identify the line we are looking at, "# KEY=value".
+            if ( !s.startsWith("# ") )
             {
-                if ( s.substr(0, parameterlist[i].size() ) == (parameterlist[i]))
-                {
-                    break;
-                }
+                continue;
             }
-            if ( i < 22 /*parameterlist.size()*/ )
+            char const * equals = static_cast<char const *>( memchr( s.begin + 2, '=', s.size() - 2 ) );
+            if ( equals )
             {
-                rightpart = s.substr(parameterlist[i].size());
-                switch(i)
-                {
-                    case 0:     // # LOCALPORTRANGESTART=
-                        localPortRangeStart = boost::lexical_cast<uint>( rightpart ); //.toUInt(&ok);
-                        if(localPortRangeStart<1024)
-                        {
-                            throw std::string ("Value in LOCALPORTRANGESTART section was less then 1024.");
-                        }
-                        break;
-                    case 1:     // # LOCALPORTRANGEEND=
-                        localPortRangeEnd = boost::lexical_cast<uint>( rightpart ); //rightpart.toUInt(&ok);
-                        if(localPortRangeEnd>65535) {
-                            throw std::string("Value in LOCALPORTRANGEEND is greater than 65535.");
-                        }
-                        break;
-                    case 2:     // # DISABLED=
-                        disabled = rightpart=="1";
-                        break;
-                    case 3:     // # LOGREJECT=
-                        logreject = rightpart=="1";
-                        break;
-                    case 4:     // # LOGDROP=
-                        logdrop = rightpart=="1";
-                        break;
-                    case 5:     // # LOGABORTEDTCP=
-                        logabortedtcp = rightpart=="1";
-                        break;
-                    case 6:     // # LOGIPOPTIONS=
-                        logipoptions = rightpart=="1";
-                        break;
-                    case 7:     // # LOGTCPOPTIONS=
-                        logtcpoptions = rightpart=="1";
-                        break;
-                    case 8:     // # LOGTCPSEQUENCE=
-                        logtcpsequence = rightpart=="1";
-                        break;
-                    case 9:     // # LOGLEVEL=",
-                        loglevel = boost::lexical_cast<uint>( rightpart );
-                        if(loglevel>7)
-                        {
-                            throw std::string("Error, the value in the LOGLEVEL section is too big.");
-                        }
-                        break;
-                    case 10:     // # LOGRATELIMIT=
-                        logratelimit = rightpart=="1";
-                        break;
-                    case 11:    // # LOGRATE=
-                        lograte = boost::lexical_cast<uint>( rightpart );
-                        if(lograte>65535)
-                        {
-                            throw std::string("Error, the value in the LOGRATE section is too big (>65535).");
-                        }
-                        break;
-                    case 12:    // # LOGRATEUNIT=
-                        lograteunit = (LogRateUnit)boost::lexical_cast<uint>( rightpart );
-                        if(lograteunit>3)
-                        {
-                            throw std::string("Error the value in the LOGRATEUNIT section is out of range.");
-                        }
-                        break;
-                    case 13:    // # LOGRATEBURST=
-                        lograteburst = boost::lexical_cast<uint>( rightpart );
-                        if(lograteburst > 65535) {
-                            throw std::string("Error, the value in the LOGRATEBURST section is too big.");
-                        }
-                        break;
-                    case 14:    // # LOGWARNLIMIT=
-                        logwarnlimit = rightpart=="1";
-                        break;
-                    case 15:    // # LOGWARNRATE=
-                        logwarnrate = boost::lexical_cast<uint>( rightpart );
-                        if(logwarnrate > 65535)
-                        {
-                            throw std::string("Error, the value in the LOGWARNRATE section is too big (>65535).");
-                        }
-                        break;
-                    case 16:    // # LOGWARNRATEUNIT=
-                        logwarnrateunit = (LogRateUnit)boost::lexical_cast<uint>( rightpart );
-                        if(logwarnrateunit>3)
-                        {
-                            throw std::string("Error the value in the LOGWARNRATEUNIT section is out of range.");
-                        }
-                        break;
-                    case 17:    // # DHCPC=
-                        dhcpcenabled = rightpart=="1";
-                        break;
-                    case 18:    // # DHCPCINTERFACENAME=
-                        dhcpcinterfacename = rightpart;
-                        break;
-                    case 19:    // # DHCPD=
-                        dhcpdenabled = rightpart=="1";
-                        break;
-                    case 20:    // # DHCPDINTERFACENAME=
-                        dhcpdinterfacename = rightpart;
-                        break;
-                    case 21:    // # ALLOWTCPTIMESTAMPS=
-                        allowtcptimestamps = rightpart=="1";
-                        break;
-
-                    default:
-                        // Should we complain?
-                        break;
-                }
+                readConfigValue( configKeys().find( s.begin + 2, equals ), std::string( equals + 1, s.end ) );
             }
         }
 
@@ -1764,38 +3143,55 @@ public:
         // Parse a Zone record.
         while( s =="# [Zone]")
         {
-            Zone newzone(Zone::UserZone);
+            zones.push_back(Zone(Zone::UserZone));
+            Zone & newzone = zones.back();
 
             // Parse the Zone name.
-            std::getline( stream, s );
-            if ( s.empty() || s.substr( 0, 7) != ("# NAME="))
+            s = lines.next();
+            if ( !s.startsWith("# NAME=") )
             {
                 throw std::string("Error parsing firewall [Zone] section. Expected '# NAME='");
             }
-            newzone.setName( s.substr(7) );
+            newzone.setName( s.after(7) );
 
             // Parse the Zone comment.
-            std::getline( stream, s );
-            if(s.empty() || s.substr(0,10) != ("# COMMENT="))
+            s = lines.next();
+            if ( !s.startsWith("# COMMENT=") )
             {
                 throw std::string("Error parsing firewall [Zone] section. Expected '# COMMENT='");
             }
-            newzone.setComment( s.substr(10) );
+            newzone.setComment( s.after(10) );
 
-            // Parse the Zone addresses.
-            while(true)
+            // Parse the Zone definition, for zones that have one.
+            ScriptLines definition = lines;
+            if ( definition.next().startsWith("# DEFINITION=") )
             {
-                std::getline( stream, s );
-                if(s.empty() || s.substr(0,10) == ("# ADDRESS="))
-                {
-                    newzone.addMemberMachine(IPRange(s.substr(10)));
-                }
-                else
-                {
-                    zones.push_back(newzone);
-                    break;
-                }
+                s = lines.next();
+                newzone.setDefinition( s.after(13) );
+            }
+
+            // Parse the Zone addresses straight into place, counting them
+            // first.  They're given to the zones at the end, so growing
+            // zones doesn't copy them.
+            ScriptLines ahead = lines;
+            size_t count = 0;
+            while ( ahead.next().startsWith("# ADDRESS=") )
+            {
+                count++;
+            }
+            memberLists.push_back( std::vector<IPRange>() );
+            std::vector<IPRange> & addresses = memberLists.back();
+            addresses.resize( count );
+            BOOST_FOREACH( IPRange & address, addresses )
+            {
+                s = lines.next();
+                address.setAddress( s.begin + 10, s.end );
             }
+            s = lines.next();
+        }
+        for ( size_t z = 0; z < memberLists.size(); z++ )
+        {
+            zones[ zones.size() - memberLists.size() + z ].takeMemberMachines( memberLists[z] );
         }
 
         // Read in any user defined protocols.
@@ -1803,32 +3199,22 @@ public:
         while(s=="# [UserDefinedProtocol]")
         {
             // Snarf the ID.
-            std::getline( stream, s );
-            if(s.empty() || s.substr(0,5) != ("# ID="))
+            s = lines.next();
+            if ( !s.startsWith("# ID=") )
             {
                 throw std::string("Error parsing firewall [UserDefinedProtocol] section. Expected '# ID='");
             }
-            udpid = boost::lexical_cast<uint>( s.substr(5));
+            udpid = boost::lexical_cast<uint>( s.after(5) );
 
             // Snarf the NAME
-            std::getline( stream, s );
-            if(s.empty() || s.substr(0,7) != ("# NAME="))
+            s = lines.next();
+            if ( !s.startsWith("# NAME=") )
             {
                 throw std::string("Error parsing firewall [UserDefinedProtocol] section. Expected '# NAME='");
             }
-            std::string tmpstring = s.substr(7);
-            ProtocolEntry * ent;
-            try { ent = &pdb->lookup(tmpstring); }
-            catch(...)
-            {
-                ProtocolEntry t(tmpstring);
-                pdb->addProtocolEntry(t);
-                ent = &pdb->lookup(tmpstring);
-                ent->Classification = "User Defined";
-                ent->longname = tmpstring; //for udp the name and long name are the same
-            }
+            ProtocolEntry * ent = &userDefinedProtocol( s.after(7) );
 
-            std::getline( stream, s );
+            s = lines.next();
             do
             {
                 // Snarf the protocol type.
@@ -1849,8 +3235,8 @@ public:
                 }
 
                 // Snarf the PORT now.
-                std::getline( stream, s );
-                if(s.empty() || s.substr(0,7) != ("# PORT="))
+                s = lines.next();
+                if ( !s.startsWith("# PORT=") )
                 {
                     throw std::string("Error parsing firewall [UserDefinedProtocol] section. Expected '# PORT='");
                 }
@@ -1860,16 +3246,17 @@ public:
                 // # PORT=xxx
                 //
                 // if the colon is missing, it's file from an older version
-                if (s.find(":") == std::string::npos)
-                    udpstartport = udpendport = boost::lexical_cast<uint>(s.substr(7));
+                char const * colon = static_cast<char const *>( memchr( s.begin, ':', s.size() ) );
+                if ( !colon )
+                    udpstartport = udpendport = boost::lexical_cast<uint>( s.after(7) );
                 else
                 {
-                    udpstartport = boost::lexical_cast<uint>(s.substr(7, s.find(":")-7));
-                    udpendport = boost::lexical_cast<uint>(s.substr(s.find(":")+1));
+                    udpstartport = boost::lexical_cast<uint>( std::string( s.begin + 7, colon ) );
+                    udpendport = boost::lexical_cast<uint>( std::string( colon + 1, s.end ) );
                 }
 
                 // Bidirectional or not?
-                std::getline( stream, s );
+                s = lines.next();
                 if(s.empty() || s=="# BIDIRECTIONAL=0")
                     udpbidirectional = false;
                 else
@@ -1879,13 +3266,9 @@ public:
                     else
                         throw std::string("Error parsing firewall [UserDefinedProtocol] section. Expected '# BIDIRECTIONAL=0' or '# BIDIRECTIONAL=1'");
                 }
-                ProtocolNetUse t;
-                t.addDest(ProtocolNetUseDetail(PORTRANGE_RANGE, udpstartport, udpendport));
-                t.setType(udptype);
-                t.setBidirectional(udpbidirectional);
-                ent->addNetwork(t);
-                std::getline( stream, s );
-            }while(s.empty() || s.substr(0, 7) == "# TYPE=" );
+                addUserDefinedNetwork( *ent, udptype, udpstartport, udpendport, udpbidirectional );
+                s = lines.next();
+            }while( s.empty() || s.startsWith("# TYPE=") );
         }
 
         state = READSTATE_PROTOCOLCONFIG;
@@ -1896,11 +3279,11 @@ public:
         while ( true )
         {
             //  If I follow this code corectly, the name after [ToZone] should match toZone.getName()
-            if ( s.substr(0,10) == ("# [ToZone]") || s.substr( 0, 14 ) == "# [ServerZone]" )
+            if ( s.startsWith("# [ToZone]") || s.startsWith("# [ServerZone]") )
             {
                 fromZone  = zones.begin();
 
-                std::getline( stream, s );
+                s = lines.next();
                 if ( s.empty() ) throw std::string( "Empty string read2" );
 
                 while ( true )
@@ -1909,59 +3292,52 @@ public:
                     {
                         ++fromZone ;
                     }
-                    if ( s.substr(0,12) == ("# [FromZone]") || s.substr(0,14) == ("# [ClientZone]" ) )
+                    if ( s.startsWith("# [FromZone]") || s.startsWith("# [ClientZone]") )
                     {
                         //  If I follow this code corectly, the name after [FromZone] should match fromZone .getName()
-                        std::getline( stream, s );
+                        s = lines.next();
                         if(s.empty()) throw std::string( "Empty string read3" );
 
-                        if ( s.substr(0,13) == ("# CONNECTED=1") )
+                        if ( s.startsWith("# CONNECTED=1") )
                         {
-                            updateZoneConnection( fromZone ->getName(), toZone->getName(), true );
+                            fromZone->connect( toZone->getName() );
 
                             while(true)
                             {
-                                std::getline( stream, s );
+                                s = lines.next();
                                 if ( s.empty() ) throw std::string( "Empty string read4" );
 
-                                if ( s.substr(0,11) == ("# PROTOCOL=") )
+                                if ( s.startsWith("# PROTOCOL=") )
                                 {
-                                    if(s.substr(11,11) == "userdefined" )
+                                    if ( s.at(11, "userdefined") )
                                     {
-                                        std::cerr << "Attempt to import GuardDog file. Zone connection failed for "<< s.substr(11) << std::endl;
+                                        std::cerr << "Attempt to import GuardDog file. Zone connection failed for "<< s.after(11) << std::endl;
                                     }
-                                    else
+                                    else if ( ProtocolEntry const * pe = lookupProtocol( protocolsByName, s.after(11) ) )
                                     {
-                                        try
-                                        {
-                                            ProtocolEntry & pe = pdb->lookup(s.substr(11));
-                                            fromZone->setProtocolState( *toZone, pe, Zone::PERMIT );
-                                        }
-                                        catch ( ... )
-                                        {
-                                            //std::cout << "Shouldn't see this anymore..." << std::endl;
-                                        }
+                                        fromZone->setProtocolState( *toZone, *pe, Zone::PERMIT );
                                     }
                                 }
+                                else if ( s.startsWith("# FASTPATH=") )
+                                {
+                                    fromZone->setFastPath( toZone->getName(), s.after(11) == "1" );
+                                }
+                                else if ( s.startsWith("# LOG=") )
+                                {
+                                    fromZone->setLogging( toZone->getName(), s.after(6) == "1" );
+                                }
                                 else
                                 {
-                                    if ( s.substr(0,9) == ("# REJECT=") )
+                                    if ( s.startsWith("# REJECT=") )
                                     {
-                                        if(s.substr(9,11) == "userdefined" )
+                                        if ( s.at(9, "userdefined") )
                                         {
-                                            std::cerr << "Attempt to import GuardDog file. Zone connection failed for "<< s.substr(9) << std::endl;
+                                            std::cerr << "Attempt to import GuardDog file. Zone connection failed for "<< s.after(9) << std::endl;
                                         }
-                                        else
+                                        else if ( ProtocolEntry const * pe = lookupProtocol( protocolsByName, s.after(9) ) )
                                         {
-                                            try
-                                            {
-                                                ProtocolEntry & pe = pdb->lookup(s.substr(9));
-                                                fromZone->setProtocolState( *toZone, pe, Zone::REJECT );
-                                            }
-                                            catch ( ... )
-                                            {//this can happen when importing old version files
-                                                //std::cout << "Shouldn't see this anymore..." << std::endl;
-                                            }
+                                            //this can fail when importing old version files
+                                            fromZone->setProtocolState( *toZone, *pe, Zone::REJECT );
                                         }
                                     }
                                     else
@@ -1974,13 +3350,19 @@ public:
                         else
                         {
                             // This zone is disconnected.
-                            if ( s.substr(0,13) != ("# CONNECTED=0"))
+                            if ( !s.startsWith("# CONNECTED=0") )
                             {
                                 throw std::string("Error parsing firewall [ToZone] section. Expected '# CONNECTED=0' or '# CONNECTED=1'");
                             }
                             fromZone->disconnect( toZone->getName() );
-                            std::getline( stream, s );
+                            s = lines.next();
                             if ( s.empty() ) throw std::string( "Empty string read5" );
+                            if ( s.startsWith("# LOG=") )
+                            {
+                                fromZone->setLogging( toZone->getName(), s.after(6) == "1" );
+                                s = lines.next();
+                                if ( s.empty() ) throw std::string( "Empty string read5" );
+                            }
                         }
                         ++fromZone ;  // Take us to the next client zone in anticipation.
                     }
@@ -1991,7 +3373,7 @@ public:
                     }
                 }
             }
-            else if(s.substr(0,7) == ("# [End]"))
+            else if ( s.startsWith("# [End]") )
             {
                 break;
             }
@@ -2000,7 +3382,297 @@ public:
                 throw std::string( "Empty string read6" );
             }
         }
+        markZoneDefinitionsCurrent();
+    }
+    /*!
+    **  \brief Where the snapshot of the firewall saved as script is kept
+    */
+    static std::string snapshotFilename( std::string const & script )
+    {
+        return script + ".snapshot";
+    }
+
+    /*!
+    **  \brief Save a PolicySnapshot of the firewall next to script, which
+    **         must just have been written from it
+    **
+    **  The snapshot holds what readFirewall() would read from script.
+    */
+    void writeSnapshot( std::string const & script )
+    {
+        PolicySnapshotWriter snapshot;
+
+        // The [Config] lines, taken apart the way readFirewall() does.
+        std::vector<uint32_t> & settings = snapshot.section( PolicySnapshot::SETTINGS );
+        settings.push_back( snapshot.add( description ) );
+        settings.push_back( 0 );
+        std::ostringstream config;
+        writeSettings( config );
+        std::string const text = config.str();
+        ScriptLines configLines( text.data(), text.data() + text.size() );
+        while ( !configLines.atEnd() )
+        {
+            ScriptLine line = configLines.next();
+            char const * equals = line.startsWith("# ") ? static_cast<char const *>( memchr( line.begin + 2, '=', line.size() - 2 ) ) : 0;
+            int key = equals ? configKeys().find( line.begin + 2, equals ) : -1;
+            if ( key >= 0 )
+            {
+                settings.push_back( key );
+                settings.push_back( snapshot.intern( std::string( equals + 1, line.end ) ) );
+                settings[1]++;
+            }
+        }
+
+        std::vector<uint32_t> & zoneWords = snapshot.section( PolicySnapshot::ZONES );
+        std::vector<uint32_t> & addresses = snapshot.section( PolicySnapshot::ADDRESSES );
+        zoneWords.push_back( 0 );
+        addresses.push_back( 0 );
+        BOOST_FOREACH( Zone const & zone, zones )
+        {
+            if ( zone.editable() )
+            {
+                std::vector<IPRange> const & members = zone.getMemberMachineList();
+                zoneWords[0]++;
+                zoneWords.push_back( snapshot.intern( zone.getName() ) );
+                zoneWords.push_back( snapshot.add( zone.getComment() ) );
+                zoneWords.push_back( snapshot.add( zone.getDefinition() ) );
+                zoneWords.push_back( addresses[0] );
+                zoneWords.push_back( members.size() );
+                BOOST_FOREACH( IPRange range, members )
+                {
+                    addresses.push_back( snapshot.add( range.getAddress() ) );
+                    addresses.push_back( range.getType() | range.getMask() << 8 );
+                }
+                addresses[0] += members.size();
+            }
+        }
+
+        snapshot.section( PolicySnapshot::PROTOCOLS ).push_back( 0 );
+        {
+            SnapshotUDP SnapshotUDPm( snapshot );
+            pdb->ApplyToRows( SnapshotUDPm );
+        }
+
+        // The [ToZone] sections.
+        std::vector<uint32_t> & policy = snapshot.section( PolicySnapshot::POLICY );
+        policy.push_back( zones.size() );
+        BOOST_FOREACH( Zone const & zone, zones )
+        {
+            policy.push_back( snapshot.intern( zone.getName() ) );
+        }
+        BOOST_FOREACH( Zone const & toZone, zones )
+        {
+            BOOST_FOREACH( Zone const & fromZone, zones )
+            {
+                if ( toZone != fromZone )
+                {
+                    uint32_t flags = 0;
+                    std::vector< std::string > permitted;
+                    std::vector< std::string > rejected;
+                    if ( fromZone.isConnectedTo( toZone.getName() ) )
+                    {
+                        flags |= PolicySnapshot::CONNECTED;
+                        permitted = fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::PERMIT );
+                        rejected = fromZone.getConnectedZoneProtocols( toZone.getName(), Zone::REJECT );
+                        if ( fromZone.isFastPath( toZone.getName() ) )
+                            flags |= PolicySnapshot::FASTPATH;
+                    }
+                    if ( !fromZone.isLogging( toZone.getName() ) )
+                        flags |= PolicySnapshot::QUIET;
+                    policy.push_back( flags );
+                    policy.push_back( permitted.size() + rejected.size() );
+                    BOOST_FOREACH( std::string const & p, permitted )
+                    {
+                        policy.push_back( snapshot.intern( p ) );
+                        policy.push_back( Zone::PERMIT );
+                    }
+                    BOOST_FOREACH( std::string const & p, rejected )
+                    {
+                        policy.push_back( snapshot.intern( p ) );
+                        policy.push_back( Zone::REJECT );
+                    }
+                }
+            }
+        }
+
+        // The part of script readFirewall() reads.
+        MappedFile file( script );
+        ScriptLines lines( file.begin(), file.end() );
+        ScriptLine line;
+        do
+        {
+            line = lines.next();
+        } while ( line != "# [End]" && !lines.atEnd() );
+        if ( line != "# [End]" )
+        {
+            throw std::string( "No [End] line in " ) + script;
+        }
+        size_t size = line.end - file.begin() + ( line.end == file.end() ? 0 : 1 );
+        snapshot.write( snapshotFilename( script ), size, snapshotHash( file.begin(), size ) );
+    }
+
+    /*!
+    **  \brief writeSnapshot(), only telling about it failing, as a snapshot
+    **         only makes reading script faster
+    */
+    void keepSnapshot( std::string const & script )
+    {
+        try
+        {
+            writeSnapshot( script );
+        }
+        catch ( std::string const & msg )
+        {
+            std::cerr << "Unable to save a snapshot of " << script << ": " << msg << std::endl;
+        }
+    }
+
+    /*!
+    **  \brief Read the firewall from the snapshot saved next to script, if
+    **         there is one of script as it is now
+    **
+    **  Like readFirewall() this starts from the factory defaults.  The
+    **  zones' addresses are only read from the snapshot when they're first
+    **  needed.
+    **
+    **  \return false if there is no snapshot of script as it is now
+    */
+    bool readSnapshot( std::string const & script )
+    {
+        if ( !boost::filesystem::exists( snapshotFilename( script ) ) )
+        {
+            return false;
+        }
+        boost::shared_ptr< PolicySnapshot const > snapshot( new PolicySnapshot( snapshotFilename( script ) ) );
+        {
+            MappedFile file( script );
+            if ( file.size() < snapshot->getScriptSize()
+                    || snapshotHash( file.begin(), snapshot->getScriptSize() ) != snapshot->getScriptHash() )
+            {
+                return false;
+            }
+        }
+
+        zonePairScripts.clear();
+
+        PolicySnapshot::Cursor settings = snapshot->cursor( PolicySnapshot::SETTINGS );
+        description = snapshot->string( settings.next() );
+        nologprotocols.clear();
+        for ( uint32_t n = settings.next(); n > 0; n-- )
+        {
+            int key = settings.next();
+            readConfigValue( key, snapshot->string( settings.next() ) );
+        }
+        if ( localPortRangeEnd < localPortRangeStart)
+        {
+            throw std::string("Value for LOCALPORTRANGEEND is less than the one in LOCALPORTRANGESTART");
+        }
+
+        PolicySnapshot::Cursor zoneWords = snapshot->cursor( PolicySnapshot::ZONES );
+        for ( uint32_t n = zoneWords.next(); n > 0; n-- )
+        {
+            zones.push_back(Zone(Zone::UserZone));
+            Zone & zone = zones.back();
+            zone.setName( snapshot->string( zoneWords.next() ) );
+            zone.setComment( snapshot->string( zoneWords.next() ) );
+            zone.setDefinition( snapshot->string( zoneWords.next() ) );
+            uint32_t first = zoneWords.next();
+            uint32_t count = zoneWords.next();
+            if ( count > 0 )
+            {
+                zone.setPendingMembers( boost::shared_ptr< ZoneMemberSource const >( new SnapshotMembers( snapshot, first, count ) ) );
+            }
+        }
+
+        // The rest is read through once before the user defined protocols
+        // go into the protocol database, as a caller going on to read the
+        // script after a throw doesn't reset the database.
+        std::vector< std::pair< std::string, std::vector< uint32_t > > > userProtocols;   // name, 4 words a network
+        PolicySnapshot::Cursor protocols = snapshot->cursor( PolicySnapshot::PROTOCOLS );
+        for ( uint32_t n = protocols.next(); n > 0; n-- )
+        {
+            userProtocols.push_back( std::make_pair( snapshot->string( protocols.next() ), std::vector< uint32_t >() ) );
+            for ( uint32_t words = 4 * protocols.next(); words > 0; words-- )
+            {
+                userProtocols.back().second.push_back( protocols.next() );
+            }
+        }
+
+        PolicySnapshot::Cursor policy = snapshot->cursor( PolicySnapshot::POLICY );
+        if ( policy.next() != zones.size() )
+        {
+            throw std::string( "Snapshot of other zones" );
+        }
+        BOOST_FOREACH( Zone const & zone, zones )
+        {
+            if ( snapshot->string( policy.next() ) != zone.getName() )
+            {
+                throw std::string( "Snapshot of other zones" );
+            }
+        }
+        PolicySnapshot::Cursor pairs = policy;
+        for ( size_t n = zones.size() * ( zones.size() - 1 ); n > 0; n-- )
+        {
+            pairs.next();
+            for ( uint32_t states = pairs.next(); states > 0; states-- )
+            {
+                snapshot->string( pairs.next() );
+                pairs.next();
+            }
+        }
+
+        for ( size_t p = 0; p < userProtocols.size(); p++ )
+        {
+            ProtocolEntry & entry = userDefinedProtocol( userProtocols[p].first );
+            std::vector< uint32_t > const & words = userProtocols[p].second;
+            for ( size_t w = 0; w < words.size(); w += 4 )
+            {
+                addUserDefinedNetwork( entry, words[w], words[w + 1], words[w + 2], words[w + 3] != 0 );
+            }
+        }
+        std::map<std::string, ProtocolEntry const *> protocolsByName;   // 0 for unknown names
+        for ( size_t to = 0; to < zones.size(); to++ )
+        {
+            for ( size_t from = 0; from < zones.size(); from++ )
+            {
+                if ( from == to )
+                {
+                    continue;
+                }
+                Zone & fromZone = zones[from];
+                Zone const & toZone = zones[to];
+                uint32_t flags = policy.next();
+                if ( flags & PolicySnapshot::CONNECTED )
+                {
+                    fromZone.connect( toZone.getName() );
+                }
+                else
+                {
+                    fromZone.disconnect( toZone.getName() );
+                }
+                for ( uint32_t states = policy.next(); states > 0; states-- )
+                {
+                    ProtocolEntry const * pe = lookupProtocol( protocolsByName, snapshot->string( policy.next() ) );
+                    Zone::ProtocolState state = policy.next() == Zone::REJECT ? Zone::REJECT : Zone::PERMIT;
+                    if ( pe )
+                    {
+                        fromZone.setProtocolState( toZone, *pe, state );
+                    }
+                }
+                if ( flags & PolicySnapshot::FASTPATH )
+                {
+                    fromZone.setFastPath( toZone.getName(), true );
+                }
+                if ( flags & PolicySnapshot::QUIET )
+                {
+                    fromZone.setLogging( toZone.getName(), false );
+                }
+            }
+        }
+        markZoneDefinitionsCurrent();
+        return true;
     }
+
 //i need this also public
     /*!
     **  \brief Set firewall to known "good" defaults
@@ -2008,6 +3680,7 @@ public:
     void factoryDefaults()
     {
         zones.clear();
+        zonePairScripts.clear();
         disabled = false;
         logreject = true;
 
@@ -2048,6 +3721,16 @@ public:
         dhcpdenabled = false;
         dhcpdinterfacename = "eth0";
         allowtcptimestamps = false;
+        flowtableenabled = false;
+        flowtableinterfacename = "eth0";
+        lognflog = false;
+        nfloggroup = 1;
+        nflogthreshold = 20;
+        nflogsnaplen = 128;
+        logpersource = false;
+        logsample = false;
+        logsamplerate = 100;
+        nologprotocols.clear();
 
         description = "";
     }
@@ -2086,7 +3769,9 @@ public:
             "/sbin/iptables -P OUTPUT ACCEPT\n"
             "/sbin/iptables -P INPUT ACCEPT\n"
             "/sbin/iptables -P FORWARD ACCEPT\n"
-            "fi;\n";
+            "fi;\n"
+            "/sbin/iptables -t raw -F\n"
+            "nft delete table inet guardpuppy > /dev/null 2>&1\n";
 
         int rv = system( command.c_str() );
         if ( rv == -1 ) throw std::string( "system command returned error" );
@@ -2111,7 +3796,9 @@ public:
             "/sbin/iptables -P OUTPUT DROP\n"
             "/sbin/iptables -P INPUT DROP\n"
             "/sbin/iptables -P FORWARD DROP\n"
-            "fi;\n";
+            "fi;\n"
+            "/sbin/iptables -t raw -F\n"
+            "nft delete table inet guardpuppy > /dev/null 2>&1\n";
 
         int rv = system( command.c_str() );
         if ( rv == -1 ) throw std::string( "system command returned error" );
@@ -2120,59 +3807,75 @@ public:
 //TODO make these safe to call with bad strings.
     std::string getName(std::string s) const
     {
-        return pdb->lookup(s).getName();
+        return db().lookup(s).getName();
     }
     void setName(std::string current, std::string next)
     {
         pdb->lookup(current).setName(next);
+        pdb->protocolChanged();
+        zonePairScripts.clear();
     }
-    std::vector<uchar> getTypes(std::string s) const
+    ProtocolColumn<uchar> getTypes(std::string s) const
     {
-        return pdb->lookup(s).getTypes();
+        return pdb->rows(s).types;
     }
     void setType(std::string s, uchar type, int j)
     {
-            pdb->lookup(s).setType(type, j);
+        pdb->lookup(s).setType(type, j);
+        pdb->protocolChanged();
+        zonePairScripts.clear();
     }
 
-    std::vector<uint> getStartPorts(std::string s) const
+    ProtocolColumn<uint> getStartPorts(std::string s) const
     {
-        return pdb->lookup(s).getStartPorts();
+        return pdb->rows(s).destStarts;
     }
     void setStartPort(std::string s, uint i, int j)
     {
         pdb->lookup(s).setStartPort(i, j);
+        pdb->protocolChanged();
+        zonePairScripts.clear();
     }
-    std::vector<uint> getEndPorts(std::string s) const
+    ProtocolColumn<uint> getEndPorts(std::string s) const
     {
-        return pdb->lookup(s).getEndPorts();
+        return pdb->rows(s).destEnds;
     }
     void setEndPort(std::string s, uint i, int j)
     {
         pdb->lookup(s).setEndPort(i, j);
+        pdb->protocolChanged();
+        zonePairScripts.clear();
     }
-    std::vector<bool> getBidirectionals(std::string s) const
+    ProtocolColumn<uchar> getBidirectionals(std::string s) const
     {
-        return pdb->lookup(s).getBidirectionals();
+        return pdb->rows(s).bidirectionals;
     }
     void setBidirectional(std::string s, bool on, int j)
     {
         pdb->lookup(s).setBidirectional(on, j);
+        pdb->protocolChanged();
+        zonePairScripts.clear();
     }
-    std::vector<std::string> getRangeStrings(std::string s) const
+    std::string getRangeString(std::string s, int j) const
     {
-        return pdb->lookup(s).getRangeStrings();
+        return pdb->rows(s).rangeString(j);
     }
     template <class T>
     void ApplyToDB(T & func)
     {
         pdb->ApplyToDB(func);
     }
+    template <class T>
+    void ApplyToRows(T & func) const
+    {
+        pdb->ApplyToRows(func);
+    }
 
     template<class T>
     void ApplyToNthInClass(T & func, int i, std::string c)
     {
         pdb->ApplyToNthInClass(func, i, c);
+        zonePairScripts.clear();
     }
 };
 
@@ -0,0 +1,381 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+/*!
+**  \brief A 128 bit IPv6 address, in host byte order
+*/
+struct IPv6Address
+{
+    uint64_t high;
+    uint64_t low;
+
+    IPv6Address( uint64_t _high = 0, uint64_t _low = 0 )
+     : high( _high ), low( _low )
+    {
+    }
+
+    bool operator<( IPv6Address const & rhs ) const
+    {
+        return high != rhs.high ? high < rhs.high : low < rhs.low;
+    }
+    bool operator<=( IPv6Address const & rhs ) const { return !( rhs < *this ); }
+    bool operator==( IPv6Address const & rhs ) const { return high == rhs.high && low == rhs.low; }
+    bool operator!=( IPv6Address const & rhs ) const { return !( *this == rhs ); }
+
+    IPv6Address operator&( IPv6Address const & rhs ) const { return IPv6Address( high & rhs.high, low & rhs.low ); }
+    IPv6Address operator|( IPv6Address const & rhs ) const { return IPv6Address( high | rhs.high, low | rhs.low ); }
+};
+
+/*!
+**  \brief What IntervalSet needs to know of an address type
+**
+**  lowBits( n ) is the address with only its lowest n bits set, next() and
+**  prev() the addresses either side of one, which is not the last or first
+**  address.  str() and parse() give and read the usual text of an address.
+*/
+template< class Address >
+struct AddressTraits;
+
+template<>
+struct AddressTraits< uint32_t >
+{
+    static uint const width = 32;
+
+    static uint32_t max() { return 0xffffffffu; }
+    static uint32_t lowBits( uint n ) { return n >= 32 ? 0xffffffffu : ( 1u << n ) - 1; }
+    static uint32_t next( uint32_t a ) { return a + 1; }
+    static uint32_t prev( uint32_t a ) { return a - 1; }
+
+    static std::string str( uint32_t a )
+    {
+        return boost::lexical_cast< std::string >( a >> 24 ) + "."
+            + boost::lexical_cast< std::string >( a >> 16 & 0xff ) + "."
+            + boost::lexical_cast< std::string >( a >> 8 & 0xff ) + "."
+            + boost::lexical_cast< std::string >( a & 0xff );
+    }
+
+    static bool parse( std::string const & s, uint32_t & a )
+    {
+        struct in_addr addr;
+        if ( inet_pton( AF_INET, s.c_str(), &addr ) != 1 )
+            return false;
+        a = ntohl( addr.s_addr );
+        return true;
+    }
+};
+
+template<>
+struct AddressTraits< IPv6Address >
+{
+    static uint const width = 128;
+
+    static IPv6Address max() { return IPv6Address( ~uint64_t( 0 ), ~uint64_t( 0 ) ); }
+
+    static IPv6Address lowBits( uint n )
+    {
+        if ( n >= 128 )
+            return max();
+        if ( n >= 64 )
+            return IPv6Address( n == 64 ? 0 : ( uint64_t( 1 ) << ( n - 64 ) ) - 1, ~uint64_t( 0 ) );
+        return IPv6Address( 0, ( uint64_t( 1 ) << n ) - 1 );
+    }
+
+    static IPv6Address next( IPv6Address a ) { return IPv6Address( a.high + ( a.low == ~uint64_t( 0 ) ), a.low + 1 ); }
+    static IPv6Address prev( IPv6Address a ) { return IPv6Address( a.high - ( a.low == 0 ), a.low - 1 ); }
+
+    static std::string str( IPv6Address a )
+    {
+        unsigned char bytes[16];
+        for ( int i = 0; i < 8; i++ )
+        {
+            bytes[i] = a.high >> ( 56 - 8 * i );
+            bytes[ 8 + i ] = a.low >> ( 56 - 8 * i );
+        }
+        char text[ INET6_ADDRSTRLEN ];
+        return inet_ntop( AF_INET6, bytes, text, sizeof( text ) ) ? text : "";
+    }
+
+    static bool parse( std::string const & s, IPv6Address & a )
+    {
+        unsigned char bytes[16];
+        if ( inet_pton( AF_INET6, s.c_str(), bytes ) != 1 )
+            return false;
+        a = IPv6Address();
+        for ( int i = 0; i < 8; i++ )
+        {
+            a.high = a.high << 8 | bytes[i];
+            a.low = a.low << 8 | bytes[ 8 + i ];
+        }
+        return true;
+    }
+};
+
+/*!
+**  \brief A set of addresses kept as the sorted ranges of it
+**
+**  The ranges are in one vector, in order, none overlapping or touching the
+**  next, so two sets are combined by walking both once and an address is
+**  looked up by a binary search.  Ranges are added in any order, then
+**  build() puts them in order and joins them, in O(n log n).  Address is
+**  uint32_t for IPv4 or IPv6Address.
+*/
+template< class Address >
+class IntervalSet
+{
+public:
+    typedef AddressTraits< Address > Traits;
+
+    struct Interval
+    {
+        Address first;
+        Address last;
+
+        Interval( Address _first = Address(), Address _last = Address() )
+         : first( _first ), last( _last )
+        {
+        }
+
+        bool operator<( Interval const & rhs ) const { return first < rhs.first; }
+        bool operator==( Interval const & rhs ) const { return first == rhs.first && last == rhs.last; }
+    };
+
+    /*!
+    **  \brief network/length, network having no bits set past length
+    */
+    struct Prefix
+    {
+        Address network;
+        uint length;
+
+        std::string str() const
+        {
+            return Traits::str( network ) + "/" + boost::lexical_cast< std::string >( length );
+        }
+    };
+
+    typedef typename std::vector< Interval >::const_iterator const_iterator;
+    typedef const_iterator iterator;        // the intervals only change through the set
+
+private:
+    std::vector< Interval > intervals;      // sorted, apart once built
+
+    static bool before( Address const & a, Interval const & i )
+    {
+        return a < i.first;
+    }
+
+    /*!
+    **  \brief Join the sorted intervals that overlap or touch
+    */
+    void join()
+    {
+        if ( intervals.empty() )
+            return;
+        typename std::vector< Interval >::iterator out = intervals.begin();
+        for ( typename std::vector< Interval >::iterator i = out + 1; i != intervals.end(); ++i )
+        {
+            if ( out->last == Traits::max() || i->first <= Traits::next( out->last ) )
+            {
+                if ( out->last < i->last )
+                    out->last = i->last;
+            }
+            else
+            {
+                *++out = *i;
+            }
+        }
+        intervals.erase( out + 1, intervals.end() );
+    }
+
+    void append( Address const & first, Address const & last )
+    {
+        intervals.push_back( Interval( first, last ) );
+    }
+
+public:
+    /*!
+    **  \brief Add first to last, to be in the set from the next build()
+    */
+    void add( Address const & first, Address const & last )
+    {
+        if ( !( last < first ) )
+            append( first, last );
+    }
+
+    void add( Prefix const & p )
+    {
+        add( p.network, p.network | Traits::lowBits( Traits::width - p.length ) );
+    }
+
+    void build()
+    {
+        std::sort( intervals.begin(), intervals.end() );
+        join();
+    }
+
+    void clear()
+    {
+        intervals.clear();
+    }
+
+    void swap( IntervalSet & that )
+    {
+        intervals.swap( that.intervals );
+    }
+
+    bool empty() const { return intervals.empty(); }
+    size_t size() const { return intervals.size(); }
+    const_iterator begin() const { return intervals.begin(); }
+    const_iterator end() const { return intervals.end(); }
+    Interval const & operator[]( size_t i ) const { return intervals[i]; }
+
+    bool operator==( IntervalSet const & rhs ) const { return intervals == rhs.intervals; }
+    bool operator!=( IntervalSet const & rhs ) const { return !( *this == rhs ); }
+
+    /*!
+    **  \brief The interval holding a, end() if a isn't in the set
+    */
+    const_iterator find( Address const & a ) const
+    {
+        const_iterator i = std::upper_bound( intervals.begin(), intervals.end(), a, before );
+        if ( i == intervals.begin() || ( i - 1 )->last < a )
+            return intervals.end();
+        return i - 1;
+    }
+
+    bool contains( Address const & a ) const
+    {
+        return find( a ) != end();
+    }
+
+    /*!
+    **  \brief Whether all of first to last is in the set
+    */
+    bool contains( Address const & first, Address const & last ) const
+    {
+        const_iterator i = find( first );
+        return i != end() && !( i->last < last );
+    }
+
+    /*!
+    **  \brief Whether every address of rhs is in the set
+    */
+    bool contains( IntervalSet const & rhs ) const
+    {
+        const_iterator i = intervals.begin();
+        BOOST_FOREACH( Interval const & r, rhs.intervals )
+        {
+            while ( i != intervals.end() && i->last < r.first )
+                ++i;
+            if ( i == intervals.end() || r.first < i->first || i->last < r.last )
+                return false;
+        }
+        return true;
+    }
+
+    /*!
+    **  \brief Whether any of first to last is in the set
+    */
+    bool intersects( Address const & first, Address const & last ) const
+    {
+        const_iterator i = std::upper_bound( intervals.begin(), intervals.end(), last, before );
+        return i != intervals.begin() && !( ( i - 1 )->last < first );
+    }
+
+    IntervalSet unite( IntervalSet const & rhs ) const
+    {
+        IntervalSet result;
+        result.intervals.resize( intervals.size() + rhs.intervals.size() );
+        std::merge( intervals.begin(), intervals.end(), rhs.intervals.begin(), rhs.intervals.end(), result.intervals.begin() );
+        result.join();
+        return result;
+    }
+
+    IntervalSet intersect( IntervalSet const & rhs ) const
+    {
+        IntervalSet result;
+        const_iterator i = intervals.begin();
+        const_iterator j = rhs.intervals.begin();
+        while ( i != intervals.end() && j != rhs.intervals.end() )
+        {
+            Address first = std::max( i->first, j->first );
+            Address last = std::min( i->last, j->last );
+            if ( first <= last )
+                result.append( first, last );
+            if ( i->last < j->last )
+                ++i;
+            else
+                ++j;
+        }
+        return result;
+    }
+
+    /*!
+    **  \brief The addresses of the set that aren't in rhs
+    */
+    IntervalSet subtract( IntervalSet const & rhs ) const
+    {
+        IntervalSet result;
+        const_iterator j = rhs.intervals.begin();
+        BOOST_FOREACH( Interval const & i, intervals )
+        {
+            while ( j != rhs.intervals.end() && j->last < i.first )
+                ++j;
+            Address start = i.first;
+            bool covered = false;
+            for ( const_iterator k = j; k != rhs.intervals.end() && k->first <= i.last; ++k )
+            {
+                if ( start < k->first )
+                    result.append( start, Traits::prev( k->first ) );
+                if ( !( k->last < i.last ) )
+                {
+                    covered = true;
+                    break;
+                }
+                start = Traits::next( k->last );
+            }
+            if ( !covered )
+                result.append( start, i.last );
+        }
+        return result;
+    }
+
+    /*!
+    **  \brief Add the fewest prefixes covering exactly the set to out, in
+    **         order
+    */
+    void prefixes( std::vector< Prefix > & out ) const
+    {
+        BOOST_FOREACH( Interval const & i, intervals )
+        {
+            Address start = i.first;
+            while ( true )
+            {
+                // The widest prefix starting at start that doesn't go past i.last
+                uint bits = 0;
+                while ( bits < Traits::width && ( start & Traits::lowBits( bits + 1 ) ) == Address()
+                        && ( start | Traits::lowBits( bits + 1 ) ) <= i.last )
+                    bits++;
+                Prefix p;
+                p.network = start;
+                p.length = Traits::width - bits;
+                out.push_back( p );
+                Address end = start | Traits::lowBits( bits );
+                if ( end == i.last )
+                    break;
+                start = Traits::next( end );
+            }
+        }
+    }
+};
@@ -17,14 +17,25 @@
 
 #pragma once
 
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/regex.hpp>
 
+#include "intervalset.h"
+
 enum IPRangeType 
 {
     invalid,
     domainname,
     ip,
-    iprange
+    iprange,
+    ipinterval                  // a.b.c.d-e.f.g.h, the first address to the last
 };
 
 class IPRange 
@@ -45,6 +56,14 @@ public:
         setAddress(a);
     }
 
+    /*!
+    **  \brief An address digested before, to type and mask
+    */
+    IPRange( char const * begin, char const * end, IPRangeType t, uint m )
+     : address( begin, end ), digested( true ), type( t ), mask( m )
+    {
+    }
+
     ~IPRange() {
 
     }
@@ -53,6 +72,14 @@ public:
     {
         address = a;
         digest();
+        digested = true;
+    }
+
+    void setAddress( char const * begin, char const * end )
+    {
+        address.assign( begin, end );
+        digest();
+        digested = true;
     }
 
     ///////////////////////////////////////////////////////////////////////////
@@ -76,14 +103,183 @@ public:
         return boost::lexical_cast<long>(s);
     }
 
+    ///////////////////////////////////////////////////////////////////////////
+    /*!
+    **  \brief Digest a.b.c.d, a.b.c.d/n and a.b.c.d/m.m.m.m without the
+    **         regular expressions, the same way they would
+    **
+    **  \return false for any other address, or numbers longer than three
+    **          digits, which are left to the regular expressions
+    */
+    bool digestDottedQuad()
+    {
+        uint parts[8];
+        uint count = 0;
+        std::string::const_iterator p = address.begin();
+        while ( true )
+        {
+            if ( count == 8 )
+                return false;
+            uint value = 0;
+            int digits = 0;
+            for ( ; p != address.end() && *p >= '0' && *p <= '9'; ++p )
+            {
+                if ( ++digits > 3 )
+                    return false;
+                value = value * 10 + ( *p - '0' );
+            }
+            if ( digits == 0 )
+                return false;
+            parts[ count++ ] = value;
+            if ( p == address.end() )
+                break;
+            if ( *p == '/' ? count != 4 : *p != '.' || count % 4 == 0 )
+                return false;
+            ++p;
+        }
+        if ( count != 4 && count != 5 && count != 8 )
+            return false;
+
+        mask = 32;
+        type = invalid;
+        for ( uint i = 0; i < count; i++ )
+        {
+            if ( parts[i] > ( count == 5 && i == 4 ? 32u : 255u ) )
+                return true;
+        }
+        if ( count == 4 )
+        {
+            type = ip;
+            return true;
+        }
+        type = iprange;
+        if ( count == 5 )
+        {
+            mask = parts[4];
+            return true;
+        }
+        uint bitmask = parts[4] << 24 | parts[5] << 16 | parts[6] << 8 | parts[7];
+        if ( bitmask == 0 )
+        {
+            mask = 0;
+        }
+        else
+        {
+            while ( ( bitmask & 1 ) == 0 )
+            {
+                bitmask >>= 1;
+                mask--;
+            }
+        }
+        return true;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    /*!
+    **  \brief Read a.b.c.d from p, moving p past it
+    **
+    **  Numbers of any length are read, valid being cleared for one over 255.
+    **
+    **  \return false if there is no dotted quad at p
+    */
+    static bool readQuad( char const * & p, char const * end, uint32_t & value, bool & valid )
+    {
+        value = 0;
+        valid = true;
+        for ( int i = 0; i < 4; i++ )
+        {
+            if ( i > 0 )
+            {
+                if ( p == end || *p != '.' )
+                    return false;
+                ++p;
+            }
+            char const * digits = p;
+            uint part = 0;
+            for ( ; p != end && *p >= '0' && *p <= '9'; ++p )
+                part = std::min( part * 10 + ( *p - '0' ), 256u );
+            if ( p == digits )
+                return false;
+            valid = valid && part <= 255;
+            value = value << 8 | ( part & 0xff );
+        }
+        return true;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    /*!
+    **  \brief Digest a.b.c.d-e.f.g.h, which would otherwise be taken for a
+    **         domain name for its dash
+    **
+    **  \return false for any other address
+    */
+    bool digestInterval()
+    {
+        char const * p = address.data();
+        char const * end = p + address.size();
+        uint32_t first, last;
+        bool firstValid, lastValid;
+        if ( !readQuad( p, end, first, firstValid ) || p == end || *p++ != '-'
+                || !readQuad( p, end, last, lastValid ) || p != end )
+            return false;
+        mask = 32;
+        type = firstValid && lastValid && first <= last ? ipinterval : invalid;
+        return true;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    /*!
+    **  \brief Digest an address with a letter or a dash in it, which the
+    **         IP address regular expressions can't match, as a domain name
+    **
+    **  \return false for an address of digits, dots and slashes only
+    */
+    bool digestDomainName()
+    {
+        std::string::const_iterator p = address.begin();
+        while ( p != address.end() && ( ( *p >= '0' && *p <= '9' ) || *p == '.' || *p == '/' ) )
+            ++p;
+        if ( p == address.end() )
+            return false;
+
+        mask = 32;
+        type = invalid;
+        uint labels = 0;
+        uint labelLength = 0;
+        for ( p = address.begin(); p != address.end(); ++p )
+        {
+            if ( *p == '.' )
+            {
+                if ( labelLength == 0 )
+                    return true;
+                labels++;
+                labelLength = 0;
+            }
+            else if ( ( *p >= '0' && *p <= '9' ) || ( *p >= 'a' && *p <= 'z' ) || ( *p >= 'A' && *p <= 'Z' ) || *p == '-' )
+                labelLength++;
+            else
+                return true;
+        }
+        if ( labelLength > 0 && labels > 0 )
+            type = domainname;
+        return true;
+    }
+
     ///////////////////////////////////////////////////////////////////////////
     void digest() 
     {
-        boost::regex sanity("^[0-9a-zA-Z./-]*$");
-        boost::regex domainnametest("^([a-zA-Z0-9-]+\\.)+[a-zA-Z0-9-]+$");
-        boost::regex iptest("^([0-9]+)\\.([0-9]+)\\.([0-9]+)\\.([0-9]+)$");
-        boost::regex ipmaskedtest("^([0-9]+)\\.([0-9]+)\\.([0-9]+)\\.([0-9]+)/([0-9]+)$");
-        boost::regex ipmasked2test("^([0-9]+)\\.([0-9]+)\\.([0-9]+)\\.([0-9]+)/([0-9]+)\\.([0-9]+)\\.([0-9]+)\\.([0-9]+)$");
+        if ( digestDottedQuad() || digestInterval() || digestDomainName() )
+        {
+            return;
+        }
+
+
+        // Compiled once, every zone member goes through here
+        static boost::regex const sanity("^[0-9a-zA-Z./-]*$");
+        static boost::regex const domainnametest("^([a-zA-Z0-9-]+\\.)+[a-zA-Z0-9-]+$");
+        static boost::regex const iptest("^([0-9]+)\\.([0-9]+)\\.([0-9]+)\\.([0-9]+)$");
+        static boost::regex const ipmaskedtest("^([0-9]+)\\.([0-9]+)\\.([0-9]+)\\.([0-9]+)/([0-9]+)$");
+        static boost::regex const ipmasked2test("^([0-9]+)\\.([0-9]+)\\.([0-9]+)\\.([0-9]+)/([0-9]+)\\.([0-9]+)\\.([0-9]+)\\.([0-9]+)$");
 
         long ipbyte;
         uint bitmask;
@@ -102,14 +298,6 @@ public:
             return;
         }
 
-        // Test against the domainname regexp.
-        if(boost::regex_match(address, domainnametest)) 
-        {
-            type = domainname;
-            mask = 32;
-            return;
-        }
-
         // Ok, now lets try the IP address regexp.
         boost::smatch what;
         if(boost::regex_match(address, what, iptest)==true) 
@@ -257,6 +445,15 @@ public:
 
             return;
         }
+
+        // Test against the domainname regexp.  This has to come after the IP
+        // tests, a dotted quad is also a valid domain name.
+        if(boost::regex_match(address, domainnametest)) 
+        {
+            type = domainname;
+            mask = 32;
+            return;
+        }
         type = invalid;
     }
 
@@ -266,6 +463,83 @@ public:
        return mask;
     }    
 
+    ///////////////////////////////////////////////////////////////////////////
+    /*!
+    **  \brief The first and last addresses of an ip, iprange or ipinterval,
+    **         in host byte order
+    **
+    **  \return false for a domain name or an invalid address
+    */
+    bool getBounds( uint32_t & first, uint32_t & last ) const
+    {
+        if ( !digested || ( type != ip && type != iprange && type != ipinterval ) )
+            return false;
+        char const * p = address.data();
+        char const * end = p + address.size();
+        bool valid;
+        if ( !readQuad( p, end, first, valid ) )
+            return false;
+        if ( type == ipinterval )
+            return p != end && *p++ == '-' && readQuad( p, end, last, valid );
+        uint32_t bits = mask == 0 ? 0 : 0xffffffffu << ( 32 - mask );
+        first &= bits;
+        last = first | ~bits;
+        return true;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    /*!
+    **  \brief An ipinterval as the fewest a.b.c.d/n covering it, for where
+    **         addresses can only be matched by prefix; any other address as
+    **         it is
+    */
+    std::vector< IPRange > getPrefixes() const
+    {
+        std::vector< IPRange > prefixes;
+        uint32_t first, last;
+        if ( !digested || type != ipinterval || !getBounds( first, last ) )
+        {
+            prefixes.push_back( *this );
+            return prefixes;
+        }
+        IntervalSet< uint32_t > addresses;
+        addresses.add( first, last );
+        addresses.build();
+        std::vector< IntervalSet< uint32_t >::Prefix > cover;
+        addresses.prefixes( cover );
+        BOOST_FOREACH( IntervalSet< uint32_t >::Prefix const & p, cover )
+        {
+            std::string prefix = p.str();
+            prefixes.push_back( IPRange( prefix.data(), prefix.data() + prefix.size(), iprange, p.length ) );
+        }
+        return prefixes;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    /*!
+    **  \brief first to last, in host byte order, as an ip if it is one
+    **         address, an iprange if it is one prefix and otherwise an
+    **         ipinterval
+    */
+    static IPRange fromBounds( uint32_t first, uint32_t last )
+    {
+        IntervalSet< uint32_t > addresses;
+        addresses.add( first, last );
+        addresses.build();
+        std::vector< IntervalSet< uint32_t >::Prefix > cover;
+        addresses.prefixes( cover );
+        std::string address = AddressTraits< uint32_t >::str( first );
+        if ( cover.size() == 1 && cover[0].length == 32 )
+            return IPRange( address.data(), address.data() + address.size(), ip, 32 );
+        if ( cover.size() == 1 )
+        {
+            address = cover[0].str();
+            return IPRange( address.data(), address.data() + address.size(), iprange, cover[0].length );
+        }
+        address += "-" + AddressTraits< uint32_t >::str( last );
+        return IPRange( address.data(), address.data() + address.size(), ipinterval, 32 );
+    }
+
     bool operator==( IPRange const & rhs ) const
     {
         return address == rhs.address;
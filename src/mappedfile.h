@@ -0,0 +1,64 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+/*!
+**  \brief A read only mapping of a whole file
+*/
+class MappedFile
+{
+    int fd;
+    char const * data;
+    size_t length;
+
+    MappedFile( MappedFile const & );
+    MappedFile & operator=( MappedFile const & );
+
+public:
+    MappedFile( std::string const & filename )
+     : fd( -1 ), data( 0 ), length( 0 )
+    {
+        fd = open( filename.c_str(), O_RDONLY );
+        if ( fd < 0 )
+        {
+            throw std::string( "Unable to open " ) + filename + ": " + strerror( errno );
+        }
+        struct stat st;
+        if ( fstat( fd, &st ) < 0 )
+        {
+            close( fd );
+            throw std::string( "Unable to read " ) + filename + ": " + strerror( errno );
+        }
+        length = st.st_size;
+        if ( length == 0 )
+            return;
+
+        void * p = mmap( 0, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if ( p == MAP_FAILED )
+        {
+            close( fd );
+            throw std::string( "Unable to map " ) + filename + ": " + strerror( errno );
+        }
+        madvise( p, length, MADV_SEQUENTIAL );
+        data = static_cast< char const * >( p );
+    }
+
+    ~MappedFile()
+    {
+        if ( data )
+            munmap( const_cast< char * >( data ), length );
+        if ( fd >= 0 )
+            close( fd );
+    }
+
+    char const * begin() const { return data; }
+    char const * end() const { return data + length; }
+    size_t size() const { return length; }
+};
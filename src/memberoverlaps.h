@@ -0,0 +1,196 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "intervalset.h"
+#include "iprange.h"
+
+/*!
+**  \brief How the member networks of the zones overlap, and which of them
+**         decide nothing in the generated chains
+**
+**  The script tells zones apart by the longest matching prefix, equal
+**  prefixes going to the zone listed first: srcfilt over all the zones, and
+**  the split chain of each zone over all the others.  Member networks
+**  either nest or don't overlap, so they make a tree, an entry's parent
+**  being the entry its addresses would go to without it.
+**
+**  - REDUNDANT: the nearest kept entry around it is of its own zone, or it
+**    is covered by more specific entries of its own zone.  Leaving it out of
+**    every chain, and out of any match on the zone's addresses, changes
+**    nothing.
+**  - SHADOWED: every address of it is taken by a more specific entry of
+**    another zone, so it never matches in srcfilt.  It stays in the split
+**    chains, where that zone's entries aren't.
+**  - LIVE: everything else.  A live entry inside an entry of another zone
+**    takes its addresses from that zone.
+**
+**  Members given by name aren't known until the script runs; they are
+**  always LIVE and not entries.
+*/
+class MemberOverlaps
+{
+public:
+    enum State { LIVE, SHADOWED, REDUNDANT };
+
+    struct Entry
+    {
+        uint32_t network;           // in host byte order
+        uint8_t mask;
+        uint8_t state;
+        uint16_t zone;
+        uint32_t member;            // place in the prefixes of the zone
+        int32_t over;               // the nearest entry around it that isn't REDUNDANT, -1 for none
+
+        uint64_t size() const { return (uint64_t)1 << ( 32 - mask ); }
+        uint64_t end() const { return network + size(); }
+
+        std::string str() const
+        {
+            std::string s = AddressTraits< uint32_t >::str( network );
+            return mask == 32 ? s : s + "/" + boost::lexical_cast< std::string >( (uint)mask );
+        }
+    };
+
+private:
+    std::vector< Entry > entries;                   // in srcfilt order
+    std::vector< uint32_t > nesting;                // entries by network, each after those around it
+    std::vector< std::vector< uint8_t > > states;   // [zone][member]
+
+    static bool longerMask( Entry const & lhs, Entry const & rhs )
+    {
+        return lhs.mask > rhs.mask;
+    }
+
+    struct NestingOrder
+    {
+        std::vector< Entry > const * entries;
+
+        // wider first, and of equal prefixes the one matched later first
+        bool operator()( uint32_t lhs, uint32_t rhs ) const
+        {
+            Entry const & l = ( *entries )[lhs];
+            Entry const & r = ( *entries )[rhs];
+            if ( l.network != r.network ) return l.network < r.network;
+            if ( l.mask != r.mask ) return l.mask < r.mask;
+            return lhs > rhs;
+        }
+    };
+
+public:
+    /*!
+    **  \param prefixes The member networks of each zone as getPrefixes()
+    **         gives them, in zone order, empty for the Local and Internet
+    **         zones
+    */
+    MemberOverlaps( std::vector< std::vector< IPRange > > const & prefixes )
+    {
+        states.resize( prefixes.size() );
+        for ( uint16_t z = 0; z < prefixes.size(); z++ )
+        {
+            states[z].assign( prefixes[z].size(), LIVE );
+            for ( uint32_t m = 0; m < prefixes[z].size(); m++ )
+            {
+                IPRange range = prefixes[z][m];             // getType() digests it
+                uint32_t first, last;
+                if ( ( range.getType() != ip && range.getType() != iprange ) || !range.getBounds( first, last ) )
+                    continue;
+                Entry e;
+                e.network = first;
+                e.mask = range.getMask();
+                e.state = LIVE;
+                e.zone = z;
+                e.member = m;
+                e.over = -1;
+                entries.push_back( e );
+            }
+        }
+        // srcfilt has the longest masks first, then zone and member order
+        std::stable_sort( entries.begin(), entries.end(), longerMask );
+
+        nesting.resize( entries.size() );
+        for ( uint32_t e = 0; e < entries.size(); e++ )
+            nesting[e] = e;
+        NestingOrder order;
+        order.entries = &entries;
+        std::sort( nesting.begin(), nesting.end(), order );
+
+        // The parent of each entry, and how much of each entry the nearest
+        // entries of its own zone inside it cover.
+        std::vector< int32_t > parent( entries.size(), -1 );
+        std::vector< uint64_t > ownCover( entries.size(), 0 );
+        std::vector< uint32_t > stack;
+        BOOST_FOREACH( uint32_t e, nesting )
+        {
+            while ( !stack.empty() && entries[ stack.back() ].end() <= entries[e].network )
+                stack.pop_back();
+            if ( !stack.empty() )
+                parent[e] = stack.back();
+            for ( std::vector< uint32_t >::reverse_iterator a = stack.rbegin(); a != stack.rend(); ++a )
+            {
+                if ( entries[*a].zone == entries[e].zone )
+                {
+                    ownCover[*a] += entries[e].size();
+                    break;
+                }
+            }
+            stack.push_back( e );
+        }
+
+        // Parents come first, so the entries around one are settled by the
+        // time it is.
+        BOOST_FOREACH( uint32_t e, nesting )
+        {
+            Entry & entry = entries[e];
+            int32_t p = parent[e];
+            entry.over = p < 0 || entries[p].state != REDUNDANT ? p : entries[p].over;
+            if ( ownCover[e] == entry.size() || ( entry.over >= 0 && entries[ entry.over ].zone == entry.zone ) )
+                entry.state = REDUNDANT;
+        }
+
+        // What is left of each entry once the entries inside it are taken out.
+        std::vector< uint64_t > cover( entries.size(), 0 );
+        BOOST_FOREACH( Entry const & entry, entries )
+        {
+            if ( entry.state != REDUNDANT && entry.over >= 0 )
+                cover[ entry.over ] += entry.size();
+        }
+        for ( uint32_t e = 0; e < entries.size(); e++ )
+        {
+            if ( entries[e].state != REDUNDANT && cover[e] == entries[e].size() )
+                entries[e].state = SHADOWED;
+            states[ entries[e].zone ][ entries[e].member ] = entries[e].state;
+        }
+    }
+
+    /*!
+    **  \brief The State of member of zone, in the prefixes given
+    */
+    State getState( uint16_t zone, uint32_t member ) const
+    {
+        return State( states[zone][member] );
+    }
+
+    size_t size() const { return entries.size(); }
+    Entry const & operator[]( size_t e ) const { return entries[e]; }
+
+    /*!
+    **  \brief The entries in order of network, each after the entries
+    **         around it
+    */
+    std::vector< uint32_t > const & getNesting() const { return nesting; }
+
+    size_t count( State state ) const
+    {
+        size_t n = 0;
+        BOOST_FOREACH( Entry const & entry, entries )
+            n += entry.state == state;
+        return n;
+    }
+};
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_log.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*
+
+   Reads the packets the firewall logs with the NFLOG target.
+
+   The kernel queues logged packets for a group until the batch threshold
+   (--nflog-threshold) or the flush timeout is reached, and then sends the
+   whole batch to userspace in a single netlink message buffer.  One recv()
+   here therefore returns many packets, and each one is handed to the caller
+   as an NFLogPacket that points straight into the receive buffer, so reading
+   a batch doesn't allocate anything.
+
+   When the reader falls behind, the kernel drops whole batches instead of
+   blocking the firewall.  Those are counted as overruns.
+
+   Only the raw nfnetlink_log protocol is used, there is no dependency on
+   libnetfilter_log.
+
+ */
+
+/*!
+**  \brief One logged packet.  The pointers are only valid inside the callback.
+*/
+struct NFLogPacket
+{
+    char const *    prefix;         // NUL terminated, e.g. "DROPPED "
+    uint32_t        indev;          // ifindex, 0 if none
+    uint32_t        outdev;
+    uint8_t const * payload;        // The IP header onwards, truncated to the snaplen
+    uint32_t        payloadlen;
+
+    // Decoded from the payload when it is IPv4.
+    bool            ipv4;
+    uint32_t        saddr;          // host byte order
+    uint32_t        daddr;
+    uint8_t         protocol;
+    bool            hasports;
+    uint16_t        sport;
+    uint16_t        dport;
+
+    NFLogPacket()
+     : prefix( "" ), indev( 0 ), outdev( 0 ), payload( 0 ), payloadlen( 0 ),
+       ipv4( false ), saddr( 0 ), daddr( 0 ), protocol( 0 ), hasports( false ), sport( 0 ), dport( 0 )
+    {
+    }
+};
+
+class NFLogReader
+{
+    int fd;
+    uint16_t group;
+    std::vector< char > buffer;
+    unsigned long overruns;
+    uint32_t seq;
+
+    NFLogReader( NFLogReader const & );
+    NFLogReader & operator=( NFLogReader const & );
+
+public:
+    /*!
+    **  \brief Bind to an NFLOG group.
+    **
+    **  snaplen is the number of bytes copied of each packet (0 = whole packet),
+    **  threshold the number of packets the kernel batches up, and
+    **  flushTimeout how long, in 1/100 s, a partial batch may wait.
+    */
+    NFLogReader( uint16_t _group, uint32_t snaplen = 128, uint32_t threshold = 20, uint32_t flushTimeout = 100 )
+     : fd( -1 ), group( _group ), buffer( 256 * 1024 ), overruns( 0 ), seq( 0 )
+    {
+        fd = socket( AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER );
+        if ( fd < 0 )
+        {
+            throw std::string( "Unable to open netfilter netlink socket: " ) + strerror( errno );
+        }
+        sockaddr_nl local;
+        memset( &local, 0, sizeof( local ) );
+        local.nl_family = AF_NETLINK;
+        if ( bind( fd, (sockaddr *)&local, sizeof( local ) ) < 0 )
+        {
+            std::string err = strerror( errno );
+            close( fd );
+            throw std::string( "Unable to bind netfilter netlink socket: " ) + err;
+        }
+        // Room for a good number of batches before the kernel has to drop any.
+        int rcvbuf = 4 * 1024 * 1024;
+        setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof( rcvbuf ) );
+
+        try
+        {
+            // Older kernels want the log backend bound per protocol family.
+            configCommand( NFULNL_CFG_CMD_PF_UNBIND, AF_INET, 0, false );
+            configCommand( NFULNL_CFG_CMD_PF_BIND, AF_INET, 0, false );
+            configCommand( NFULNL_CFG_CMD_BIND, AF_UNSPEC, group, true );
+
+            nfulnl_msg_config_mode mode;
+            memset( &mode, 0, sizeof( mode ) );
+            mode.copy_range = htonl( snaplen == 0 ? 0xffff : snaplen );
+            mode.copy_mode = NFULNL_COPY_PACKET;
+            configAttribute( NFULA_CFG_MODE, &mode, sizeof( mode ) );
+
+            uint32_t value = htonl( threshold == 0 ? 1 : threshold );
+            configAttribute( NFULA_CFG_QTHRESH, &value, sizeof( value ) );
+            value = htonl( flushTimeout );
+            configAttribute( NFULA_CFG_TIMEOUT, &value, sizeof( value ) );
+            value = htonl( 64 * 1024 );
+            configAttribute( NFULA_CFG_NLBUFSIZ, &value, sizeof( value ) );
+        }
+        catch ( ... )
+        {
+            close( fd );
+            throw;
+        }
+    }
+
+    ~NFLogReader()
+    {
+        try
+        {
+            configCommand( NFULNL_CFG_CMD_UNBIND, AF_UNSPEC, group, false );
+        }
+        catch ( ... )
+        { }
+        close( fd );
+    }
+
+    int getFileDescriptor() const { return fd; }
+
+    /*!
+    **  \brief Number of batches the kernel dropped because we were too slow
+    */
+    unsigned long getOverruns() const { return overruns; }
+
+    /*!
+    **  \brief Wait for the next batch and call func( NFLogPacket const & ) for
+    **         every packet in it.  Returns the number of packets.
+    */
+    template< typename Func >
+    size_t readBatch( Func & func )
+    {
+        ssize_t len = recv( fd, &buffer[0], buffer.size(), 0 );
+        if ( len < 0 )
+        {
+            if ( errno == ENOBUFS )
+            {
+                overruns++;
+                return 0;
+            }
+            if ( errno == EINTR )
+            {
+                return 0;
+            }
+            throw std::string( "Error reading from netfilter netlink socket: " ) + strerror( errno );
+        }
+
+        size_t count = 0;
+        int remaining = (int)len;
+        for ( nlmsghdr const * nlh = (nlmsghdr const *)&buffer[0]; NLMSG_OK( nlh, remaining ); nlh = NLMSG_NEXT( nlh, remaining ) )
+        {
+            if ( ( nlh->nlmsg_type >> 8 ) != NFNL_SUBSYS_ULOG || ( nlh->nlmsg_type & 0xff ) != NFULNL_MSG_PACKET )
+                continue;
+
+            NFLogPacket packet;
+            if ( parsePacket( nlh, packet ) )
+            {
+                func( packet );
+                count++;
+            }
+        }
+        return count;
+    }
+
+    /*!
+    **  \brief Fill in an NFLogPacket from an NFULNL_MSG_PACKET message
+    */
+    static bool parsePacket( nlmsghdr const * nlh, NFLogPacket & packet )
+    {
+        int const header = NLMSG_LENGTH( sizeof( nfgenmsg ) );
+        if ( nlh->nlmsg_len < (uint32_t)header )
+            return false;
+
+        char const * p = (char const *)nlh + NLMSG_ALIGN( header );
+        char const * end = (char const *)nlh + nlh->nlmsg_len;
+        while ( p + sizeof( nlattr ) <= end )
+        {
+            nlattr const * attr = (nlattr const *)p;
+            if ( attr->nla_len < sizeof( nlattr ) || p + attr->nla_len > end )
+                break;
+            char const * data = p + NLA_HDRLEN;
+            uint32_t datalen = attr->nla_len - NLA_HDRLEN;
+            switch ( attr->nla_type & NLA_TYPE_MASK )
+            {
+                case NFULA_PREFIX:
+                    if ( datalen > 0 && data[datalen-1] == '\0' )
+                        packet.prefix = data;
+                    break;
+                case NFULA_IFINDEX_INDEV:
+                    if ( datalen >= 4 )
+                        packet.indev = readBE32( data );
+                    break;
+                case NFULA_IFINDEX_OUTDEV:
+                    if ( datalen >= 4 )
+                        packet.outdev = readBE32( data );
+                    break;
+                case NFULA_PAYLOAD:
+                    packet.payload = (uint8_t const *)data;
+                    packet.payloadlen = datalen;
+                    break;
+                default:
+                    break;
+            }
+            p += NLA_ALIGN( attr->nla_len );
+        }
+
+        decodeIPv4( packet );
+        return true;
+    }
+
+private:
+    static uint32_t readBE32( char const * p )
+    {
+        uint32_t v;
+        memcpy( &v, p, sizeof( v ) );
+        return ntohl( v );
+    }
+
+    static void decodeIPv4( NFLogPacket & packet )
+    {
+        uint8_t const * ip = packet.payload;
+        if ( ip == 0 || packet.payloadlen < 20 || ( ip[0] >> 4 ) != 4 )
+            return;
+        uint32_t ihl = ( ip[0] & 0x0f ) * 4;
+        if ( ihl < 20 || ihl > packet.payloadlen )
+            return;
+
+        packet.ipv4 = true;
+        packet.protocol = ip[9];
+        packet.saddr = ( (uint32_t)ip[12] << 24 ) | ( (uint32_t)ip[13] << 16 ) | ( (uint32_t)ip[14] << 8 ) | ip[15];
+        packet.daddr = ( (uint32_t)ip[16] << 24 ) | ( (uint32_t)ip[17] << 16 ) | ( (uint32_t)ip[18] << 8 ) | ip[19];
+
+        // Only the first fragment carries the ports.
+        bool firstfragment = ( ( ( ip[6] & 0x1f ) << 8 ) | ip[7] ) == 0;
+        if ( firstfragment && ( packet.protocol == IPPROTO_TCP || packet.protocol == IPPROTO_UDP ) && packet.payloadlen >= ihl + 4 )
+        {
+            packet.hasports = true;
+            packet.sport = ( ip[ihl] << 8 ) | ip[ihl+1];
+            packet.dport = ( ip[ihl+2] << 8 ) | ip[ihl+3];
+        }
+    }
+
+    void configCommand( uint8_t command, uint8_t family, uint16_t resid, bool mustSucceed )
+    {
+        nfulnl_msg_config_cmd cmd;
+        cmd.command = command;
+        sendConfig( family, resid, NFULA_CFG_CMD, &cmd, sizeof( cmd ), mustSucceed );
+    }
+
+    void configAttribute( uint16_t type, void const * data, size_t len )
+    {
+        sendConfig( AF_UNSPEC, group, type, data, len, true );
+    }
+
+    /*!
+    **  \brief Send one NFULNL_MSG_CONFIG message and wait for its ack
+    */
+    void sendConfig( uint8_t family, uint16_t resid, uint16_t type, void const * data, size_t len, bool mustSucceed )
+    {
+        char request[ NLMSG_SPACE( sizeof( nfgenmsg ) ) + NLA_HDRLEN + 64 ];
+        memset( request, 0, sizeof( request ) );
+
+        nlmsghdr * nlh = (nlmsghdr *)request;
+        nlh->nlmsg_len = NLMSG_LENGTH( sizeof( nfgenmsg ) );
+        nlh->nlmsg_type = ( NFNL_SUBSYS_ULOG << 8 ) | NFULNL_MSG_CONFIG;
+        nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+        nlh->nlmsg_seq = ++seq;
+
+        nfgenmsg * nfg = (nfgenmsg *)NLMSG_DATA( nlh );
+        nfg->nfgen_family = family;
+        nfg->version = NFNETLINK_V0;
+        nfg->res_id = htons( resid );
+
+        nlattr * attr = (nlattr *)( request + NLMSG_ALIGN( nlh->nlmsg_len ) );
+        attr->nla_type = type;
+        attr->nla_len = NLA_HDRLEN + len;
+        memcpy( (char *)attr + NLA_HDRLEN, data, len );
+        nlh->nlmsg_len = NLMSG_ALIGN( nlh->nlmsg_len ) + NLA_ALIGN( attr->nla_len );
+
+        sockaddr_nl kernel;
+        memset( &kernel, 0, sizeof( kernel ) );
+        kernel.nl_family = AF_NETLINK;
+        if ( sendto( fd, request, nlh->nlmsg_len, 0, (sockaddr *)&kernel, sizeof( kernel ) ) < 0 )
+        {
+            if ( mustSucceed )
+                throw std::string( "Unable to configure NFLOG group: " ) + strerror( errno );
+            return;
+        }
+
+        // Wait for the ack, skipping any log packets that are already queued.
+        while ( true )
+        {
+            ssize_t n = recv( fd, &buffer[0], buffer.size(), 0 );
+            if ( n < 0 )
+            {
+                if ( errno == EINTR || errno == ENOBUFS )
+                    continue;
+                if ( mustSucceed )
+                    throw std::string( "Unable to configure NFLOG group: " ) + strerror( errno );
+                return;
+            }
+            int remaining = (int)n;
+            for ( nlmsghdr const * reply = (nlmsghdr const *)&buffer[0]; NLMSG_OK( reply, remaining ); reply = NLMSG_NEXT( reply, remaining ) )
+            {
+                if ( reply->nlmsg_type == NLMSG_ERROR && reply->nlmsg_seq == seq )
+                {
+                    nlmsgerr const * err = (nlmsgerr const *)NLMSG_DATA( reply );
+                    if ( err->error != 0 && mustSucceed )
+                    {
+                        throw std::string( "Unable to configure NFLOG group: " ) + strerror( -err->error );
+                    }
+                    return;
+                }
+            }
+        }
+    }
+};
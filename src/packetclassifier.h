@@ -0,0 +1,318 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "firewall.h"
+#include "portintervals.h"
+#include "zoneaddressindex.h"
+
+/*!
+**  \brief Answers "what would the firewall do with this packet?" without
+**         applying it.
+**
+**  The zone to zone rules come from GuardPuppyFireWall::walkFilterRules(),
+**  the walk the script itself is written from, and are compiled per chain and
+**  protocol into PortIntervals.  Zones are found with a ZoneAddressIndex.
+**  The fixed rules of the script around them (loopback, DHCP, established
+**  connections, critical ICMP, srcfilt and the split chains) are modelled
+**  here in the same order as writeIPTablesFirewall() writes them.
+**
+**  The script learns the firewall's own addresses when it runs, so they have
+**  to be given with addLocalAddress().  Interfaces aren't known either: every
+**  packet is taken to arrive on an interface nicfilt accepts, and the DHCP
+**  rules to apply on any interface.
+**
+**  Each result also counts the rules the packet is checked against in the
+**  chains that depend on the zones: srcfilt, the split chain and the zone
+**  to zone chain.  The fixed rules ahead of them cost every packet the same.
+*/
+class PacketClassifier
+{
+public:
+    enum ConnectionState { NEW, ESTABLISHED, RELATED, INVALID };
+    enum Verdict { ACCEPT, DROP, REJECT };
+
+    /*!
+    **  \brief A packet to classify.  For ICMP sport is the type and dport the
+    **         code.  Addresses are in host byte order.
+    */
+    struct Packet
+    {
+        uint32_t src;
+        uint32_t dst;
+        uint8_t protocol;
+        uint8_t state;          // ConnectionState
+        uint16_t sport;
+        uint16_t dport;
+    };
+
+    struct Result
+    {
+        uint8_t verdict;        // Verdict
+        bool logged;
+        uint16_t fromZone;
+        uint16_t toZone;
+        uint32_t rules;         // zone chain rules checked, 0 if accepted before srcfilt
+    };
+
+private:
+    struct PortRule
+    {
+        uint sportStart;
+        uint sportEnd;
+        uint dportStart;
+        uint dportEnd;
+        bool newOnly;           // TCP rules only match new connections
+        uint8_t verdict;
+        bool logged;
+        uint32_t position;      // in the chain
+    };
+
+    struct ProtocolRule
+    {
+        uint8_t protocol;
+        int icmpType;           // -1 for any protocol but ICMP
+        int icmpCode;           // -1 for any code
+        uint8_t verdict;
+        bool logged;
+        uint32_t position;
+    };
+
+    struct Chain
+    {
+        PortIntervals< PortRule > tcp;
+        PortIntervals< PortRule > udp;
+        std::vector< ProtocolRule > others;
+        bool endLogged;
+        uint32_t length;        // rules before the final DROP
+
+        Chain() : endLogged( false ), length( 0 ) {}
+    };
+
+    /*!
+    **  \brief walkFilterRules() sink compiling the rules into the chains
+    */
+    class RuleCompiler
+    {
+        PacketClassifier & classifier;
+        std::ostream nowhere;
+
+    public:
+        RuleCompiler( PacketClassifier & _classifier )
+         : classifier( _classifier ), nowhere( 0 )
+        {
+        }
+
+        std::ostream & comment()
+        {
+            return nowhere;
+        }
+
+        void rule( std::string const & fromzone, PortRangeInfo * fromzonePRI, std::string const & tozone, PortRangeInfo * tozonePRI,
+                ProtocolNetUse const & netuse, Zone::ProtocolState state = Zone::PERMIT, bool log = false )
+        {
+            Chain & chain = classifier.chain( classifier.zoneIds[fromzone], classifier.zoneIds[tozone] );
+            uint8_t verdict = state == Zone::PERMIT ? ACCEPT : state == Zone::DENY ? DROP :
+                ( netuse.getType() == IPPROTO_TCP || netuse.getType() == IPPROTO_UDP ) ? REJECT : DROP;
+            bool logged = state != Zone::PERMIT && log;
+
+            if ( netuse.getType() == IPPROTO_TCP || netuse.getType() == IPPROTO_UDP )
+            {
+                PortRule r;
+                r.sportStart = netuse.sourcedetail.getStart( fromzonePRI );
+                r.sportEnd = netuse.sourcedetail.getEnd( fromzonePRI );
+                r.dportStart = netuse.destdetail.getStart( tozonePRI );
+                r.dportEnd = netuse.destdetail.getEnd( tozonePRI );
+                r.newOnly = netuse.getType() == IPPROTO_TCP;
+                r.verdict = verdict;
+                r.logged = logged;
+                r.position = chain.length++;
+                ( netuse.getType() == IPPROTO_TCP ? chain.tcp : chain.udp ).add( r );
+            }
+            else
+            {
+                ProtocolRule r;
+                r.protocol = netuse.getType();
+                r.icmpType = netuse.getType() == IPPROTO_ICMP ? (int)netuse.sourcedetail.getType() : -1;
+                r.icmpCode = netuse.getType() == IPPROTO_ICMP ? netuse.sourcedetail.getCode() : -1;
+                r.verdict = verdict;
+                r.logged = logged;
+                r.position = chain.length++;
+                chain.others.push_back( r );
+            }
+        }
+
+        void chainEnd( std::string const & fromzone, std::string const & tozone, bool logged )
+        {
+            classifier.chain( classifier.zoneIds[fromzone], classifier.zoneIds[tozone] ).endLogged = logged;
+        }
+    };
+
+    ZoneAddressIndex zones;
+    std::map< std::string, uint16_t > zoneIds;
+    std::vector< Chain > chains;                // [ from * zoneCount + to ]
+    std::vector< uint32_t > localAddresses;     // sorted
+    bool disabled;
+    bool dhcpc;
+    bool dhcpd;
+    bool logdrop;
+
+    Chain & chain( uint16_t from, uint16_t to )
+    {
+        return chains[ from * zones.zoneCount() + to ];
+    }
+
+    bool isLocalAddress( uint32_t address ) const
+    {
+        return std::binary_search( localAddresses.begin(), localAddresses.end(), address );
+    }
+
+    static bool isUDP( Packet const & p, uint sport, uint dport )
+    {
+        return p.protocol == IPPROTO_UDP && p.sport == sport && p.dport == dport;
+    }
+
+    static void setResult( Result & result, Verdict verdict, bool logged )
+    {
+        result.verdict = verdict;
+        result.logged = logged;
+    }
+
+    void classifyChain( Packet const & p, Chain const & c, Result & result ) const
+    {
+        if ( p.protocol == IPPROTO_TCP || p.protocol == IPPROTO_UDP )
+        {
+            PortIntervals< PortRule > const & rules = p.protocol == IPPROTO_TCP ? c.tcp : c.udp;
+            std::pair< uint32_t const *, uint32_t const * > found = rules.find( p.dport );
+            for ( uint32_t const * i = found.first; i != found.second; i++ )
+            {
+                PortRule const * r = &rules[*i];
+                if ( p.sport >= r->sportStart && p.sport <= r->sportEnd && ( !r->newOnly || p.state == NEW ) )
+                {
+                    setResult( result, (Verdict)r->verdict, r->logged );
+                    result.rules += r->position + 1;
+                    return;
+                }
+            }
+        }
+        else
+        {
+            BOOST_FOREACH( ProtocolRule const & r, c.others )
+            {
+                if ( r.protocol != p.protocol )
+                    continue;
+                if ( r.protocol == IPPROTO_ICMP && ( r.icmpType != p.sport || ( r.icmpCode != -1 && r.icmpCode != p.dport ) ) )
+                    continue;
+                setResult( result, (Verdict)r.verdict, r.logged );
+                result.rules += r.position + 1;
+                return;
+            }
+        }
+        setResult( result, DROP, c.endLogged && logdrop );
+        result.rules += c.length + 1;
+    }
+
+public:
+    PacketClassifier( GuardPuppyFireWall & firewall )
+     : zones( firewall )
+    {
+        for ( uint16_t z = 0; z < zones.zoneCount(); z++ )
+            zoneIds[ zones.zoneName( z ) ] = z;
+        chains.resize( zones.zoneCount() * zones.zoneCount() );
+
+        disabled = firewall.isDisabled();
+        dhcpc = firewall.isDHCPcEnabled();
+        dhcpd = firewall.isDHCPdEnabled();
+        logdrop = firewall.isLogDrop();
+
+        RuleCompiler compiler( *this );
+        firewall.walkFilterRules( compiler );
+        BOOST_FOREACH( Chain & c, chains )
+        {
+            c.tcp.build();
+            c.udp.build();
+        }
+    }
+
+    /*!
+    **  \brief Add one of the firewall's own addresses, in host byte order
+    */
+    void addLocalAddress( uint32_t address )
+    {
+        localAddresses.insert( std::upper_bound( localAddresses.begin(), localAddresses.end(), address ), address );
+    }
+
+    Result classify( Packet const & p ) const
+    {
+        Result result;
+        result.fromZone = result.toZone = zones.getLocalZone();
+        result.rules = 0;
+        setResult( result, ACCEPT, false );
+        if ( disabled )
+            return result;
+
+        bool fromLocal = isLocalAddress( p.src );
+        bool toLocal = isLocalAddress( p.dst );
+        if ( fromLocal && toLocal )
+            return result;                                              // loopback
+
+        // srcfilt, or the OUTPUT chain straight to Local, then the split
+        // chain of the source zone, which tries the local addresses first
+        uint32_t srcRules = 0;
+        uint32_t splitRules = 0;
+        uint16_t from = fromLocal ? zones.getLocalZone() : zones.lookup( p.src, -1, &srcRules );
+        uint16_t to;
+        if ( toLocal )
+        {
+            to = zones.getLocalZone();
+            splitRules = std::lower_bound( localAddresses.begin(), localAddresses.end(), p.dst ) - localAddresses.begin();
+        }
+        else
+        {
+            to = zones.lookup( p.dst, from, &splitRules );
+            splitRules += fromLocal ? 0 : localAddresses.size();
+        }
+        result.fromZone = from;
+        result.toZone = to;
+
+        if ( ( dhcpc && ( ( toLocal && isUDP( p, 67, 68 ) ) || ( fromLocal && isUDP( p, 68, 67 ) ) ) )
+          || ( dhcpd && ( ( toLocal && isUDP( p, 68, 67 ) ) || ( fromLocal && isUDP( p, 67, 68 ) ) ) ) )
+            return result;
+
+        if ( p.state == ESTABLISHED || p.state == RELATED )
+            return result;
+        if ( p.protocol == IPPROTO_ICMP && ( p.sport == 3 || p.sport == 11 || p.sport == 12 ) )
+            return result;                                              // critical ICMP
+
+        result.rules = ( fromLocal ? 0 : srcRules + 1 ) + splitRules + 1;
+        if ( from == zones.getInternetZone() && to == zones.getInternetZone() )
+        {
+            setResult( result, DROP, logdrop );                         // Internet to Internet
+            return result;
+        }
+
+        classifyChain( p, chains[ from * zones.zoneCount() + to ], result );
+        return result;
+    }
+
+    /*!
+    **  \brief Classify every packet between begin and end into results
+    */
+    void classify( Packet const * begin, Packet const * end, Result * results ) const
+    {
+        for ( ; begin != end; ++begin, ++results )
+            *results = classify( *begin );
+    }
+
+    ZoneAddressIndex const & getZoneIndex() const { return zones; }
+};
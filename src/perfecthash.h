@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+/*!
+**  \brief Tells which of a fixed set of keys a text is with one hash and
+**         at most one comparison
+**
+**  When the set is built a seed is searched for that gives every key a
+**  slot of its own, doubling the table if no seed does.  Keys are looked up
+**  straight from the text they're in, nothing is copied.
+*/
+class PerfectHash
+{
+    std::vector< std::string > keys;
+    std::vector< int > slots;       // index into keys, -1 for none
+    uint32_t seed;
+
+    size_t slot( char const * p, char const * end ) const
+    {
+        uint32_t h = 2166136261u ^ seed;       // FNV-1a
+        for ( ; p != end; ++p )
+        {
+            h ^= (unsigned char)*p;
+            h *= 16777619u;
+        }
+        return ( h ^ ( h >> 15 ) ) & ( slots.size() - 1 );
+    }
+
+    bool place()
+    {
+        slots.assign( slots.size(), -1 );
+        for ( size_t i = 0; i < keys.size(); i++ )
+        {
+            size_t s = slot( keys[i].data(), keys[i].data() + keys[i].size() );
+            if ( slots[s] != -1 )
+                return false;
+            slots[s] = i;
+        }
+        return true;
+    }
+
+public:
+    PerfectHash( char const * const * _keys, size_t count )
+     : keys( _keys, _keys + count ), slots( 1 ), seed( 0 )
+    {
+        while ( slots.size() < 2 * count )
+            slots.resize( slots.size() * 2 );
+        while ( true )
+        {
+            for ( seed = 0; seed < 1000; seed++ )
+            {
+                if ( place() )
+                    return;
+            }
+            slots.resize( slots.size() * 2 );
+        }
+    }
+
+    /*!
+    **  \brief Index of the key between begin and end, -1 if it isn't one
+    */
+    int find( char const * begin, char const * end ) const
+    {
+        int i = slots[ slot( begin, end ) ];
+        if ( i < 0 || keys[i].size() != (size_t)( end - begin ) || memcmp( keys[i].data(), begin, end - begin ) != 0 )
+            return -1;
+        return i;
+    }
+};
@@ -0,0 +1,564 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "firewall.h"
+#include "packetclassifier.h"
+#include "zoneaddressindex.h"
+
+/*!
+**  \brief Decides whether two firewalls treat every new connection the same,
+**         and where they don't.
+**
+**  Nothing is enumerated.  Both address spaces are cut into regions on
+**  which every zone lookup, including those of the split chains, gives the
+**  same answer (ZoneAddressIndex::regions()), and the regions of the two
+**  firewalls are overlaid.  Every source and destination of one combined
+**  class then goes through the same pair of zone to zone chains.  The
+**  chains of each pair that occurs are compared by cutting the port space
+**  at every port any of their rules mentions and checking one port of each
+**  piece.  The cost grows with the number of networks and rules, not with
+**  the number of addresses.
+**
+**  The firewall's own addresses are the Local zone in both; which addresses
+**  those are doesn't matter.  Established connections, loopback and the
+**  critical ICMP types are accepted alike by every guard-puppy firewall and
+**  are not compared.  Members given by name are not known until the script
+**  runs, see ZoneAddressIndex::skippedMembers().
+*/
+class PolicyEquivalence
+{
+public:
+    /*!
+    **  \brief A block of the protocol and port space both firewalls treat
+    **         uniformly, but differently from each other.
+    **
+    **  For ICMP the source range holds the type and the destination range
+    **  the code, for the other protocols without ports both ranges are
+    **  0:65535.
+    */
+    struct PortRegion
+    {
+        uint8_t protocolFirst;
+        uint8_t protocolLast;
+        uint sportFirst;
+        uint sportLast;
+        uint dportFirst;
+        uint dportLast;
+        uint8_t verdictA;       // PacketClassifier::Verdict
+        uint8_t verdictB;
+    };
+
+    struct AddressRange
+    {
+        uint32_t first;
+        uint32_t last;
+    };
+
+    /*!
+    **  \brief Traffic from any of sources to any of destinations, for which
+    **         the firewalls disagree on ports.
+    **
+    **  The address ranges are empty for the firewall itself.
+    */
+    struct Difference
+    {
+        std::string fromA;
+        std::string toA;
+        std::string fromB;
+        std::string toB;
+        std::vector< AddressRange > sources;
+        std::vector< AddressRange > destinations;
+        std::vector< PortRegion > ports;
+    };
+
+private:
+    struct Rule
+    {
+        uint8_t protocol;
+        uint sportStart;
+        uint sportEnd;
+        uint dportStart;
+        uint dportEnd;
+        int icmpType;           // -1 for any protocol but ICMP
+        int icmpCode;           // -1 for any code
+        uint8_t verdict;
+    };
+
+    /*!
+    **  \brief What of a firewall matters to new connections
+    */
+    class Model
+    {
+        /*!
+        **  \brief walkFilterRules() sink keeping the rules of every chain in order
+        */
+        class RuleCollector
+        {
+            Model & model;
+            std::ostream nowhere;
+
+        public:
+            RuleCollector( Model & _model )
+             : model( _model ), nowhere( 0 )
+            {
+            }
+
+            std::ostream & comment()
+            {
+                return nowhere;
+            }
+
+            void rule( std::string const & fromzone, PortRangeInfo * fromzonePRI, std::string const & tozone, PortRangeInfo * tozonePRI,
+                    ProtocolNetUse const & netuse, Zone::ProtocolState state = Zone::PERMIT, bool = false )
+            {
+                bool ports = netuse.getType() == IPPROTO_TCP || netuse.getType() == IPPROTO_UDP;
+                Rule r;
+                r.protocol = netuse.getType();
+                r.sportStart = ports ? netuse.sourcedetail.getStart( fromzonePRI ) : 0;
+                r.sportEnd = ports ? netuse.sourcedetail.getEnd( fromzonePRI ) : 65535;
+                r.dportStart = ports ? netuse.destdetail.getStart( tozonePRI ) : 0;
+                r.dportEnd = ports ? netuse.destdetail.getEnd( tozonePRI ) : 65535;
+                r.icmpType = netuse.getType() == IPPROTO_ICMP ? (int)netuse.sourcedetail.getType() : -1;
+                r.icmpCode = netuse.getType() == IPPROTO_ICMP ? netuse.sourcedetail.getCode() : -1;
+                r.verdict = state == Zone::PERMIT ? PacketClassifier::ACCEPT : state == Zone::DENY ? PacketClassifier::DROP :
+                    ports ? PacketClassifier::REJECT : PacketClassifier::DROP;
+                model.chains[ model.ids[fromzone] * model.zones.zoneCount() + model.ids[tozone] ].push_back( r );
+            }
+
+            void chainEnd( std::string const &, std::string const &, bool )
+            {
+            }
+        };
+
+    public:
+        ZoneAddressIndex zones;
+        std::map< std::string, uint16_t > ids;
+        std::vector< std::vector< Rule > > chains;      // [ from * zoneCount + to ]
+        std::vector< ZoneAddressIndex::Region > regions;
+        bool disabled;
+        bool dhcpc;
+        bool dhcpd;
+
+        Model( GuardPuppyFireWall & firewall )
+         : zones( firewall )
+        {
+            for ( uint16_t z = 0; z < zones.zoneCount(); z++ )
+                ids[ zones.zoneName( z ) ] = z;
+            chains.resize( zones.zoneCount() * zones.zoneCount() );
+            disabled = firewall.isDisabled();
+            dhcpc = firewall.isDHCPcEnabled();
+            dhcpd = firewall.isDHCPdEnabled();
+            RuleCollector collector( *this );
+            firewall.walkFilterRules( collector );
+            zones.regions( regions );
+        }
+
+        /*!
+        **  \brief The verdict on a new packet from zone from to zone to.  For
+        **         ICMP sport is the type and dport the code.
+        */
+        uint8_t verdict( uint16_t from, uint16_t to, uint protocol, uint sport, uint dport ) const
+        {
+            if ( disabled )
+                return PacketClassifier::ACCEPT;
+            if ( protocol == IPPROTO_ICMP && ( sport == 3 || sport == 11 || sport == 12 ) )
+                return PacketClassifier::ACCEPT;
+            if ( protocol == IPPROTO_UDP )
+            {
+                bool toLocal = to == zones.getLocalZone();
+                bool fromLocal = from == zones.getLocalZone();
+                if ( ( dhcpc && ( ( toLocal && sport == 67 && dport == 68 ) || ( fromLocal && sport == 68 && dport == 67 ) ) )
+                  || ( dhcpd && ( ( toLocal && sport == 68 && dport == 67 ) || ( fromLocal && sport == 67 && dport == 68 ) ) ) )
+                    return PacketClassifier::ACCEPT;
+            }
+            if ( from == to )
+                return PacketClassifier::DROP;                  // Internet to Internet
+
+            BOOST_FOREACH( Rule const & r, chains[ from * zones.zoneCount() + to ] )
+            {
+                if ( r.protocol != protocol )
+                    continue;
+                if ( protocol == IPPROTO_ICMP )
+                {
+                    if ( r.icmpType == (int)sport && ( r.icmpCode == -1 || r.icmpCode == (int)dport ) )
+                        return r.verdict;
+                }
+                else if ( sport >= r.sportStart && sport <= r.sportEnd && dport >= r.dportStart && dport <= r.dportEnd )
+                {
+                    return r.verdict;
+                }
+            }
+            return PacketClassifier::DROP;
+        }
+
+        std::vector< Rule > const & chain( uint16_t from, uint16_t to ) const
+        {
+            return chains[ from * zones.zoneCount() + to ];
+        }
+    };
+
+    /*!
+    **  \brief A zone pair of each firewall
+    */
+    struct Route
+    {
+        uint16_t fromA;
+        uint16_t toA;
+        uint16_t fromB;
+        uint16_t toB;
+
+        uint64_t key() const
+        {
+            return ( (uint64_t)fromA << 48 ) | ( (uint64_t)toA << 32 ) | ( (uint64_t)fromB << 16 ) | toB;
+        }
+    };
+
+    Model a;
+    Model b;
+    bool verdicts;
+    std::map< uint64_t, std::vector< PortRegion > > compared;    // by Route::key()
+    std::vector< Difference > differences;
+
+    static void appendRange( std::vector< AddressRange > & ranges, uint32_t first, uint32_t last )
+    {
+        if ( !ranges.empty() && (uint64_t)ranges.back().last + 1 == first )
+        {
+            ranges.back().last = last;
+            return;
+        }
+        AddressRange r;
+        r.first = first;
+        r.last = last;
+        ranges.push_back( r );
+    }
+
+    static bool rangeLess( AddressRange const & lhs, AddressRange const & rhs )
+    {
+        return lhs.first < rhs.first;
+    }
+
+    /*!
+    **  \brief Sort ranges and join the ones that touch
+    */
+    static void coalesce( std::vector< AddressRange > & ranges )
+    {
+        std::sort( ranges.begin(), ranges.end(), rangeLess );
+        std::vector< AddressRange > joined;
+        BOOST_FOREACH( AddressRange const & r, ranges )
+            appendRange( joined, r.first, r.last );
+        ranges.swap( joined );
+    }
+
+    bool differ( uint8_t va, uint8_t vb ) const
+    {
+        return verdicts ? va != vb : ( va == PacketClassifier::ACCEPT ) != ( vb == PacketClassifier::ACCEPT );
+    }
+
+    /*!
+    **  \brief Add region to regions, or grow the last one if it simply
+    **         continues it along the source or destination range.
+    */
+    static void appendRegion( std::vector< PortRegion > & regions, PortRegion const & region )
+    {
+        if ( !regions.empty() )
+        {
+            PortRegion & last = regions.back();
+            bool same = last.verdictA == region.verdictA && last.verdictB == region.verdictB;
+            if ( same && last.protocolFirst == region.protocolFirst && last.protocolLast == region.protocolLast
+              && last.sportFirst == region.sportFirst && last.sportLast == region.sportLast && last.dportLast + 1 == region.dportFirst )
+            {
+                last.dportLast = region.dportLast;
+                return;
+            }
+        }
+        regions.push_back( region );
+    }
+
+    /*!
+    **  \brief Merge regions that continue each other along the source range
+    */
+    static void mergeSources( std::vector< PortRegion > & regions )
+    {
+        std::vector< PortRegion > merged;
+        std::map< std::pair< std::pair< uint, uint >, uint >, size_t > open;   // (dport range, verdicts) -> index
+        BOOST_FOREACH( PortRegion const & r, regions )
+        {
+            std::pair< std::pair< uint, uint >, uint > key( std::make_pair( r.dportFirst, r.dportLast ),
+                    ( r.protocolFirst << 16 ) | ( r.verdictA << 8 ) | r.verdictB );
+            std::map< std::pair< std::pair< uint, uint >, uint >, size_t >::iterator it = open.find( key );
+            if ( it != open.end() && merged[it->second].sportLast + 1 == r.sportFirst )
+            {
+                merged[it->second].sportLast = r.sportLast;
+                continue;
+            }
+            open[key] = merged.size();
+            merged.push_back( r );
+        }
+        regions.swap( merged );
+    }
+
+    static void addBounds( std::vector< uint > & bounds, uint first, uint last )
+    {
+        bounds.push_back( first );
+        bounds.push_back( last + 1 );
+    }
+
+    static void finishBounds( std::vector< uint > & bounds, uint limit )
+    {
+        bounds.push_back( 0 );
+        std::sort( bounds.begin(), bounds.end() );
+        bounds.erase( std::unique( bounds.begin(), bounds.end() ), bounds.end() );
+        while ( !bounds.empty() && bounds.back() > limit )
+            bounds.pop_back();
+        bounds.push_back( limit + 1 );
+    }
+
+    void comparePorts( Route const & route, uint8_t protocol, std::vector< PortRegion > & regions ) const
+    {
+        std::vector< uint > sports;
+        std::vector< uint > dports;
+        addBounds( sports, 67, 67 );                    // DHCP
+        addBounds( sports, 68, 68 );
+        addBounds( dports, 67, 67 );
+        addBounds( dports, 68, 68 );
+        std::vector< Rule > const * chains[2] = { &a.chain( route.fromA, route.toA ), &b.chain( route.fromB, route.toB ) };
+        for ( int i = 0; i < 2; i++ )
+        {
+            BOOST_FOREACH( Rule const & r, *chains[i] )
+            {
+                if ( r.protocol != protocol )
+                    continue;
+                addBounds( sports, r.sportStart, r.sportEnd );
+                addBounds( dports, r.dportStart, r.dportEnd );
+            }
+        }
+        finishBounds( sports, 65535 );
+        finishBounds( dports, 65535 );
+
+        std::vector< PortRegion > found;
+        for ( size_t s = 0; s + 1 < sports.size(); s++ )
+        {
+            for ( size_t d = 0; d + 1 < dports.size(); d++ )
+            {
+                PortRegion r;
+                r.protocolFirst = r.protocolLast = protocol;
+                r.sportFirst = sports[s];
+                r.sportLast = sports[s + 1] - 1;
+                r.dportFirst = dports[d];
+                r.dportLast = dports[d + 1] - 1;
+                r.verdictA = a.verdict( route.fromA, route.toA, protocol, r.sportFirst, r.dportFirst );
+                r.verdictB = b.verdict( route.fromB, route.toB, protocol, r.sportFirst, r.dportFirst );
+                if ( differ( r.verdictA, r.verdictB ) )
+                    appendRegion( found, r );
+            }
+        }
+        mergeSources( found );
+        regions.insert( regions.end(), found.begin(), found.end() );
+    }
+
+    void compareICMP( Route const & route, std::vector< PortRegion > & regions ) const
+    {
+        std::vector< Rule > const * chains[2] = { &a.chain( route.fromA, route.toA ), &b.chain( route.fromB, route.toB ) };
+        std::vector< PortRegion > found;
+        for ( uint type = 0; type < 256; type++ )
+        {
+            std::vector< uint > codes;
+            for ( int i = 0; i < 2; i++ )
+            {
+                BOOST_FOREACH( Rule const & r, *chains[i] )
+                {
+                    if ( r.protocol == IPPROTO_ICMP && r.icmpType == (int)type && r.icmpCode != -1 )
+                        addBounds( codes, r.icmpCode, r.icmpCode );
+                }
+            }
+            finishBounds( codes, 255 );
+            for ( size_t c = 0; c + 1 < codes.size(); c++ )
+            {
+                PortRegion r;
+                r.protocolFirst = r.protocolLast = IPPROTO_ICMP;
+                r.sportFirst = r.sportLast = type;
+                r.dportFirst = codes[c];
+                r.dportLast = codes[c + 1] - 1;
+                r.verdictA = a.verdict( route.fromA, route.toA, IPPROTO_ICMP, type, r.dportFirst );
+                r.verdictB = b.verdict( route.fromB, route.toB, IPPROTO_ICMP, type, r.dportFirst );
+                if ( differ( r.verdictA, r.verdictB ) )
+                    appendRegion( found, r );
+            }
+        }
+        mergeSources( found );
+        regions.insert( regions.end(), found.begin(), found.end() );
+    }
+
+    void compareOtherProtocols( Route const & route, std::vector< PortRegion > & regions ) const
+    {
+        for ( uint protocol = 0; protocol < 256; protocol++ )
+        {
+            if ( protocol == IPPROTO_TCP || protocol == IPPROTO_UDP || protocol == IPPROTO_ICMP )
+                continue;
+            PortRegion r;
+            r.protocolFirst = r.protocolLast = protocol;
+            r.sportFirst = r.dportFirst = 0;
+            r.sportLast = r.dportLast = 65535;
+            r.verdictA = a.verdict( route.fromA, route.toA, protocol, 0, 0 );
+            r.verdictB = b.verdict( route.fromB, route.toB, protocol, 0, 0 );
+            if ( !differ( r.verdictA, r.verdictB ) )
+                continue;
+            if ( !regions.empty() )
+            {
+                PortRegion & last = regions.back();
+                if ( last.protocolLast + 1u == protocol && last.protocolFirst != IPPROTO_TCP && last.protocolFirst != IPPROTO_UDP
+                  && last.protocolFirst != IPPROTO_ICMP && last.verdictA == r.verdictA && last.verdictB == r.verdictB )
+                {
+                    last.protocolLast = protocol;
+                    continue;
+                }
+            }
+            regions.push_back( r );
+        }
+    }
+
+    std::vector< PortRegion > const & compare( Route const & route )
+    {
+        std::map< uint64_t, std::vector< PortRegion > >::iterator it = compared.find( route.key() );
+        if ( it != compared.end() )
+            return it->second;
+
+        std::vector< PortRegion > & regions = compared[ route.key() ];
+        comparePorts( route, IPPROTO_TCP, regions );
+        comparePorts( route, IPPROTO_UDP, regions );
+        compareICMP( route, regions );
+        compareOtherProtocols( route, regions );
+        return regions;
+    }
+
+    void addDifference( Route const & route, std::vector< AddressRange > const & sources, std::vector< AddressRange > const & destinations )
+    {
+        std::vector< PortRegion > const & ports = compare( route );
+        if ( ports.empty() )
+            return;
+        Difference d;
+        d.fromA = a.zones.zoneName( route.fromA );
+        d.toA = a.zones.zoneName( route.toA );
+        d.fromB = b.zones.zoneName( route.fromB );
+        d.toB = b.zones.zoneName( route.toB );
+        d.sources = sources;
+        d.destinations = destinations;
+        d.ports = ports;
+        differences.push_back( d );
+    }
+
+public:
+    /*!
+    **  \brief Compare firewalls a and b.  With verdicts set a DROP and a
+    **         REJECT differ too, otherwise only whether a packet gets
+    **         through counts.
+    */
+    PolicyEquivalence( GuardPuppyFireWall & _a, GuardPuppyFireWall & _b, bool _verdicts = false )
+     : a( _a ), b( _b ), verdicts( _verdicts )
+    {
+        // Overlay the regions of both firewalls; one class per combination
+        // of answers, (zone, runnerUp) in a then in b.
+        typedef std::map< uint64_t, std::vector< AddressRange > > Classes;
+        Classes classes;
+        size_t i = 0;
+        size_t j = 0;
+        uint64_t address = 0;
+        while ( address < ( (uint64_t)1 << 32 ) )
+        {
+            while ( i + 1 < a.regions.size() && a.regions[i + 1].start <= address )
+                i++;
+            while ( j + 1 < b.regions.size() && b.regions[j + 1].start <= address )
+                j++;
+            uint64_t end = (uint64_t)1 << 32;
+            if ( i + 1 < a.regions.size() )
+                end = std::min< uint64_t >( end, a.regions[i + 1].start );
+            if ( j + 1 < b.regions.size() )
+                end = std::min< uint64_t >( end, b.regions[j + 1].start );
+
+            uint64_t key = ( (uint64_t)a.regions[i].zone << 48 ) | ( (uint64_t)a.regions[i].runnerUp << 32 )
+                | ( (uint64_t)b.regions[j].zone << 16 ) | b.regions[j].runnerUp;
+            appendRange( classes[key], address, end - 1 );
+            address = end;
+        }
+
+        std::vector< AddressRange > local;              // the firewall itself
+        Route route;
+
+        // from the firewall itself
+        route.fromA = a.zones.getLocalZone();
+        route.fromB = b.zones.getLocalZone();
+        std::map< uint32_t, std::vector< AddressRange > > destinations;
+        for ( Classes::const_iterator c = classes.begin(); c != classes.end(); ++c )
+        {
+            uint32_t to = ( ( c->first >> 48 ) << 16 ) | ( ( c->first >> 16 ) & 0xffff );
+            std::vector< AddressRange > & ranges = destinations[to];
+            ranges.insert( ranges.end(), c->second.begin(), c->second.end() );
+        }
+        for ( std::map< uint32_t, std::vector< AddressRange > >::iterator d = destinations.begin(); d != destinations.end(); ++d )
+        {
+            coalesce( d->second );
+            route.toA = d->first >> 16;
+            route.toB = d->first & 0xffff;
+            addDifference( route, local, d->second );
+        }
+
+        // from every class of sources
+        std::map< uint32_t, std::vector< AddressRange > > sources;
+        for ( Classes::const_iterator c = classes.begin(); c != classes.end(); ++c )
+        {
+            uint32_t from = ( ( c->first >> 48 ) << 16 ) | ( ( c->first >> 16 ) & 0xffff );
+            std::vector< AddressRange > & ranges = sources[from];
+            ranges.insert( ranges.end(), c->second.begin(), c->second.end() );
+        }
+        for ( std::map< uint32_t, std::vector< AddressRange > >::iterator s = sources.begin(); s != sources.end(); ++s )
+        {
+            coalesce( s->second );
+            route.fromA = s->first >> 16;
+            route.fromB = s->first & 0xffff;
+
+            route.toA = a.zones.getLocalZone();
+            route.toB = b.zones.getLocalZone();
+            addDifference( route, s->second, local );
+
+            // the split chain of the source zone skips the zone itself
+            destinations.clear();
+            for ( Classes::const_iterator c = classes.begin(); c != classes.end(); ++c )
+            {
+                uint16_t zoneA = c->first >> 48;
+                uint16_t runnerUpA = ( c->first >> 32 ) & 0xffff;
+                uint16_t zoneB = ( c->first >> 16 ) & 0xffff;
+                uint16_t runnerUpB = c->first & 0xffff;
+                uint32_t to = ( (uint32_t)( zoneA != route.fromA ? zoneA : runnerUpA ) << 16 ) | ( zoneB != route.fromB ? zoneB : runnerUpB );
+                std::vector< AddressRange > & ranges = destinations[to];
+                ranges.insert( ranges.end(), c->second.begin(), c->second.end() );
+            }
+            for ( std::map< uint32_t, std::vector< AddressRange > >::iterator d = destinations.begin(); d != destinations.end(); ++d )
+            {
+                coalesce( d->second );
+                route.toA = d->first >> 16;
+                route.toB = d->first & 0xffff;
+                addDifference( route, s->second, d->second );
+            }
+        }
+    }
+
+    bool equivalent() const { return differences.empty(); }
+    std::vector< Difference > const & getDifferences() const { return differences; }
+
+    /*!
+    **  \brief The number of members of both firewalls given by name, which
+    **         were left out of the comparison
+    */
+    size_t skippedMembers() const { return a.zones.skippedMembers() + b.zones.skippedMembers(); }
+};
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "atomicfile.h"
+#include "iprange.h"
+#include "mappedfile.h"
+#include "snapshothash.h"
+#include "zone.h"
+
+/*!
+**  \brief A saved firewall in a form that is read by mapping it, without
+**         parsing anything.
+**
+**  The file is a Header and then a body of 32 bit words in sections.  Strings
+**  are numbers into the string table.  All counts come first in their
+**  section:
+**
+**  - STRINGS: count, count + 1 offsets into the characters, the characters
+**  - SETTINGS: description, count, then key and value for each [Config]
+**    line, key being its place in the [Config] keys of readFirewall()
+**  - ZONES: count, then name, comment, definition, first address and address
+**    count for each user zone, in order
+**  - ADDRESSES: count, then text and type | mask << 8 for each address, each
+**    zone's in its order
+**  - PROTOCOLS: count, then for each user defined protocol its name and
+**    network count followed by type, start port, end port and
+**    bidirectional for each network
+**  - POLICY: zone count, the names of all zones in order, then for each zone
+**    and each other zone the flags, state count and protocol name and state
+**    of each state, in the order of the [ToZone] sections
+**
+**  The header keeps a hash of the body and of the script the snapshot was
+**  taken with, up to and including its "# [End]" line.
+*/
+class PolicySnapshot
+{
+public:
+    enum Section { STRINGS, SETTINGS, ZONES, ADDRESSES, PROTOCOLS, POLICY, SECTION_COUNT };
+
+    enum PairFlags { CONNECTED = 1, FASTPATH = 2, QUIET = 4 };
+
+    static uint32_t const VERSION = 2;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;                 // 0x01020304 as written
+        uint64_t scriptSize;
+        uint64_t scriptHash;
+        uint64_t bodyHash;
+        uint32_t bodyWords;
+        uint32_t sections[ SECTION_COUNT ]; // where each section starts in the body
+    };
+
+    static char const * magic() { return "GPSNAP\r\n"; }
+
+    /*!
+    **  \brief Reads the words of one section in turn
+    */
+    class Cursor
+    {
+        uint32_t const * p;
+        uint32_t const * end;
+
+    public:
+        Cursor( uint32_t const * begin, uint32_t const * _end )
+         : p( begin ), end( _end )
+        {
+        }
+
+        uint32_t next()
+        {
+            if ( p == end )
+                throw std::string( "Snapshot section ends too soon" );
+            return *p++;
+        }
+    };
+
+private:
+    MappedFile file;
+    Header header;
+    uint32_t const * body;
+    uint32_t stringCount;
+    uint32_t const * stringOffsets;
+    char const * chars;
+    uint32_t charCount;
+    uint32_t addressCount;
+    uint32_t const * addresses;
+
+    PolicySnapshot( PolicySnapshot const & );
+    PolicySnapshot & operator=( PolicySnapshot const & );
+
+    uint32_t sectionEnd( Section s ) const
+    {
+        return s + 1 == SECTION_COUNT ? header.bodyWords : header.sections[ s + 1 ];
+    }
+
+public:
+    /*!
+    **  \brief Map the snapshot in filename and check that it is whole
+    */
+    explicit PolicySnapshot( std::string const & filename )
+     : file( filename )
+    {
+        if ( file.size() < sizeof( header ) )
+            throw std::string( "Snapshot too short" );
+        memcpy( &header, file.begin(), sizeof( header ) );
+        if ( memcmp( header.magic, magic(), sizeof( header.magic ) ) != 0 )
+            throw std::string( "Not a snapshot" );
+        if ( header.version != VERSION || header.byteOrder != 0x01020304 )
+            throw std::string( "Snapshot of another version" );
+        if ( ( file.size() - sizeof( header ) ) / 4 != header.bodyWords || ( file.size() - sizeof( header ) ) % 4 != 0 )
+            throw std::string( "Snapshot of the wrong size" );
+        body = reinterpret_cast< uint32_t const * >( file.begin() + sizeof( header ) );
+        if ( snapshotHash( reinterpret_cast< char const * >( body ), header.bodyWords * 4 ) != header.bodyHash )
+            throw std::string( "Snapshot damaged" );
+        for ( int s = 0; s < SECTION_COUNT; s++ )
+        {
+            if ( header.sections[s] > sectionEnd( Section( s ) ) || sectionEnd( Section( s ) ) > header.bodyWords )
+                throw std::string( "Snapshot sections out of order" );
+        }
+
+        Cursor strings = cursor( STRINGS );
+        stringCount = strings.next();
+        if ( stringCount >= sectionEnd( STRINGS ) - header.sections[ STRINGS ] - 1 )
+            throw std::string( "Snapshot string table too short" );
+        stringOffsets = body + header.sections[ STRINGS ] + 1;
+        chars = reinterpret_cast< char const * >( stringOffsets + stringCount + 1 );
+        charCount = ( sectionEnd( STRINGS ) - header.sections[ STRINGS ] - 1 - stringCount - 1 ) * 4;
+        for ( uint32_t i = 0; i < stringCount; i++ )
+        {
+            if ( stringOffsets[i] > stringOffsets[ i + 1 ] )
+                throw std::string( "Snapshot string table out of order" );
+        }
+        if ( stringOffsets[ stringCount ] > charCount )
+            throw std::string( "Snapshot string table too short" );
+
+        Cursor addressWords = cursor( ADDRESSES );
+        addressCount = addressWords.next();
+        if ( addressCount > ( sectionEnd( ADDRESSES ) - header.sections[ ADDRESSES ] - 1 ) / 2 )
+            throw std::string( "Snapshot address table too short" );
+        addresses = body + header.sections[ ADDRESSES ] + 1;
+        for ( uint32_t i = 0; i < addressCount; i++ )
+        {
+            if ( addresses[ 2 * i ] >= stringCount || ( addresses[ 2 * i + 1 ] & 0xff ) > ipinterval )
+                throw std::string( "Snapshot address out of range" );
+        }
+    }
+
+    uint64_t getScriptSize() const { return header.scriptSize; }
+    uint64_t getScriptHash() const { return header.scriptHash; }
+
+    Cursor cursor( Section s ) const
+    {
+        return Cursor( body + header.sections[s], body + sectionEnd( s ) );
+    }
+
+    std::string string( uint32_t id ) const
+    {
+        if ( id >= stringCount )
+            throw std::string( "Snapshot string out of range" );
+        return std::string( chars + stringOffsets[id], chars + stringOffsets[ id + 1 ] );
+    }
+
+    /*!
+    **  \brief Check that count addresses from first are in the snapshot
+    */
+    void checkAddresses( uint32_t first, uint32_t count ) const
+    {
+        if ( first > addressCount || count > addressCount - first )
+            throw std::string( "Snapshot zone addresses out of range" );
+    }
+
+    /*!
+    **  \brief Add count addresses from first, which checkAddresses() passed,
+    **         to members
+    */
+    void readAddresses( uint32_t first, uint32_t count, std::vector< IPRange > & members ) const
+    {
+        members.reserve( members.size() + count );
+        for ( uint32_t const * a = addresses + 2 * first; a != addresses + 2 * ( first + count ); a += 2 )
+        {
+            members.push_back( IPRange( chars + stringOffsets[ a[0] ], chars + stringOffsets[ a[0] + 1 ],
+                    IPRangeType( a[1] & 0xff ), a[1] >> 8 ) );
+        }
+    }
+};
+
+/*!
+**  \brief The addresses of a zone that are read from a snapshot when they
+**         are first needed
+*/
+class SnapshotMembers : public ZoneMemberSource
+{
+    boost::shared_ptr< PolicySnapshot const > snapshot;
+    uint32_t first;
+    uint32_t count;
+
+public:
+    SnapshotMembers( boost::shared_ptr< PolicySnapshot const > const & _snapshot, uint32_t _first, uint32_t _count )
+     : snapshot( _snapshot ), first( _first ), count( _count )
+    {
+        snapshot->checkAddresses( first, count );
+    }
+
+    void read( std::vector< IPRange > & members ) const
+    {
+        snapshot->readAddresses( first, count, members );
+    }
+};
+
+/*!
+**  \brief Puts a PolicySnapshot together, section by section
+*/
+class PolicySnapshotWriter
+{
+    std::vector< uint32_t > sections[ PolicySnapshot::SECTION_COUNT ];
+    std::vector< uint32_t > stringOffsets;
+    std::string chars;
+    std::map< std::string, uint32_t > interned;
+
+public:
+    PolicySnapshotWriter()
+     : stringOffsets( 1, 0 )
+    {
+    }
+
+    /*!
+    **  \brief Words of section s, to add to
+    */
+    std::vector< uint32_t > & section( PolicySnapshot::Section s )
+    {
+        return sections[s];
+    }
+
+    /*!
+    **  \brief Add s to the string table, every time
+    */
+    uint32_t add( std::string const & s )
+    {
+        chars += s;
+        stringOffsets.push_back( chars.size() );
+        return stringOffsets.size() - 2;
+    }
+
+    /*!
+    **  \brief Add s to the string table once
+    */
+    uint32_t intern( std::string const & s )
+    {
+        std::map< std::string, uint32_t >::iterator i = interned.find( s );
+        if ( i == interned.end() )
+            i = interned.insert( std::make_pair( s, add( s ) ) ).first;
+        return i->second;
+    }
+
+    /*!
+    **  \brief Write the snapshot to filename, taken with the first
+    **         scriptSize bytes of a script hashing to scriptHash
+    */
+    void write( std::string const & filename, uint64_t scriptSize, uint64_t scriptHash )
+    {
+        std::vector< uint32_t > & strings = sections[ PolicySnapshot::STRINGS ];
+        strings.clear();
+        strings.push_back( stringOffsets.size() - 1 );
+        strings.insert( strings.end(), stringOffsets.begin(), stringOffsets.end() );
+        size_t charWords = strings.size();
+        strings.resize( charWords + ( chars.size() + 3 ) / 4 );
+        if ( !chars.empty() )
+            memcpy( &strings[ charWords ], chars.data(), chars.size() );
+
+        PolicySnapshot::Header header;
+        memset( &header, 0, sizeof( header ) );
+        memcpy( header.magic, PolicySnapshot::magic(), sizeof( header.magic ) );
+        header.version = PolicySnapshot::VERSION;
+        header.byteOrder = 0x01020304;
+        header.scriptSize = scriptSize;
+        header.scriptHash = scriptHash;
+
+        std::vector< uint32_t > body;
+        for ( int s = 0; s < PolicySnapshot::SECTION_COUNT; s++ )
+        {
+            header.sections[s] = body.size();
+            body.insert( body.end(), sections[s].begin(), sections[s].end() );
+        }
+        header.bodyWords = body.size();
+        header.bodyHash = snapshotHash( reinterpret_cast< char const * >( body.empty() ? 0 : &body[0] ), body.size() * 4 );
+
+        AtomicFile file( filename, 0600 );
+        file.stream().write( reinterpret_cast< char const * >( &header ), sizeof( header ) );
+        if ( !body.empty() )
+            file.stream().write( reinterpret_cast< char const * >( &body[0] ), body.size() * 4 );
+        file.commit();
+    }
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <set>
+#include <utility>
+#include <vector>
+
+/*!
+**  \brief Finds the items whose port range covers a port in O(log n)
+**
+**  The port ranges, given by each item's dportStart and dportEnd members, are
+**  cut into elementary intervals and every interval lists the indices of the
+**  items covering all of it, in the order they were added.  The intervals are
+**  built in one sweep over the sorted range starts and ends, and a lookup is
+**  then a binary search for the interval.  Add all the items, then call
+**  build().
+*/
+template< class T >
+class PortIntervals
+{
+    typedef std::pair< uint, uint32_t > Event;  // port, item index
+
+    std::vector< uint > starts;             // first port of each interval
+    std::vector< uint > offsets;            // indices of interval i are [offsets[i], offsets[i+1])
+    std::vector< uint32_t > indices;
+    std::vector< T > items;
+    std::vector< T > pending;               // added but not yet built
+
+public:
+    void add( T const & item )
+    {
+        pending.push_back( item );
+    }
+
+    void build()
+    {
+        items.insert( items.end(), pending.begin(), pending.end() );
+        std::vector< T >().swap( pending );
+
+        std::vector< Event > opens, closes;
+        for ( uint32_t i = 0; i < items.size(); i++ )
+        {
+            opens.push_back( Event( items[i].dportStart, i ) );
+            closes.push_back( Event( items[i].dportEnd + 1, i ) );
+        }
+        std::sort( opens.begin(), opens.end() );
+        std::sort( closes.begin(), closes.end() );
+
+        starts.clear();
+        offsets.clear();
+        indices.clear();
+        std::set< uint32_t > active;        // ordered by index, so by insertion
+        size_t o = 0, c = 0;
+        uint port = 0;
+        while ( port <= 65535 )
+        {
+            for ( ; c < closes.size() && closes[c].first <= port; c++ )
+                active.erase( closes[c].second );
+            for ( ; o < opens.size() && opens[o].first <= port; o++ )
+                active.insert( opens[o].second );
+
+            starts.push_back( port );
+            offsets.push_back( indices.size() );
+            indices.insert( indices.end(), active.begin(), active.end() );
+
+            uint next = 65536;
+            if ( o < opens.size() )
+                next = opens[o].first;
+            if ( c < closes.size() && closes[c].first < next )
+                next = closes[c].first;
+            port = next;
+        }
+        offsets.push_back( indices.size() );
+    }
+
+    T const & operator[]( uint32_t index ) const
+    {
+        return items[index];
+    }
+
+    /*!
+    **  \brief The indices of the items covering port, as a [first, second) range
+    */
+    std::pair< uint32_t const *, uint32_t const * > find( uint port ) const
+    {
+        if ( starts.empty() || indices.empty() )
+            return std::pair< uint32_t const *, uint32_t const * >( 0, 0 );
+
+        size_t i = std::upper_bound( starts.begin(), starts.end(), port ) - starts.begin() - 1;
+        return std::make_pair( &indices[0] + offsets[i], &indices[0] + offsets[i + 1] );
+    }
+};
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "atomicfile.h"
+#include "mappedfile.h"
+#include "snapshothash.h"
+
+/*!
+**  \brief A protocol database as it was read from its XML file, in a form
+**         that is read by mapping it
+**
+**  The file is a Header and then a body of 32 bit words: the string table
+**  (count, count + 1 offsets into the characters, the characters) and then
+**  the protocols, in whatever words ProtocolDB puts there and takes out again
+**  in the same order.  Strings are numbers into the string table.
+**
+**  The header keeps the size and hash of the XML file the cache was made
+**  from and a hash of the languages it was read for, the cache being of no
+**  use for any other.
+*/
+class ProtocolCache
+{
+public:
+    static uint32_t const VERSION = 3;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;                 // 0x01020304 as written
+        uint64_t xmlSize;
+        uint64_t xmlHash;
+        uint64_t languagesHash;
+        uint64_t bodyHash;
+        uint32_t stringWords;               // where the protocols start in the body
+        uint32_t bodyWords;
+    };
+
+    static char const * magic() { return "GPPDB\r\n\032"; }
+
+    /*!
+    **  \brief Hash of the languages a database is read for
+    */
+    static uint64_t languagesHash( std::vector< std::string > const & languages )
+    {
+        std::string all;
+        BOOST_FOREACH( std::string const & l, languages )
+            all += l + '\n';
+        return snapshotHash( all.data(), all.size() );
+    }
+
+    /*!
+    **  \brief Reads the words of the protocols in turn
+    */
+    class Cursor
+    {
+        uint32_t const * p;
+        uint32_t const * end;
+
+    public:
+        Cursor( uint32_t const * begin, uint32_t const * _end )
+         : p( begin ), end( _end )
+        {
+        }
+
+        uint32_t next()
+        {
+            if ( p == end )
+                throw std::string( "Protocol cache ends too soon" );
+            return *p++;
+        }
+
+        /*!
+        **  \brief The next word, which is one of the values 0 to most
+        */
+        uint32_t upTo( uint32_t most )
+        {
+            uint32_t word = next();
+            if ( word > most )
+                throw std::string( "Protocol cache value out of range" );
+            return word;
+        }
+
+        bool atEnd() const { return p == end; }
+    };
+
+private:
+    MappedFile file;
+    Header header;
+    uint32_t const * body;
+    uint32_t stringCount;
+    uint32_t const * stringOffsets;
+    char const * chars;
+
+    ProtocolCache( ProtocolCache const & );
+    ProtocolCache & operator=( ProtocolCache const & );
+
+public:
+    /*!
+    **  \brief Map the cache in filename and check that it is whole
+    */
+    explicit ProtocolCache( std::string const & filename )
+     : file( filename )
+    {
+        if ( file.size() < sizeof( header ) )
+            throw std::string( "Protocol cache too short" );
+        memcpy( &header, file.begin(), sizeof( header ) );
+        if ( memcmp( header.magic, magic(), sizeof( header.magic ) ) != 0 )
+            throw std::string( "Not a protocol cache" );
+        if ( header.version != VERSION || header.byteOrder != 0x01020304 )
+            throw std::string( "Protocol cache of another version" );
+        if ( ( file.size() - sizeof( header ) ) / 4 != header.bodyWords || ( file.size() - sizeof( header ) ) % 4 != 0 )
+            throw std::string( "Protocol cache of the wrong size" );
+        body = reinterpret_cast< uint32_t const * >( file.begin() + sizeof( header ) );
+        if ( snapshotHash( reinterpret_cast< char const * >( body ), header.bodyWords * 4 ) != header.bodyHash )
+            throw std::string( "Protocol cache damaged" );
+        if ( header.stringWords < 2 || header.stringWords > header.bodyWords )
+            throw std::string( "Protocol cache string table too short" );
+
+        stringCount = body[0];
+        if ( stringCount >= header.stringWords - 1 )
+            throw std::string( "Protocol cache string table too short" );
+        stringOffsets = body + 1;
+        chars = reinterpret_cast< char const * >( stringOffsets + stringCount + 1 );
+        for ( uint32_t i = 0; i < stringCount; i++ )
+        {
+            if ( stringOffsets[i] > stringOffsets[ i + 1 ] )
+                throw std::string( "Protocol cache string table out of order" );
+        }
+        if ( stringOffsets[ stringCount ] > ( header.stringWords - 1 - stringCount - 1 ) * 4 )
+            throw std::string( "Protocol cache string table too short" );
+    }
+
+    /*!
+    **  \brief Whether the cache was made from an XML file of xmlSize bytes
+    **         hashing to xmlHash, read for the languages hashing to
+    **         languages
+    */
+    bool madeFrom( uint64_t xmlSize, uint64_t xmlHash, uint64_t languages ) const
+    {
+        return header.xmlSize == xmlSize && header.xmlHash == xmlHash && header.languagesHash == languages;
+    }
+
+    Cursor protocols() const
+    {
+        return Cursor( body + header.stringWords, body + header.bodyWords );
+    }
+
+    std::string string( uint32_t id ) const
+    {
+        if ( id >= stringCount )
+            throw std::string( "Protocol cache string out of range" );
+        return std::string( chars + stringOffsets[id], chars + stringOffsets[ id + 1 ] );
+    }
+};
+
+/*!
+**  \brief Puts a ProtocolCache together
+*/
+class ProtocolCacheWriter
+{
+    std::vector< uint32_t > words;
+    std::vector< uint32_t > stringOffsets;
+    std::string chars;
+    std::map< std::string, uint32_t > interned;
+
+public:
+    ProtocolCacheWriter()
+     : stringOffsets( 1, 0 )
+    {
+    }
+
+    void add( uint32_t word )
+    {
+        words.push_back( word );
+    }
+
+    /*!
+    **  \brief Add the number of s in the string table, putting it there the
+    **         first time
+    */
+    void addString( std::string const & s )
+    {
+        std::map< std::string, uint32_t >::iterator i = interned.find( s );
+        if ( i == interned.end() )
+        {
+            chars += s;
+            stringOffsets.push_back( chars.size() );
+            i = interned.insert( std::make_pair( s, uint32_t( stringOffsets.size() - 2 ) ) ).first;
+        }
+        words.push_back( i->second );
+    }
+
+    /*!
+    **  \brief Write the cache to filename, made from an XML file of xmlSize
+    **         bytes hashing to xmlHash read for the languages hashing to
+    **         languages
+    */
+    void write( std::string const & filename, uint64_t xmlSize, uint64_t xmlHash, uint64_t languages )
+    {
+        std::vector< uint32_t > body;
+        body.push_back( stringOffsets.size() - 1 );
+        body.insert( body.end(), stringOffsets.begin(), stringOffsets.end() );
+        size_t charWords = body.size();
+        body.resize( charWords + ( chars.size() + 3 ) / 4 );
+        if ( !chars.empty() )
+            memcpy( &body[ charWords ], chars.data(), chars.size() );
+
+        ProtocolCache::Header header;
+        memset( &header, 0, sizeof( header ) );
+        memcpy( header.magic, ProtocolCache::magic(), sizeof( header.magic ) );
+        header.version = ProtocolCache::VERSION;
+        header.byteOrder = 0x01020304;
+        header.xmlSize = xmlSize;
+        header.xmlHash = xmlHash;
+        header.languagesHash = languages;
+        header.stringWords = body.size();
+        body.insert( body.end(), words.begin(), words.end() );
+        header.bodyWords = body.size();
+        header.bodyHash = snapshotHash( reinterpret_cast< char const * >( &body[0] ), body.size() * 4 );
+
+        AtomicFile file( filename, 0644 );
+        file.stream().write( reinterpret_cast< char const * >( &header ), sizeof( header ) );
+        file.stream().write( reinterpret_cast< char const * >( &body[0] ), body.size() * 4 );
+        file.commit();
+    }
+};
@@ -18,21 +18,36 @@ email                : simon@simonzone.com
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <stdlib.h>
+#include <unistd.h>
 
+#include <map>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <algorithm>
 #include <sstream>
+#include <boost/bind/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/flyweight.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 
 #include <boost/spirit/home/phoenix/core.hpp>
 #include <boost/spirit/home/phoenix/operator.hpp>
 #include <boost/spirit/home/phoenix/bind.hpp>
 
 
-#include <QXmlDefaultHandler>
+#include <QtGlobal>
+
+#include "mappedfile.h"
+#include "protocolcache.h"
+#include "protocoltable.h"
+#include "protocoltext.h"
+#include "xmlpullparser.h"
 
 /*
 
@@ -64,6 +79,14 @@ email                : simon@simonzone.com
 
  */
 
+/*!
+**  \brief A string kept once however many protocols have it, such as a
+**         classification or a pragma
+*/
+typedef boost::flyweight< std::string > InternedString;
+
+typedef std::map< InternedString, InternedString > PragmaMap;
+
     /*!
     **  \struct Contains the dynamic port range
     */
@@ -206,9 +229,19 @@ class ProtocolNetUse
     //        bool destPortEquals(uint port);
     //       bool icmpTypeCodeEquals(uint type, int code);
 public:
-    std::string   descriptionlanguage;
-    std::string   description;
+    /*!
+    **  \brief The pragmas the firewall acts on, kept as flags
+    **
+    **  Any other pragma a network use has is kept by its ProtocolEntry.
+    */
+    enum PragmaFlag
+    {
+        PRAGMA_RELATED = 0x01      // <pragma name="guarddog">RELATED</pragma>
+    };
+
+    ProtocolText  description;
     uchar         type;    // IPPROTO_TCP, IPPROTO_UDP or IPPROTO_ICMP
+    uchar         pragmas; // PragmaFlag
     bool          bidirectional;    // For UDP.
     NetworkEntity source;
     NetworkEntity dest;
@@ -222,16 +255,6 @@ public:
     ProtocolNetUseDetail destdetail;
 
 public:
-    std::string lastPragmaName;
-    std::map< std::string, std::string > pragma;
-
-    void addPragmaValue( std::string const & value )
-    {
-        //std::cout << "Pragma " << lastPragmaName << " = " << value << std::endl;
-        pragma[ lastPragmaName ] = value;
-    }
-
-
     void setType( uchar t ) { type = t; }
     void setSource( NetworkEntity s ) { source = s; }
     void setDest( NetworkEntity d ) { dest = d; }
@@ -251,6 +274,7 @@ public:
     : sourcedetail(PORTRANGE_ANY), destdetail(PORTRANGE_ANY)
     {
         type = t;
+        pragmas = 0;
         source = sr;
         dest = des;
         bidirectional = bi;
@@ -261,6 +285,27 @@ public:
         return (type==IPPROTO_TCP) || bidirectional;
     }
 
+    /*!
+    **  \brief Whether the traffic is only let through as RELATED to a
+    **         connection of another network use of the protocol
+    */
+    bool isRelated() const { return ( pragmas & PRAGMA_RELATED ) != 0; }
+    void setRelated( bool r )
+    {
+        pragmas = r ? pragmas | PRAGMA_RELATED : pragmas & ~PRAGMA_RELATED;
+    }
+
+    /*!
+    **  \brief The PragmaFlag the pragma name with value stands for, 0 if it
+    **         isn't one of them
+    */
+    static uchar pragmaFlag( std::string const & name, std::string const & value )
+    {
+        if ( name == "guarddog" && value == "RELATED" )
+            return PRAGMA_RELATED;
+        return 0;
+    }
+
 
     ~ProtocolNetUse()
     { }
@@ -269,7 +314,7 @@ public:
     {
         //out << std:: endl << ;
         if(!description.empty())
-            out << "  Description: " << description.c_str() << std::endl << " ";
+            out << "  Description: " << description << std::endl << " ";
         out << "  Type: ";
         switch(type)
         {
@@ -327,41 +372,73 @@ class ProtocolEntry
 {
 public:
     std::string name;
-    std::string longnamelanguage;
+    InternedString longnamelanguage;
     std::string longname;
 
-    std::string descriptionlanguage;
-    std::string description;
+    InternedString descriptionlanguage;
+    ProtocolText description;
 
     Score threat;
     Score falsepos;
-    std::string Classification;
+    InternedString Classification;
 private:
     friend class ProtocolDB;
     friend class GuardPuppyFireWall;
     std::vector< ProtocolNetUse > networkuse;
+    std::map< uint, PragmaMap > networkpragma;     // pragmas of networkuse[n] that aren't flags
 public:
-    std::string lastPragmaName;
-    std::map< std::string, std::string > pragma;
+    PragmaMap pragma;
 
     bool operator==(ProtocolEntry const & that) const
     {   //protocols are now considered the same if they have the same name.
         //because if they don't we can run into very bad times
         return  name == that.name;
     }
-    void addPragmaValue( std::string const & value )
+
+    void addNetwork( ProtocolNetUse const & net )
     {
-        //std::cout << "Pragma " << lastPragmaName << " = " << value << std::endl;
-        pragma[ lastPragmaName ] = value;
+        networkuse.push_back( net );
     }
 
-    void addNetwork( ProtocolNetUse const & net )
+    /*!
+    **  \brief Add net with pragmas, those that are flags setting them on it
+    */
+    void addNetwork( ProtocolNetUse net, PragmaMap const & pragmas )
     {
+        PragmaMap other;
+        for ( PragmaMap::const_iterator i = pragmas.begin(); i != pragmas.end(); ++i )
+        {
+            uchar flag = ProtocolNetUse::pragmaFlag( i->first, i->second );
+            if ( flag )
+                net.pragmas |= flag;
+            else
+                other.insert( other.end(), *i );
+        }
+        if ( !other.empty() )
+            networkpragma[ networkuse.size() ].swap( other );
         networkuse.push_back( net );
     }
+
     void deleteNetwork( uint n )
     {
         networkuse.erase(networkuse.begin()+n);
+        std::map< uint, PragmaMap > moved;
+        for ( std::map< uint, PragmaMap >::iterator i = networkpragma.begin(); i != networkpragma.end(); ++i )
+        {
+            if ( i->first != n )
+                moved[ i->first > n ? i->first - 1 : i->first ].swap( i->second );
+        }
+        networkpragma.swap( moved );
+    }
+
+    /*!
+    **  \brief The pragmas of network use n other than its flags
+    */
+    PragmaMap const & getNetworkPragmas( uint n ) const
+    {
+        static PragmaMap const none;
+        std::map< uint, PragmaMap >::const_iterator i = networkpragma.find( n );
+        return i == networkpragma.end() ? none : i->second;
     }
 
     ProtocolEntry( std::string const & _name = "" )
@@ -378,6 +455,21 @@ public:
 
     }
 
+    void swap( ProtocolEntry & that )
+    {
+        name.swap( that.name );
+        std::swap( longnamelanguage, that.longnamelanguage );
+        longname.swap( that.longname );
+        std::swap( descriptionlanguage, that.descriptionlanguage );
+        std::swap( description, that.description );
+        std::swap( threat, that.threat );
+        std::swap( falsepos, that.falsepos );
+        std::swap( Classification, that.Classification );
+        networkuse.swap( that.networkuse );
+        networkpragma.swap( that.networkpragma );
+        pragma.swap( that.pragma );
+    }
+
     void print(std::ostream & out = std::cerr) const
     {
 
@@ -410,57 +502,39 @@ public:
     std::string getName() const        { return name; }
     void setName( std::string const & n ) { name = n; longname = n;  }
 
-    std::vector<uchar> getTypes() const
+    std::vector< ProtocolNetUse > const & getNetworkUses() const { return networkuse; }
+
+    /*!
+    **  \brief Name of the conntrack helper this protocol needs, or "" if none.
+    **
+    **  Falls back on the old Guarddog "ip_conntrack_xxx" module pragma.
+    */
+    std::string getHelper() const
     {
-        std::vector<uchar> temp;
-        BOOST_FOREACH( ProtocolNetUse const & nu, networkuse)
-            temp.push_back( nu.type );
-        return temp;
+        PragmaMap::const_iterator it = pragma.find( InternedString( "helper" ) );
+        if ( it != pragma.end() )
+            return it->second;
+        it = pragma.find( InternedString( "guarddog" ) );
+        if ( it != pragma.end() && boost::starts_with( it->second.get(), "ip_conntrack_" ) )
+            return it->second.get().substr( 13 );
+        return "";
     }
+
     void setType(uchar t, int j)
     {
         networkuse[j].type = t;
     }
 
-    std::vector<std::string> getRangeStrings() const
-    {
-        std::vector<std::string> temp;
-        BOOST_FOREACH( ProtocolNetUse const & nu, networkuse)
-            temp.push_back( nu.destdetail.getRangeString() );
-        return temp;
-    }
-
-    std::vector<uint> getStartPorts() const
-    {
-        std::vector<uint> temp;
-        BOOST_FOREACH( ProtocolNetUse const & nu, networkuse)
-            temp.push_back( nu.destdetail.getStart() );
-        return temp;
-    }
     void setStartPort(uint i, int j)
     {
         networkuse[j].destdetail.setStartPort(i);
     }
 
-    std::vector<uint> getEndPorts() const
-    {
-        std::vector<uint> temp;
-        BOOST_FOREACH( ProtocolNetUse const & nu, networkuse)
-            temp.push_back( nu.destdetail.getEnd() );
-        return temp;
-    }
     void setEndPort(uint i, int j)
     {
         networkuse[j].destdetail.setEndPort(i);
     }
 
-    std::vector<bool> getBidirectionals() const
-    {
-        std::vector<bool> temp;
-        BOOST_FOREACH( ProtocolNetUse const & nu, networkuse)
-            temp.push_back( nu.isBidirectional() );
-        return temp;
-    }
     void setBidirectional(bool on, int j)
     {
         networkuse[j].bidirectional = on;
@@ -472,19 +546,32 @@ public:
 
 
 
-class ProtocolDB : public QXmlDefaultHandler
+class ProtocolDB
 {
 public:
     template <typename func>
     void ApplyToDB(func & f)
     {
+        tableStale = true;
         BOOST_FOREACH(ProtocolEntry & i, protocolDataBase)
             f(i);
     }
 
+    /*!
+    **  \brief Call f with each protocol and its rows of table()
+    */
+    template <typename func>
+    void ApplyToRows(func & f) const
+    {
+        ProtocolTable const & rows = table();
+        for ( uint p = 0; p < protocolDataBase.size(); p++ )
+            f( protocolDataBase[p], rows.protocol( p ) );
+    }
+
     template<class T>
     void ApplyToNthInClass(T & func, int i, std::string c)
     {
+        tableStale = true;
         int n = 0;
         BOOST_FOREACH(ProtocolEntry & ent, protocolDataBase)
         {
@@ -502,6 +589,14 @@ public:
             {}//std::cerr << "Index too great" << std::endl;
     }
 
+    /*!
+    **  \brief Note that a protocol was changed through lookup()
+    */
+    void protocolChanged()
+    {
+        tableStale = true;
+    }
+
     std::vector< ProtocolEntry > const & getProtocolDataBase() const
     {
         return protocolDataBase;
@@ -510,6 +605,7 @@ public:
     void addProtocolEntry( ProtocolEntry const & pe )
     {
         protocolDataBase.push_back( pe );
+        tableStale = true;
     }
 
     void UserDefinedProtocol(std::string name, uchar udptype, uint startp, uint endp, bool bi)
@@ -558,16 +654,26 @@ public:
             }
         }
         protocolDataBase.erase(pit);
+        tableStale = true;
     }
 
 private:
     std::vector< ProtocolEntry > protocolDataBase;
 
-//    QXmlLocator *xmllocator;
     ProtocolEntry currententry;
 
     ProtocolNetUse currentnetuse;
     ProtocolNetUseDetail currentnetusedetail;
+    InternedString entrypragma;     // the last pragma named in currententry
+    InternedString netusepragma;    // and in currentnetuse
+    PragmaMap netusepragmas;        // the pragmas of currentnetuse
+    InternedString netuselanguage;  // of the description kept for currentnetuse
+
+    boost::shared_ptr< ProtocolTextPool > texts;
+    std::vector< boost::shared_ptr< ProtocolTextPool > > overlaytexts;    // of protocols merged in from overlays
+
+    mutable ProtocolTable columns;  // see table()
+    mutable bool tableStale;        // columns are of the database as it was
 
 
     int unknowndepth;   // This is so that we can skip unknown tags.
@@ -575,23 +681,6 @@ private:
 #ifndef QT_LITE
     //    QProgressDialog *progressdialog;
 #endif
-    std::string protocolnamespace;
-    std::string linesattr;
-    std::string nameattr;
-    std::string portnumattr;
-    std::string portstartattr;
-    std::string portendattr;
-    std::string threatattr;
-    std::string falseposattr;
-    std::string sourceattr;
-    std::string destattr;
-    std::string directionattr;
-    std::string valueattr;
-    std::string codeattr;
-    std::string classattr;
-    std::string langattr;
-    std::string protocolattr;
-
     std::vector< std::string > parseerror;
     std::vector<std::string> languagelist;
     bool loaddescription;
@@ -674,32 +763,120 @@ private:
         PROTOCOL_ERROR_CLASSIFICATION_CLASS_UNKNOWN
     };
     ErrorState errorstate;
+
+    static void writeCachedPragmas( ProtocolCacheWriter & writer, PragmaMap const & pragma )
+    {
+        writer.add( pragma.size() );
+        for ( PragmaMap::const_iterator i = pragma.begin(); i != pragma.end(); ++i )
+        {
+            writer.addString( i->first );
+            writer.addString( i->second );
+        }
+    }
+
+    static void readCachedPragmas( ProtocolCache const & compiled, ProtocolCache::Cursor & words, PragmaMap & pragma )
+    {
+        for ( uint32_t n = words.next(); n > 0; n-- )
+        {
+            InternedString name( compiled.string( words.next() ) );
+            pragma.insert( pragma.end(), std::make_pair( name, InternedString( compiled.string( words.next() ) ) ) );
+        }
+    }
+
+    // Descriptions are cached as they are kept, still escaped if they were.
+    static void writeCachedText( ProtocolCacheWriter & writer, ProtocolText const & text )
+    {
+        writer.addString( std::string( text.begin(), text.end() ) );
+        writer.add( text.escaped() );
+    }
+
+    ProtocolText readCachedText( ProtocolCache const & compiled, ProtocolCache::Cursor & words )
+    {
+        std::string kept = compiled.string( words.next() );
+        return texts->add( kept.data(), kept.data() + kept.size(), words.upTo( 1 ) != 0 );
+    }
+
+    // getType() and getCode() give the start and end as they are kept,
+    // whatever the range type.
+    static void writeCachedDetail( ProtocolCacheWriter & writer, ProtocolNetUseDetail const & detail )
+    {
+        writer.add( detail.getRangeType() );
+        writer.add( detail.getType() );
+        writer.add( detail.getCode() );
+    }
+
+    static ProtocolNetUseDetail readCachedDetail( ProtocolCache::Cursor & words )
+    {
+        RangeType rangetype = RangeType( words.upTo( PORTRANGE_DYNAMIC ) );
+        uint start = words.next();
+        uint end = words.next();
+        return ProtocolNetUseDetail( rangetype, start, end );
+    }
 public:
-    ProtocolDB( std::string const & filename )
-     :  protocolnamespace(""),
-        linesattr("lines"),
-        nameattr("name"),
-        portnumattr("portnum"),
-        portstartattr("start"),
-        portendattr("end"),
-        threatattr("threat"),
-        falseposattr("falsepos"),
-        sourceattr("source"),
-        destattr("dest"),
-        directionattr("direction"),
-        valueattr("value"),
-        codeattr("code"),
-        classattr("class"),
-        langattr("lang"),
-        protocolattr("protocol")
+    ProtocolDB( std::string const & filename, bool useCache = true )
+     : texts( new ProtocolTextPool ), tableStale( true )
     {
         std::vector< std::string > languages;
         languages.push_back( "english" );
-        loadDB( filename, languages );
+        loadDB( filename, languages, useCache );
+    }
+
+    /*!
+    **  \brief The database in filename with the overlays over it, see
+    **         loadDB()
+    */
+    ProtocolDB( std::string const & filename, std::vector< std::string > const & overlays, bool useCache = true )
+     : texts( new ProtocolTextPool ), tableStale( true )
+    {
+        std::vector< std::string > languages;
+        languages.push_back( "english" );
+        loadDB( filename, overlays, languages, useCache );
     }
 
     ProtocolDB()
+     : texts( new ProtocolTextPool ), tableStale( true )
+    {
+    }
+
+    /*!
+    **  \brief The network uses of the database as a ProtocolTable
+    **
+    **  Built again the first time it is asked for after the database may
+    **  have changed: after adding or deleting a protocol, ApplyToDB(),
+    **  ApplyToNthInClass() or protocolChanged().  Build it before threads
+    **  share the database, so they don't all build it at once, and don't
+    **  change the database while they do.
+    */
+    ProtocolTable const & table() const
     {
+        if ( tableStale )
+        {
+            columns.clear();
+            BOOST_FOREACH( ProtocolEntry const & entry, protocolDataBase )
+            {
+                columns.addProtocol( entry.name, entry.longname );
+                BOOST_FOREACH( ProtocolNetUse const & nu, entry.networkuse )
+                {
+                    columns.addRow( nu.type, nu.isBidirectional(), nu.source, nu.dest,
+                            nu.sourcedetail.getStart(), nu.sourcedetail.getEnd(), nu.destdetail.getStart(), nu.destdetail.getEnd() );
+                }
+            }
+            columns.finish();
+            tableStale = false;
+        }
+        return columns;
+    }
+
+    /*!
+    **  \brief The rows of table() of the protocol called name, or with the
+    **         long name name
+    */
+    ProtocolTable::Protocol rows( std::string const & name ) const
+    {
+        int p = table().find( name );
+        if ( p < 0 )
+            throw std::string("Zone not found 5");
+        return columns.protocol( p );
     }
 
     std::vector< ProtocolNetUse > const & getNetworkUses( std::string const & protocolName ) const
@@ -707,54 +884,366 @@ public:
         return lookup( protocolName ).networkuse;
     }
 
-    bool loadDB(const std::string &filename, std::vector< std::string > const & languages)
+    /*!
+    **  \brief Where the compiled form of the database in filename is kept,
+    **         "" if there is no home to keep it in
+    */
+    static std::string cacheFilename( std::string const & filename )
     {
-        bool rc;
-        parsestate = PROTOCOL_STATE_OUTSIDE;
-        errorstate = PROTOCOL_ERROR_NOERROR;
-        unknowndepth = 0;
+        char const * home = getenv( "HOME" );
+        if ( !home )
+            return "";
+        std::string::size_type slash = filename.rfind( '/' );
+        return std::string( home ) + "/.config/guard-puppy/"
+            + filename.substr( slash == std::string::npos ? 0 : slash + 1 ) + ".cache";
+    }
+
+    /*!
+    **  \brief The protocol database files in dir, in the order they are
+    **         overlaid: the .xml files by name
+    **
+    **  None if there is no such directory.
+    */
+    static std::vector< std::string > overlayFiles( std::string const & dir )
+    {
+        std::vector< std::string > files;
+        boost::system::error_code ec;
+        for ( boost::filesystem::directory_iterator i( dir, ec ), end; !ec && i != end; i.increment( ec ) )
+        {
+            if ( i->path().extension() == ".xml" && boost::filesystem::is_regular_file( i->status() ) )
+                files.push_back( i->path().string() );
+        }
+        std::sort( files.begin(), files.end() );
+        return files;
+    }
 
+    /*!
+    **  \brief Load the database in filename with the overlays over it, in
+    **         order
+    **
+    **  Each file is loaded as loadDB() loads one, the files shared out
+    **  between as many threads as there are processors.  Then a protocol of
+    **  an overlay takes the place of the one of the same name loaded before
+    **  it, or if there is none is added after the others.  An overlay that
+    **  can't be loaded is told about and left out; what comes of filename is
+    **  kept as loadDB() keeps it.
+    **
+    **  \return whether filename could be loaded
+    */
+    bool loadDB( std::string const & filename, std::vector< std::string > const & overlays,
+            std::vector< std::string > const & languages, bool useCache = true )
+    {
+        if ( overlays.empty() )
+            return loadDB( filename, languages, useCache );
+
+        std::vector< std::string > files( 1, filename );
+        files.insert( files.end(), overlays.begin(), overlays.end() );
+        std::vector< boost::shared_ptr< ProtocolDB > > layers;
+        for ( size_t i = 0; i < files.size(); i++ )
+            layers.push_back( boost::shared_ptr< ProtocolDB >( new ProtocolDB ) );
+        std::vector< char > loaded( files.size() );
+        size_t threads = std::min< size_t >( boost::thread::hardware_concurrency(), files.size() );
+        if ( threads <= 1 )
+        {
+            loadLayers( layers, files, languages, useCache, loaded, 0, 1 );
+        }
+        else
+        {
+            boost::thread_group group;
+            for ( size_t i = 0; i < threads; i++ )
+            {
+                group.create_thread( boost::bind( &ProtocolDB::loadLayers, boost::cref( layers ), boost::cref( files ),
+                            boost::cref( languages ), useCache, boost::ref( loaded ), i, threads ) );
+            }
+            group.join_all();
+        }
+
+        BOOST_FOREACH( std::string const & l, languages )
+            languagelist.push_back( l.substr(0,2) );
+        errorstate = layers[0]->errorstate;
+        parseerror = layers[0]->parseerror;
+
+        size_t most = protocolDataBase.size();
+        BOOST_FOREACH( boost::shared_ptr< ProtocolDB > const & layer, layers )
+            most += layer->protocolDataBase.size();
+        protocolDataBase.reserve( most );
+
+        ProtocolEntry const blank;
+        std::map< std::string, size_t > names;
+        for ( size_t i = 0; i < protocolDataBase.size(); i++ )
+            names.insert( std::make_pair( protocolDataBase[i].name, i ) );
+        for ( size_t i = 0; i < layers.size(); i++ )
+        {
+            if ( i > 0 && !loaded[i] )
+            {
+                std::cerr << "Leaving out protocol overlay " << files[i] << std::endl;
+                continue;
+            }
+            overlaytexts.push_back( layers[i]->texts );
+            BOOST_FOREACH( ProtocolEntry & entry, layers[i]->protocolDataBase )
+            {
+                std::map< std::string, size_t >::iterator known = names.find( entry.name );
+                if ( known == names.end() )
+                {
+                    known = names.insert( std::make_pair( entry.name, protocolDataBase.size() ) ).first;
+                    protocolDataBase.push_back( blank );
+                }
+                protocolDataBase[ known->second ].swap( entry );
+            }
+        }
+        tableStale = true;
+        return loaded[0];
+    }
+
+    /*!
+    **  \brief Load the database in filename, from its compiled form if
+    **         useCache and there is one of filename as it is now
+    **
+    **  Once filename has been parsed its compiled form is kept for the next
+    **  time.
+    */
+    bool loadDB(const std::string &filename, std::vector< std::string > const & languages, bool useCache = true)
+    {
         // Copy the list of permitted languages one by one. Convert things
         // like 'en_GB' to just 'en'.
         BOOST_FOREACH( std::string const & l, languages )
             languagelist.push_back( l.substr(0,2) );
 
-        /*!
-        **  \todo Need to eliminate the dependence on QFile
-        **       for the XML parsing.
-        */
-        QFile xmlfile( filename.c_str() );
-        if(!xmlfile.open(QIODevice::ReadOnly))
+        std::string cache = useCache ? cacheFilename( filename ) : "";
+        uint64_t xmlSize = 0;
+        uint64_t xmlHash = 0;
+        if ( !cache.empty() )
+        {
+            try
+            {
+                MappedFile xml( filename );
+                xmlSize = xml.size();
+                xmlHash = snapshotHash( xml.begin(), xml.size() );
+            }
+            catch ( std::string const & )
+            {
+                cache.clear();      // parseDB() tells about it
+            }
+        }
+        if ( !cache.empty() )
+        {
+            try
+            {
+                if ( readCache( cache, xmlSize, xmlHash ) )
+                    return true;
+            }
+            catch ( std::string const & msg )
+            {
+                std::cerr << "Unable to use " << cache << ": " << msg << std::endl;
+            }
+        }
+
+        if ( !parseDB( filename ) )
+            return false;
+        if ( !cache.empty() )
+            keepCache( cache, xmlSize, xmlHash );
+        return true;
+    }
+
+    /*!
+    **  \brief Parse the XML in filename into the database
+    */
+    bool parseDB(const std::string &filename)
+    {
+        bool rc;
+        try
+        {
+            MappedFile xmlfile( filename );
+            rc = parseXML( xmlfile.begin(), xmlfile.end() );
+        }
+        catch ( std::string const & )
         {
             errorstate = PROTOCOL_ERROR_OPEN_ERROR;
             std::cout << "unable to open: " << filename << std::endl;
             return false;
         }
-        QXmlInputSource source(&xmlfile);
-        QXmlSimpleReader reader;
-        reader.setContentHandler(this);
-        reader.setErrorHandler(this);
-        parseerror.clear(); //.truncate(0);
-        //std::cout << "Parsing...";
-        if ( reader.parse(source))
+        texts->compact();
+        if ( !rc )
+            std::cerr << errorString() << std::endl;
+        return rc;
+    }
+
+    /*!
+    **  \brief Parse the XML document between begin and end into the database
+    **
+    **  The elements and text are handed to startElement(), endElement() and
+    **  characters() as they are found, stopping when one of those fails.
+    */
+    bool parseXML( char const * begin, char const * end )
+    {
+        parsestate = PROTOCOL_STATE_OUTSIDE;
+        errorstate = PROTOCOL_ERROR_NOERROR;
+        unknowndepth = 0;
+        parseerror.clear();
+
+        XmlPullParser parser( begin, end );
+        try
         {
-            //std::cout << "success" << std::endl;
-            rc = true;
+            while ( true )
+            {
+                bool ok = true;
+                switch ( parser.next() )
+                {
+                    case XmlPullParser::START:  ok = startElement( parser.name(), parser ); break;
+                    case XmlPullParser::END:    ok = endElement(); break;
+                    case XmlPullParser::TEXT:   ok = characters( parser.text() ); break;
+                    case XmlPullParser::DONE:   return true;
+                }
+                if ( !ok )
+                    return false;
+            }
         }
-        else
+        catch ( std::string const & msg )
         {
-            //std::cout << "failed" << std::endl;
-            std::cerr << errorString().toStdString() << std::endl;
-            rc = false;
+            parseerror.push_back( msg + "\n" );
+            errorstate = PROTOCOL_ERROR_PARSE_ERROR;
+            return false;
         }
+    }
 
-        xmlfile.close();
-        return rc;
+    /*!
+    **  \brief Write the database to cache, as read from an XML file of
+    **         xmlSize bytes hashing to xmlHash
+    */
+    void writeCache( std::string const & cache, uint64_t xmlSize, uint64_t xmlHash ) const
+    {
+        ProtocolCacheWriter writer;
+        writer.add( protocolDataBase.size() );
+        BOOST_FOREACH( ProtocolEntry const & entry, protocolDataBase )
+        {
+            writer.addString( entry.name );
+            writer.addString( entry.longnamelanguage );
+            writer.addString( entry.longname );
+            writer.addString( entry.descriptionlanguage );
+            writeCachedText( writer, entry.description );
+            writer.add( entry.threat );
+            writer.add( entry.falsepos );
+            writer.addString( entry.Classification );
+            writeCachedPragmas( writer, entry.pragma );
+            writer.add( entry.networkuse.size() );
+            for ( uint n = 0; n < entry.networkuse.size(); n++ )
+            {
+                ProtocolNetUse const & netuse = entry.networkuse[n];
+                writeCachedText( writer, netuse.description );
+                writer.add( netuse.type );
+                writer.add( netuse.bidirectional );
+                writer.add( netuse.source );
+                writer.add( netuse.dest );
+                writeCachedDetail( writer, netuse.sourcedetail );
+                writeCachedDetail( writer, netuse.destdetail );
+                writer.add( netuse.pragmas );
+                writeCachedPragmas( writer, entry.getNetworkPragmas( n ) );
+            }
+        }
+        writer.write( cache, xmlSize, xmlHash, ProtocolCache::languagesHash( languagelist ) );
+    }
+
+    /*!
+    **  \brief writeCache(), only telling about it failing, as the cache
+    **         only makes loading faster
+    */
+    void keepCache( std::string const & cache, uint64_t xmlSize, uint64_t xmlHash ) const
+    {
+        try
+        {
+            writeCache( cache, xmlSize, xmlHash );
+        }
+        catch ( std::string const & msg )
+        {
+            std::cerr << "Unable to save " << cache << ": " << msg << std::endl;
+        }
+    }
+
+    /*!
+    **  \brief Add the protocols kept in cache to the database, if it was
+    **         made from an XML file of xmlSize bytes hashing to xmlHash and
+    **         for the languages loadDB() was given
+    **
+    **  \return false if there is no cache of that file
+    */
+    bool readCache( std::string const & cache, uint64_t xmlSize, uint64_t xmlHash )
+    {
+        if ( access( cache.c_str(), F_OK ) != 0 )
+            return false;
+        ProtocolCache compiled( cache );
+        if ( !compiled.madeFrom( xmlSize, xmlHash, ProtocolCache::languagesHash( languagelist ) ) )
+            return false;
+
+        std::vector< ProtocolEntry > entries;
+        ProtocolCache::Cursor words = compiled.protocols();
+        entries.resize( words.next() );
+        BOOST_FOREACH( ProtocolEntry & entry, entries )
+        {
+            entry.name = compiled.string( words.next() );
+            entry.longnamelanguage = compiled.string( words.next() );
+            entry.longname = compiled.string( words.next() );
+            entry.descriptionlanguage = compiled.string( words.next() );
+            entry.description = readCachedText( compiled, words );
+            entry.threat = Score( words.upTo( SCORE_HIGH ) );
+            entry.falsepos = Score( words.upTo( SCORE_HIGH ) );
+            entry.Classification = compiled.string( words.next() );
+            readCachedPragmas( compiled, words, entry.pragma );
+            entry.networkuse.resize( words.next() );
+            for ( uint n = 0; n < entry.networkuse.size(); n++ )
+            {
+                ProtocolNetUse & netuse = entry.networkuse[n];
+                netuse.description = readCachedText( compiled, words );
+                netuse.type = words.upTo( 255 );
+                netuse.bidirectional = words.upTo( 1 ) != 0;
+                netuse.source = NetworkEntity( words.upTo( ENTITY_CLIENT ) );
+                netuse.dest = NetworkEntity( words.upTo( ENTITY_CLIENT ) );
+                netuse.sourcedetail = readCachedDetail( words );
+                netuse.destdetail = readCachedDetail( words );
+                netuse.pragmas = words.upTo( ProtocolNetUse::PRAGMA_RELATED );
+                PragmaMap other;
+                readCachedPragmas( compiled, words, other );
+                if ( !other.empty() )
+                    entry.networkpragma[n].swap( other );
+            }
+        }
+        if ( !words.atEnd() )
+            throw std::string( "Protocol cache too long" );
+
+        protocolDataBase.insert( protocolDataBase.end(), entries.begin(), entries.end() );
+        tableStale = true;
+        texts->compact();
+        return true;
+    }
+
+    /*!
+    **  \brief loadDB() files[first], files[first + step] and so on into
+    **         layers, for the loadDB() of overlays, setting loaded to what
+    **         it returns
+    */
+    static void loadLayers( std::vector< boost::shared_ptr< ProtocolDB > > const & layers, std::vector< std::string > const & files,
+            std::vector< std::string > const & languages, bool useCache, std::vector< char > & loaded, size_t first, size_t step )
+    {
+        for ( size_t i = first; i < files.size(); i += step )
+        {
+            ProtocolDB & layer = *layers[i];
+            try
+            {
+                loaded[i] = layer.loadDB( files[i], languages, useCache );
+            }
+            catch ( std::exception const & e )
+            {
+                layer.parseerror.push_back( std::string( e.what() ) + "\n" );
+                layer.errorstate = PROTOCOL_ERROR_PARSE_ERROR;
+                std::cerr << files[i] << ": " << layer.errorString() << std::endl;
+                loaded[i] = false;
+            }
+        }
     }
 
-    bool startElement(const QString &/*namespaceURI*/, QString const & localName, const QString &/*qName*/, const QXmlAttributes &atts)
+    bool startElement(XmlToken const & localName, XmlPullParser const & atts)
     {
-        int i;
+        XmlToken value;
+        bool found;
         std::string protocolname;
         std::string tmp;
         bool ok;
@@ -768,7 +1257,6 @@ public:
                     if(localName=="protocoldb")
                     {
                         parsestate = PROTOCOL_STATE_PROTOCOLDB;
-//                        i = atts.index(protocolnamespace.c_str(),linesattr.c_str());
                         return true;
                     }
                     break;
@@ -777,15 +1265,16 @@ public:
                     if ( localName == "protocol" )
                     {
                         currententry = ProtocolEntry();
+                        entrypragma = InternedString();
                         // Fetch the name attribute.
-                        i = atts.index(protocolnamespace.c_str(),nameattr.c_str());
-                        if(i==-1)
+                        found = atts.attribute( "name", value );
+                        if(!found)
                         {
                             //std::cerr << "  errorstate = PROTOCOL_ERROR_ENTRY_NAME_ATTR_NOT_FOUND" << std::endl;
                             errorstate = PROTOCOL_ERROR_ENTRY_NAME_ATTR_NOT_FOUND;
                             return false;
                         }
-                        currententry.setName( atts.value(i).toStdString() );
+                        currententry.setName( value.str() );
                         parsestate = PROTOCOL_STATE_ENTRY;
                         return true;
                     }
@@ -795,12 +1284,12 @@ public:
                     if(localName=="longname")
                     {
                         loadlongname = false;
-                        i = atts.index(protocolnamespace.c_str(),langattr.c_str());
-                        if(i!=-1)
-                            tmp = atts.value(i).toStdString();
+                        found = atts.attribute( "lang", value );
+                        if(found)
+                            tmp = value.str();
                         else
                             tmp = "en";
-                        if(currententry.longnamelanguage.empty())
+                        if(currententry.longnamelanguage.get().empty())
                         {
                             loadlongname = true;
                             currententry.longnamelanguage = tmp;
@@ -812,13 +1301,13 @@ public:
                     if(localName=="description")
                     {
                         loaddescription = false;
-                        i = atts.index(protocolnamespace.c_str(),langattr.c_str());
-                        if(i!=-1)
-                            tmp = atts.value(i).toStdString();
+                        found = atts.attribute( "lang", value );
+                        if(found)
+                            tmp = value.str();
                         else
                             tmp = "en";
 
-                        if(currententry.descriptionlanguage.empty())
+                        if(currententry.descriptionlanguage.get().empty())
                         {
                             loaddescription = true;
                             currententry.descriptionlanguage = tmp;
@@ -828,10 +1317,10 @@ public:
                     }
                     if ( localName=="classification" )
                     {
-                        i = atts.index(protocolnamespace.c_str(),classattr.c_str());
-                        if ( i != -1 )
+                        found = atts.attribute( "class", value );
+                        if ( found )
                         {
-                            tmp = atts.value(i).toStdString();
+                            tmp = value.str();
                             currententry.Classification = tmp;
                         }
                         parsestate = PROTOCOL_STATE_CLASSIFICATION;
@@ -845,17 +1334,16 @@ public:
                     if(localName=="security")
                     {
                         // Grab the threat info
-                        i = atts.index(protocolnamespace.c_str(),threatattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "threat", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="unknown")
+                            if(value=="unknown")
                                 currententry.threat = SCORE_UNKNOWN;
-                            else if(tmp=="low")
+                            else if(value=="low")
                                 currententry.threat = SCORE_LOW;
-                            else if(tmp=="medium")
+                            else if(value=="medium")
                                 currententry.threat = SCORE_MEDIUM;
-                            else if(tmp=="high")
+                            else if(value=="high")
                                 currententry.threat = SCORE_HIGH;
                             else
                             {
@@ -865,17 +1353,16 @@ public:
                         }
 
                         // Grab the falsepos info
-                        i = atts.index(protocolnamespace.c_str(),falseposattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "falsepos", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="unknown")
+                            if(value=="unknown")
                                 currententry.falsepos = SCORE_UNKNOWN;
-                            else if(tmp=="low")
+                            else if(value=="low")
                                 currententry.falsepos = SCORE_LOW;
-                            else if(tmp=="medium")
+                            else if(value=="medium")
                                 currententry.falsepos = SCORE_MEDIUM;
-                            else if(tmp=="high")
+                            else if(value=="high")
                                 currententry.falsepos = SCORE_HIGH;
                             else
                             {
@@ -890,12 +1377,11 @@ public:
                     if(localName=="pragma")
                     {
                         // Grab the pragma name
-                        i = atts.index(protocolnamespace.c_str(),nameattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "name", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            currententry.lastPragmaName = tmp;
-                            currententry.pragma[tmp] = "";
+                            entrypragma = InternedString( value.str() );
+                            currententry.pragma[ entrypragma ] = InternedString();
                         }
                         parsestate = PROTOCOL_STATE_ENTRY_PRAGMA;
                         return true;
@@ -906,15 +1392,17 @@ public:
                     if(localName=="tcp")
                     {
                         currentnetuse = ProtocolNetUse();
+                        netusepragma = InternedString();
+                        netusepragmas.clear();
+                        netuselanguage = InternedString();
                         currentnetuse.setType( IPPROTO_TCP );
                         // Handle Source attribute
-                        i = atts.index(protocolnamespace.c_str(),sourceattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "source", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="client")
+                            if(value=="client")
                                 currentnetuse.setSource( ENTITY_CLIENT );
-                            else if(tmp=="server")
+                            else if(value=="server")
                                 currentnetuse.setSource( ENTITY_SERVER );
                             else
                             {
@@ -924,13 +1412,12 @@ public:
                             }
                         }
                         // Handle Dest attribute
-                        i = atts.index(protocolnamespace.c_str(),destattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "dest", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="client")
+                            if(value=="client")
                                 currentnetuse.setDest( ENTITY_CLIENT );
-                            else if(tmp=="server")
+                            else if(value=="server")
                                 currentnetuse.setDest( ENTITY_SERVER );
                             else
                             {
@@ -945,15 +1432,17 @@ public:
                     if(localName=="udp")
                     {
                         currentnetuse = ProtocolNetUse();
+                        netusepragma = InternedString();
+                        netusepragmas.clear();
+                        netuselanguage = InternedString();
                         currentnetuse.setType( IPPROTO_UDP );
                         // Handle Source attribute
-                        i = atts.index(protocolnamespace.c_str(),sourceattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "source", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="client")
+                            if(value=="client")
                                 currentnetuse.setSource( ENTITY_CLIENT );
-                            else if(tmp=="server")
+                            else if(value=="server")
                                 currentnetuse.setSource( ENTITY_SERVER );
                             else
                             {
@@ -963,13 +1452,12 @@ public:
                             }
                         }
                         // Handle Dest attribute
-                        i = atts.index(protocolnamespace.c_str(),destattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "dest", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="client")
+                            if(value=="client")
                                 currentnetuse.setDest( ENTITY_CLIENT );
-                            else if(tmp=="server")
+                            else if(value=="server")
                                 currentnetuse.setDest( ENTITY_SERVER );
                             else
                             {
@@ -980,8 +1468,8 @@ public:
                         }
 
                         // Check for direction attribute
-                        i = atts.index(protocolnamespace.c_str(),directionattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "direction", value );
+                        if(found)
                             currentnetuse.setBidirectional( true );
                         parsestate = PROTOCOL_STATE_UDP;
                         return true;
@@ -989,15 +1477,17 @@ public:
                     if(localName=="icmp")
                     {
                         currentnetuse = ProtocolNetUse();
+                        netusepragma = InternedString();
+                        netusepragmas.clear();
+                        netuselanguage = InternedString();
                         currentnetuse.setType( IPPROTO_ICMP );
                         // Handle Source attribute
-                        i = atts.index(protocolnamespace.c_str(),sourceattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "source", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="client")
+                            if(value=="client")
                                 currentnetuse.setSource( ENTITY_CLIENT );
-                            else if(tmp=="server")
+                            else if(value=="server")
                                 currentnetuse.setSource( ENTITY_SERVER );
                             else
                             {
@@ -1007,13 +1497,12 @@ public:
                             }
                         }
                         // Handle Dest attribute
-                        i = atts.index(protocolnamespace.c_str(),destattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "dest", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="client")
+                            if(value=="client")
                                 currentnetuse.setDest( ENTITY_CLIENT );
-                            else if(tmp=="server")
+                            else if(value=="server")
                                 currentnetuse.setDest( ENTITY_SERVER );
                             else
                             {
@@ -1028,17 +1517,19 @@ public:
                     if(localName=="ip")
                     {
                         currentnetuse = ProtocolNetUse();
+                        netusepragma = InternedString();
+                        netusepragmas.clear();
+                        netuselanguage = InternedString();
                         currentnetuse.setType( 0 );    // Dummy.
 
                         // Handle the Protocol attribute.
-                        i = atts.index(protocolnamespace.c_str(),protocolattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "protocol", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
                             try
                             {
                                 ok = true;
-                                x = boost::lexical_cast<uint>(tmp); //tmp.toUInt(&ok);
+                                x = boost::lexical_cast<uint>(value.str()); //tmp.toUInt(&ok);
                             }
                             catch ( ... )
                             {
@@ -1059,13 +1550,12 @@ public:
                             return false;
                         }
                         // Handle Source attribute
-                        i = atts.index(protocolnamespace.c_str(),sourceattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "source", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="client")
+                            if(value=="client")
                                 currentnetuse.setSource( ENTITY_CLIENT );
-                            else if(tmp=="server")
+                            else if(value=="server")
                                 currentnetuse.setSource( ENTITY_SERVER );
                             else
                             {
@@ -1074,13 +1564,12 @@ public:
                             }
                         }
                         // Handle Dest attribute
-                        i = atts.index(protocolnamespace.c_str(),destattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "dest", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            if(tmp=="client")
+                            if(value=="client")
                                 currentnetuse.setDest( ENTITY_CLIENT );
-                            else if(tmp=="server")
+                            else if(value=="server")
                                 currentnetuse.setDest( ENTITY_SERVER );
                             else
                             {
@@ -1090,8 +1579,8 @@ public:
                         }
 
                         // Check for direction attribute
-                        i = atts.index(protocolnamespace.c_str(),directionattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "direction", value );
+                        if(found)
                             currentnetuse.setBidirectional( true );
 
                         parsestate = PROTOCOL_STATE_IP;
@@ -1120,12 +1609,11 @@ public:
                     if(localName=="pragma")
                     {
                         // Grab the pragma name
-                        i = atts.index(protocolnamespace.c_str(),nameattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "name", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            currentnetuse.lastPragmaName = tmp;
-                            currentnetuse.pragma[tmp] = "";
+                            netusepragma = InternedString( value.str() );
+                            netusepragmas[ netusepragma ] = InternedString();
                         }
                         parsestate = PROTOCOL_STATE_TCP_PRAGMA;
                         return true;
@@ -1152,12 +1640,11 @@ public:
                     if(localName=="pragma")
                     {
                         // Grab the pragma name
-                        i = atts.index(protocolnamespace.c_str(),nameattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "name", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            currentnetuse.lastPragmaName = tmp;
-                            currentnetuse.pragma[tmp] = "";
+                            netusepragma = InternedString( value.str() );
+                            netusepragmas[ netusepragma ] = InternedString();
                         }
                         parsestate = PROTOCOL_STATE_UDP_PRAGMA;
                         return true;
@@ -1170,21 +1657,19 @@ public:
                         currentnetusedetail = ProtocolNetUseDetail();
                         currentnetusedetail.setCode( -1 );
                         // Grab the type number
-                        i = atts.index(protocolnamespace.c_str(),valueattr.c_str());
-                        if(i==-1)
+                        found = atts.attribute( "value", value );
+                        if(!found)
                         {
                             errorstate = PROTOCOL_ERROR_TYPE_VALUE_ATTR_NOT_FOUND;
                             return false;
                         }
-                        tmp = atts.value(i).toStdString();
-                        currentnetusedetail.setType( boost::lexical_cast<uint>(tmp) ); //tmp.toUInt(&ok);
+                        currentnetusedetail.setType( boost::lexical_cast<uint>(value.str()) ); //tmp.toUInt(&ok);
 
                         // Grab the ICMP code.
-                        i = atts.index(protocolnamespace.c_str(),codeattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "code", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            currentnetusedetail.setCode( boost::lexical_cast<uint>(tmp)); //tmp.toUInt(&ok);
+                            currentnetusedetail.setCode( boost::lexical_cast<uint>(value.str())); //tmp.toUInt(&ok);
                         }
 
                         parsestate = PROTOCOL_STATE_ICMP_TYPE;
@@ -1199,12 +1684,11 @@ public:
                     if(localName=="pragma")
                     {
                         // Grab the pragma name
-                        i = atts.index(protocolnamespace.c_str(),nameattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "name", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            currentnetuse.lastPragmaName = tmp;
-                            currentnetuse.pragma[tmp] = "";
+                            netusepragma = InternedString( value.str() );
+                            netusepragmas[ netusepragma ] = InternedString();
                         }
                         parsestate = PROTOCOL_STATE_ICMP_PRAGMA;
                         return true;
@@ -1221,12 +1705,11 @@ public:
                     if(localName=="pragma")
                     {
                         // Grab the pragma name
-                        i = atts.index(protocolnamespace.c_str(),nameattr.c_str());
-                        if(i!=-1)
+                        found = atts.attribute( "name", value );
+                        if(found)
                         {
-                            tmp = atts.value(i).toStdString();
-                            currentnetuse.lastPragmaName = tmp;
-                            currentnetuse.pragma[tmp] = "";
+                            netusepragma = InternedString( value.str() );
+                            netusepragmas[ netusepragma ] = InternedString();
                         }
                         parsestate = PROTOCOL_STATE_IP_PRAGMA;
                         return true;
@@ -1242,38 +1725,36 @@ public:
                         currentnetusedetail = ProtocolNetUseDetail();
 
                         // Grab the port number
-                        i = atts.index(protocolnamespace.c_str(),portnumattr.c_str());
-                        if(i==-1)
+                        found = atts.attribute( "portnum", value );
+                        if(!found)
                         {
                             errorstate = PROTOCOL_ERROR_PORT_PORTNUM_ATTR_NOT_FOUND;
                             return false;
                         }
-                        tmp = atts.value(i).toStdString();
-
-                        if(tmp=="any")
+                        if(value=="any")
                         {
                             currentnetusedetail.setRangeType( PORTRANGE_ANY );
                             currentnetusedetail.setEndPort( 65535 );
                         }
-                        else if(tmp=="privileged")
+                        else if(value=="privileged")
                         {
                             currentnetusedetail.setRangeType( PORTRANGE_PRIVILEGED );
                             currentnetusedetail.setEndPort( 1023 );
                         }
-                        else if(tmp=="nonprivileged")
+                        else if(value=="nonprivileged")
                         {
                             currentnetusedetail.setRangeType( PORTRANGE_NONPRIVILEGED );
                             currentnetusedetail.setStartPort( 1024 );
                             currentnetusedetail.setEndPort( 65535 );
                         }
-                        else if(tmp=="dynamic")
+                        else if(value=="dynamic")
                         {
                             currentnetusedetail.setRangeType( PORTRANGE_DYNAMIC );
                             currentnetusedetail.setStartPort( 1024 );
                             currentnetusedetail.setEndPort( 65535 );
                         }
                         else
-                            currentnetusedetail.setStartPort( boost::lexical_cast<uint>(tmp) ); //tmp.toUInt(&ok);
+                            currentnetusedetail.setStartPort( boost::lexical_cast<uint>(value.str()) ); //tmp.toUInt(&ok);
 
                         switch(parsestate)
                         {
@@ -1298,24 +1779,22 @@ public:
                     {
                         currentnetusedetail = ProtocolNetUseDetail();
                         // Grab the start port number
-                        i = atts.index(protocolnamespace.c_str(),portstartattr.c_str());
-                        if(i==-1)
+                        found = atts.attribute( "start", value );
+                        if(!found)
                         {
                             errorstate = PROTOCOL_ERROR_PORTRANGE_START_ATTR_NOT_FOUND;
                             return false;
                         }
-                        tmp = atts.value(i).toStdString();
-                        currentnetusedetail.setStartPort( boost::lexical_cast<uint>(tmp) );
+                        currentnetusedetail.setStartPort( boost::lexical_cast<uint>(value.str()) );
 
                         // Grab the end port number
-                        i = atts.index(protocolnamespace.c_str(),portendattr.c_str());
-                        if(i==-1)
+                        found = atts.attribute( "end", value );
+                        if(!found)
                         {
                             errorstate = PROTOCOL_ERROR_PORTRANGE_END_ATTR_NOT_FOUND;
                             return false;
                         }
-                        tmp = atts.value(i).toStdString();
-                        currentnetusedetail.setEndPort( boost::lexical_cast<uint>(tmp) );
+                        currentnetusedetail.setEndPort( boost::lexical_cast<uint>(value.str()) );
 
                         switch(parsestate)
                         {
@@ -1346,25 +1825,26 @@ public:
         return true;
     }
 
-    void doNetuseLanguage(const QXmlAttributes &atts)
+    void doNetuseLanguage(XmlPullParser const & atts)
     {
-        int i;
+        XmlToken value;
+        bool found;
         std::string tmp;
 
         loaddescription = false;
-        i = atts.index(protocolnamespace.c_str(),langattr.c_str());
-        if(i!=-1)
-            tmp = atts.value(i).toStdString();
+        found = atts.attribute( "lang", value );
+        if(found)
+            tmp = value.str();
         else
             tmp = "en";
-        if(currentnetuse.descriptionlanguage.empty())
+        if(netuselanguage.get().empty())
         {
             loaddescription = true;
-            currentnetuse.descriptionlanguage = tmp;
+            netuselanguage = tmp;
         }
     }
 
-    bool endElement(const QString &/*namespaceURI*/, const QString &/*localName*/, const QString &/*qName*/)
+    bool endElement()
     {
         if(unknowndepth==0)
         {
@@ -1393,7 +1873,7 @@ public:
                 case PROTOCOL_STATE_UDP:
                 case PROTOCOL_STATE_ICMP:
                 case PROTOCOL_STATE_IP:
-                    currententry.addNetwork( currentnetuse ); //networkuse.push_back(currentnetuse);
+                    currententry.addNetwork( currentnetuse, netusepragmas );
                     parsestate = PROTOCOL_STATE_NETWORK;
                     return true;
 
@@ -1458,7 +1938,7 @@ public:
         return true;
     }
 
-    bool characters(const QString &ch)
+    bool characters(XmlToken const & ch)
     {
         if ( unknowndepth )
             return true;
@@ -1467,29 +1947,29 @@ public:
         {
             case PROTOCOL_STATE_LONGNAME:
                 if(loadlongname)
-                    currententry.longname = ch.toStdString();
+                    currententry.longname = ch.str();
                 return true;
 
             case PROTOCOL_STATE_DESCRIPTION:
                 if ( loaddescription )
-                    currententry.description = ch.toStdString();
+                    currententry.description = texts->add( ch );
                 return true;
 
             case PROTOCOL_STATE_ENTRY_PRAGMA:
-                currententry.addPragmaValue(ch.toStdString());
+                currententry.pragma[ entrypragma ] = InternedString( ch.str() );
                 return true;
 
             case PROTOCOL_STATE_TCP_DESCRIPTION:
             case PROTOCOL_STATE_UDP_DESCRIPTION:
             case PROTOCOL_STATE_ICMP_DESCRIPTION:
                 if ( loaddescription )
-                    currentnetuse.description = ch.toStdString();
+                    currentnetuse.description = texts->add( ch );
                 return true;
 
             case PROTOCOL_STATE_TCP_PRAGMA:
             case PROTOCOL_STATE_UDP_PRAGMA:
             case PROTOCOL_STATE_ICMP_PRAGMA:
-                currentnetuse.addPragmaValue(ch.toStdString());
+                netusepragmas[ netusepragma ] = InternedString( ch.str() );
                 return true;
 
             default:
@@ -1498,28 +1978,7 @@ public:
         return true;
     }
 
-    bool error(const QXmlParseException &exception)
-    {
-        printParseException(exception);
-        errorstate = PROTOCOL_ERROR_PARSE_ERROR;
-        return false;
-    }
-
-    bool fatalError(const QXmlParseException &exception)
-    {
-        printParseException(exception);
-        errorstate = PROTOCOL_ERROR_PARSE_ERROR;
-        return false;
-    }
-
-    bool warning(const QXmlParseException &exception)
-    {
-        printParseException(exception);
-        errorstate = PROTOCOL_ERROR_PARSE_ERROR;
-        return false;
-    }
-
-    QString errorString() const
+    std::string errorString() const
     {
         switch(errorstate)
         {
@@ -1532,7 +1991,7 @@ public:
                     std::string message( "XML Parse error:\n");
                     BOOST_FOREACH( std::string const & s, parseerror )
                         message += s;
-                    return message.c_str();
+                    return message;
                 }
             case PROTOCOL_ERROR_ENTRY_NAME_ATTR_NOT_FOUND:
                 return ("'protocol' tag requires a 'name' attribute, but none was found.");
@@ -1584,43 +2043,26 @@ public:
         }
     }
 
-    void printParseException(const QXmlParseException &exception)
-    {
-        std::stringstream ss;
-        ss << "Line: "   << exception.lineNumber()   << ", "
-           << "Column: " << exception.columnNumber() << " "  << exception.systemId().toStdString() << ", "
-           << exception.publicId().toStdString()     << ", " << exception.message().toStdString()  << std::endl;
-        parseerror.push_back( ss.str() );
-    }
-
+    /*!
+    **  \brief The protocol called name, or with the long name name, to
+    **         change
+    **
+    **  table() doesn't see the change until protocolChanged() is called.
+    */
     ProtocolEntry & lookup( std::string const & name )
     {
-        std::vector< ProtocolEntry >::iterator pit = std::find_if( protocolDataBase.begin(), protocolDataBase.end(), boost::phoenix::bind( &ProtocolEntry::name, boost::phoenix::arg_names::arg1) == name );
-        if ( pit == protocolDataBase.end() )
+        int p = table().find( name );
+        if ( p < 0 )
         {
-            pit = std::find_if( protocolDataBase.begin(), protocolDataBase.end(), boost::phoenix::bind( &ProtocolEntry::longname, boost::phoenix::arg_names::arg1) == name );
-            if ( pit == protocolDataBase.end() )
-            {
-                //std::cout << "Didn't protocol database: " << name << std::endl;
-                throw std::string("Zone not found 4");
-            }
+            //std::cout << "Didn't protocol database: " << name << std::endl;
+            throw std::string("Zone not found 4");
         }
-        return *pit;
+        return protocolDataBase[p];
     }
 
     ProtocolEntry const & lookup( std::string const & name ) const
     {
-        std::vector< ProtocolEntry >::const_iterator pit = std::find_if( protocolDataBase.begin(), protocolDataBase.end(), boost::phoenix::bind( &ProtocolEntry::name, boost::phoenix::arg_names::arg1) == name );
-        if ( pit == protocolDataBase.end() )
-        {
-            pit = std::find_if( protocolDataBase.begin(), protocolDataBase.end(), boost::phoenix::bind( &ProtocolEntry::longname, boost::phoenix::arg_names::arg1) == name );
-            if ( pit == protocolDataBase.end() )
-            {
-                //std::cout << "Didn't protocol database: " << name << std::endl;
-                throw std::string("Zone not found 5");
-            }
-        }
-        return *pit;
+        return protocolDataBase[ rows( name ).index ];
     }
 };
 
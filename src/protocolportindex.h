@@ -0,0 +1,137 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "protocoldb.h"
+#include "portintervals.h"
+
+/*!
+**  \brief One protocol a packet could belong to
+*/
+struct ProtocolPortMatch
+{
+    uint16_t protocol;      // index of the protocol, see ProtocolPortIndex::getProtocolName()
+    bool reversed;          // the packet goes from the server zone to the client zone
+    uint width;             // number of destination ports the matching netuse covers
+};
+
+/*!
+**  \brief Reverse index from TCP and UDP ports to the protocols of the
+**         protocol database using them.
+**
+**  The destination port ranges of every netuse go into PortIntervals, so a
+**  lookup is a binary search followed by a check of the source port of the
+**  few netuses found.  Feed it the protocols with ProtocolDB::ApplyToDB(),
+**  then call build().
+**
+**  Netuses handled by connection tracking (the RELATED pragma) never show up
+**  on their own and are left out.  Dynamic port ranges are taken as the
+**  default 1024:65535, as for every zone but Local.
+*/
+class ProtocolPortIndex
+{
+    struct Posting
+    {
+        uint16_t protocol;
+        bool reversed;
+        uint sportStart;
+        uint sportEnd;
+        uint dportStart;
+        uint dportEnd;
+    };
+
+    std::vector< std::string > names;
+    PortIntervals< Posting > tables[2];         // TCP, UDP
+
+    PortIntervals< Posting > * table( uint8_t protocol )
+    {
+        return protocol == IPPROTO_TCP ? &tables[0] : protocol == IPPROTO_UDP ? &tables[1] : 0;
+    }
+
+    PortIntervals< Posting > const * table( uint8_t protocol ) const
+    {
+        return protocol == IPPROTO_TCP ? &tables[0] : protocol == IPPROTO_UDP ? &tables[1] : 0;
+    }
+
+public:
+    /*!
+    **  \brief Add the netuses of one protocol
+    */
+    void operator()( ProtocolEntry const & entry )
+    {
+        uint16_t protocol = names.size();
+        names.push_back( entry.getName() );
+
+        BOOST_FOREACH( ProtocolNetUse const & netuse, entry.getNetworkUses() )
+        {
+            PortIntervals< Posting > * t = table( netuse.getType() );
+            if ( t == 0 || netuse.isRelated() )
+                continue;
+
+            Posting p;
+            p.protocol = protocol;
+            p.sportStart = netuse.sourcedetail.getStart();
+            p.sportEnd = netuse.sourcedetail.getEnd();
+            p.dportStart = netuse.destdetail.getStart();
+            p.dportEnd = netuse.destdetail.getEnd();
+            if ( netuse.source == ENTITY_CLIENT )
+            {
+                p.reversed = false;
+                t->add( p );
+            }
+            if ( netuse.dest == ENTITY_CLIENT )
+            {
+                p.reversed = true;
+                t->add( p );
+            }
+        }
+    }
+
+    /*!
+    **  \brief Build the intervals, after all the protocols have been added
+    */
+    void build()
+    {
+        tables[0].build();
+        tables[1].build();
+    }
+
+    /*!
+    **  \brief Replace matches with the protocols a packet could belong to
+    **
+    **  \return the number of matches
+    */
+    size_t lookup( uint8_t protocol, uint sport, uint dport, std::vector< ProtocolPortMatch > & matches ) const
+    {
+        matches.clear();
+        PortIntervals< Posting > const * t = table( protocol );
+        if ( t == 0 )
+            return 0;
+
+        std::pair< uint32_t const *, uint32_t const * > found = t->find( dport );
+        for ( uint32_t const * i = found.first; i != found.second; i++ )
+        {
+            Posting const * p = &( *t )[*i];
+            if ( sport >= p->sportStart && sport <= p->sportEnd )
+            {
+                ProtocolPortMatch m;
+                m.protocol = p->protocol;
+                m.reversed = p->reversed;
+                m.width = p->dportEnd - p->dportStart + 1;
+                matches.push_back( m );
+            }
+        }
+        return matches.size();
+    }
+
+    size_t protocolCount() const { return names.size(); }
+    std::string const & getProtocolName( uint16_t protocol ) const { return names[protocol]; }
+};
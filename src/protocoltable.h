@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <QtGlobal>
+
+/*!
+**  \brief A run of one column of a ProtocolTable
+**
+**  Points into the table, so it is only good until the table is built again.
+*/
+template< class T >
+class ProtocolColumn
+{
+    T const * first;
+    T const * last;
+
+public:
+    ProtocolColumn( T const * _first = 0, T const * _last = 0 )
+     : first( _first ), last( _last )
+    {
+    }
+
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+    T const & operator[]( size_t i ) const { return first[i]; }
+    T const * begin() const { return first; }
+    T const * end() const { return last; }
+};
+
+/*!
+**  \brief The network uses of a protocol database a column at a time
+**
+**  There is a row for each network use, protocol after protocol in the
+**  order of the database, and a column for each thing the dialog and the
+**  script writers ask of them.  Ports are those of ProtocolNetUseDetail
+**  getStart() and getEnd() with the default dynamic range.
+**
+**  Protocols are found by name, or failing that by long name, through
+**  sorted indexes rather than by walking the database.
+*/
+class ProtocolTable
+{
+public:
+    /*!
+    **  \brief The rows of one protocol
+    */
+    struct Protocol
+    {
+        uint index;                                 // of the protocol in the database
+        ProtocolColumn< uchar > types;              // IPPROTO_TCP, IPPROTO_UDP, ...
+        ProtocolColumn< uchar > bidirectionals;     // ProtocolNetUse::isBidirectional()
+        ProtocolColumn< uchar > sources;            // NetworkEntity
+        ProtocolColumn< uchar > dests;
+        ProtocolColumn< uint > sourceStarts;
+        ProtocolColumn< uint > sourceEnds;
+        ProtocolColumn< uint > destStarts;
+        ProtocolColumn< uint > destEnds;
+
+        size_t size() const { return types.size(); }
+
+        /*!
+        **  \brief The destination ports of row as
+        **         ProtocolNetUseDetail::getRangeString() gives them
+        */
+        std::string rangeString( size_t row ) const
+        {
+            std::stringstream result;
+            if ( destStarts[row] == destEnds[row] )
+                result << destStarts[row];
+            else
+                result << destStarts[row] << ":" << destEnds[row];
+            return result.str();
+        }
+    };
+
+private:
+    typedef std::vector< std::pair< std::string, uint > > Index;
+
+    std::vector< uint > firstRows;      // protocol p has rows firstRows[p] up to firstRows[p + 1]
+    std::vector< uchar > types;
+    std::vector< uchar > bidirectionals;
+    std::vector< uchar > sources;
+    std::vector< uchar > dests;
+    std::vector< uint > sourceStarts;
+    std::vector< uint > sourceEnds;
+    std::vector< uint > destStarts;
+    std::vector< uint > destEnds;
+    Index names;
+    Index longnames;
+
+    template< class T >
+    static ProtocolColumn< T > column( std::vector< T > const & v, uint first, uint last )
+    {
+        return v.empty() ? ProtocolColumn< T >() : ProtocolColumn< T >( &v[0] + first, &v[0] + last );
+    }
+
+    // The first protocol called name in the order of the database.
+    static int find( Index const & index, std::string const & name )
+    {
+        Index::const_iterator i = std::lower_bound( index.begin(), index.end(), std::make_pair( name, 0u ) );
+        if ( i == index.end() || i->first != name )
+            return -1;
+        return i->second;
+    }
+
+public:
+    ProtocolTable()
+     : firstRows( 1, 0 )
+    {
+    }
+
+    void clear()
+    {
+        ProtocolTable().swap( *this );
+    }
+
+    /*!
+    **  \brief Start the rows of the next protocol
+    */
+    void addProtocol( std::string const & name, std::string const & longname )
+    {
+        uint protocol = firstRows.size() - 1;
+        firstRows.push_back( firstRows.back() );
+        names.push_back( std::make_pair( name, protocol ) );
+        longnames.push_back( std::make_pair( longname, protocol ) );
+    }
+
+    /*!
+    **  \brief Add a row to the last protocol added
+    */
+    void addRow( uchar type, bool bidirectional, uchar source, uchar dest,
+            uint sourceStart, uint sourceEnd, uint destStart, uint destEnd )
+    {
+        types.push_back( type );
+        bidirectionals.push_back( bidirectional );
+        sources.push_back( source );
+        dests.push_back( dest );
+        sourceStarts.push_back( sourceStart );
+        sourceEnds.push_back( sourceEnd );
+        destStarts.push_back( destStart );
+        destEnds.push_back( destEnd );
+        firstRows.back()++;
+    }
+
+    /*!
+    **  \brief Sort the indexes, once all the protocols are added
+    */
+    void finish()
+    {
+        std::sort( names.begin(), names.end() );
+        std::sort( longnames.begin(), longnames.end() );
+    }
+
+    size_t size() const { return firstRows.size() - 1; }
+
+    Protocol protocol( uint p ) const
+    {
+        uint first = firstRows[p];
+        uint last = firstRows[ p + 1 ];
+        Protocol rows;
+        rows.index = p;
+        rows.types = column( types, first, last );
+        rows.bidirectionals = column( bidirectionals, first, last );
+        rows.sources = column( sources, first, last );
+        rows.dests = column( dests, first, last );
+        rows.sourceStarts = column( sourceStarts, first, last );
+        rows.sourceEnds = column( sourceEnds, first, last );
+        rows.destStarts = column( destStarts, first, last );
+        rows.destEnds = column( destEnds, first, last );
+        return rows;
+    }
+
+    /*!
+    **  \brief The protocol called name, or with the long name name if none
+    **         is, -1 if there is no such protocol
+    */
+    int find( std::string const & name ) const
+    {
+        int p = find( names, name );
+        return p >= 0 ? p : find( longnames, name );
+    }
+
+    void swap( ProtocolTable & that )
+    {
+        firstRows.swap( that.firstRows );
+        types.swap( that.types );
+        bidirectionals.swap( that.bidirectionals );
+        sources.swap( that.sources );
+        dests.swap( that.dests );
+        sourceStarts.swap( that.sourceStarts );
+        sourceEnds.swap( that.sourceEnds );
+        destStarts.swap( that.destStarts );
+        destEnds.swap( that.destEnds );
+        names.swap( that.names );
+        longnames.swap( that.longnames );
+    }
+};
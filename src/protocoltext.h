@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <ostream>
+#include <string>
+
+#include "xmlpullparser.h"
+
+class ProtocolTextPool;
+
+/*!
+**  \brief A description kept in a ProtocolTextPool
+**
+**  Only the place of the text in the pool is kept, so copying one costs
+**  nothing.  The text is read the way XML reads it only when it is asked
+**  for, by str() or by writing it to a stream.
+*/
+class ProtocolText
+{
+    friend class ProtocolTextPool;
+
+    ProtocolTextPool const * pool;
+    uint32_t offset;
+    uint32_t length;                // top bit set if kept as it is in the XML
+    static uint32_t const ESCAPED = 0x80000000u;
+
+public:
+    ProtocolText()
+     : pool( 0 ), offset( 0 ), length( 0 )
+    {
+    }
+
+    bool empty() const { return ( length & ~ESCAPED ) == 0; }
+
+    /*!
+    **  \brief Whether the text still has its XML references in it
+    */
+    bool escaped() const { return ( length & ESCAPED ) != 0; }
+
+    /*!
+    **  \brief The text as it is kept, see escaped()
+    */
+    char const * begin() const;
+    char const * end() const;
+
+    std::string str() const
+    {
+        if ( !escaped() )
+            return std::string( begin(), end() );
+        XmlToken token( XmlToken::TEXT );
+        token.begin = begin();
+        token.end = end();
+        token.plain = false;
+        return token.str();
+    }
+
+    friend std::ostream & operator<<( std::ostream & out, ProtocolText const & text )
+    {
+        if ( text.escaped() )
+            return out << text.str();
+        return out.write( text.begin(), text.end() - text.begin() );
+    }
+};
+
+/*!
+**  \brief The descriptions of a protocol database, back to back in one
+**         string
+**
+**  Texts from the XML are kept as they are there, references and all.
+*/
+class ProtocolTextPool
+{
+    std::string chars;
+
+public:
+    /*!
+    **  \brief Keep the text between begin and end, escaped if it still has
+    **         its XML references in it
+    */
+    ProtocolText add( char const * begin, char const * end, bool escaped )
+    {
+        ProtocolText text;
+        if ( begin == end )
+            return text;
+        text.pool = this;
+        text.offset = chars.size();
+        text.length = ( end - begin ) | ( escaped ? ProtocolText::ESCAPED : 0 );
+        chars.append( begin, end );
+        return text;
+    }
+
+    ProtocolText add( XmlToken const & token )
+    {
+        return add( token.begin, token.end, !token.plain );
+    }
+
+    ProtocolText add( std::string const & s )
+    {
+        return add( s.data(), s.data() + s.size(), false );
+    }
+
+    /*!
+    **  \brief Give back the room kept for texts still to come
+    */
+    void compact()
+    {
+        std::string( chars ).swap( chars );
+    }
+
+    size_t size() const { return chars.size(); }
+
+    char const * data() const { return chars.data(); }
+};
+
+inline char const * ProtocolText::begin() const
+{
+    return pool ? pool->data() + offset : "";
+}
+
+inline char const * ProtocolText::end() const
+{
+    return begin() + ( length & ~ESCAPED );
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "firewall.h"
+#include "zoneaddressindex.h"
+
+/*!
+**  \brief Estimates how many rules a new connection between two zones is
+**         checked against, from the rules the script would be written with.
+**
+**  Like PacketClassifier, only the rules of srcfilt, the split chain and
+**  the zone to zone chain count; the fixed rules ahead of them cost every
+**  packet the same.  The worst case comes from the last network of each
+**  zone and is dropped at the end of the zone to zone chain.  The typical
+**  case comes from an average network of each zone and is accepted by any
+**  one of the zone to zone rules, all equally likely.  The firewall's own
+**  addresses are only known when the script runs and are counted as one.
+*/
+class RuleCostEstimator
+{
+public:
+    struct Cost
+    {
+        bool reachable;         // both zones have an address the script can match
+        double typical;
+        uint32_t worst;
+        uint32_t chainRules;    // in the zone to zone chain, before its final DROP
+    };
+
+private:
+    /*!
+    **  \brief walkFilterRules() sink counting the rules of each chain
+    */
+    class RuleCounter
+    {
+        RuleCostEstimator & estimator;
+        std::ostream nowhere;
+
+    public:
+        RuleCounter( RuleCostEstimator & _estimator )
+         : estimator( _estimator ), nowhere( 0 )
+        {
+        }
+
+        std::ostream & comment()
+        {
+            return nowhere;
+        }
+
+        void rule( std::string const & fromzone, PortRangeInfo *, std::string const & tozone, PortRangeInfo *,
+                ProtocolNetUse const &, Zone::ProtocolState = Zone::PERMIT, bool = false )
+        {
+            estimator.chainRules[ estimator.ids[fromzone] * estimator.zones.zoneCount() + estimator.ids[tozone] ]++;
+        }
+
+        void chainEnd( std::string const &, std::string const &, bool )
+        {
+        }
+    };
+
+    ZoneAddressIndex zones;
+    std::map< std::string, uint16_t > ids;
+    std::vector< uint32_t > chainRules;         // [ from * zoneCount + to ]
+    std::vector< Cost > costs;
+    size_t chainCount;
+    size_t ruleCount;
+
+    /*!
+    **  \brief Average and largest number of rules a chain checks to reach
+    **         one of positions, leaving out those of zone exclude, or those
+    **         srcfilt leaves out if exclude is -1
+    **
+    **  \return the number of positions the chain has
+    */
+    size_t addressRules( std::vector< uint32_t > const & positions, int exclude, double & mean, uint32_t & worst ) const
+    {
+        double sum = 0;
+        size_t count = 0;
+        worst = 0;
+        BOOST_FOREACH( uint32_t position, positions )
+        {
+            if ( exclude < 0 && zones.isShadowed( position ) )
+                continue;
+            uint32_t rules = zones.rulesBefore( position, exclude ) + 1;
+            sum += rules;
+            count++;
+            worst = std::max( worst, rules );
+        }
+        mean = count == 0 ? 0 : sum / count;
+        return count;
+    }
+
+    Cost estimate( uint16_t from, uint16_t to ) const
+    {
+        Cost cost;
+        cost.chainRules = chainRules[ from * zones.zoneCount() + to ];
+        cost.reachable = true;
+
+        // srcfilt
+        double srcMean = 0;
+        uint32_t srcWorst = 0;
+        if ( from == zones.getInternetZone() )
+            srcMean = srcWorst = zones.rulesBefore( zones.getRuleCount() ) + 1;
+        else if ( from != zones.getLocalZone() )
+            cost.reachable = addressRules( zones.getZoneRules( from ), -1, srcMean, srcWorst ) > 0;
+
+        // the split chain, which tries the firewall's own address first
+        double splitMean = 1;
+        uint32_t splitWorst = 1;
+        if ( to != zones.getLocalZone() )
+        {
+            uint32_t local = from == zones.getLocalZone() ? 0 : 1;
+            if ( to == zones.getInternetZone() )
+                splitMean = splitWorst = zones.rulesBefore( zones.getRuleCount(), from ) + 1;
+            else
+            {
+                addressRules( zones.getZoneRules( to ), from, splitMean, splitWorst );
+                cost.reachable = cost.reachable && !zones.getZoneRules( to ).empty();
+            }
+            splitMean += local;
+            splitWorst += local;
+        }
+
+        // the zone to zone chain
+        double chainMean = cost.chainRules == 0 ? 1 : ( cost.chainRules + 1 ) / 2.0;
+        cost.typical = srcMean + splitMean + chainMean;
+        cost.worst = srcWorst + splitWorst + cost.chainRules + 1;
+        return cost;
+    }
+
+public:
+    RuleCostEstimator( GuardPuppyFireWall const & firewall )
+     : zones( firewall ), chainCount( 0 ), ruleCount( 0 )
+    {
+        size_t count = zones.zoneCount();
+        for ( uint16_t z = 0; z < count; z++ )
+            ids[ zones.zoneName( z ) ] = z;
+        chainRules.resize( count * count );
+        RuleCounter counter( *this );
+        firewall.walkFilterRules( counter );
+
+        costs.resize( count * count );
+        chainCount = 1 + count;                                     // srcfilt and the split chains
+        ruleCount = zones.rulesBefore( zones.getRuleCount() ) + 1;
+        for ( uint16_t from = 0; from < count; from++ )
+        {
+            if ( from != zones.getLocalZone() )
+                ruleCount++;                                        // the firewall's own address
+            ruleCount += zones.rulesBefore( zones.getRuleCount(), from ) + 1;
+            for ( uint16_t to = 0; to < count; to++ )
+            {
+                if ( from == to )
+                    continue;
+                costs[ from * count + to ] = estimate( from, to );
+                chainCount++;
+                ruleCount += chainRules[ from * count + to ] + 1;
+            }
+        }
+    }
+
+    /*!
+    **  \brief The cost of a new connection from zone from to zone to, which
+    **         must be different zones
+    */
+    Cost const & getCost( std::string const & from, std::string const & to ) const
+    {
+        return costs[ ids.find( from )->second * zones.zoneCount() + ids.find( to )->second ];
+    }
+
+    ZoneAddressIndex const & getZoneIndex() const { return zones; }
+    size_t getChainCount() const { return chainCount; }
+    size_t getRuleCount() const { return ruleCount; }
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string.h>
+
+#include <string>
+
+/*!
+**  \brief One line of a script held in memory, without its newline
+**
+**  Only points into the script, the text is copied out by str() and after()
+**  where a std::string is really wanted.
+*/
+struct ScriptLine
+{
+    char const * begin;
+    char const * end;
+
+    size_t size() const { return end - begin; }
+    bool empty() const { return begin == end; }
+
+    /*!
+    **  \brief Whether text, a string literal, is found at pos
+    */
+    template< size_t N >
+    bool at( size_t pos, char const ( &text )[N] ) const
+    {
+        return size() >= pos + N - 1 && memcmp( begin + pos, text, N - 1 ) == 0;
+    }
+
+    template< size_t N >
+    bool startsWith( char const ( &text )[N] ) const
+    {
+        return at( 0, text );
+    }
+
+    template< size_t N >
+    bool operator==( char const ( &text )[N] ) const
+    {
+        return size() == N - 1 && memcmp( begin, text, N - 1 ) == 0;
+    }
+
+    template< size_t N >
+    bool operator!=( char const ( &text )[N] ) const
+    {
+        return !( *this == text );
+    }
+
+    std::string str() const { return std::string( begin, end ); }
+
+    /*!
+    **  \brief The rest of the line after the first pos characters
+    */
+    std::string after( size_t pos ) const
+    {
+        return pos < size() ? std::string( begin + pos, end ) : std::string();
+    }
+};
+
+/*!
+**  \brief Walks the lines of a script held in memory
+**
+**  Past the last line next() gives empty lines, the way std::getline()
+**  leaves its string empty at the end of a stream.
+*/
+class ScriptLines
+{
+    char const * p;
+    char const * end;
+
+public:
+    ScriptLines( char const * begin, char const * _end )
+     : p( begin ), end( _end )
+    {
+    }
+
+    ScriptLine next()
+    {
+        ScriptLine line;
+        line.begin = p;
+        char const * nl = p == end ? 0 : static_cast< char const * >( memchr( p, '\n', end - p ) );
+        line.end = nl ? nl : end;
+        p = nl ? nl + 1 : end;
+        return line;
+    }
+
+    bool atEnd() const { return p == end; }
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/*!
+**  \brief 64 bit hash of size bytes at data, taken eight bytes at a time
+**         (MurmurHash64A)
+*/
+inline uint64_t snapshotHash( char const * data, size_t size, uint64_t seed = 0 )
+{
+    uint64_t const m = 0xc6a4a7935bd1e995ull;
+    int const r = 47;
+    uint64_t h = seed ^ ( size * m );
+
+    char const * end = data + ( size & ~(size_t)7 );
+    for ( ; data != end; data += 8 )
+    {
+        uint64_t k;
+        memcpy( &k, data, 8 );
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    size_t rest = size & 7;
+    if ( rest > 0 )
+    {
+        uint64_t k = 0;
+        for ( size_t i = rest; i > 0; i-- )
+            k = ( k << 8 ) | (unsigned char)data[ i - 1 ];
+        h ^= k;
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
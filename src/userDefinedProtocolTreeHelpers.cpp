@@ -189,7 +189,7 @@ void UDPTreeDelegate::setModelData(QWidget * editor, QAbstractItemModel * model,
             range->value(i,j);
             fw->setStartPort(protocolName.toStdString(), i, index.row());
             fw->setEndPort(protocolName.toStdString(), j, index.row());
-            QString rangeString = fw->getRangeStrings(protocolName.toStdString())[index.row()].c_str();
+            QString rangeString = fw->getRangeString(protocolName.toStdString(), index.row()).c_str();
             model->setData(index, rangeString, Qt::EditRole);//get the value from the protocol
             return;
         }
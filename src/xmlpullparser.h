@@ -0,0 +1,453 @@
+#pragma once
+
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+/*!
+**  \brief A name, attribute value or text of an XML document held in memory
+**
+**  Only points into the document.  Where there are references in the text,
+**  or line ends and whitespace that XML reads differently, str() gives the
+**  text the way XML reads it; otherwise that is just the bytes between begin
+**  and end.  Characters are kept as the bytes they are in the document,
+**  character references above 255 becoming '?'.
+*/
+struct XmlToken
+{
+    enum Kind { NAME, TEXT, ATTRIBUTE };
+
+    char const * begin;
+    char const * end;
+    Kind kind;
+    bool plain;             // str() is just the bytes between begin and end
+
+    XmlToken( Kind _kind = NAME )
+     : begin( 0 ), end( 0 ), kind( _kind ), plain( true )
+    {
+    }
+
+    size_t size() const { return end - begin; }
+    bool empty() const { return begin == end; }
+
+    template< size_t N >
+    bool operator==( char const ( &text )[N] ) const
+    {
+        if ( !plain )
+            return str() == text;
+        return size() == N - 1 && memcmp( begin, text, N - 1 ) == 0;
+    }
+
+    template< size_t N >
+    bool operator!=( char const ( &text )[N] ) const
+    {
+        return !( *this == text );
+    }
+
+    bool operator==( XmlToken const & that ) const
+    {
+        return size() == that.size() && memcmp( begin, that.begin, size() ) == 0;
+    }
+
+    std::string str() const
+    {
+        if ( plain )
+            return std::string( begin, end );
+
+        std::string s;
+        s.reserve( size() );
+        for ( char const * p = begin; p != end; ++p )
+        {
+            if ( *p == '&' )
+            {
+                char const * semicolon = static_cast< char const * >( memchr( p, ';', end - p ) );
+                s += reference( p + 1, semicolon );
+                p = semicolon;
+            }
+            else if ( *p == '\r' )
+            {
+                s += kind == ATTRIBUTE ? ' ' : '\n';
+                if ( p + 1 != end && p[1] == '\n' )
+                    ++p;
+            }
+            else if ( kind == ATTRIBUTE && ( *p == '\n' || *p == '\t' ) )
+                s += ' ';
+            else
+                s += *p;
+        }
+        return s;
+    }
+
+    /*!
+    **  \brief The character the reference between begin and end stands for,
+    **         0 if it isn't one XML knows without a DTD
+    */
+    static char reference( char const * begin, char const * end )
+    {
+        std::string name( begin, end );
+        if ( name == "lt" )     return '<';
+        if ( name == "gt" )     return '>';
+        if ( name == "amp" )    return '&';
+        if ( name == "quot" )   return '"';
+        if ( name == "apos" )   return '\'';
+        if ( name.size() < 2 || name[0] != '#' )
+            return 0;
+
+        unsigned long code = 0;
+        bool hex = name[1] == 'x';
+        if ( hex && name.size() == 2 )
+            return 0;
+        for ( size_t i = hex ? 2 : 1; i < name.size(); i++ )
+        {
+            char c = name[i];
+            int digit;
+            if ( c >= '0' && c <= '9' )
+                digit = c - '0';
+            else if ( hex && c >= 'a' && c <= 'f' )
+                digit = c - 'a' + 10;
+            else if ( hex && c >= 'A' && c <= 'F' )
+                digit = c - 'A' + 10;
+            else
+                return 0;
+            code = code * ( hex ? 16 : 10 ) + digit;
+            if ( code > 0x10ffff )
+                return 0;
+        }
+        if ( code == 0 )
+            return 0;
+        return code > 255 ? '?' : char( code );
+    }
+};
+
+/*!
+**  \brief Reads an XML document held in memory one start tag, end tag or
+**         piece of text at a time
+**
+**  Everything found points into the document, nothing is copied.  Comments,
+**  processing instructions and the document type declaration are skipped,
+**  an empty element tag is given as a start tag and an end tag.  Text is
+**  given as it comes between the markup, so text with a comment or an
+**  element in it comes in pieces.  A document that isn't well formed makes
+**  next() throw a std::string telling where.
+*/
+class XmlPullParser
+{
+public:
+    enum Event { START, END, TEXT, DONE };
+
+private:
+    typedef std::pair< XmlToken, XmlToken > Attribute;
+
+    char const * begin;
+    char const * p;
+    char const * end;
+    std::vector< XmlToken > open;       // elements not yet ended, the current one last
+    std::vector< Attribute > attributes;
+    XmlToken current;
+    XmlToken currentText;
+    bool rootSeen;
+    bool emptyElement;                  // the last START was of <name/>
+
+    void error( std::string const & message ) const
+    {
+        int line = 1;
+        char const * lineStart = begin;
+        for ( char const * c = begin; c != p; ++c )
+        {
+            if ( *c == '\n' )
+            {
+                line++;
+                lineStart = c + 1;
+            }
+        }
+        throw "Line " + boost::lexical_cast< std::string >( line ) + ", column "
+            + boost::lexical_cast< std::string >( p - lineStart + 1 ) + ": " + message;
+    }
+
+    template< size_t N >
+    bool at( char const ( &text )[N] ) const
+    {
+        return size_t( end - p ) >= N - 1 && memcmp( p, text, N - 1 ) == 0;
+    }
+
+    /*!
+    **  \brief Move past text, which ends what starts at p
+    */
+    template< size_t N >
+    void skipPast( char const ( &text )[N], char const * what )
+    {
+        for ( char const * c = p; size_t( end - c ) >= N - 1; ++c )
+        {
+            if ( memcmp( c, text, N - 1 ) == 0 )
+            {
+                p = c + N - 1;
+                return;
+            }
+        }
+        error( std::string( what ) + " not ended" );
+    }
+
+    static bool isSpace( char c )
+    {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+    }
+
+    static bool isNameChar( char c )
+    {
+        return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' )
+            || c == '_' || c == ':' || c == '-' || c == '.' || (unsigned char)c >= 0x80;
+    }
+
+    void skipSpace()
+    {
+        while ( p != end && isSpace( *p ) )
+            ++p;
+    }
+
+    XmlToken readName()
+    {
+        XmlToken token( XmlToken::NAME );
+        token.begin = p;
+        while ( p != end && isNameChar( *p ) )
+            ++p;
+        token.end = p;
+        if ( token.empty() || ( *token.begin >= '0' && *token.begin <= '9' ) || *token.begin == '-' || *token.begin == '.' )
+        {
+            p = token.begin;
+            error( "Name expected" );
+        }
+        return token;
+    }
+
+    /*!
+    **  \brief Check the references in token, which is ended by stop, and
+    **         whether str() has anything to change in it
+    */
+    void scan( XmlToken & token, char stop )
+    {
+        token.plain = true;
+        for ( char const * c = token.begin; c != token.end; ++c )
+        {
+            if ( *c == '&' )
+            {
+                char const * semicolon = static_cast< char const * >( memchr( c, ';', token.end - c ) );
+                if ( !semicolon || XmlToken::reference( c + 1, semicolon ) == 0 )
+                {
+                    p = c;
+                    error( "Unknown or unended reference" );
+                }
+                token.plain = false;
+                c = semicolon;
+            }
+            else if ( *c == '\r' || ( token.kind == XmlToken::ATTRIBUTE && ( *c == '\n' || *c == '\t' ) ) )
+                token.plain = false;
+            else if ( *c == '<' && stop != '<' )
+            {
+                p = c;
+                error( "'<' in an attribute value" );
+            }
+        }
+    }
+
+    void skipDoctype()
+    {
+        int brackets = 0;
+        for ( ; p != end; ++p )
+        {
+            if ( *p == '"' || *p == '\'' )
+            {
+                char const * close = static_cast< char const * >( memchr( p + 1, *p, end - p - 1 ) );
+                if ( !close )
+                    break;
+                p = close;
+            }
+            else if ( *p == '[' )
+                brackets++;
+            else if ( *p == ']' )
+                brackets--;
+            else if ( *p == '>' && brackets == 0 )
+            {
+                ++p;
+                return;
+            }
+        }
+        error( "Document type declaration not ended" );
+    }
+
+    Event startTag()
+    {
+        ++p;
+        if ( rootSeen && open.empty() )
+            error( "Element after the root element" );
+        current = readName();
+        attributes.clear();
+        while ( true )
+        {
+            char const * beforeSpace = p;
+            skipSpace();
+            if ( p == end )
+                error( "Start tag not ended" );
+            if ( *p == '>' || *p == '/' )
+                break;
+            if ( p == beforeSpace )
+                error( "Space expected between attributes" );
+            Attribute attribute;
+            attribute.first = readName();
+            skipSpace();
+            if ( p == end || *p != '=' )
+                error( "'=' expected" );
+            ++p;
+            skipSpace();
+            if ( p == end || ( *p != '"' && *p != '\'' ) )
+                error( "Quoted attribute value expected" );
+            char const * close = static_cast< char const * >( memchr( p + 1, *p, end - p - 1 ) );
+            if ( !close )
+                error( "Attribute value not ended" );
+            attribute.second.kind = XmlToken::ATTRIBUTE;
+            attribute.second.begin = p + 1;
+            attribute.second.end = close;
+            scan( attribute.second, *p );
+            for ( size_t i = 0; i < attributes.size(); i++ )
+            {
+                if ( attributes[i].first == attribute.first )
+                    error( "Attribute " + attribute.first.str() + " given twice" );
+            }
+            attributes.push_back( attribute );
+            p = close + 1;
+        }
+
+        emptyElement = *p == '/';
+        if ( emptyElement )
+        {
+            ++p;
+            if ( p == end || *p != '>' )
+                error( "'>' expected" );
+        }
+        ++p;
+        rootSeen = true;
+        open.push_back( current );
+        return START;
+    }
+
+    Event endTag()
+    {
+        p += 2;
+        current = readName();
+        skipSpace();
+        if ( p == end || *p != '>' )
+            error( "'>' expected" );
+        if ( open.empty() || !( open.back() == current ) )
+            error( "End tag of " + current.str() + " does not match" );
+        ++p;
+        open.pop_back();
+        return END;
+    }
+
+public:
+    XmlPullParser( char const * _begin, char const * _end )
+     : begin( _begin ), p( _begin ), end( _end ), currentText( XmlToken::TEXT ), rootSeen( false ), emptyElement( false )
+    {
+    }
+
+    /*!
+    **  \brief Read on to the next start tag, end tag or text
+    */
+    Event next()
+    {
+        if ( emptyElement )
+        {
+            emptyElement = false;
+            open.pop_back();
+            return END;
+        }
+
+        while ( p != end )
+        {
+            if ( *p != '<' )
+            {
+                char const * lt = static_cast< char const * >( memchr( p, '<', end - p ) );
+                currentText.kind = XmlToken::TEXT;
+                currentText.begin = p;
+                currentText.end = lt ? lt : end;
+                scan( currentText, '<' );
+                p = currentText.end;
+                if ( !open.empty() )
+                    return TEXT;
+                for ( char const * c = currentText.begin; c != currentText.end; ++c )
+                {
+                    if ( !isSpace( *c ) )
+                    {
+                        p = c;
+                        error( "Text outside the root element" );
+                    }
+                }
+                continue;
+            }
+
+            if ( at( "<!--" ) )
+                skipPast( "-->", "Comment" );
+            else if ( at( "<![CDATA[" ) )
+            {
+                if ( open.empty() )
+                    error( "CDATA section outside the root element" );
+                p += 9;
+                currentText.begin = p;
+                skipPast( "]]>", "CDATA section" );
+                currentText.end = p - 3;
+                currentText.kind = XmlToken::TEXT;
+                currentText.plain = true;       // given as it is
+                return TEXT;
+            }
+            else if ( at( "<!DOCTYPE" ) )
+            {
+                if ( rootSeen )
+                    error( "Document type declaration after the root element" );
+                skipDoctype();
+            }
+            else if ( at( "<?" ) )
+                skipPast( "?>", "Processing instruction" );
+            else if ( at( "</" ) )
+                return endTag();
+            else
+                return startTag();
+        }
+
+        if ( !open.empty() )
+            error( "Document ends inside " + open.back().str() );
+        if ( !rootSeen )
+            error( "No root element" );
+        return DONE;
+    }
+
+    /*!
+    **  \brief Name of the element of the last START or END
+    */
+    XmlToken const & name() const { return current; }
+
+    /*!
+    **  \brief The last TEXT
+    */
+    XmlToken const & text() const { return currentText; }
+
+    /*!
+    **  \brief Find the attribute called name, a string literal, of the last
+    **         START
+    */
+    template< size_t N >
+    bool attribute( char const ( &name )[N], XmlToken & value ) const
+    {
+        for ( size_t i = 0; i < attributes.size(); i++ )
+        {
+            if ( attributes[i].first == name )
+            {
+                value = attributes[i].second;
+                return true;
+            }
+        }
+        return false;
+    }
+};
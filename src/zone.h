@@ -5,6 +5,7 @@
 #include <map>
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/spirit/home/phoenix/core.hpp>
 #include <boost/spirit/home/phoenix/operator.hpp>
 #include <boost/spirit/home/phoenix/bind.hpp>
@@ -19,6 +20,21 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/numeric/conversion/cast.hpp>
 
+/*!
+**  \brief Addresses of a zone kept somewhere else until they're first
+**         needed, such as a PolicySnapshot
+*/
+class ZoneMemberSource
+{
+public:
+    virtual ~ZoneMemberSource() {}
+
+    /*!
+    **  \brief Add the addresses to members
+    */
+    virtual void read( std::vector<IPRange> & members ) const = 0;
+};
+
 /*
 **  Each zone maintains a list of IPaddress that define this zone and
 **  a list of zone-protocol pairs this zone can communicate with.
@@ -33,12 +49,20 @@ private:
     std::string                name;
     std::string                comment;
     ZoneType                   zonetype;
-    std::vector<IPRange>       memberMachine;
+    mutable std::vector<IPRange> memberMachine;
+    mutable boost::shared_ptr< ZoneMemberSource const > pendingMembers;  // read into memberMachine when first needed
     std::map< std::string, std::map< std::string, ProtocolState > > protocols;  // [toZone][protocolName] = state
     std::vector< std::string > connections;          // List of zone names this zone is connected to, in theory, these are keys of protocols
                                                      // Though it's possible that zones are connected in name before any protocols are associated
                                                      // with them.
                                                      //! \todo Might be something to examine in the future.
+    std::vector< std::string > fastPaths;            // List of zone names whose established forwarded traffic from this zone
+                                                     // is offloaded to the nftables flowtable.
+    std::vector< std::string > quietZones;           // List of zone names whose dropped traffic from this zone is not logged.
+    std::string                definition;           // ZoneExpression the members are worked out from, empty if they're given
+    std::vector< std::pair< unsigned int, unsigned int > > definitionInputs;  // id and membersVersion of each zone of the
+                                                     // definition when the members were last worked out from it
+    unsigned int               membersVersion;       // changes whenever memberMachine does
     //  id, nextId are used to assign integers to zones.  Probably not needed
     //  as zone name could be used instead.  Too early to remove though.
     unsigned int               id;
@@ -54,10 +78,11 @@ public:
     {
         zonetype = zt;
         id = nextId++;
+        membersVersion = 0;
     }
 
     Zone( std::string const & zoneName, ZoneType zt = UserZone )
-     : name( zoneName ), zonetype( zt )
+     : name( zoneName ), zonetype( zt ), membersVersion( 0 )
     {
         id = nextId++;
     }
@@ -71,22 +96,61 @@ public:
         name          = rhs.name;
         comment       = rhs.comment;
         memberMachine = rhs.memberMachine;
+        pendingMembers = rhs.pendingMembers;
         zonetype      = rhs.zonetype;
         protocols     = rhs.protocols;
         id            = rhs.id;
 
         connections   = rhs.connections;
+        fastPaths     = rhs.fastPaths;
+        quietZones    = rhs.quietZones;
+        definition    = rhs.definition;
+        definitionInputs = rhs.definitionInputs;
+        membersVersion = rhs.membersVersion;
         return *this;
     }
 
     unsigned int getId() const { return id; }
 
+    /*!
+    **  \brief A number that changes whenever the members do
+    */
+    unsigned int getMembersVersion() const { return membersVersion; }
+
+    /*!
+    **  \brief Read the addresses from source when they're first needed,
+    **         after any the zone has already
+    **
+    **  They're read by whichever thread looks at them first, so zones
+    **  shared between threads should be looked at before.
+    */
+    void setPendingMembers( boost::shared_ptr< ZoneMemberSource const > const & source )
+    {
+        readPendingMembers();
+        pendingMembers = source;
+        ++membersVersion;
+    }
+
+    void readPendingMembers() const
+    {
+        if ( pendingMembers )
+        {
+            boost::shared_ptr< ZoneMemberSource const > source;
+            source.swap( pendingMembers );
+            source->read( memberMachine );
+        }
+    }
+
     void renameMachine( std::string const & oldMachineName, std::string const & newMachineName )
     {
+        readPendingMembers();
         std::vector< IPRange >::iterator i = std::find_if( memberMachine.begin(), memberMachine.end(), boost::phoenix::bind( &IPRange::getAddress, boost::phoenix::arg_names::arg1) == oldMachineName );
 
         if ( i != memberMachine.end() )
+        {
             i->setAddress( newMachineName );
+            ++membersVersion;
+        }
     }
 
     void setComment( std::string const & c )
@@ -99,6 +163,36 @@ public:
         return comment;
     }
 
+    /*!
+    **  \brief Work the members out from the ZoneExpression d from now on,
+    **         or stop if d is empty
+    */
+    void setDefinition( std::string const & d )
+    {
+        definition = d;
+        definitionInputs.clear();
+    }
+
+    std::string const & getDefinition() const
+    {
+        return definition;
+    }
+
+    bool isDefined() const
+    {
+        return !definition.empty();
+    }
+
+    std::vector< std::pair< unsigned int, unsigned int > > const & getDefinitionInputs() const
+    {
+        return definitionInputs;
+    }
+
+    void setDefinitionInputs( std::vector< std::pair< unsigned int, unsigned int > > const & inputs )
+    {
+        definitionInputs = inputs;
+    }
+
     void setName( std::string const & n )
     {
         name = n;
@@ -110,19 +204,55 @@ public:
 
     std::vector<IPRange> const & getMemberMachineList() const
     {
+        readPendingMembers();
         return memberMachine;
     }
 
     void addMemberMachine( IPRange const & ip )
     {
+        readPendingMembers();
         memberMachine.push_back( ip );
+        ++membersVersion;
+    }
+
+    /*!
+    **  \brief Add all of ips, leaving ips empty
+    */
+    void takeMemberMachines( std::vector<IPRange> & ips )
+    {
+        readPendingMembers();
+        if ( memberMachine.empty() )
+        {
+            memberMachine.swap( ips );
+        }
+        else
+        {
+            memberMachine.insert( memberMachine.end(), ips.begin(), ips.end() );
+            ips.clear();
+        }
+        ++membersVersion;
+    }
+
+    /*!
+    **  \brief Make ips the members instead, leaving ips empty
+    */
+    void setMemberMachines( std::vector<IPRange> & ips )
+    {
+        pendingMembers.reset();
+        memberMachine.swap( ips );
+        ips.clear();
+        ++membersVersion;
     }
 
     void deleteMemberMachine( IPRange const & ip )
     {
+        readPendingMembers();
         std::vector<IPRange>::iterator i = std::find( memberMachine.begin(), memberMachine.end(), ip );
         if ( i != memberMachine.end() )
+        {
             memberMachine.erase( i );
+            ++membersVersion;
+        }
     }
 
     bool operator!=( Zone const & rhs ) const
@@ -223,6 +353,55 @@ public:
     {
         return std::find( connections.begin(), connections.end(), zoneName ) != connections.end();
     }
+    void setFastPath( std::string const & zoneTo, bool on )
+    {
+        std::vector< std::string >::iterator i = std::find( fastPaths.begin(), fastPaths.end(), zoneTo );
+        if ( on && i == fastPaths.end() )
+        {
+            fastPaths.push_back( zoneTo );
+        }
+        else if ( !on && i != fastPaths.end() )
+        {
+            fastPaths.erase( i );
+        }
+    }
+    bool isFastPath( std::string const & zoneName ) const
+    {
+        return std::find( fastPaths.begin(), fastPaths.end(), zoneName ) != fastPaths.end();
+    }
+    /*!
+    **  \brief Keep the settings toward zone oldName when it is renamed to
+    **         newName
+    */
+    void renameZoneReferences( std::string const & oldName, std::string const & newName )
+    {
+        std::replace( fastPaths.begin(), fastPaths.end(), oldName, newName );
+        std::replace( quietZones.begin(), quietZones.end(), oldName, newName );
+    }
+    /*!
+    **  \brief Drop the settings toward zone zoneName when it is deleted
+    */
+    void forgetZone( std::string const & zoneName )
+    {
+        setFastPath( zoneName, false );
+        setLogging( zoneName, true );
+    }
+    void setLogging( std::string const & zoneTo, bool on )
+    {
+        std::vector< std::string >::iterator i = std::find( quietZones.begin(), quietZones.end(), zoneTo );
+        if ( !on && i == quietZones.end() )
+        {
+            quietZones.push_back( zoneTo );
+        }
+        else if ( on && i != quietZones.end() )
+        {
+            quietZones.erase( i );
+        }
+    }
+    bool isLogging( std::string const & zoneName ) const
+    {
+        return std::find( quietZones.begin(), quietZones.end(), zoneName ) == quietZones.end();
+    }
     bool isConnectionMutable(std::string const & toZone)
     {
         if(isLocal() && (toZone=="Internet"))
@@ -5,6 +5,7 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/numeric/conversion/cast.hpp>
 
+#include "intervalset.h"
 #include "zone.h"
 #include "zoneImportStrategy.h"
 
@@ -16,7 +17,7 @@
 hostname:255.0.123.222-255.12.1.132 #GOOD
 hostname:321.0.259.0-321.1.0.0 #BAD
 hostname:123.0.0.12-123.0.0.1 #BAD
- *it will be nessicary to convert ip ranges into masked ip addresses.
+ *ranges that overlap or touch are joined, then each becomes one member (see IPRange::fromBounds).
  *there is no support for adding a host name from this format, because the format
  *does not specify a way of doing that, and i don't want to modify the existing standard format
  */
@@ -25,6 +26,7 @@ void ZoneImportP2P::Import(std::istream & in, Zone & zone) const
     std::string tmp;
     std::getline( in, tmp );
     boost::regex const IPaddresses("(\\b\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\b)-(\\b\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\b)");
+    IntervalSet<uint32_t> ranges;
     while(in)
     {
         boost::smatch m;
@@ -32,13 +34,17 @@ void ZoneImportP2P::Import(std::istream & in, Zone & zone) const
         //std::cerr << "Found: " << m[0] << ", on the line: " << tmp << std::endl;
         if(m.size() == 3)
         {
-            RangeFinder finder;
-            if( finder.fromString(m[1], m[2]) )
-                for(uint i(0); i < finder.size(); i++)
-                    zone.addMemberMachine(IPRange(finder.toStdStr(i)));
+            IPRange range(m[1] + "-" + m[2]);
+            uint32_t first, last;
+            if( range.getType() == ipinterval && range.getBounds(first, last) )
+                ranges.add(first, last);
         }
         std::getline( in, tmp );
     }
+    // lists repeat and overlap their ranges a lot, each address goes in once
+    ranges.build();
+    BOOST_FOREACH( IntervalSet<uint32_t>::Interval const & i, ranges )
+        zone.addMemberMachine(IPRange::fromBounds(i.first, i.last));
 }
 
 
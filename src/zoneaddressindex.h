@@ -0,0 +1,273 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "firewall.h"
+#include "intervalset.h"
+#include "memberoverlaps.h"
+
+/*!
+**  \brief Longest prefix match from IPv4 addresses to the zones of a firewall
+**
+**  The generated script sends a packet to the zone of its most specific
+**  matching member address, trying zones in order when the masks are equal,
+**  and everything else to the Internet zone.  The index answers the same
+**  question for addresses found outside the kernel, e.g. in logs, or asked
+**  about on the zone page, with one binary search.
+**
+**  Member machines given as domain names are resolved by iptables when the
+**  script is run and cannot be matched here; they are skipped.  Address
+**  ranges are the prefixes covering them, as in the script, and like the
+**  script the index leaves out the networks MemberOverlaps finds REDUNDANT.
+**
+**  Every network also remembers its place among the rules of the split
+**  chains, which have the SHADOWED networks srcfilt leaves out, so a lookup
+**  can tell how many rules the script checks before it matches.
+*/
+class ZoneAddressIndex
+{
+    /*!
+    **  \brief From start up to the start of the next one, the zone the
+    **         addresses belong to and the zone they go to when it is
+    **         excluded, with the networks that decide it
+    */
+    struct Owner
+    {
+        uint32_t start;
+        uint16_t zone;
+        uint16_t runnerUp;
+        uint32_t rule;                                  // of zone, ruleCount for the Internet zone
+        uint32_t runnerUpRule;
+    };
+
+    std::vector< std::string > names;
+    MemberOverlaps overlaps;
+    std::vector< Owner > owners;                        // sorted by start, the first starting at 0
+    std::vector< uint32_t > rules;                      // split chain position of each MemberOverlaps entry
+    std::vector< std::vector< uint32_t > > zoneRules;   // sorted positions of each zone
+    std::vector< uint32_t > shadowedRules;              // sorted positions srcfilt leaves out
+    uint32_t ruleCount;
+    size_t skipped;                                     // members given by name
+    uint16_t internetZone;
+    uint16_t localZone;
+
+    static bool ownerAfter( uint32_t address, Owner const & owner )
+    {
+        return address < owner.start;
+    }
+
+    static std::vector< std::vector< IPRange > > memberPrefixes( GuardPuppyFireWall const & firewall )
+    {
+        std::vector< std::string > names = firewall.getZoneList();
+        std::vector< std::vector< IPRange > > prefixes( names.size() );
+        for ( size_t z = 0; z < names.size(); z++ )
+        {
+            Zone const & zone = firewall.getZone( names[z] );
+            if ( zone.isInternet() || zone.isLocal() )
+                continue;
+            BOOST_FOREACH( IPRange const & member, zone.getMemberMachineList() )
+            {
+                std::vector< IPRange > p = member.getPrefixes();
+                prefixes[z].insert( prefixes[z].end(), p.begin(), p.end() );
+            }
+        }
+        return prefixes;
+    }
+
+    /*!
+    **  \brief Sweep over the networks, keeping those covering the current
+    **         address on a stack, the most specific one on top
+    */
+    void findOwners()
+    {
+        std::vector< uint32_t > networks;
+        BOOST_FOREACH( uint32_t e, overlaps.getNesting() )
+        {
+            if ( overlaps[e].state != MemberOverlaps::REDUNDANT )
+                networks.push_back( e );
+        }
+
+        std::vector< uint32_t > stack;
+        size_t next = 0;
+        uint64_t address = 0;
+        while ( address < ( (uint64_t)1 << 32 ) )
+        {
+            while ( !stack.empty() && overlaps[ stack.back() ].end() <= address )
+                stack.pop_back();
+            while ( next < networks.size() && overlaps[ networks[next] ].network == address )
+                stack.push_back( networks[next++] );
+
+            Owner o;
+            o.start = address;
+            o.zone = o.runnerUp = internetZone;
+            o.rule = o.runnerUpRule = ruleCount;
+            std::vector< uint32_t >::reverse_iterator it = stack.rbegin();
+            if ( it != stack.rend() )
+            {
+                o.zone = overlaps[*it].zone;
+                o.rule = rules[*it];
+                for ( ; it != stack.rend(); ++it )
+                {
+                    if ( overlaps[*it].zone != o.zone )
+                    {
+                        o.runnerUp = overlaps[*it].zone;
+                        o.runnerUpRule = rules[*it];
+                        break;
+                    }
+                }
+            }
+            if ( owners.empty() || owners.back().zone != o.zone || owners.back().runnerUp != o.runnerUp
+                    || owners.back().rule != o.rule || owners.back().runnerUpRule != o.runnerUpRule )
+                owners.push_back( o );
+
+            uint64_t end = (uint64_t)1 << 32;
+            if ( !stack.empty() )
+                end = overlaps[ stack.back() ].end();
+            if ( next < networks.size() && overlaps[ networks[next] ].network < end )
+                end = overlaps[ networks[next] ].network;
+            address = end;
+        }
+    }
+
+public:
+    ZoneAddressIndex( GuardPuppyFireWall const & firewall )
+     : overlaps( memberPrefixes( firewall ) ), ruleCount( 0 ), skipped( 0 ), internetZone( 0 ), localZone( 0 )
+    {
+        names = firewall.getZoneList();
+        zoneRules.resize( names.size() );
+        for ( uint16_t z = 0; z < names.size(); z++ )
+        {
+            Zone const & zone = firewall.getZone( names[z] );
+            if ( zone.isInternet() )
+                internetZone = z;
+            if ( zone.isLocal() )
+                localZone = z;
+            if ( !zone.isInternet() && !zone.isLocal() )
+            {
+                BOOST_FOREACH( IPRange const & member, zone.getMemberMachineList() )
+                    skipped += member.getPrefixes().size();
+            }
+        }
+        skipped -= overlaps.size();
+
+        // The entries are in srcfilt order.
+        rules.resize( overlaps.size() );
+        for ( uint32_t e = 0; e < overlaps.size(); e++ )
+        {
+            if ( overlaps[e].state == MemberOverlaps::REDUNDANT )
+                continue;
+            rules[e] = ruleCount++;
+            zoneRules[ overlaps[e].zone ].push_back( rules[e] );
+            if ( overlaps[e].state == MemberOverlaps::SHADOWED )
+                shadowedRules.push_back( rules[e] );
+        }
+        findOwners();
+    }
+
+    /*!
+    **  \brief The index of the zone address belongs to, address in host byte order
+    **
+    **  With exclude set, that zone is skipped, like a zone's split chain in
+    **  the script never sends traffic back to the zone itself.  If rule is
+    **  given it is set to the number of address rules the chain checks before
+    **  the matching one, or before its catch-all rule.
+    */
+    uint16_t lookup( uint32_t address, int exclude = -1, uint32_t * rule = 0 ) const
+    {
+        Owner const & o = *( std::upper_bound( owners.begin(), owners.end(), address, ownerAfter ) - 1 );
+        bool excluded = exclude >= 0 && o.zone == exclude;
+        if ( rule )
+            *rule = rulesBefore( excluded ? o.runnerUpRule : o.rule, exclude );
+        return excluded ? o.runnerUp : o.zone;
+    }
+
+    /*!
+    **  \brief lookup() of an address given as text, -1 if it isn't an IPv4
+    **         address
+    */
+    int lookup( std::string const & address, int exclude = -1 ) const
+    {
+        uint32_t a;
+        if ( !AddressTraits< uint32_t >::parse( address, a ) )
+            return -1;
+        return lookup( a, exclude );
+    }
+
+    /*!
+    **  \brief The number of rules before position, in srcfilt if exclude is
+    **         -1 and otherwise in the split chain of the excluded zone
+    */
+    uint32_t rulesBefore( uint32_t position, int exclude = -1 ) const
+    {
+        std::vector< uint32_t > const & left = exclude < 0 ? shadowedRules : zoneRules[exclude];
+        return position - ( std::lower_bound( left.begin(), left.end(), position ) - left.begin() );
+    }
+
+    /*!
+    **  \brief Whether srcfilt leaves out the network at position
+    */
+    bool isShadowed( uint32_t position ) const
+    {
+        return std::binary_search( shadowedRules.begin(), shadowedRules.end(), position );
+    }
+
+    /*!
+    **  \brief A stretch of addresses that all belong to the same zone
+    */
+    struct Region
+    {
+        uint32_t start;         // the region ends where the next one starts
+        uint16_t zone;
+        uint16_t runnerUp;      // the zone when zone is excluded
+    };
+
+    /*!
+    **  \brief Cut the whole IPv4 address space into regions, in order of
+    **         address, on which lookup() gives the same answers.
+    */
+    void regions( std::vector< Region > & out ) const
+    {
+        out.clear();
+        BOOST_FOREACH( Owner const & o, owners )
+        {
+            if ( out.empty() || out.back().zone != o.zone || out.back().runnerUp != o.runnerUp )
+            {
+                Region r;
+                r.start = o.start;
+                r.zone = o.zone;
+                r.runnerUp = o.runnerUp;
+                out.push_back( r );
+            }
+        }
+    }
+
+    /*!
+    **  \brief The number of member machines given by name, which lookup()
+    **         knows nothing about
+    */
+    size_t skippedMembers() const { return skipped; }
+
+    /*!
+    **  \brief How the networks of the zones overlap, zones numbered as here
+    */
+    MemberOverlaps const & getOverlaps() const { return overlaps; }
+
+    /*!
+    **  \brief The positions in the split chains of the networks of zone, in
+    **         order
+    */
+    std::vector< uint32_t > const & getZoneRules( uint16_t zone ) const { return zoneRules[zone]; }
+    uint32_t getRuleCount() const { return ruleCount; }
+
+    uint16_t getLocalZone() const { return localZone; }
+    uint16_t getInternetZone() const { return internetZone; }
+    size_t zoneCount() const { return names.size(); }
+    std::string const & zoneName( uint16_t zone ) const { return names[zone]; }
+};
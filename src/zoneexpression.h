@@ -0,0 +1,244 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "intervalset.h"
+
+/*!
+**  \brief The definition of a zone by other zones, e.g.
+**         "Corporate - Quarantine" or "(Partners + Vendors) & Europe"
+**
+**  Zone names are combined with + (union), - (difference) and & (intersection),
+**  & binding tighter than + and -, which go left to right, and parentheses.
+**  Zone names can have dashes in them, so a - is only taken for a difference
+**  at the start of a word: "dmz-2 -Quarantine" is the zone dmz-2 less the
+**  zone Quarantine.  The expression is kept as the postfix program it parses
+**  to.
+**
+**  Addresses are combined as IntervalSets.  Members that are names rather
+**  than addresses can't be compared with addresses, so they are combined by
+**  name on their own.
+*/
+class ZoneExpression
+{
+public:
+    struct Step
+    {
+        char op;                    // '+', '-', '&', or 0 for the zone
+        std::string zone;
+    };
+
+private:
+    std::vector< Step > steps;
+    std::string text;
+    size_t p;                       // where the parser is in text
+
+    void error( std::string const & message ) const
+    {
+        throw "Zone definition \"" + text + "\": " + message;
+    }
+
+    void skipSpace()
+    {
+        while ( p < text.size() && ( text[p] == ' ' || text[p] == '\t' ) )
+            p++;
+    }
+
+    void step( char op, std::string const & zone = std::string() )
+    {
+        Step s;
+        s.op = op;
+        s.zone = zone;
+        steps.push_back( s );
+    }
+
+    void parseOperand()
+    {
+        skipSpace();
+        if ( p == text.size() )
+            error( "zone name expected at the end" );
+        if ( text[p] == '(' )
+        {
+            p++;
+            parseSum();
+            skipSpace();
+            if ( p == text.size() || text[p] != ')' )
+                error( "')' expected" );
+            p++;
+            return;
+        }
+        size_t start = p;
+        while ( p < text.size() && text[p] != ' ' && text[p] != '\t' && text[p] != '(' && text[p] != ')'
+                && text[p] != '+' && text[p] != '&' && !( text[p] == '-' && p == start ) )
+            p++;
+        if ( p == start )
+            error( std::string( "zone name expected before '" ) + text[p] + "'" );
+        step( 0, text.substr( start, p - start ) );
+    }
+
+    void parseProduct()
+    {
+        parseOperand();
+        while ( true )
+        {
+            skipSpace();
+            if ( p == text.size() || text[p] != '&' )
+                return;
+            p++;
+            parseOperand();
+            step( '&' );
+        }
+    }
+
+    void parseSum()
+    {
+        parseProduct();
+        while ( true )
+        {
+            skipSpace();
+            if ( p == text.size() || ( text[p] != '+' && text[p] != '-' ) )
+                return;
+            char op = text[ p++ ];
+            parseProduct();
+            step( op );
+        }
+    }
+
+    static int precedence( char op )
+    {
+        return op == 0 ? 3 : op == '&' ? 2 : 1;
+    }
+
+    static void combine( char op, IntervalSet< uint32_t > const & lhs, IntervalSet< uint32_t > const & rhs, IntervalSet< uint32_t > & result )
+    {
+        IntervalSet< uint32_t > r = op == '+' ? lhs.unite( rhs ) : op == '-' ? lhs.subtract( rhs ) : lhs.intersect( rhs );
+        result.swap( r );
+    }
+
+    static void combine( char op, std::set< std::string > const & lhs, std::set< std::string > const & rhs, std::set< std::string > & result )
+    {
+        std::insert_iterator< std::set< std::string > > out( result, result.end() );
+        if ( op == '+' )
+            std::set_union( lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), out );
+        else if ( op == '-' )
+            std::set_difference( lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), out );
+        else
+            std::set_intersection( lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), out );
+    }
+
+public:
+    ZoneExpression()
+     : p( 0 )
+    {
+    }
+
+    /*!
+    **  \brief Parse text, throwing a std::string telling what is wrong with
+    **         it if it isn't an expression
+    */
+    explicit ZoneExpression( std::string const & _text )
+     : text( _text ), p( 0 )
+    {
+        skipSpace();
+        if ( p == text.size() )
+            return;
+        parseSum();
+        skipSpace();
+        if ( p != text.size() )
+            error( std::string( "unexpected '" ) + text[p] + "'" );
+    }
+
+    bool empty() const { return steps.empty(); }
+
+    std::vector< Step > const & getSteps() const { return steps; }
+
+    /*!
+    **  \brief The zones named, each once, in the order they first come
+    */
+    std::vector< std::string > getZones() const
+    {
+        std::vector< std::string > zones;
+        BOOST_FOREACH( Step const & s, steps )
+        {
+            if ( s.op == 0 && std::find( zones.begin(), zones.end(), s.zone ) == zones.end() )
+                zones.push_back( s.zone );
+        }
+        return zones;
+    }
+
+    void renameZone( std::string const & oldName, std::string const & newName )
+    {
+        BOOST_FOREACH( Step & s, steps )
+        {
+            if ( s.op == 0 && s.zone == oldName )
+                s.zone = newName;
+        }
+    }
+
+    /*!
+    **  \brief The expression written out again, with only the parentheses
+    **         it needs
+    */
+    std::string str() const
+    {
+        std::vector< std::pair< std::string, char > > stack;     // text and its operator
+        BOOST_FOREACH( Step const & s, steps )
+        {
+            if ( s.op == 0 )
+            {
+                stack.push_back( std::make_pair( s.zone, char( 0 ) ) );
+                continue;
+            }
+            std::pair< std::string, char > rhs = stack.back();
+            stack.pop_back();
+            std::pair< std::string, char > & lhs = stack.back();
+            if ( precedence( lhs.second ) < precedence( s.op ) )
+                lhs.first = "(" + lhs.first + ")";
+            if ( precedence( rhs.second ) <= precedence( s.op ) )
+                rhs.first = "(" + rhs.first + ")";
+            lhs.first += std::string( " " ) + s.op + " " + rhs.first;
+            lhs.second = s.op;
+        }
+        return stack.empty() ? std::string() : stack.back().first;
+    }
+
+    /*!
+    **  \brief What the expression comes to, given the same of each zone in
+    **         it; Set is IntervalSet< uint32_t > or std::set< std::string >
+    */
+    template< class Set >
+    Set evaluate( std::map< std::string, Set > const & zones ) const
+    {
+        std::vector< Set > stack;
+        BOOST_FOREACH( Step const & s, steps )
+        {
+            if ( s.op == 0 )
+            {
+                typename std::map< std::string, Set >::const_iterator z = zones.find( s.zone );
+                if ( z == zones.end() )
+                    throw std::string( "Zone " ) + s.zone + " not in the zone definition";
+                stack.push_back( z->second );
+                continue;
+            }
+            Set rhs;
+            rhs.swap( stack.back() );
+            stack.pop_back();
+            Set result;
+            combine( s.op, stack.back(), rhs, result );
+            stack.back().swap( result );
+        }
+        Set result;
+        if ( !stack.empty() )
+            result.swap( stack.back() );
+        return result;
+    }
+};
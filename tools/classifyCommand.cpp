@@ -0,0 +1,194 @@
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "firewall.h"
+#include "packetclassifier.h"
+#include "firewallLog.h"
+#include "commands.h"
+
+namespace
+{
+    char const * const verdictNames[] = { "ACCEPT", "DROP", "REJECT" };
+    char const * const stateNames[] = { "new", "established", "related", "invalid" };
+
+    uint8_t parseProtocol( std::string const & s )
+    {
+        std::string p = boost::to_lower_copy( s );
+        if ( p == "tcp" )  return IPPROTO_TCP;
+        if ( p == "udp" )  return IPPROTO_UDP;
+        if ( p == "icmp" ) return IPPROTO_ICMP;
+        uint number = boost::lexical_cast< uint >( s );
+        if ( number > 255 )
+            throw std::string( "Not a protocol: " ) + s;
+        return number;
+    }
+
+    uint8_t parseState( std::string const & s )
+    {
+        for ( uint i = 0; i < sizeof( stateNames ) / sizeof( stateNames[0] ); i++ )
+        {
+            if ( boost::iequals( s, stateNames[i] ) )
+                return i;
+        }
+        throw std::string( "Unknown connection state: " ) + s;
+    }
+
+    void printResult( PacketClassifier const & classifier, PacketClassifier::Result const & r )
+    {
+        ZoneAddressIndex const & zones = classifier.getZoneIndex();
+        std::cout << verdictNames[r.verdict] << ( r.logged ? " logged " : " " )
+            << zones.zoneName( r.fromZone ) << " -> " << zones.zoneName( r.toZone ) << "\n";
+    }
+
+    /*!
+    **  \brief Time batches of random packets between the zones' addresses
+    */
+    void benchmark( PacketClassifier const & classifier, size_t count, std::vector< uint32_t > const & addresses )
+    {
+        std::vector< PacketClassifier::Packet > packets( count );
+        uint8_t const protocols[] = { IPPROTO_TCP, IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP };
+        srand( 1 );
+        BOOST_FOREACH( PacketClassifier::Packet & p, packets )
+        {
+            p.src = addresses.empty() || rand() % 2 ? (uint32_t)rand() * 2654435761u : addresses[ rand() % addresses.size() ];
+            p.dst = addresses.empty() || rand() % 2 ? (uint32_t)rand() * 2654435761u : addresses[ rand() % addresses.size() ];
+            p.protocol = protocols[ rand() % 4 ];
+            p.state = PacketClassifier::NEW;
+            p.sport = p.protocol == IPPROTO_ICMP ? rand() % 19 : 1024 + rand() % 64512;
+            p.dport = p.protocol == IPPROTO_ICMP ? 0 : rand() % 2 ? rand() % 1024 : rand() % 65536;
+        }
+
+        std::vector< PacketClassifier::Result > results( count );
+        double start = monotonicSeconds();
+        classifier.classify( &packets[0], &packets[0] + count, &results[0] );
+        double elapsed = monotonicSeconds() - start;
+
+        size_t verdicts[3] = { 0, 0, 0 };
+        BOOST_FOREACH( PacketClassifier::Result const & r, results )
+            verdicts[r.verdict]++;
+        printf( "%zu packets in %.3f s, %.1f ns per packet (%zu accepted, %zu dropped, %zu rejected)\n",
+                count, elapsed, elapsed * 1e9 / count, verdicts[0], verdicts[1], verdicts[2] );
+    }
+
+    void classifyUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool classify [-c firewall] [-l address]... [-B packets] [file]\n"
+            "  -c  firewall script to classify with (default " SYSTEM_RC_FIREWALL2 ")\n"
+            "  -l  address of the firewall itself, may be repeated (default this machine's addresses)\n"
+            "  -B  time this many random packets instead of reading any\n"
+            "  Each line of file (default standard input) is one packet:\n"
+            "    source destination tcp|udp|icmp|number source-port|icmp-type destination-port|icmp-code [new|established|related|invalid]\n";
+    }
+}
+
+/*!
+**  \brief Print the verdict the firewall would give each packet
+*/
+int classifyCommand( int argc, char * argv[] )
+{
+    std::string filename( SYSTEM_RC_FIREWALL2 );
+    std::vector< uint32_t > locals;
+    size_t bench = 0;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "c:l:B:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'c': filename = optarg; break;
+                case 'l': locals.push_back( parseIPv4( optarg ) ); break;
+                case 'B': bench = boost::lexical_cast< size_t >( optarg ); break;
+                default:
+                    classifyUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        classifyUsage();
+        return 1;
+    }
+    if ( locals.empty() )
+        locals = interfaceAddresses();
+
+    GuardPuppyFireWall firewall( false );
+    loadFirewall( firewall, filename );
+    PacketClassifier classifier( firewall );
+    BOOST_FOREACH( uint32_t address, locals )
+        classifier.addLocalAddress( address );
+
+    if ( bench > 0 )
+    {
+        std::vector< uint32_t > addresses = locals;
+        BOOST_FOREACH( std::string const & zoneName, firewall.getZoneList() )
+        {
+            BOOST_FOREACH( IPRange range, firewall.getZone( zoneName ).getMemberMachineList() )
+            {
+                if ( range.getType() == ip || range.getType() == iprange )
+                    addresses.push_back( parseIPv4( range.getAddress().substr( 0, range.getAddress().find( '/' ) ) ) );
+                else if ( range.getType() == ipinterval )
+                    addresses.push_back( parseIPv4( range.getAddress().substr( 0, range.getAddress().find( '-' ) ) ) );
+            }
+        }
+        benchmark( classifier, bench, addresses );
+        return 0;
+    }
+
+    std::ifstream file;
+    if ( optind < argc )
+    {
+        file.open( argv[optind] );
+        if ( !file )
+            throw std::string( "Unable to open " ) + argv[optind];
+    }
+    std::istream & in = optind < argc ? file : std::cin;
+
+    std::string line;
+    uint lineno = 0;
+    while ( std::getline( in, line ) )
+    {
+        lineno++;
+        std::vector< std::string > fields;
+        boost::split( fields, line, boost::is_any_of( " \t" ), boost::token_compress_on );
+        fields.erase( std::remove( fields.begin(), fields.end(), std::string() ), fields.end() );
+        if ( fields.empty() || fields[0][0] == '#' )
+            continue;
+        try
+        {
+            if ( fields.size() < 5 || fields.size() > 6 )
+                throw std::string( "expected 5 or 6 fields" );
+            PacketClassifier::Packet p;
+            p.src = parseIPv4( fields[0] );
+            p.dst = parseIPv4( fields[1] );
+            p.protocol = parseProtocol( fields[2] );
+            p.sport = boost::lexical_cast< uint16_t >( fields[3] );
+            p.dport = boost::lexical_cast< uint16_t >( fields[4] );
+            p.state = fields.size() == 6 ? parseState( fields[5] ) : (uint8_t)PacketClassifier::NEW;
+            printResult( classifier, classifier.classify( p ) );
+        }
+        catch ( std::string const & msg )
+        {
+            std::cerr << "line " << lineno << ": " << msg << std::endl;
+        }
+        catch ( boost::bad_lexical_cast const & )
+        {
+            std::cerr << "line " << lineno << ": bad number" << std::endl;
+        }
+    }
+    return 0;
+}
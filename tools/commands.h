@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+   Each guard-puppy-tool sub command gets the arguments following its name,
+   argv[0] being the name itself, and returns the process exit code.
+ */
+
+int nflogCommand( int argc, char * argv[] );
+int logstatsCommand( int argc, char * argv[] );
+int logbenchCommand( int argc, char * argv[] );
+int learnCommand( int argc, char * argv[] );
+int classifyCommand( int argc, char * argv[] );
+int replayCommand( int argc, char * argv[] );
+int compareCommand( int argc, char * argv[] );
+int savebenchCommand( int argc, char * argv[] );
+int loadbenchCommand( int argc, char * argv[] );
+int dbbenchCommand( int argc, char * argv[] );
+int setbenchCommand( int argc, char * argv[] );
@@ -0,0 +1,141 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+#include "firewall.h"
+#include "policyequivalence.h"
+#include "firewallLog.h"
+#include "commands.h"
+
+namespace
+{
+    char const * const verdictNames[] = { "ACCEPT", "DROP", "REJECT" };
+
+    std::string formatAddress( uint32_t address )
+    {
+        struct in_addr addr;
+        addr.s_addr = htonl( address );
+        return inet_ntoa( addr );
+    }
+
+    std::string formatRange( uint first, uint last )
+    {
+        if ( first == last )
+            return boost::lexical_cast< std::string >( first );
+        return boost::lexical_cast< std::string >( first ) + ":" + boost::lexical_cast< std::string >( last );
+    }
+
+    void printRanges( char const * label, std::vector< PolicyEquivalence::AddressRange > const & ranges, size_t shown )
+    {
+        printf( "  %-13s", label );
+        if ( ranges.empty() )
+            printf( " the firewall itself" );
+        for ( size_t i = 0; i < ranges.size() && i < shown; i++ )
+        {
+            std::string first = formatAddress( ranges[i].first );
+            if ( ranges[i].first == ranges[i].last )
+                printf( "%s %s", i ? "," : "", first.c_str() );
+            else
+                printf( "%s %s-%s", i ? "," : "", first.c_str(), formatAddress( ranges[i].last ).c_str() );
+        }
+        if ( ranges.size() > shown )
+            printf( " and %zu more ranges", ranges.size() - shown );
+        printf( "\n" );
+    }
+
+    void printPorts( PolicyEquivalence::PortRegion const & r )
+    {
+        std::string what;
+        if ( r.protocolFirst == IPPROTO_TCP || r.protocolFirst == IPPROTO_UDP )
+        {
+            what = std::string( r.protocolFirst == IPPROTO_TCP ? "tcp" : "udp" ) + " sport " + formatRange( r.sportFirst, r.sportLast )
+                + " dport " + formatRange( r.dportFirst, r.dportLast );
+        }
+        else if ( r.protocolFirst == IPPROTO_ICMP )
+        {
+            what = "icmp type " + formatRange( r.sportFirst, r.sportLast );
+            if ( r.dportFirst != 0 || r.dportLast != 255 )
+                what += " code " + formatRange( r.dportFirst, r.dportLast );
+        }
+        else
+        {
+            what = "protocol " + formatRange( r.protocolFirst, r.protocolLast );
+        }
+        printf( "    %-48s %-6s / %s\n", what.c_str(), verdictNames[r.verdictA], verdictNames[r.verdictB] );
+    }
+
+    void compareUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool compare [-v] [-n ranges] firewall-a firewall-b\n"
+            "  -v  tell a DROP from a REJECT, not only whether a connection gets through\n"
+            "  -n  most address ranges printed for each difference (default 4)\n"
+            "  Exits with 0 when the firewalls treat every new connection the same, 1 when not.\n";
+    }
+}
+
+/*!
+**  \brief Check whether two firewall scripts permit the same connections
+*/
+int compareCommand( int argc, char * argv[] )
+{
+    bool verdicts = false;
+    size_t shown = 4;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "vn:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'v': verdicts = true; break;
+                case 'n': shown = boost::lexical_cast< size_t >( optarg ); break;
+                default:
+                    compareUsage();
+                    return 2;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        compareUsage();
+        return 2;
+    }
+    if ( argc - optind != 2 )
+    {
+        compareUsage();
+        return 2;
+    }
+
+    GuardPuppyFireWall a( false );
+    loadFirewall( a, argv[optind] );
+    GuardPuppyFireWall b( false );
+    loadFirewall( b, argv[optind + 1] );
+
+    double start = monotonicSeconds();
+    PolicyEquivalence equivalence( a, b, verdicts );
+    double elapsed = monotonicSeconds() - start;
+
+    BOOST_FOREACH( PolicyEquivalence::Difference const & d, equivalence.getDifferences() )
+    {
+        printf( "%s -> %s / %s -> %s\n", d.fromA.c_str(), d.toA.c_str(), d.fromB.c_str(), d.toB.c_str() );
+        printRanges( "from", d.sources, shown );
+        printRanges( "to", d.destinations, shown );
+        BOOST_FOREACH( PolicyEquivalence::PortRegion const & r, d.ports )
+            printPorts( r );
+    }
+    if ( equivalence.skippedMembers() > 0 )
+    {
+        std::cerr << equivalence.skippedMembers() << " zone members given by name were left out" << std::endl;
+    }
+    std::cerr << ( equivalence.equivalent() ? "equivalent" : "different" ) << ", compared in " << elapsed << " s" << std::endl;
+    return equivalence.equivalent() ? 0 : 1;
+}
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "firewall.h"
+#include "mappedfile.h"
+
+/*
+   Reading the kernel log lines written by the LOG (or, through the nflog
+   command, NFLOG) targets of a guard-puppy firewall.
+ */
+
+/*!
+**  \brief The log prefixes the generated firewall uses, in the order the
+**         columns are printed.
+*/
+enum LogAction { DROPPED, REJECTED, ABORTED, LIMITED, ACTIONCOUNT };
+
+struct LogPrefix
+{
+    char const * text;
+    size_t length;
+};
+
+LogPrefix const logPrefixes[ACTIONCOUNT] = {
+    { "DROPPED ", 8 },
+    { "REJECTED ", 9 },
+    { "ABORTED ", 8 },
+    { "LIMITED ", 8 },
+};
+
+/*!
+**  \brief The fields of one firewall log line guard-puppy cares about
+*/
+struct LogEntry
+{
+    LogAction action;
+    bool fromLocal;         // no input interface, the firewall itself sent it
+    bool toLocal;           // no output interface, addressed to the firewall
+    uint32_t src;           // host byte order
+    uint32_t dst;
+    uint8_t protocol;       // IPPROTO_xxx, 0 if the line had none
+    bool hasPorts;
+    uint sport;
+    uint dport;
+};
+
+namespace firewalllog
+{
+    /*!
+    **  \brief Find the value of " KEY=" between p and end, the key includes
+    **         the leading space and the equals sign.
+    */
+    inline char const * findField( char const * p, char const * end, char const * key, size_t keylen )
+    {
+        void const * hit = memmem( p, end - p, key, keylen );
+        return hit ? static_cast< char const * >( hit ) + keylen : 0;
+    }
+
+    inline char const * parseAddress( char const * p, char const * end, uint32_t & address )
+    {
+        address = 0;
+        for ( int octet = 0; octet < 4; octet++ )
+        {
+            uint value = 0;
+            char const * start = p;
+            while ( p < end && *p >= '0' && *p <= '9' && p - start < 3 )
+                value = value * 10 + ( *p++ - '0' );
+            if ( p == start || value > 255 )
+                return 0;
+            address = ( address << 8 ) | value;
+            if ( octet < 3 )
+            {
+                if ( p == end || *p != '.' )
+                    return 0;
+                p++;
+            }
+        }
+        return p;
+    }
+
+    inline char const * parseNumber( char const * p, char const * end, uint & number, uint max )
+    {
+        number = 0;
+        char const * start = p;
+        while ( p < end && *p >= '0' && *p <= '9' && p - start < 10 )
+            number = number * 10 + ( *p++ - '0' );
+        return ( p == start || number > max ) ? 0 : p;
+    }
+
+    /*!
+    **  \brief Parse the fields of a line.  field points just past its "IN=".
+    */
+    inline bool parseLine( LogEntry & entry, char const * field, char const * end )
+    {
+        entry.fromLocal = ( field == end || *field == ' ' );
+
+        char const * out = findField( field, end, " OUT=", 5 );
+        char const * src = out ? findField( out, end, " SRC=", 5 ) : 0;
+        char const * p = src ? parseAddress( src, end, entry.src ) : 0;
+        char const * dst = p ? findField( p, end, " DST=", 5 ) : 0;
+        p = dst ? parseAddress( dst, end, entry.dst ) : 0;
+        if ( p == 0 )
+            return false;
+        entry.toLocal = ( out == end || *out == ' ' );
+
+        entry.protocol = 0;
+        entry.hasPorts = false;
+        char const * proto = findField( p, end, " PROTO=", 7 );
+        if ( proto == 0 || end - proto < 3 )
+            return true;
+        uint number;
+        if ( memcmp( proto, "TCP", 3 ) == 0 )
+            entry.protocol = IPPROTO_TCP;
+        else if ( memcmp( proto, "UDP", 3 ) == 0 )
+            entry.protocol = IPPROTO_UDP;
+        else if ( end - proto >= 4 && memcmp( proto, "ICMP", 4 ) == 0 )
+            entry.protocol = IPPROTO_ICMP;
+        else if ( parseNumber( proto, end, number, 255 ) )
+            entry.protocol = number;
+        if ( entry.protocol != IPPROTO_TCP && entry.protocol != IPPROTO_UDP )
+            return true;
+
+        char const * spt = findField( proto, end, " SPT=", 5 );
+        p = spt ? parseNumber( spt, end, entry.sport, 65535 ) : 0;
+        char const * dpt = p ? findField( p, end, " DPT=", 5 ) : 0;
+        entry.hasPorts = dpt && parseNumber( dpt, end, entry.dport, 65535 );
+        return true;
+    }
+}
+
+/*!
+**  \brief Hand the firewall log lines between begin and end, which must both
+**         be at the start of a line, to sink.entry(), and count the ones that
+**         can't be read with sink.malformed().
+**
+**  Only lines with "IN=" can be firewall log lines, so memmem skips over
+**  everything else without looking at line boundaries at all.
+*/
+template< class Sink >
+void scanLog( Sink & sink, char const * begin, char const * end )
+{
+    LogEntry entry;
+    char const * p = begin;
+    while ( p < end )
+    {
+        char const * hit = static_cast< char const * >( memmem( p, end - p, "IN=", 3 ) );
+        if ( hit == 0 )
+            break;
+        char const * lineEnd = static_cast< char const * >( memchr( hit, '\n', end - hit ) );
+        if ( lineEnd == 0 )
+            lineEnd = end;
+
+        for ( int action = 0; action < ACTIONCOUNT; action++ )
+        {
+            size_t len = logPrefixes[action].length;
+            if ( (size_t)( hit - begin ) >= len && memcmp( hit - len, logPrefixes[action].text, len ) == 0 )
+            {
+                entry.action = (LogAction)action;
+                if ( firewalllog::parseLine( entry, hit + 3, lineEnd ) )
+                    sink.entry( entry );
+                else
+                    sink.malformed();
+                break;
+            }
+        }
+        p = lineEnd + 1;
+    }
+}
+
+/*!
+**  \brief Split the log into one line aligned part per sink and scan the
+**         parts in parallel, one thread each.
+*/
+template< class Sink >
+void scanLogParallel( std::vector< Sink > & sinks, char const * begin, char const * end )
+{
+    size_t parts = sinks.size();
+    std::vector< char const * > bounds;
+    bounds.push_back( begin );
+    for ( size_t i = 1; i < parts; i++ )
+    {
+        char const * p = begin + ( end - begin ) * i / parts;
+        if ( p < bounds.back() )
+            p = bounds.back();
+        char const * nl = static_cast< char const * >( memchr( p, '\n', end - p ) );
+        bounds.push_back( nl ? nl + 1 : end );
+    }
+    bounds.push_back( end );
+
+    if ( parts == 1 )
+    {
+        scanLog( sinks[0], begin, end );
+        return;
+    }
+    boost::thread_group group;
+    for ( size_t i = 0; i < parts; i++ )
+    {
+        group.create_thread( boost::bind( &scanLog< Sink >, boost::ref( sinks[i] ), bounds[i], bounds[i + 1] ) );
+    }
+    group.join_all();
+}
+
+inline double monotonicSeconds()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+inline unsigned defaultThreads()
+{
+    unsigned threads = boost::thread::hardware_concurrency();
+    return threads == 0 ? 1 : threads;
+}
+
+/*!
+**  \brief Read the zones etc. of a firewall script, for tools working on
+**         logs it produced.
+*/
+inline void loadFirewall( GuardPuppyFireWall & firewall, std::string const & filename )
+{
+    if ( !boost::filesystem::exists( filename ) )
+    {
+        throw std::string( "Unable to find the firewall script " ) + filename;
+    }
+    firewall.readFirewall( filename );
+}
+
+/*!
+**  \brief Parse a dotted IPv4 address into host byte order
+*/
+inline uint32_t parseIPv4( std::string const & s )
+{
+    struct in_addr addr;
+    if ( inet_aton( s.c_str(), &addr ) == 0 )
+    {
+        throw std::string( "Not an IPv4 address: " ) + s;
+    }
+    return ntohl( addr.s_addr );
+}
+
+/*!
+**  \brief The IPv4 addresses of this machine, which the script finds with
+**         ifconfig when it runs.
+*/
+inline std::vector< uint32_t > interfaceAddresses()
+{
+    std::vector< uint32_t > addresses;
+    struct ifaddrs * list;
+    if ( getifaddrs( &list ) < 0 )
+        return addresses;
+    for ( struct ifaddrs * i = list; i != 0; i = i->ifa_next )
+    {
+        if ( i->ifa_addr && i->ifa_addr->sa_family == AF_INET )
+            addresses.push_back( ntohl( ( (struct sockaddr_in *)i->ifa_addr )->sin_addr.s_addr ) );
+    }
+    freeifaddrs( list );
+    return addresses;
+}
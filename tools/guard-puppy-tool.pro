@@ -0,0 +1,53 @@
+######################################################################
+# Command line helpers for guard-puppy firewalls.
+######################################################################
+
+TEMPLATE = app
+TARGET = guard-puppy-tool
+DEPENDPATH += . ../src
+INCLUDEPATH += . ../src
+
+CONFIG += debug
+CONFIG += console
+CONFIG -= app_bundle
+
+LIBS += -L/usr/lib -L/usr/lib64  -lboost_regex -lboost_filesystem -lboost_system -lboost_thread
+
+QT += core
+QT -= gui
+
+# Input
+HEADERS += commands.h
+HEADERS += firewallLog.h
+HEADERS += pcapReader.h
+HEADERS += ../src/atomicfile.h
+HEADERS += ../src/firewall.h
+HEADERS += ../src/intervalset.h
+HEADERS += ../src/mappedfile.h
+HEADERS += ../src/memberoverlaps.h
+HEADERS += ../src/nflogreader.h
+HEADERS += ../src/packetclassifier.h
+HEADERS += ../src/perfecthash.h
+HEADERS += ../src/policyequivalence.h
+HEADERS += ../src/policysnapshot.h
+HEADERS += ../src/portintervals.h
+HEADERS += ../src/protocolcache.h
+HEADERS += ../src/protocolportindex.h
+HEADERS += ../src/protocoltable.h
+HEADERS += ../src/protocoltext.h
+HEADERS += ../src/scriptlines.h
+HEADERS += ../src/snapshothash.h
+HEADERS += ../src/xmlpullparser.h
+HEADERS += ../src/zoneaddressindex.h
+HEADERS += ../src/zoneexpression.h
+
+SOURCES += classifyCommand.cpp
+SOURCES += compareCommand.cpp
+SOURCES += guardPuppyTool.cpp
+SOURCES += learnCommand.cpp
+SOURCES += logstatsCommand.cpp
+SOURCES += nflogCommand.cpp
+SOURCES += replayCommand.cpp
+SOURCES += saveCommand.cpp
+SOURCES += setbenchCommand.cpp
+SOURCES += ../src/zoneImportStrategy.cpp
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <string>
+
+#include "zone.h"
+#include "commands.h"
+
+unsigned int Zone::nextId = 0;
+
+namespace
+{
+    struct Command
+    {
+        char const * name;
+        int (*run)( int argc, char * argv[] );
+        char const * help;
+    };
+
+    Command const commands[] = {
+        { "nflog", nflogCommand, "Print the packets the firewall logs through NFLOG" },
+        { "logstats", logstatsCommand, "Count the firewall log entries by zone pair and port" },
+        { "logbench", logbenchCommand, "Time logstats on a generated log" },
+        { "learn", learnCommand, "Suggest protocols to permit from the packets the firewall dropped" },
+        { "classify", classifyCommand, "Print what the firewall would do with given packets" },
+        { "replay", replayCommand, "Replay packet captures through the firewall offline" },
+        { "compare", compareCommand, "Check whether two firewalls permit the same connections" },
+        { "savebench", savebenchCommand, "Time writing the firewall script" },
+        { "loadbench", loadbenchCommand, "Time reading the firewall script" },
+        { "dbbench", dbbenchCommand, "Time loading the protocol database" },
+        { "setbench", setbenchCommand, "Time address interval set operations" },
+    };
+    size_t const commandcount = sizeof( commands ) / sizeof( commands[0] );
+
+    void usage()
+    {
+        std::cerr << "Usage: guard-puppy-tool <command> [options]\n\nCommands:\n";
+        for ( size_t i = 0; i < commandcount; i++ )
+        {
+            std::cerr << "  " << commands[i].name << "\t" << commands[i].help << "\n";
+        }
+    }
+}
+
+int main( int argc, char * argv[] )
+{
+    if ( argc < 2 )
+    {
+        usage();
+        return 1;
+    }
+
+    std::string name = argv[1];
+    for ( size_t i = 0; i < commandcount; i++ )
+    {
+        if ( name == commands[i].name )
+        {
+            try
+            {
+                return commands[i].run( argc - 1, argv + 1 );
+            }
+            catch ( std::string const & msg )
+            {
+                std::cerr << "guard-puppy-tool " << name << ": " << msg << std::endl;
+                return 1;
+            }
+        }
+    }
+    usage();
+    return 1;
+}
@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+#include "firewall.h"
+#include "zoneaddressindex.h"
+#include "protocolportindex.h"
+#include "firewallLog.h"
+#include "commands.h"
+
+namespace
+{
+    /*!
+    **  \brief Counts the dropped packets each protocol would explain, per
+    **         zone pair, for one part of the log.
+    **
+    **  A packet matching several protocols counts for those whose
+    **  destination port range is the narrowest, so ssh gets port 22 and not
+    **  every protocol with a port range across it.
+    */
+    struct Learner
+    {
+        ZoneAddressIndex const * zones;
+        ProtocolPortIndex const * protocols;
+        size_t zoneCount;
+        size_t protocolCount;
+        std::vector< uint64_t > hits;           // [ ( client * zoneCount + server ) * protocolCount + protocol ]
+        std::vector< uint64_t > unexplained;    // [ from * zoneCount + to ]
+        std::vector< ProtocolPortMatch > matches;
+        uint64_t entries;
+        uint64_t malformedEntries;
+
+        Learner( ZoneAddressIndex const & _zones, ProtocolPortIndex const & _protocols )
+         : zones( &_zones ), protocols( &_protocols ), zoneCount( _zones.zoneCount() ), protocolCount( _protocols.protocolCount() ),
+           hits( zoneCount * zoneCount * protocolCount ), unexplained( zoneCount * zoneCount ), entries( 0 ), malformedEntries( 0 )
+        {
+        }
+
+        void entry( LogEntry const & e )
+        {
+            if ( ( e.action != DROPPED && e.action != REJECTED ) || !e.hasPorts )
+                return;
+            entries++;
+
+            uint16_t from = e.fromLocal ? zones->getLocalZone() : zones->lookup( e.src );
+            uint16_t to = e.toLocal ? zones->getLocalZone() : zones->lookup( e.dst, from );   // as the split chain of from does
+            if ( protocols->lookup( e.protocol, e.sport, e.dport, matches ) == 0 )
+            {
+                unexplained[ from * zoneCount + to ]++;
+                return;
+            }
+
+            uint narrowest = matches[0].width;
+            BOOST_FOREACH( ProtocolPortMatch const & m, matches )
+                narrowest = std::min( narrowest, m.width );
+            BOOST_FOREACH( ProtocolPortMatch const & m, matches )
+            {
+                if ( m.width != narrowest )
+                    continue;
+                size_t pair = m.reversed ? to * zoneCount + from : from * zoneCount + to;
+                hits[ pair * protocolCount + m.protocol ]++;
+            }
+        }
+
+        void malformed()
+        {
+            malformedEntries++;
+        }
+
+        void merge( Learner const & rhs )
+        {
+            for ( size_t i = 0; i < hits.size(); i++ )
+                hits[i] += rhs.hits[i];
+            for ( size_t i = 0; i < unexplained.size(); i++ )
+                unexplained[i] += rhs.unexplained[i];
+            entries += rhs.entries;
+            malformedEntries += rhs.malformedEntries;
+        }
+    };
+
+    char const * stateName( Zone::ProtocolState state )
+    {
+        switch ( state )
+        {
+            case Zone::PERMIT: return "permitted";
+            case Zone::REJECT: return "rejected";
+            case Zone::DENY:
+            default:           return "denied";
+        }
+    }
+
+    void learnUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool learn [-c firewall] [-j threads] [-n protocols] logfile...\n"
+            "  -c  firewall script whose zones and protocols are used (default " SYSTEM_RC_FIREWALL2 ")\n"
+            "  -j  threads scanning each file (default one per cpu)\n"
+            "  -n  most protocols suggested for each zone pair (default 10)\n";
+    }
+}
+
+/*!
+**  \brief Suggest the protocols to permit between zones from the packets
+**         a firewall dropped or rejected.
+*/
+int learnCommand( int argc, char * argv[] )
+{
+    std::string filename( SYSTEM_RC_FIREWALL2 );
+    unsigned threads = defaultThreads();
+    size_t top = 10;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "c:j:n:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'c': filename = optarg; break;
+                case 'j': threads = std::max( 1u, boost::lexical_cast< unsigned >( optarg ) ); break;
+                case 'n': top = boost::lexical_cast< size_t >( optarg ); break;
+                default:
+                    learnUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        learnUsage();
+        return 1;
+    }
+    if ( optind >= argc )
+    {
+        learnUsage();
+        return 1;
+    }
+
+    GuardPuppyFireWall firewall( false );
+    loadFirewall( firewall, filename );
+    ZoneAddressIndex zones( firewall );
+    ProtocolPortIndex protocols;
+    firewall.ApplyToDB( protocols );
+    protocols.build();
+
+    Learner total( zones, protocols );
+    for ( int i = optind; i < argc; i++ )
+    {
+        MappedFile log( argv[i] );
+        std::vector< Learner > parts( threads, Learner( zones, protocols ) );
+        scanLogParallel( parts, log.begin(), log.end() );
+        BOOST_FOREACH( Learner const & part, parts )
+            total.merge( part );
+    }
+
+    for ( uint16_t client = 0; client < zones.zoneCount(); client++ )
+    {
+        for ( uint16_t server = 0; server < zones.zoneCount(); server++ )
+        {
+            if ( client == server )
+                continue;
+            std::string const & clientName = zones.zoneName( client );
+            std::string const & serverName = zones.zoneName( server );
+
+            uint64_t const * counts = &total.hits[ ( client * total.zoneCount + server ) * total.protocolCount ];
+            std::vector< std::pair< uint64_t, uint16_t > > ranked;
+            for ( uint16_t p = 0; p < total.protocolCount; p++ )
+            {
+                if ( counts[p] != 0 )
+                    ranked.push_back( std::make_pair( counts[p], p ) );
+            }
+            uint64_t other = total.unexplained[ client * total.zoneCount + server ];
+            if ( ranked.empty() && other == 0 )
+                continue;
+
+            size_t shown = std::min( top, ranked.size() );
+            std::partial_sort( ranked.begin(), ranked.begin() + shown, ranked.end(), std::greater< std::pair< uint64_t, uint16_t > >() );
+
+            printf( "%s -> %s\n", clientName.c_str(), serverName.c_str() );
+            for ( size_t i = 0; i < shown; i++ )
+            {
+                std::string const & name = protocols.getProtocolName( ranked[i].second );
+                printf( "  %-24s %12llu  %s\n", name.c_str(), (unsigned long long)ranked[i].first,
+                        stateName( firewall.getProtocolState( clientName, serverName, name ) ) );
+            }
+            if ( other != 0 )
+                printf( "  %-24s %12llu\n", "(no protocol)", (unsigned long long)other );
+        }
+    }
+    std::cerr << total.entries << " dropped or rejected packets with ports, " << total.malformedEntries << " malformed entries" << std::endl;
+    return 0;
+}
@@ -0,0 +1,316 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+#include "firewall.h"
+#include "zoneaddressindex.h"
+#include "firewallLog.h"
+#include "commands.h"
+
+namespace
+{
+    enum PortProtocol { TCP, UDP, PORTPROTOCOLCOUNT };
+    char const * const portProtocolNames[PORTPROTOCOLCOUNT] = { "tcp", "udp" };
+
+    /*!
+    **  \brief Counters for one part of the log, merged once all parts are done
+    */
+    struct LogStats
+    {
+        ZoneAddressIndex const * index;
+        size_t zones;
+        std::vector< uint64_t > pairs;      // [ ( from * zones + to ) * ACTIONCOUNT + action ]
+        std::vector< uint64_t > ports;      // [ protocol * 65536 + destination port ]
+        uint64_t entries;
+        uint64_t malformedEntries;
+
+        LogStats( ZoneAddressIndex const & _index )
+         : index( &_index ), zones( _index.zoneCount() ), pairs( zones * zones * ACTIONCOUNT ), ports( PORTPROTOCOLCOUNT * 65536 ),
+           entries( 0 ), malformedEntries( 0 )
+        {
+        }
+
+        void entry( LogEntry const & e )
+        {
+            uint16_t from = e.fromLocal ? index->getLocalZone() : index->lookup( e.src );
+            uint16_t to = e.toLocal ? index->getLocalZone() : index->lookup( e.dst, from );   // as the split chain of from does
+            pairs[ ( from * zones + to ) * ACTIONCOUNT + e.action ]++;
+            entries++;
+            if ( e.hasPorts )
+                ports[ ( e.protocol == IPPROTO_TCP ? TCP : UDP ) * 65536 + e.dport ]++;
+        }
+
+        void malformed()
+        {
+            malformedEntries++;
+        }
+
+        void merge( LogStats const & rhs )
+        {
+            for ( size_t i = 0; i < pairs.size(); i++ )
+                pairs[i] += rhs.pairs[i];
+            for ( size_t i = 0; i < ports.size(); i++ )
+                ports[i] += rhs.ports[i];
+            entries += rhs.entries;
+            malformedEntries += rhs.malformedEntries;
+        }
+    };
+
+    void analyze( LogStats & total, ZoneAddressIndex const & index, char const * begin, char const * end, unsigned threads )
+    {
+        std::vector< LogStats > parts( threads, LogStats( index ) );
+        scanLogParallel( parts, begin, end );
+        for ( unsigned i = 0; i < threads; i++ )
+            total.merge( parts[i] );
+    }
+
+    void printStats( LogStats const & stats, ZoneAddressIndex const & index, size_t topPorts )
+    {
+        printf( "%-16s %-16s", "From", "To" );
+        for ( int action = 0; action < ACTIONCOUNT; action++ )
+            printf( " %10.*s", (int)logPrefixes[action].length - 1, logPrefixes[action].text );
+        printf( "\n" );
+        for ( uint16_t from = 0; from < stats.zones; from++ )
+        {
+            for ( uint16_t to = 0; to < stats.zones; to++ )
+            {
+                uint64_t const * counts = &stats.pairs[ ( from * stats.zones + to ) * ACTIONCOUNT ];
+                if ( std::count( counts, counts + ACTIONCOUNT, 0 ) == ACTIONCOUNT )
+                    continue;
+                printf( "%-16s %-16s", index.zoneName( from ).c_str(), index.zoneName( to ).c_str() );
+                for ( int action = 0; action < ACTIONCOUNT; action++ )
+                    printf( " %10llu", (unsigned long long)counts[action] );
+                printf( "\n" );
+            }
+        }
+
+        std::vector< std::pair< uint64_t, size_t > > ports;
+        for ( size_t i = 0; i < stats.ports.size(); i++ )
+        {
+            if ( stats.ports[i] != 0 )
+                ports.push_back( std::make_pair( stats.ports[i], i ) );
+        }
+        size_t shown = std::min( topPorts, ports.size() );
+        std::partial_sort( ports.begin(), ports.begin() + shown, ports.end(), std::greater< std::pair< uint64_t, size_t > >() );
+        if ( shown > 0 )
+        {
+            printf( "\n%-16s %10s\n", "Port", "Entries" );
+        }
+        for ( size_t i = 0; i < shown; i++ )
+        {
+            char port[16];
+            snprintf( port, sizeof( port ), "%s/%u", portProtocolNames[ ports[i].second / 65536 ], (uint)( ports[i].second % 65536 ) );
+            printf( "%-16s %10llu\n", port, (unsigned long long)ports[i].first );
+        }
+    }
+
+    void logstatsUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool logstats [-c firewall] [-j threads] [-n ports] logfile...\n"
+            "  -c  firewall script whose zones classify the addresses (default " SYSTEM_RC_FIREWALL2 ")\n"
+            "  -j  threads scanning each file (default one per cpu)\n"
+            "  -n  busiest destination ports listed (default 20)\n";
+    }
+
+    void logbenchUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool logbench [-c firewall] [-j threads] [-m megabytes] [fixture]\n"
+            "  -c  firewall script whose zones classify the addresses (default " SYSTEM_RC_FIREWALL2 ")\n"
+            "  -j  most threads tried (default one per cpu)\n"
+            "  -m  size of the generated log (default 512)\n"
+            "  fixture is a sample log repeated to the size, a built in one is used when not given\n";
+    }
+
+    /*!
+    **  \brief A small mixed log: firewall lines of every kind between the
+    **         ordinary kernel and daemon chatter they are usually buried in.
+    */
+    char const * const builtinFixture =
+        "Oct 19 10:00:01 gw kernel: [8312.101] DROPPED IN=eth0 OUT= MAC=00:11:22:33:44:55:66:77:88:99:aa:bb:08:00 SRC=203.0.113.7 DST=192.0.2.1 LEN=60 TOS=0x00 PREC=0x00 TTL=52 ID=4242 DF PROTO=TCP SPT=51514 DPT=22 WINDOW=29200 RES=0x00 SYN URGP=0\n"
+        "Oct 19 10:00:01 gw sshd[1021]: Connection closed by 198.51.100.4 port 40022 [preauth]\n"
+        "Oct 19 10:00:02 gw kernel: [8312.544] REJECTED IN=eth1 OUT=eth0 SRC=192.168.1.23 DST=198.51.100.9 LEN=52 TOS=0x00 PREC=0x00 TTL=63 ID=0 DF PROTO=TCP SPT=40110 DPT=25 WINDOW=64240 RES=0x00 SYN URGP=0\n"
+        "Oct 19 10:00:02 gw CRON[2210]: (root) CMD (command -v debian-sa1 > /dev/null && debian-sa1 1 1)\n"
+        "Oct 19 10:00:03 gw kernel: [8313.002] DROPPED IN=eth0 OUT= MAC=00:11:22:33:44:55:66:77:88:99:aa:bb:08:00 SRC=198.51.100.77 DST=192.0.2.1 LEN=78 TOS=0x00 PREC=0x00 TTL=117 ID=1290 PROTO=UDP SPT=137 DPT=137 LEN=58\n"
+        "Oct 19 10:00:03 gw kernel: [8313.120] ABORTED IN=eth0 OUT= MAC=00:11:22:33:44:55:66:77:88:99:aa:bb:08:00 SRC=203.0.113.80 DST=192.0.2.1 LEN=40 TOS=0x00 PREC=0x00 TTL=49 ID=0 DF PROTO=TCP SPT=443 DPT=53312 WINDOW=0 RES=0x00 RST URGP=0\n"
+        "Oct 19 10:00:04 gw dhclient[811]: DHCPREQUEST for 192.0.2.1 on eth0 to 192.0.2.254 port 67\n"
+        "Oct 19 10:00:04 gw kernel: [8314.887] DROPPED IN= OUT=eth0 SRC=192.0.2.1 DST=203.0.113.53 LEN=84 TOS=0x00 PREC=0x00 TTL=64 ID=3321 DF PROTO=ICMP TYPE=8 CODE=0 ID=7 SEQ=1\n"
+        "Oct 19 10:00:05 gw kernel: [8315.010] LIMITED IN=eth0 OUT= MAC=00:11:22:33:44:55:66:77:88:99:aa:bb:08:00 SRC=203.0.113.7 DST=192.0.2.1 LEN=60 TOS=0x00 PREC=0x00 TTL=52 ID=4250 DF PROTO=TCP SPT=51530 DPT=23 WINDOW=29200 RES=0x00 SYN URGP=0\n"
+        "Oct 19 10:00:05 gw kernel: [8315.300] e1000e: eth1 NIC Link is Up 1000 Mbps Full Duplex, Flow Control: Rx/Tx\n";
+}
+
+/*!
+**  \brief Count the DROPPED, REJECTED, ABORTED and LIMITED entries of kernel
+**         logs by zone pair and destination port.
+*/
+int logstatsCommand( int argc, char * argv[] )
+{
+    std::string filename( SYSTEM_RC_FIREWALL2 );
+    unsigned threads = defaultThreads();
+    size_t topPorts = 20;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "c:j:n:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'c': filename = optarg; break;
+                case 'j': threads = std::max( 1u, boost::lexical_cast< unsigned >( optarg ) ); break;
+                case 'n': topPorts = boost::lexical_cast< size_t >( optarg ); break;
+                default:
+                    logstatsUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        logstatsUsage();
+        return 1;
+    }
+    if ( optind >= argc )
+    {
+        logstatsUsage();
+        return 1;
+    }
+
+    GuardPuppyFireWall firewall( false );
+    loadFirewall( firewall, filename );
+    ZoneAddressIndex index( firewall );
+
+    LogStats stats( index );
+    uint64_t bytes = 0;
+    double start = monotonicSeconds();
+    for ( int i = optind; i < argc; i++ )
+    {
+        MappedFile log( argv[i] );
+        analyze( stats, index, log.begin(), log.end(), threads );
+        bytes += log.size();
+    }
+    double elapsed = monotonicSeconds() - start;
+
+    printStats( stats, index, topPorts );
+    std::cerr << stats.entries << " entries, " << stats.malformedEntries << " malformed, in "
+        << bytes / ( 1024 * 1024 ) << " MiB (" << ( elapsed > 0 ? bytes / elapsed / ( 1024 * 1024 ) : 0 ) << " MiB/s)" << std::endl;
+    return 0;
+}
+
+/*!
+**  \brief Time logstats on a log built by repeating a fixture, with one
+**         thread and then doubling up to the given number.
+*/
+int logbenchCommand( int argc, char * argv[] )
+{
+    std::string filename( SYSTEM_RC_FIREWALL2 );
+    unsigned threads = defaultThreads();
+    size_t megabytes = 512;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "c:j:m:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'c': filename = optarg; break;
+                case 'j': threads = std::max( 1u, boost::lexical_cast< unsigned >( optarg ) ); break;
+                case 'm': megabytes = std::max( (size_t)1, boost::lexical_cast< size_t >( optarg ) ); break;
+                default:
+                    logbenchUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        logbenchUsage();
+        return 1;
+    }
+
+    std::string fixture( builtinFixture );
+    if ( optind < argc )
+    {
+        MappedFile sample( argv[optind] );
+        fixture.assign( sample.begin(), sample.end() );
+        if ( fixture.empty() )
+            throw std::string( "The fixture " ) + argv[optind] + " is empty.";
+        if ( fixture[ fixture.size() - 1 ] != '\n' )
+            fixture += '\n';
+    }
+
+    GuardPuppyFireWall firewall( false );
+    loadFirewall( firewall, filename );
+    ZoneAddressIndex index( firewall );
+
+    // Build the log in a file so the runs read it through the page cache
+    // the same way logstats does.
+    char logname[] = "/tmp/guard-puppy-logbench.XXXXXX";
+    int fd = mkstemp( logname );
+    if ( fd < 0 )
+    {
+        throw std::string( "Unable to create a temporary file: " ) + strerror( errno );
+    }
+    close( fd );
+    uint64_t copies = 0;
+    {
+        std::ofstream out( logname, std::ios::binary );
+        std::string block;
+        while ( block.size() < 1024 * 1024 )
+            block += fixture;
+        uint64_t target = (uint64_t)megabytes * 1024 * 1024;
+        for ( uint64_t written = 0; written < target; written += block.size() )
+        {
+            out.write( block.data(), block.size() );
+            copies += block.size() / fixture.size();
+        }
+        if ( !out )
+        {
+            unlink( logname );
+            throw std::string( "Unable to write " ) + logname;
+        }
+    }
+
+    try
+    {
+        MappedFile log( logname );
+        LogStats expected( index );
+        analyze( expected, index, log.begin(), log.end(), 1 );    // warms the page cache
+
+        printf( "%8s %12s %12s %10s\n", "Threads", "Entries", "Seconds", "MiB/s" );
+        for ( unsigned n = 1; ; n = std::min( n * 2, threads ) )
+        {
+            LogStats stats( index );
+            double start = monotonicSeconds();
+            analyze( stats, index, log.begin(), log.end(), n );
+            double elapsed = monotonicSeconds() - start;
+            if ( stats.pairs != expected.pairs || stats.ports != expected.ports )
+            {
+                throw std::string( "The counts changed with the number of threads." );
+            }
+            printf( "%8u %12llu %12.3f %10.0f\n", n, (unsigned long long)stats.entries, elapsed,
+                    elapsed > 0 ? log.size() / elapsed / ( 1024 * 1024 ) : 0.0 );
+            if ( n == threads )
+                break;
+        }
+        std::cerr << copies << " copies of the fixture, " << expected.entries / std::max( (uint64_t)1, copies ) << " entries each" << std::endl;
+    }
+    catch ( ... )
+    {
+        unlink( logname );
+        throw;
+    }
+    unlink( logname );
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <net/if.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <string>
+
+#include <boost/lexical_cast.hpp>
+
+#include "nflogreader.h"
+#include "commands.h"
+
+namespace
+{
+    /*!
+    **  \brief Formats the packets of a batch into one buffer in the same
+    **         style as the kernel LOG target, so existing log watchers keep
+    **         working.  At most maxPerSecond lines are written each second,
+    **         the rest are only counted.
+    */
+    class LogFormatter
+    {
+        std::string batch;
+        std::map< uint32_t, std::string > interfaces;
+        unsigned long maxPerSecond;
+        unsigned long printed;
+        unsigned long suppressed;
+        time_t second;
+        char stamp[32];
+
+        std::string const & interfaceName( uint32_t index )
+        {
+            std::map< uint32_t, std::string >::iterator it = interfaces.find( index );
+            if ( it == interfaces.end() )
+            {
+                char name[IF_NAMESIZE];
+                std::string s;
+                if ( index != 0 )
+                    s = if_indextoname( index, name ) ? name : boost::lexical_cast< std::string >( index );
+                it = interfaces.insert( std::make_pair( index, s ) ).first;
+            }
+            return it->second;
+        }
+
+        static char const * protocolName( uint8_t protocol, char * buf, size_t len )
+        {
+            switch ( protocol )
+            {
+                case IPPROTO_TCP:  return "TCP";
+                case IPPROTO_UDP:  return "UDP";
+                case IPPROTO_ICMP: return "ICMP";
+                default:
+                    snprintf( buf, len, "%u", protocol );
+                    return buf;
+            }
+        }
+
+    public:
+        LogFormatter( unsigned long _maxPerSecond )
+         : maxPerSecond( _maxPerSecond ), printed( 0 ), suppressed( 0 ), second( 0 )
+        {
+            batch.reserve( 64 * 1024 );
+            stamp[0] = '\0';
+        }
+
+        void startBatch()
+        {
+            batch.clear();
+            time_t now = time( 0 );
+            if ( now != second )
+            {
+                if ( suppressed > 0 )
+                {
+                    char line[96];
+                    snprintf( line, sizeof( line ), "%s SUPPRESSED %lu packets\n", stamp, suppressed );
+                    batch += line;
+                }
+                second = now;
+                printed = 0;
+                suppressed = 0;
+                strftime( stamp, sizeof( stamp ), "%b %e %H:%M:%S", localtime( &now ) );
+            }
+        }
+
+        void operator()( NFLogPacket const & packet )
+        {
+            if ( maxPerSecond != 0 && printed >= maxPerSecond )
+            {
+                suppressed++;
+                return;
+            }
+            printed++;
+
+            char line[256];
+            int n;
+            if ( packet.ipv4 )
+            {
+                char protobuf[8];
+                n = snprintf( line, sizeof( line ), "%s %sIN=%s OUT=%s SRC=%u.%u.%u.%u DST=%u.%u.%u.%u LEN=%u PROTO=%s",
+                        stamp, packet.prefix, interfaceName( packet.indev ).c_str(), interfaceName( packet.outdev ).c_str(),
+                        packet.saddr >> 24, ( packet.saddr >> 16 ) & 0xff, ( packet.saddr >> 8 ) & 0xff, packet.saddr & 0xff,
+                        packet.daddr >> 24, ( packet.daddr >> 16 ) & 0xff, ( packet.daddr >> 8 ) & 0xff, packet.daddr & 0xff,
+                        ( packet.payload[2] << 8 ) | packet.payload[3],
+                        protocolName( packet.protocol, protobuf, sizeof( protobuf ) ) );
+                if ( packet.hasports && n > 0 && n < (int)sizeof( line ) )
+                {
+                    n += snprintf( line + n, sizeof( line ) - n, " SPT=%u DPT=%u", packet.sport, packet.dport );
+                }
+            }
+            else
+            {
+                n = snprintf( line, sizeof( line ), "%s %sIN=%s OUT=%s LEN=%u",
+                        stamp, packet.prefix, interfaceName( packet.indev ).c_str(), interfaceName( packet.outdev ).c_str(), packet.payloadlen );
+            }
+            if ( n < 0 )
+                return;
+            batch.append( line, std::min( (size_t)n, sizeof( line ) - 1 ) );
+            batch += '\n';
+        }
+
+        void flush()
+        {
+            if ( !batch.empty() )
+            {
+                fwrite( batch.data(), 1, batch.size(), stdout );
+                fflush( stdout );
+            }
+        }
+    };
+
+    void nflogUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool nflog [-g group] [-t threshold] [-s snaplen] [-f flush-ms] [-r lines-per-second]\n"
+            "  -g  NFLOG group the firewall logs to (default 1)\n"
+            "  -t  packets the kernel batches before delivering them (default 20)\n"
+            "  -s  bytes copied from each packet, 0 for all (default 128)\n"
+            "  -f  longest time a partial batch waits, in milliseconds (default 1000)\n"
+            "  -r  most lines printed per second, 0 for no limit (default 100)\n";
+    }
+}
+
+/*!
+**  \brief Print the packets logged to an NFLOG group, one line per packet.
+*/
+int nflogCommand( int argc, char * argv[] )
+{
+    uint32_t group = 1;
+    uint32_t threshold = 20;
+    uint32_t snaplen = 128;
+    uint32_t flushms = 1000;
+    unsigned long rate = 100;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "g:t:s:f:r:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'g': group = boost::lexical_cast< uint32_t >( optarg ); break;
+                case 't': threshold = boost::lexical_cast< uint32_t >( optarg ); break;
+                case 's': snaplen = boost::lexical_cast< uint32_t >( optarg ); break;
+                case 'f': flushms = boost::lexical_cast< uint32_t >( optarg ); break;
+                case 'r': rate = boost::lexical_cast< unsigned long >( optarg ); break;
+                default:
+                    nflogUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        nflogUsage();
+        return 1;
+    }
+    if ( group > 65535 )
+    {
+        throw std::string( "The NFLOG group must be between 0 and 65535." );
+    }
+
+    NFLogReader reader( group, snaplen, threshold, flushms / 10 );
+    LogFormatter formatter( rate );
+    unsigned long reportedOverruns = 0;
+    while ( true )
+    {
+        formatter.startBatch();
+        reader.readBatch( formatter );
+        formatter.flush();
+
+        if ( reader.getOverruns() != reportedOverruns )
+        {
+            reportedOverruns = reader.getOverruns();
+            std::cerr << "guard-puppy-tool nflog: kernel dropped log batches (" << reportedOverruns << " so far)" << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+   Reading classic pcap and pcapng captures straight out of a mapped file.
+   Frames point into the file, nothing is copied.
+ */
+
+/*!
+**  \brief One captured frame
+*/
+struct PcapFrame
+{
+    char const * data;
+    uint32_t length;            // bytes captured
+    uint32_t linktype;
+};
+
+/*!
+**  \brief Walks the frames of a classic pcap or pcapng capture held in memory
+**
+**  The reader only keeps pointers into the capture and what it learned from
+**  the headers so far, so a copy taken between two frames carries on from
+**  there.  split() uses that to cut a capture into parts that can be read in
+**  parallel.  Blocks of pcapng other than packets and interface descriptions
+**  are skipped, so are truncated frames at the end of the capture.
+*/
+class PcapReader
+{
+    enum { PCAPNG_SECTION = 0x0A0D0D0A, PCAPNG_INTERFACE = 1, PCAPNG_OBSOLETE_PACKET = 2,
+           PCAPNG_SIMPLE_PACKET = 3, PCAPNG_ENHANCED_PACKET = 6 };
+
+    char const * p;
+    char const * end;
+    bool ng;
+    bool swapped;
+    uint32_t linktype;                      // classic pcap
+    std::vector< uint32_t > interfaces;     // linktype of each pcapng interface
+
+    uint32_t read32( char const * at ) const
+    {
+        uint32_t v;
+        memcpy( &v, at, 4 );
+        return swapped ? __builtin_bswap32( v ) : v;
+    }
+
+    uint16_t read16( char const * at ) const
+    {
+        uint16_t v;
+        memcpy( &v, at, 2 );
+        return swapped ? ( v >> 8 ) | ( v << 8 ) : v;
+    }
+
+    void readSectionHeader()
+    {
+        if ( end - p < 28 )
+            throw std::string( "Truncated pcapng section header" );
+        uint32_t magic;
+        memcpy( &magic, p + 8, 4 );
+        if ( magic == 0x1A2B3C4D )
+            swapped = false;
+        else if ( magic == 0x4D3C2B1A )
+            swapped = true;
+        else
+            throw std::string( "Bad pcapng byte order magic" );
+        interfaces.clear();
+    }
+
+public:
+    /*!
+    **  \brief Start reading the capture between begin and end
+    */
+    PcapReader( char const * begin, char const * _end )
+     : p( begin ), end( _end ), ng( false ), swapped( false ), linktype( 0 )
+    {
+        if ( end - p < 24 )
+            throw std::string( "Not a pcap file: too short" );
+        uint32_t magic;
+        memcpy( &magic, p, 4 );
+        if ( magic == PCAPNG_SECTION )
+        {
+            ng = true;
+            readSectionHeader();
+            return;
+        }
+        if ( magic == 0xa1b2c3d4 || magic == 0xa1b23c4d )
+            swapped = false;
+        else if ( magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1 )
+            swapped = true;
+        else
+            throw std::string( "Not a pcap or pcapng file" );
+        linktype = read32( p + 20 ) & 0x03ffffff;
+        p += 24;
+    }
+
+    /*!
+    **  \brief The next frame
+    **
+    **  \return false at the end of the capture
+    */
+    bool next( PcapFrame & frame )
+    {
+        while ( true )
+        {
+            if ( !ng )
+            {
+                if ( end - p < 16 )
+                    return false;
+                uint32_t captured = read32( p + 8 );
+                if ( (size_t)( end - p - 16 ) < captured )
+                    return false;
+                frame.data = p + 16;
+                frame.length = captured;
+                frame.linktype = linktype;
+                p += 16 + captured;
+                return true;
+            }
+
+            if ( end - p < 12 )
+                return false;
+            uint32_t type;
+            memcpy( &type, p, 4 );
+            if ( type == PCAPNG_SECTION )
+                readSectionHeader();            // may change the byte order
+            else
+                type = read32( p );
+            uint32_t total = read32( p + 4 );
+            if ( total < 12 || total % 4 != 0 || (size_t)( end - p ) < total )
+                return false;
+            char const * block = p;
+            p += total;
+
+            switch ( type )
+            {
+                case PCAPNG_INTERFACE:
+                    if ( total >= 20 )
+                        interfaces.push_back( read16( block + 8 ) );
+                    break;
+
+                case PCAPNG_ENHANCED_PACKET:
+                case PCAPNG_OBSOLETE_PACKET:
+                {
+                    if ( total < 32 )
+                        break;
+                    uint32_t interface = type == PCAPNG_ENHANCED_PACKET ? read32( block + 8 ) : read16( block + 8 );
+                    uint32_t captured = read32( block + 20 );
+                    if ( interface >= interfaces.size() || captured > total - 32 )
+                        break;
+                    frame.data = block + 28;
+                    frame.length = captured;
+                    frame.linktype = interfaces[interface];
+                    return true;
+                }
+
+                case PCAPNG_SIMPLE_PACKET:
+                {
+                    if ( total < 16 || interfaces.empty() )
+                        break;
+                    uint32_t original = read32( block + 8 );
+                    frame.data = block + 12;
+                    frame.length = std::min( original, total - 16 );
+                    frame.linktype = interfaces[0];
+                    return true;
+                }
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    char const * position() const { return p; }
+
+    /*!
+    **  \brief Cut what is left of the capture into about equal parts at
+    **         frame boundaries, one reader each.
+    **
+    **  Only the frame headers are read to find the boundaries.
+    */
+    std::vector< PcapReader > split( size_t parts ) const
+    {
+        std::vector< PcapReader > readers( 1, *this );
+        PcapReader walker( *this );
+        PcapFrame frame;
+        for ( size_t i = 1; i < parts; i++ )
+        {
+            char const * target = p + ( end - p ) * i / parts;
+            while ( walker.p < target && walker.next( frame ) )
+                ;
+            readers.push_back( walker );
+        }
+        for ( size_t i = 0; i + 1 < readers.size(); i++ )
+        {
+            readers[i].end = readers[i + 1].p;      // each part ends where the next one starts
+        }
+        return readers;
+    }
+};
@@ -0,0 +1,497 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/bind/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "firewall.h"
+#include "packetclassifier.h"
+#include "protocolportindex.h"
+#include "firewallLog.h"
+#include "pcapReader.h"
+#include "commands.h"
+
+namespace
+{
+    char const * const verdictNames[] = { "ACCEPT", "DROP", "REJECT" };
+
+    enum Decoded { DECODED, NOT_IPV4, FRAGMENT, TRUNCATED };
+
+    inline uint16_t get16( unsigned char const * p ) { return ( p[0] << 8 ) | p[1]; }
+    inline uint32_t get32( unsigned char const * p ) { return ( (uint32_t)get16( p ) << 16 ) | get16( p + 2 ); }
+
+    /*!
+    **  \brief Pull the addresses, protocol and ports of an IPv4 packet out of
+    **         a frame.  syn is set for a TCP SYN without ACK.
+    */
+    Decoded decodeFrame( PcapFrame const & frame, PacketClassifier::Packet & packet, bool & syn )
+    {
+        unsigned char const * p = reinterpret_cast< unsigned char const * >( frame.data );
+        unsigned char const * end = p + frame.length;
+        uint ethertype = 0x0800;
+        switch ( frame.linktype )
+        {
+            case 1:                             // Ethernet
+                if ( end - p < 14 )
+                    return TRUNCATED;
+                ethertype = get16( p + 12 );
+                p += 14;
+                while ( ( ethertype == 0x8100 || ethertype == 0x88a8 ) && end - p >= 4 )
+                {
+                    ethertype = get16( p + 2 );
+                    p += 4;
+                }
+                break;
+            case 113:                           // Linux cooked
+                if ( end - p < 16 )
+                    return TRUNCATED;
+                ethertype = get16( p + 14 );
+                p += 16;
+                break;
+            case 276:                           // Linux cooked v2
+                if ( end - p < 20 )
+                    return TRUNCATED;
+                ethertype = get16( p );
+                p += 20;
+                break;
+            case 0:                             // BSD loopback, family in host order
+                if ( end - p < 4 )
+                    return TRUNCATED;
+                ethertype = ( p[0] == AF_INET || p[3] == AF_INET ) ? 0x0800 : 0;
+                p += 4;
+                break;
+            case 101:                           // raw IP
+            case 228:                           // IPv4
+                break;
+            default:
+                return NOT_IPV4;
+        }
+        if ( ethertype != 0x0800 )
+            return NOT_IPV4;
+        if ( end - p < 20 )
+            return TRUNCATED;
+        if ( ( p[0] >> 4 ) != 4 )
+            return NOT_IPV4;
+
+        uint headerLength = ( p[0] & 0x0f ) * 4;
+        packet.protocol = p[9];
+        packet.src = get32( p + 12 );
+        packet.dst = get32( p + 16 );
+        packet.sport = packet.dport = 0;
+        syn = false;
+        if ( get16( p + 6 ) & 0x1fff )
+            return FRAGMENT;                    // netfilter sees the reassembled packet once
+        p += headerLength;
+
+        switch ( packet.protocol )
+        {
+            case IPPROTO_TCP:
+                if ( end - p < 14 )
+                    return TRUNCATED;
+                packet.sport = get16( p );
+                packet.dport = get16( p + 2 );
+                syn = ( p[13] & 0x12 ) == 0x02;
+                break;
+            case IPPROTO_UDP:
+                if ( end - p < 4 )
+                    return TRUNCATED;
+                packet.sport = get16( p );
+                packet.dport = get16( p + 2 );
+                break;
+            case IPPROTO_ICMP:
+                if ( end - p < 2 )
+                    return TRUNCATED;
+                packet.sport = p[0];
+                packet.dport = p[1];
+                break;
+            default:
+                break;
+        }
+        return DECODED;
+    }
+
+    /*!
+    **  \brief A connection, the same both ways, or a one way flow
+    */
+    struct FlowKey
+    {
+        uint64_t addresses;
+        uint64_t rest;
+
+        bool operator==( FlowKey const & rhs ) const
+        {
+            return addresses == rhs.addresses && rest == rhs.rest;
+        }
+    };
+
+    size_t hash_value( FlowKey const & key )
+    {
+        size_t seed = 0;
+        boost::hash_combine( seed, key.addresses );
+        boost::hash_combine( seed, key.rest );
+        return seed;
+    }
+
+    FlowKey connectionKey( PacketClassifier::Packet const & p )
+    {
+        uint sport = p.protocol == IPPROTO_ICMP ? 0 : p.sport;
+        uint dport = p.protocol == IPPROTO_ICMP ? 0 : p.dport;
+        uint64_t a = ( (uint64_t)p.src << 16 ) | sport;
+        uint64_t b = ( (uint64_t)p.dst << 16 ) | dport;
+        if ( a > b )
+            std::swap( a, b );
+        FlowKey key;
+        key.addresses = ( a >> 16 << 32 ) | ( b >> 16 );
+        key.rest = ( (uint64_t)p.protocol << 32 ) | ( ( a & 0xffff ) << 16 ) | ( b & 0xffff );
+        return key;
+    }
+
+    struct BlockedFlow
+    {
+        uint64_t packets;
+        uint16_t fromZone;
+        uint16_t toZone;
+        uint8_t verdict;
+    };
+
+    /*!
+    **  \brief Replays one part of a capture through a policy, and through
+    **         the baseline it is compared with if there is one.
+    **
+    **  Each policy keeps its own connection tracking: the first packet of a
+    **  connection is new, and once the policy accepts a new packet the rest
+    **  of the connection is established.  TCP connections caught after their
+    **  SYN are taken as established before the capture began.
+    */
+    struct Replayer
+    {
+        enum { SEEN = 1, ESTABLISHED = 2, BASELINE_ESTABLISHED = 4 };
+
+        PacketClassifier const * policy;
+        PacketClassifier const * baseline;
+        ProtocolPortIndex const * protocols;
+        size_t zoneCount;
+        size_t protocolCount;
+        std::vector< uint64_t > pairs;          // [ ( from * zoneCount + to ) * 3 + verdict ]
+        std::vector< uint64_t > pairRules;      // [ from * zoneCount + to ]
+        std::vector< uint32_t > pairMaxRules;
+        std::vector< uint64_t > protocolVerdicts;   // [ protocol * 3 + verdict ], protocolCount for none
+        boost::unordered_map< FlowKey, uint8_t > connections;
+        boost::unordered_map< FlowKey, BlockedFlow > newlyBlocked;
+        std::vector< ProtocolPortMatch > matches;
+        uint64_t frames;
+        uint64_t packets;
+        uint64_t checked;                       // packets that went through the zone chains
+        uint64_t midstream;
+        uint64_t fragments;
+        uint64_t skipped;
+
+        Replayer( PacketClassifier const & _policy, PacketClassifier const * _baseline, ProtocolPortIndex const & _protocols )
+         : policy( &_policy ), baseline( _baseline ), protocols( &_protocols ),
+           zoneCount( _policy.getZoneIndex().zoneCount() ), protocolCount( _protocols.protocolCount() ),
+           pairs( zoneCount * zoneCount * 3 ), pairRules( zoneCount * zoneCount ), pairMaxRules( zoneCount * zoneCount ),
+           protocolVerdicts( ( protocolCount + 1 ) * 3 ), frames( 0 ), packets( 0 ), checked( 0 ), midstream( 0 ), fragments( 0 ), skipped( 0 )
+        {
+        }
+
+        uint16_t protocolOf( PacketClassifier::Packet const & p )
+        {
+            if ( protocols->lookup( p.protocol, p.sport, p.dport, matches ) == 0 )
+                return protocolCount;
+            ProtocolPortMatch const * narrowest = &matches[0];
+            BOOST_FOREACH( ProtocolPortMatch const & m, matches )
+            {
+                if ( m.width < narrowest->width )
+                    narrowest = &m;
+            }
+            return narrowest->protocol;
+        }
+
+        void frame( PcapFrame const & f )
+        {
+            frames++;
+            PacketClassifier::Packet p;
+            bool syn;
+            switch ( decodeFrame( f, p, syn ) )
+            {
+                case DECODED:  break;
+                case FRAGMENT: fragments++; return;
+                default:       skipped++; return;
+            }
+            packets++;
+
+            uint8_t & state = connections[ connectionKey( p ) ];
+            if ( !( state & SEEN ) && p.protocol == IPPROTO_TCP && !syn )
+            {
+                midstream++;
+                state |= ESTABLISHED | BASELINE_ESTABLISHED;
+            }
+            state |= SEEN;
+
+            p.state = ( state & ESTABLISHED ) ? PacketClassifier::ESTABLISHED : PacketClassifier::NEW;
+            PacketClassifier::Result r = policy->classify( p );
+            if ( r.verdict == PacketClassifier::ACCEPT )
+                state |= ESTABLISHED;
+
+            if ( r.rules > 0 )
+            {
+                checked++;
+                size_t pair = r.fromZone * zoneCount + r.toZone;
+                pairs[ pair * 3 + r.verdict ]++;
+                pairRules[pair] += r.rules;
+                pairMaxRules[pair] = std::max( pairMaxRules[pair], r.rules );
+                protocolVerdicts[ protocolOf( p ) * 3 + r.verdict ]++;
+            }
+
+            if ( baseline == 0 )
+                return;
+            p.state = ( state & BASELINE_ESTABLISHED ) ? PacketClassifier::ESTABLISHED : PacketClassifier::NEW;
+            PacketClassifier::Result b = baseline->classify( p );
+            if ( b.verdict != PacketClassifier::ACCEPT )
+                return;
+            state |= BASELINE_ESTABLISHED;
+            if ( r.verdict != PacketClassifier::ACCEPT )
+            {
+                FlowKey key;
+                key.addresses = ( (uint64_t)p.src << 32 ) | p.dst;
+                key.rest = ( (uint64_t)p.protocol << 16 ) | ( p.protocol == IPPROTO_ICMP ? p.sport : p.dport );
+                BlockedFlow & flow = newlyBlocked[key];
+                flow.packets++;
+                flow.fromZone = r.fromZone;
+                flow.toZone = r.toZone;
+                flow.verdict = r.verdict;
+            }
+        }
+
+        /*!
+        **  \brief Add the counts of a later part of the capture
+        */
+        void merge( Replayer const & rhs )
+        {
+            for ( size_t i = 0; i < pairs.size(); i++ )
+                pairs[i] += rhs.pairs[i];
+            for ( size_t i = 0; i < pairRules.size(); i++ )
+            {
+                pairRules[i] += rhs.pairRules[i];
+                pairMaxRules[i] = std::max( pairMaxRules[i], rhs.pairMaxRules[i] );
+            }
+            for ( size_t i = 0; i < protocolVerdicts.size(); i++ )
+                protocolVerdicts[i] += rhs.protocolVerdicts[i];
+            for ( boost::unordered_map< FlowKey, BlockedFlow >::const_iterator it = rhs.newlyBlocked.begin(); it != rhs.newlyBlocked.end(); ++it )
+            {
+                BlockedFlow & flow = newlyBlocked[it->first];
+                uint64_t before = flow.packets;
+                flow = it->second;
+                flow.packets += before;
+            }
+            frames += rhs.frames;
+            packets += rhs.packets;
+            checked += rhs.checked;
+            midstream += rhs.midstream;
+            fragments += rhs.fragments;
+            skipped += rhs.skipped;
+        }
+    };
+
+    void replayPart( Replayer & replayer, PcapReader reader )
+    {
+        PcapFrame frame;
+        while ( reader.next( frame ) )
+            replayer.frame( frame );
+    }
+
+    /*!
+    **  \brief Replay a capture cut into one part per replayer, in parallel.
+    **
+    **  Every part keeps its own connection tracking, as if it had been
+    **  captured on its own.
+    */
+    void replay( std::vector< Replayer > & parts, char const * begin, char const * end )
+    {
+        std::vector< PcapReader > readers = PcapReader( begin, end ).split( parts.size() );
+        if ( parts.size() == 1 )
+        {
+            replayPart( parts[0], readers[0] );
+            return;
+        }
+        boost::thread_group group;
+        for ( size_t i = 0; i < parts.size(); i++ )
+        {
+            group.create_thread( boost::bind( &replayPart, boost::ref( parts[i] ), readers[i] ) );
+        }
+        group.join_all();
+    }
+
+    bool flowGreater( std::pair< uint64_t, FlowKey > const & lhs, std::pair< uint64_t, FlowKey > const & rhs )
+    {
+        if ( lhs.first != rhs.first )
+            return lhs.first > rhs.first;
+        if ( lhs.second.addresses != rhs.second.addresses )
+            return lhs.second.addresses < rhs.second.addresses;
+        return lhs.second.rest < rhs.second.rest;
+    }
+
+    std::string formatAddress( uint32_t address )
+    {
+        struct in_addr addr;
+        addr.s_addr = htonl( address );
+        return inet_ntoa( addr );
+    }
+
+    void printReplay( Replayer const & total, ZoneAddressIndex const & zones, ProtocolPortIndex const & protocols, size_t topFlows )
+    {
+        printf( "%-16s %-16s %10s %10s %10s %10s %10s\n", "From", "To", "ACCEPT", "DROP", "REJECT", "AvgRules", "MaxRules" );
+        for ( uint16_t from = 0; from < total.zoneCount; from++ )
+        {
+            for ( uint16_t to = 0; to < total.zoneCount; to++ )
+            {
+                size_t pair = from * total.zoneCount + to;
+                uint64_t const * counts = &total.pairs[ pair * 3 ];
+                uint64_t sum = counts[0] + counts[1] + counts[2];
+                if ( sum == 0 )
+                    continue;
+                printf( "%-16s %-16s %10llu %10llu %10llu %10.1f %10u\n", zones.zoneName( from ).c_str(), zones.zoneName( to ).c_str(),
+                        (unsigned long long)counts[0], (unsigned long long)counts[1], (unsigned long long)counts[2],
+                        (double)total.pairRules[pair] / sum, total.pairMaxRules[pair] );
+            }
+        }
+
+        printf( "\n%-24s %10s %10s %10s\n", "Protocol", "ACCEPT", "DROP", "REJECT" );
+        for ( size_t protocol = 0; protocol <= total.protocolCount; protocol++ )
+        {
+            uint64_t const * counts = &total.protocolVerdicts[ protocol * 3 ];
+            if ( counts[0] + counts[1] + counts[2] == 0 )
+                continue;
+            printf( "%-24s %10llu %10llu %10llu\n", protocol < total.protocolCount ? protocols.getProtocolName( protocol ).c_str() : "(no protocol)",
+                    (unsigned long long)counts[0], (unsigned long long)counts[1], (unsigned long long)counts[2] );
+        }
+
+        if ( total.baseline == 0 )
+            return;
+        std::vector< std::pair< uint64_t, FlowKey > > ranked;
+        for ( boost::unordered_map< FlowKey, BlockedFlow >::const_iterator it = total.newlyBlocked.begin(); it != total.newlyBlocked.end(); ++it )
+            ranked.push_back( std::make_pair( it->second.packets, it->first ) );
+        size_t shown = std::min( topFlows, ranked.size() );
+        std::partial_sort( ranked.begin(), ranked.begin() + shown, ranked.end(), flowGreater );
+
+        printf( "\n%zu flows the baseline accepts would be blocked\n", ranked.size() );
+        for ( size_t i = 0; i < shown; i++ )
+        {
+            FlowKey const & key = ranked[i].second;
+            BlockedFlow const & flow = total.newlyBlocked.find( key )->second;
+            uint protocol = ( key.rest >> 16 ) & 0xff;
+            char port[16];
+            snprintf( port, sizeof( port ), "%s/%u", protocol == IPPROTO_TCP ? "tcp" : protocol == IPPROTO_UDP ? "udp" : protocol == IPPROTO_ICMP ? "icmp" : "ip",
+                      protocol == IPPROTO_TCP || protocol == IPPROTO_UDP || protocol == IPPROTO_ICMP ? (uint)( key.rest & 0xffff ) : protocol );
+            printf( "  %-15s %-15s %-10s %10llu  %s -> %s %s\n", formatAddress( key.addresses >> 32 ).c_str(), formatAddress( key.addresses & 0xffffffff ).c_str(),
+                    port, (unsigned long long)flow.packets, zones.zoneName( flow.fromZone ).c_str(), zones.zoneName( flow.toZone ).c_str(), verdictNames[flow.verdict] );
+        }
+    }
+
+    void replayUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool replay [-c firewall] [-b baseline] [-l address]... [-j threads] [-n flows] capture...\n"
+            "  -c  firewall script to replay the capture through (default " SYSTEM_RC_FIREWALL2 ")\n"
+            "  -b  firewall script to compare with, to list the flows that would newly be blocked\n"
+            "  -l  address of the firewall itself, may be repeated (default this machine's addresses)\n"
+            "  -j  threads replaying each capture (default one per cpu)\n"
+            "  -n  most newly blocked flows listed (default 20)\n"
+            "  Captures are classic pcap or pcapng, Ethernet, Linux cooked or raw IP.\n";
+    }
+}
+
+/*!
+**  \brief Replay packet captures through a firewall offline
+*/
+int replayCommand( int argc, char * argv[] )
+{
+    std::string filename( SYSTEM_RC_FIREWALL2 );
+    std::string baselineFilename;
+    std::vector< uint32_t > locals;
+    unsigned threads = defaultThreads();
+    size_t topFlows = 20;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "c:b:l:j:n:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'c': filename = optarg; break;
+                case 'b': baselineFilename = optarg; break;
+                case 'l': locals.push_back( parseIPv4( optarg ) ); break;
+                case 'j': threads = std::max( 1u, boost::lexical_cast< unsigned >( optarg ) ); break;
+                case 'n': topFlows = boost::lexical_cast< size_t >( optarg ); break;
+                default:
+                    replayUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        replayUsage();
+        return 1;
+    }
+    if ( optind >= argc )
+    {
+        replayUsage();
+        return 1;
+    }
+    if ( locals.empty() )
+        locals = interfaceAddresses();
+
+    GuardPuppyFireWall firewall( false );
+    loadFirewall( firewall, filename );
+    PacketClassifier policy( firewall );
+    BOOST_FOREACH( uint32_t address, locals )
+        policy.addLocalAddress( address );
+
+    GuardPuppyFireWall baselineFirewall( false );
+    PacketClassifier * baseline = 0;
+    if ( !baselineFilename.empty() )
+    {
+        loadFirewall( baselineFirewall, baselineFilename );
+        baseline = new PacketClassifier( baselineFirewall );
+        BOOST_FOREACH( uint32_t address, locals )
+            baseline->addLocalAddress( address );
+    }
+
+    ProtocolPortIndex protocols;
+    firewall.ApplyToDB( protocols );
+    protocols.build();
+
+    Replayer total( policy, baseline, protocols );
+    uint64_t bytes = 0;
+    double start = monotonicSeconds();
+    for ( int i = optind; i < argc; i++ )
+    {
+        MappedFile capture( argv[i] );
+        std::vector< Replayer > parts( threads, Replayer( policy, baseline, protocols ) );
+        replay( parts, capture.begin(), capture.end() );
+        BOOST_FOREACH( Replayer const & part, parts )
+            total.merge( part );
+        bytes += capture.size();
+    }
+    double elapsed = monotonicSeconds() - start;
+
+    printReplay( total, policy.getZoneIndex(), protocols, topFlows );
+    std::cerr << total.frames << " frames, " << total.packets << " IPv4 packets (" << total.checked << " through the zone chains, "
+        << total.midstream << " connections already open), " << total.fragments << " fragments and " << total.skipped << " other frames skipped, "
+        << ( elapsed > 0 ? total.frames / elapsed / 1e6 : 0 ) << " M frames/s" << std::endl;
+    delete baseline;
+    return 0;
+}
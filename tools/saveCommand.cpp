@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "firewall.h"
+#include "firewallLog.h"
+#include "mappedfile.h"
+#include "commands.h"
+
+namespace
+{
+    void savebenchUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool savebench [-c firewall] [-z zones] [-n rounds]\n"
+            "  -c  firewall script to save (default " SYSTEM_RC_FIREWALL2 ")\n"
+            "  -z  zones added to it first, each permitting the protocols the script\n"
+            "      permits anywhere to every other zone (default 0)\n"
+            "  -n  times each way of saving is timed, the best is printed (default 5)\n";
+    }
+
+    /*!
+    **  \brief Grow firewall by zones zones connected to every other zone
+    */
+    void addBenchZones( GuardPuppyFireWall & firewall, size_t zones )
+    {
+        std::set< std::string > protocols;
+        BOOST_FOREACH( std::string const & from, firewall.getZoneList() )
+        {
+            BOOST_FOREACH( std::string const & to, firewall.getZoneList() )
+            {
+                std::vector< std::string > permitted = firewall.getConnectedZoneProtocols( from, to, Zone::PERMIT );
+                protocols.insert( permitted.begin(), permitted.end() );
+            }
+        }
+
+        for ( size_t i = 0; i < zones; i++ )
+        {
+            std::string name = "Bench" + boost::lexical_cast< std::string >( i );
+            firewall.addZone( name );
+            firewall.addNewMachine( name, "10." + boost::lexical_cast< std::string >( i / 256 % 256 ) + "."
+                    + boost::lexical_cast< std::string >( i % 256 ) + ".0/24" );
+        }
+        BOOST_FOREACH( std::string const & from, firewall.getZoneList() )
+        {
+            BOOST_FOREACH( std::string const & to, firewall.getZoneList() )
+            {
+                if ( from == to || ( from.compare( 0, 5, "Bench" ) != 0 && to.compare( 0, 5, "Bench" ) != 0 ) )
+                    continue;
+                firewall.updateZoneConnection( from, to, true );
+                BOOST_FOREACH( std::string const & protocol, protocols )
+                    firewall.setProtocolState( from, to, protocol, Zone::PERMIT );
+            }
+        }
+    }
+
+    void loadbenchUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool loadbench [-c firewall] [-z zones] [-a addresses] [-n rounds]\n"
+            "  -c  firewall script to start from (default " SYSTEM_RC_FIREWALL2 ")\n"
+            "  -z  zones added to it first, as for savebench (default 0)\n"
+            "  -a  addresses given to each added zone (default 0)\n"
+            "  -n  times each way of reading is timed, the best is printed (default 5)\n";
+    }
+
+    /*!
+    **  \brief Give each of the zones added by addBenchZones() addresses
+    **         more addresses
+    */
+    void addBenchAddresses( GuardPuppyFireWall & firewall, size_t zones, size_t addresses )
+    {
+        for ( size_t i = 0; i < zones; i++ )
+        {
+            std::string name = "Bench" + boost::lexical_cast< std::string >( i );
+            for ( size_t a = 0; a < addresses; a++ )
+            {
+                size_t n = i * addresses + a;
+                firewall.addNewMachine( name, boost::lexical_cast< std::string >( 11 + n / 16777216 % 200 ) + "."
+                        + boost::lexical_cast< std::string >( n / 65536 % 256 ) + "."
+                        + boost::lexical_cast< std::string >( n / 256 % 256 ) + "."
+                        + boost::lexical_cast< std::string >( n % 256 ) );
+            }
+        }
+    }
+
+    void dbbenchUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool dbbench [-n rounds] [protocoldb.xml [overlay.xml ...]]\n"
+            "  -n  times each way of loading is timed, the best is printed (default 5)\n"
+            "  the database defaults to the one in ~/.config/guard-puppy, overlays are\n"
+            "  loaded over it as those in ~/.config/guard-puppy/protocols.d are\n";
+    }
+
+    /*!
+    **  \brief Addresses in all zones of firewall, which reads all of them
+    */
+    size_t countMembers( GuardPuppyFireWall const & firewall )
+    {
+        size_t members = 0;
+        BOOST_FOREACH( std::string const & zone, firewall.getZoneList() )
+            members += firewall.getZone( zone ).getMemberMachineList().size();
+        return members;
+    }
+
+    /*!
+    **  \brief Lines in filename, read the way readFirewall() reads it
+    */
+    size_t countLines( std::string const & filename )
+    {
+        MappedFile file( filename );
+        return std::count( file.begin(), file.end(), '\n' );
+    }
+
+    /*!
+    **  \brief How the script was written before AtomicFile, in place
+    **         through a std::ofstream
+    */
+    void saveThroughOfstream( GuardPuppyFireWall & firewall, std::string const & filename, bool sync )
+    {
+        {
+            std::ofstream stream( filename.c_str() );
+            firewall.writeScript( stream );
+            if ( !stream )
+                throw std::string( "Unable to write " ) + filename;
+        }
+        if ( sync )
+        {
+            int fd = open( filename.c_str(), O_WRONLY );
+            if ( fd < 0 || fsync( fd ) < 0 )
+                throw std::string( "Unable to sync " ) + filename;
+            close( fd );
+        }
+    }
+}
+
+/*!
+**  \brief Time saving a firewall script through a std::ofstream and
+**         through save()
+**
+**  The zone pairs are rendered by the first save, the rounds after that
+**  time the writing itself.
+*/
+int savebenchCommand( int argc, char * argv[] )
+{
+    std::string filename( SYSTEM_RC_FIREWALL2 );
+    size_t zones = 0;
+    size_t rounds = 5;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "c:z:n:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'c': filename = optarg; break;
+                case 'z': zones = boost::lexical_cast< size_t >( optarg ); break;
+                case 'n': rounds = std::max( (size_t)1, boost::lexical_cast< size_t >( optarg ) ); break;
+                default:
+                    savebenchUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        savebenchUsage();
+        return 1;
+    }
+
+    GuardPuppyFireWall firewall( false );
+    loadFirewall( firewall, filename );
+    addBenchZones( firewall, zones );
+
+    char dirname[] = "/tmp/guard-puppy-savebench.XXXXXX";
+    if ( !mkdtemp( dirname ) )
+    {
+        throw std::string( "Unable to create a temporary directory: " ) + strerror( errno );
+    }
+    std::string script = std::string( dirname ) + "/rc.firewall";
+
+    try
+    {
+        double start = monotonicSeconds();
+        firewall.save( script );
+        double rendered = monotonicSeconds() - start;
+        double size = boost::filesystem::file_size( script );
+
+        char const * const ways[] = { "std::ofstream", "std::ofstream + fsync", "save()" };
+        printf( "%-24s %12s %10s\n", "Written through", "Seconds", "MiB/s" );
+        for ( int way = 0; way < 3; way++ )
+        {
+            double best = 0;
+            for ( size_t round = 0; round < rounds; round++ )
+            {
+                start = monotonicSeconds();
+                if ( way == 2 )
+                    firewall.save( script );
+                else
+                    saveThroughOfstream( firewall, script, way == 1 );
+                double elapsed = monotonicSeconds() - start;
+                if ( round == 0 || elapsed < best )
+                    best = elapsed;
+            }
+            printf( "%-24s %12.4f %10.0f\n", ways[way], best, best > 0 ? size / best / ( 1024 * 1024 ) : 0.0 );
+        }
+        std::cerr << firewall.zoneCount() << " zones, " << size / ( 1024 * 1024 ) << " MiB script, the first save rendering it took "
+            << rendered << " s" << std::endl;
+    }
+    catch ( ... )
+    {
+        boost::filesystem::remove_all( dirname );
+        throw;
+    }
+    boost::filesystem::remove_all( dirname );
+    return 0;
+}
+
+/*!
+**  \brief Time reading the settings of a firewall script with
+**         readFirewall() and from its snapshot against just counting its
+**         lines
+**
+**  Counting the lines of the mapped file is as fast as the script can be
+**  read at all, the file being in the page cache for all of them.
+*/
+int loadbenchCommand( int argc, char * argv[] )
+{
+    std::string filename( SYSTEM_RC_FIREWALL2 );
+    size_t zones = 0;
+    size_t addresses = 0;
+    size_t rounds = 5;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "c:z:a:n:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'c': filename = optarg; break;
+                case 'z': zones = boost::lexical_cast< size_t >( optarg ); break;
+                case 'a': addresses = boost::lexical_cast< size_t >( optarg ); break;
+                case 'n': rounds = std::max( (size_t)1, boost::lexical_cast< size_t >( optarg ) ); break;
+                default:
+                    loadbenchUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        loadbenchUsage();
+        return 1;
+    }
+
+    GuardPuppyFireWall firewall( false );
+    loadFirewall( firewall, filename );
+    addBenchZones( firewall, zones );
+    addBenchAddresses( firewall, zones, addresses );
+
+    char dirname[] = "/tmp/guard-puppy-loadbench.XXXXXX";
+    if ( !mkdtemp( dirname ) )
+    {
+        throw std::string( "Unable to create a temporary directory: " ) + strerror( errno );
+    }
+    std::string script = std::string( dirname ) + "/rc.firewall";
+
+    try
+    {
+        {
+            AtomicFile file( script );
+            firewall.writeConfig( file.stream() );
+            file.commit();
+        }
+        firewall.writeSnapshot( script );
+        double size = boost::filesystem::file_size( script );
+        size_t lines = 0;
+
+        char const * const ways[] = { "counting lines", "readFirewall()", "readSnapshot()", "readSnapshot() + members" };
+        printf( "%-24s %12s %10s\n", "Read by", "Seconds", "MiB/s" );
+        for ( int way = 0; way < 4; way++ )
+        {
+            double best = 0;
+            for ( size_t round = 0; round < rounds; round++ )
+            {
+                double start = monotonicSeconds();
+                if ( way == 0 )
+                    lines = countLines( script );
+                else
+                {
+                    firewall.factoryDefaults();
+                    if ( way == 1 )
+                        firewall.readFirewall( script );
+                    else if ( !firewall.readSnapshot( script ) )
+                        throw std::string( "The snapshot of " ) + script + " was not taken of it";
+                    if ( way == 3 )
+                        countMembers( firewall );
+                }
+                double elapsed = monotonicSeconds() - start;
+                if ( round == 0 || elapsed < best )
+                    best = elapsed;
+            }
+            printf( "%-24s %12.4f %10.0f\n", ways[way], best, best > 0 ? size / best / ( 1024 * 1024 ) : 0.0 );
+        }
+
+        std::cerr << firewall.zoneCount() << " zones, " << countMembers( firewall ) << " addresses, " << lines << " lines, "
+            << size / ( 1024 * 1024 ) << " MiB of settings" << std::endl;
+    }
+    catch ( ... )
+    {
+        boost::filesystem::remove_all( dirname );
+        throw;
+    }
+    boost::filesystem::remove_all( dirname );
+    return 0;
+}
+
+/*!
+**  \brief Time loading the protocol database by parsing its XML and from
+**         its cache
+*/
+int dbbenchCommand( int argc, char * argv[] )
+{
+    size_t rounds = 5;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "n:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'n': rounds = std::max( (size_t)1, boost::lexical_cast< size_t >( optarg ) ); break;
+                default:
+                    dbbenchUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        dbbenchUsage();
+        return 1;
+    }
+    std::string filename;
+    if ( optind < argc )
+        filename = argv[ optind ];
+    else if ( getenv( "HOME" ) )
+        filename = std::string( getenv( "HOME" ) ) + "/.config/guard-puppy/networkprotocoldb.xml";
+    else
+    {
+        dbbenchUsage();
+        return 1;
+    }
+
+    std::vector< std::string > overlays( argv + std::min( argc, optind + 1 ), argv + argc );
+
+    // The first load with the cache parses the XML and keeps the cache.
+    size_t protocols = ProtocolDB( filename, overlays ).getProtocolDataBase().size();
+    double size = boost::filesystem::file_size( filename );
+    BOOST_FOREACH( std::string const & overlay, overlays )
+        size += boost::filesystem::file_size( overlay );
+
+    char const * const ways[] = { "parsing the XML", "the cache" };
+    printf( "%-24s %12s %10s\n", "Loaded from", "Seconds", "MiB/s" );
+    for ( int way = 0; way < 2; way++ )
+    {
+        double best = 0;
+        for ( size_t round = 0; round < rounds; round++ )
+        {
+            double start = monotonicSeconds();
+            ProtocolDB db( filename, overlays, way == 1 );
+            double elapsed = monotonicSeconds() - start;
+            if ( db.getProtocolDataBase().size() != protocols )
+                throw std::string( "Loaded another database from " ) + filename;
+            if ( round == 0 || elapsed < best )
+                best = elapsed;
+        }
+        printf( "%-24s %12.4f %10.0f\n", ways[way], best, best > 0 ? size / best / ( 1024 * 1024 ) : 0.0 );
+    }
+    std::cerr << protocols << " protocols from " << overlays.size() + 1 << " files, " << size / 1024
+        << " KiB of XML, cached in " << ProtocolDB::cacheFilename( filename ) << std::endl;
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "intervalset.h"
+#include "firewallLog.h"
+#include "commands.h"
+
+namespace
+{
+    void setbenchUsage()
+    {
+        std::cerr << "Usage: guard-puppy-tool setbench [-r ranges] [-n rounds]\n"
+            "  -r  random ranges in each of the two sets combined (default 1000000)\n"
+            "  -n  times each operation is timed, the best is printed (default 5)\n";
+    }
+
+    uint32_t random32()
+    {
+        return (uint32_t)rand() * 2654435761u ^ rand();
+    }
+
+    /*!
+    **  \brief The addresses of a 32 bit range as first and last Address,
+    **         the same for either kind so the sets have the same shape
+    */
+    template< class Address >
+    Address spread( uint32_t a, bool last );
+
+    template<>
+    uint32_t spread< uint32_t >( uint32_t a, bool )
+    {
+        return a;
+    }
+
+    template<>
+    IPv6Address spread< IPv6Address >( uint32_t a, bool last )
+    {
+        return IPv6Address( 0x20010db800000000ull, uint64_t( a ) << 16 | ( last ? 0xffff : 0 ) );
+    }
+
+    template< class Address >
+    void randomRanges( IntervalSet< Address > & set, size_t ranges )
+    {
+        for ( size_t i = 0; i < ranges; i++ )
+        {
+            uint32_t first = random32();
+            uint32_t last = first + std::min( (uint32_t)rand() % 4096, 0xffffffffu - first );
+            set.add( spread< Address >( first, false ), spread< Address >( last, true ) );
+        }
+    }
+
+    enum Operation { BUILD, UNITE, INTERSECT, SUBTRACT, CONTAINS, LOOKUP, PREFIXES, OPERATIONS };
+    char const * const operationNames[] = { "build", "unite", "intersect", "subtract", "contains set", "lookup", "prefixes" };
+
+    /*!
+    **  \brief The best time of each Operation over rounds, on two sets of
+    **         as many random ranges as ranges
+    */
+    template< class Address >
+    std::vector< double > bench( size_t ranges, size_t rounds, std::vector< size_t > & sizes )
+    {
+        std::vector< double > best( OPERATIONS, 0 );
+        std::vector< Address > addresses;
+        srand( 1 );
+        for ( size_t i = 0; i < ranges; i++ )
+            addresses.push_back( spread< Address >( random32(), false ) );
+
+        for ( size_t round = 0; round < rounds; round++ )
+        {
+            std::vector< double > times( OPERATIONS, 0 );
+            srand( 2 );
+            IntervalSet< Address > a;
+            IntervalSet< Address > b;
+            randomRanges( a, ranges );
+            randomRanges( b, ranges );
+
+            double start = monotonicSeconds();
+            a.build();
+            b.build();
+            times[ BUILD ] = monotonicSeconds() - start;
+
+            start = monotonicSeconds();
+            IntervalSet< Address > both = a.unite( b );
+            times[ UNITE ] = monotonicSeconds() - start;
+
+            start = monotonicSeconds();
+            IntervalSet< Address > common = a.intersect( b );
+            times[ INTERSECT ] = monotonicSeconds() - start;
+
+            start = monotonicSeconds();
+            IntervalSet< Address > aOnly = a.subtract( b );
+            times[ SUBTRACT ] = monotonicSeconds() - start;
+
+            start = monotonicSeconds();
+            bool contained = both.contains( a ) && both.contains( b ) && a.contains( common ) && aOnly.intersect( b ).empty();
+            times[ CONTAINS ] = monotonicSeconds() - start;
+            if ( !contained )
+                throw std::string( "Set operations disagree" );
+
+            start = monotonicSeconds();
+            size_t found = 0;
+            BOOST_FOREACH( Address const & address, addresses )
+                found += both.contains( address );
+            times[ LOOKUP ] = monotonicSeconds() - start;
+
+            start = monotonicSeconds();
+            std::vector< typename IntervalSet< Address >::Prefix > prefixes;
+            both.prefixes( prefixes );
+            times[ PREFIXES ] = monotonicSeconds() - start;
+
+            for ( int op = 0; op < OPERATIONS; op++ )
+            {
+                if ( round == 0 || times[op] < best[op] )
+                    best[op] = times[op];
+            }
+            sizes.clear();
+            sizes.push_back( a.size() );
+            sizes.push_back( both.size() );
+            sizes.push_back( common.size() );
+            sizes.push_back( aOnly.size() );
+            sizes.push_back( found );
+            sizes.push_back( prefixes.size() );
+        }
+        return best;
+    }
+}
+
+/*!
+**  \brief Time IntervalSet operations on two sets of random IPv4 ranges
+**         and the same ranges as IPv6
+*/
+int setbenchCommand( int argc, char * argv[] )
+{
+    size_t ranges = 1000000;
+    size_t rounds = 5;
+
+    int opt;
+    try
+    {
+        while ( ( opt = getopt( argc, argv, "r:n:h" ) ) != -1 )
+        {
+            switch ( opt )
+            {
+                case 'r': ranges = boost::lexical_cast< size_t >( optarg ); break;
+                case 'n': rounds = std::max( (size_t)1, boost::lexical_cast< size_t >( optarg ) ); break;
+                default:
+                    setbenchUsage();
+                    return 1;
+            }
+        }
+    }
+    catch ( boost::bad_lexical_cast const & )
+    {
+        setbenchUsage();
+        return 1;
+    }
+
+    std::vector< size_t > sizes4;
+    std::vector< size_t > sizes6;
+    std::vector< double > ipv4 = bench< uint32_t >( ranges, rounds, sizes4 );
+    std::vector< double > ipv6 = bench< IPv6Address >( ranges, rounds, sizes6 );
+    if ( sizes4 != sizes6 )
+        throw std::string( "IPv4 and IPv6 sets differ" );
+
+    printf( "%-24s %12s %12s\n", "Operation", "IPv4 secs", "IPv6 secs" );
+    for ( int op = 0; op < OPERATIONS; op++ )
+        printf( "%-24s %12.4f %12.4f\n", operationNames[op], ipv4[op], ipv6[op] );
+    std::cerr << ranges << " ranges a set, " << sizes4[0] << " intervals once built; union " << sizes4[1]
+        << ", intersection " << sizes4[2] << ", difference " << sizes4[3] << " intervals; "
+        << sizes4[4] << " of " << ranges << " addresses found; " << sizes4[5] << " prefixes cover the union" << std::endl;
+    return 0;
+}